@@ -0,0 +1,119 @@
+/*
+ * Example which moves data through the fast path. A child process opens <cons_mountpoint>/fast and reads all the
+ * data, while the parent process opens <prod_mountpoint>/fast and writes it. Both attach to the open netpipe, so
+ * the data is moved through shared memory rings and not through FUSE. If the filesystem doesn't support it then
+ * the file is used as usual. The time taken by the reader is printed.
+ *
+ * Run the following command to build this example
+ * gcc -Wall examples/fastpath.c src/fastpath_client.c src/shmring.c src/sock.c src/scfiles.c src/utils.c -o bin/fastpath
+ *
+ * Example usage with the mountpoints of mount_prod and mount_cons. Send 1 GB with 64 KB blocks:
+ * ./bin/fastpath ./tmp/prod ./tmp/cons 65536 16384
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <wait.h>
+#include <errno.h>
+#include <time.h>
+#include "../include/utils.h"
+#include "../include/scfiles.h"
+#include "../include/fastpath_client.h"
+
+#define PATH_LEN 4096
+
+/** From string to integer. Returns -1 on error */
+static long str_to_long(char *str) {
+    char *endptr;
+    long val = strtol(str, &endptr, 10);
+    return endptr == str ? -1:val;
+}
+
+static int consumer(const char *mountpoint, size_t blocksize) {
+    int fd;
+    ssize_t bytes;
+    size_t total = 0;
+    char path[PATH_LEN];
+    struct timespec start, elapsed;
+    fastpath_t *fp;
+    char *buf = (char *) malloc(sizeof(char) * blocksize);
+    EQNULLERR(buf, return EXIT_FAILURE)
+
+    snprintf(path, PATH_LEN, "%s/fast", mountpoint);
+    MINUS1ERR(fd = open(path, O_RDONLY), return EXIT_FAILURE)
+    fp = fastpath_attach(fd);
+    if (fp == NULL) perror("consumer. fast path not available");
+
+    MINUS1ERR(clock_gettime(CLOCK_MONOTONIC, &start), return EXIT_FAILURE)
+    do {
+        bytes = fp != NULL ? fastpath_read(fp, buf, blocksize) : read(fd, buf, blocksize);
+        if (bytes > 0) total += bytes;
+    } while (bytes > 0 || (bytes == -1 && errno == EINTR));
+    MINUS1ERR(bytes, return EXIT_FAILURE)
+    elapsed = elapsed_time(&start);
+
+    printf("read %ld bytes in %.3f s%s\n", total, elapsed.tv_sec + elapsed.tv_nsec / 1e9, fp != NULL ? " (fast path)" : "");
+
+    if (fp != NULL) fastpath_detach(fp);
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+static int producer(const char *mountpoint, size_t blocksize, long blocks) {
+    int fd;
+    ssize_t bytes;
+    char path[PATH_LEN];
+    fastpath_t *fp;
+    char *buf = (char *) malloc(sizeof(char) * blocksize);
+    EQNULLERR(buf, return EXIT_FAILURE)
+    memset(buf, 'a', blocksize);
+
+    snprintf(path, PATH_LEN, "%s/fast", mountpoint);
+    MINUS1ERR(fd = open(path, O_WRONLY), return EXIT_FAILURE)
+    fp = fastpath_attach(fd);
+    if (fp == NULL) perror("producer. fast path not available");
+
+    for (long i = 0; i < blocks; i++) {
+        bytes = fp != NULL ? fastpath_write(fp, buf, blocksize) : writen(fd, buf, blocksize);
+        if (bytes != (ssize_t) blocksize) { perror("producer write"); return EXIT_FAILURE; }
+    }
+
+    // the data is flushed before it returns
+    if (fp != NULL && fastpath_detach(fp) == -1) fprintf(stderr, "producer. some data was not sent\n");
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "usage: %s <prod_mountpoint> <cons_mountpoint> <block_size> <blocks>\n", progname);
+}
+
+int main(int argc, char** argv) {
+    int pid_cons, ret;
+    long blocksize, blocks;
+
+    if (argc < 5) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((blocksize = str_to_long(argv[3])) <= 0 || (blocks = str_to_long(argv[4])) <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Fork a process which reads the data
+    MINUS1ERR(pid_cons = fork(), return EXIT_FAILURE)
+
+    if (pid_cons == 0) {
+        return consumer(argv[2], blocksize);
+    }
+
+    ret = producer(argv[1], blocksize, blocks);
+    MINUS1(waitpid(pid_cons, NULL, 0), fprintf(stderr, "failure to wait pid %d: ", pid_cons); perror(""); return EXIT_FAILURE)
+    return ret;
+}
@@ -0,0 +1,90 @@
+/*
+ * Example which uses libnetpipe instead of a mountpoint. It connects to the remote host and copies the standard
+ * input into the netpipe <name>, or the netpipe <name> into the standard output. The remote host can be netpipefs
+ * or another npcat.
+ *
+ * Run the following command to build this example
+ * make lib && gcc -Wall examples/npcat.c -L libs -lnetpipe -lpthread -o bin/npcat
+ *
+ * Example usage in place of mount_prod, with the filesystem mounted by mount_cons:
+ * ./bin/npcat -w localhost 6789 12345 file < input.txt
+ * cat ./tmp/cons/file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "../include/utils.h"
+#include "../include/scfiles.h"
+#include "../include/libnetpipe.h"
+
+#define BUFSIZE 65536
+
+/** From string to integer. Returns -1 on error */
+static long str_to_long(char *str) {
+    char *endptr;
+    long val = strtol(str, &endptr, 10);
+    return endptr == str ? -1:val;
+}
+
+static int copy_to_netpipe(np_file_t *file, char *buf) {
+    ssize_t bytes;
+
+    while ((bytes = read(STDIN_FILENO, buf, BUFSIZE)) > 0 || (bytes == -1 && errno == EINTR)) {
+        if (bytes > 0 && np_write(file, buf, bytes) != bytes) return -1;
+    }
+
+    return bytes;
+}
+
+static int copy_from_netpipe(np_file_t *file, char *buf) {
+    ssize_t bytes;
+
+    while ((bytes = np_read(file, buf, BUFSIZE)) > 0) {
+        if (writen(STDOUT_FILENO, buf, bytes) <= 0) return -1;
+    }
+
+    return bytes;
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "usage: %s <-r|-w> <hostip> <hostport> <port> <name>\n", progname);
+}
+
+int main(int argc, char** argv) {
+    int ret, mode;
+    long hostport, port;
+    char *buf;
+    np_conn_t *conn;
+    np_file_t *file;
+
+    if (argc < 6 || (strcmp(argv[1], "-r") != 0 && strcmp(argv[1], "-w") != 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((hostport = str_to_long(argv[3])) <= 0 || (port = str_to_long(argv[4])) <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    mode = strcmp(argv[1], "-r") == 0 ? O_RDONLY : O_WRONLY;
+
+    EQNULLERR(buf = (char *) malloc(sizeof(char) * BUFSIZE), return EXIT_FAILURE)
+    EQNULLERR(conn = np_connect(argv[2], hostport, port, NULL), return EXIT_FAILURE)
+    EQNULLERR(file = np_open(conn, argv[5], mode), np_disconnect(conn); return EXIT_FAILURE)
+
+    ret = mode == O_RDONLY ? copy_from_netpipe(file, buf) : copy_to_netpipe(file, buf);
+    if (ret == -1) perror("copy");
+
+    // the remote host may be gone after the end of file, only a writer cares about the close
+    if (np_close(file) == -1 && mode == O_WRONLY) {
+        perror("np_close");
+        ret = -1;
+    }
+    MINUS1ERR(np_disconnect(conn), ret = -1)
+    free(buf);
+
+    return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
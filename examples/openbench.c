@@ -0,0 +1,135 @@
+/*
+ * Frontend benchmark. It measures how many open-close pairs per second the filesystem can serve and the
+ * throughput of small writes. The parent process opens <prod_mountpoint>/openbench for writing while a child
+ * process opens <cons_mountpoint>/openbench for reading, <opens> times. Then the parent writes <bytes> bytes
+ * into <prod_mountpoint>/smallwrites with one write() call per block of <block_size> bytes, while the child
+ * reads everything from <cons_mountpoint>/smallwrites.
+ *
+ * Run the following command to build this example
+ * gcc -Wall examples/openbench.c src/scfiles.c src/utils.c -o bin/openbench
+ *
+ * Example usage with the mountpoints of mount_prod and mount_cons. 10000 opens and 64 MB written 64 bytes at a time:
+ * ./bin/openbench ./tmp/prod ./tmp/cons 10000 64 67108864
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <wait.h>
+#include <errno.h>
+#include <time.h>
+#include "../include/utils.h"
+#include "../include/scfiles.h"
+
+#define PATH_LEN 4096
+#define READ_SIZE 131072
+
+/** From string to integer. Returns -1 on error */
+static long str_to_long(char *str) {
+    char *endptr;
+    long val = strtol(str, &endptr, 10);
+    return endptr == str ? -1:val;
+}
+
+static double seconds(struct timespec *start) {
+    struct timespec elapsed = elapsed_time(start);
+    return elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+}
+
+/** Opens and closes the file with the given mode many times. Returns the number of seconds or -1 on error */
+static double open_loop(const char *mountpoint, int mode, long opens) {
+    int fd;
+    char path[PATH_LEN];
+    struct timespec start;
+
+    snprintf(path, PATH_LEN, "%s/openbench", mountpoint);
+    MINUS1ERR(clock_gettime(CLOCK_MONOTONIC, &start), return -1)
+    for (long i = 0; i < opens; i++) {
+        MINUS1ERR(fd = open(path, mode), return -1)
+        MINUS1ERR(close(fd), return -1)
+    }
+
+    return seconds(&start);
+}
+
+/** Reads everything from the file until the writer closes it */
+static int consumer(const char *mountpoint, long opens) {
+    int fd;
+    ssize_t bytes;
+    char path[PATH_LEN];
+    char *buf = (char *) malloc(sizeof(char) * READ_SIZE);
+    EQNULLERR(buf, return EXIT_FAILURE)
+
+    if (open_loop(mountpoint, O_RDONLY, opens) == -1) return EXIT_FAILURE;
+
+    snprintf(path, PATH_LEN, "%s/smallwrites", mountpoint);
+    MINUS1ERR(fd = open(path, O_RDONLY), return EXIT_FAILURE)
+    while ((bytes = read(fd, buf, READ_SIZE)) > 0);
+    MINUS1ERR(bytes, return EXIT_FAILURE)
+
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+/** Writes the given number of bytes one small block at a time */
+static int producer(const char *mountpoint, long opens, size_t blocksize, long total) {
+    int fd;
+    long written = 0;
+    char path[PATH_LEN];
+    struct timespec start;
+    double secs;
+    char *buf = (char *) malloc(sizeof(char) * blocksize);
+    EQNULLERR(buf, return EXIT_FAILURE)
+    memset(buf, 'a', blocksize);
+
+    MINUS1(secs = open_loop(mountpoint, O_WRONLY, opens), return EXIT_FAILURE)
+    printf("opens=%ld elapsed=%.3fs %.0f opens/s\n", opens, secs, opens / secs);
+
+    snprintf(path, PATH_LEN, "%s/smallwrites", mountpoint);
+    MINUS1ERR(fd = open(path, O_WRONLY), return EXIT_FAILURE)
+    MINUS1ERR(clock_gettime(CLOCK_MONOTONIC, &start), return EXIT_FAILURE)
+    while (written < total) {
+        if (writen(fd, buf, blocksize) != (ssize_t) blocksize) { perror("write"); return EXIT_FAILURE; }
+        written += blocksize;
+    }
+    MINUS1ERR(close(fd), return EXIT_FAILURE) // returns when the buffer is flushed
+    secs = seconds(&start);
+
+    printf("bs=%ld bytes=%ld elapsed=%.3fs %.0f writes/s %.2f MB/s\n", blocksize, written, secs,
+           written / blocksize / secs, written / secs / (1024 * 1024));
+
+    free(buf);
+    return 0;
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "usage: %s <prod_mountpoint> <cons_mountpoint> <opens> <block_size> <bytes>\n", progname);
+}
+
+int main(int argc, char** argv) {
+    int pid_consumer, ret;
+    long opens, blocksize, total;
+
+    if (argc < 6) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((opens = str_to_long(argv[3])) <= 0 || (blocksize = str_to_long(argv[4])) <= 0 || (total = str_to_long(argv[5])) <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Fork the consumer
+    MINUS1ERR(pid_consumer = fork(), return EXIT_FAILURE)
+
+    if (pid_consumer == 0) {
+        return consumer(argv[2], opens);
+    }
+
+    ret = producer(argv[1], opens, blocksize, total);
+    MINUS1(waitpid(pid_consumer, NULL, 0), fprintf(stderr, "failure to wait pid %d: ", pid_consumer); perror(""); return EXIT_FAILURE)
+    return ret;
+}
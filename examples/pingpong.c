@@ -0,0 +1,148 @@
+/*
+ * Ping-pong latency benchmark. The parent process writes a block into <prod_mountpoint>/ping and waits
+ * for the same block from <prod_mountpoint>/pong, while a child process echoes each block read from
+ * <cons_mountpoint>/ping into <cons_mountpoint>/pong. The round trip time of each iteration is measured
+ * and the 50th, 99th and 99.9th percentiles are printed. With "rdwr" both the processes use a single
+ * full-duplex netpipe, <mountpoint>/pingpong open with O_RDWR, in both the directions.
+ *
+ * Run the following command to build this example
+ * gcc -Wall examples/pingpong.c src/scfiles.c src/utils.c -o bin/pingpong
+ *
+ * Example usage with the mountpoints of mount_prod and mount_cons. 10000 round trips of 4 KB:
+ * ./bin/pingpong ./tmp/prod ./tmp/cons 4096 10000
+ * The same over a single full-duplex netpipe:
+ * ./bin/pingpong ./tmp/prod ./tmp/cons 4096 10000 rdwr
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <wait.h>
+#include <errno.h>
+#include <time.h>
+#include "../include/utils.h"
+#include "../include/scfiles.h"
+
+#define PATH_LEN 4096
+
+/** From string to integer. Returns -1 on error */
+static long str_to_long(char *str) {
+    char *endptr;
+    long val = strtol(str, &endptr, 10);
+    return endptr == str ? -1:val;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Open the netpipes of the round trip: ping is written by the pinger and read by the echoer, pong the other
+ * way round. If duplex is 1 then both are the same netpipe, open with O_RDWR. Returns 0 on success, -1 on error
+ */
+static int open_pingpong(const char *mountpoint, int duplex, int pinger, int *pingfd, int *pongfd) {
+    char pingpath[PATH_LEN], pongpath[PATH_LEN];
+
+    if (duplex) {
+        snprintf(pingpath, PATH_LEN, "%s/pingpong", mountpoint);
+        MINUS1ERR(*pingfd = open(pingpath, O_RDWR), return -1)
+        *pongfd = *pingfd;
+        return 0;
+    }
+
+    snprintf(pingpath, PATH_LEN, "%s/ping", mountpoint);
+    snprintf(pongpath, PATH_LEN, "%s/pong", mountpoint);
+    MINUS1ERR(*pingfd = open(pingpath, pinger ? O_WRONLY : O_RDONLY), return -1)
+    MINUS1ERR(*pongfd = open(pongpath, pinger ? O_RDONLY : O_WRONLY), return -1)
+    return 0;
+}
+
+static void close_pingpong(int pingfd, int pongfd) {
+    close(pingfd);
+    if (pongfd != pingfd) close(pongfd);
+}
+
+/** Reads each block from ping and writes it back into pong */
+static int echo(const char *mountpoint, int duplex, size_t blocksize, long iterations) {
+    int pingfd, pongfd;
+    char *buf = (char *) malloc(sizeof(char) * blocksize);
+    EQNULLERR(buf, return EXIT_FAILURE)
+
+    MINUS1(open_pingpong(mountpoint, duplex, 0, &pingfd, &pongfd), return EXIT_FAILURE)
+
+    for (long i = 0; i < iterations; i++) {
+        if (readn(pingfd, buf, blocksize) != (ssize_t) blocksize) { perror("echo read"); return EXIT_FAILURE; }
+        if (writen(pongfd, buf, blocksize) != (ssize_t) blocksize) { perror("echo write"); return EXIT_FAILURE; }
+    }
+
+    close_pingpong(pingfd, pongfd);
+    free(buf);
+    return 0;
+}
+
+/** Writes each block into ping and measures how long it takes to read it from pong */
+static int ping(const char *mountpoint, int duplex, size_t blocksize, long iterations) {
+    int pingfd, pongfd;
+    struct timespec start, elapsed;
+    char *buf = (char *) malloc(sizeof(char) * blocksize);
+    double *rtt = (double *) malloc(sizeof(double) * iterations); // round trip times in microseconds
+    EQNULLERR(buf, return EXIT_FAILURE)
+    EQNULLERR(rtt, return EXIT_FAILURE)
+    memset(buf, 'a', blocksize);
+
+    MINUS1(open_pingpong(mountpoint, duplex, 1, &pingfd, &pongfd), return EXIT_FAILURE)
+
+    for (long i = 0; i < iterations; i++) {
+        MINUS1ERR(clock_gettime(CLOCK_MONOTONIC, &start), return EXIT_FAILURE)
+        if (writen(pingfd, buf, blocksize) != (ssize_t) blocksize) { perror("ping write"); return EXIT_FAILURE; }
+        if (readn(pongfd, buf, blocksize) != (ssize_t) blocksize) { perror("ping read"); return EXIT_FAILURE; }
+        elapsed = elapsed_time(&start);
+        rtt[i] = elapsed.tv_sec * 1e6 + elapsed.tv_nsec / 1e3;
+    }
+
+    qsort(rtt, iterations, sizeof(double), compare_double);
+    printf("%sbs=%ld iterations=%ld p50=%.1f us p99=%.1f us p99.9=%.1f us max=%.1f us\n", duplex ? "rdwr " : "",
+           blocksize, iterations, rtt[iterations / 2], rtt[(iterations * 99) / 100], rtt[(iterations * 999) / 1000], rtt[iterations - 1]);
+
+    close_pingpong(pingfd, pongfd);
+    free(rtt);
+    free(buf);
+    return 0;
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "usage: %s <prod_mountpoint> <cons_mountpoint> <block_size> <iterations> [rdwr]\n", progname);
+}
+
+int main(int argc, char** argv) {
+    int pid_echo, ret, duplex;
+    long blocksize, iterations;
+
+    if (argc < 5) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((blocksize = str_to_long(argv[3])) <= 0 || (iterations = str_to_long(argv[4])) <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    duplex = argc > 5 && strcmp(argv[5], "rdwr") == 0;
+    if (argc > 5 && !duplex) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Fork a process which echoes each block
+    MINUS1ERR(pid_echo = fork(), return EXIT_FAILURE)
+
+    if (pid_echo == 0) {
+        return echo(argv[2], duplex, blocksize, iterations);
+    }
+
+    ret = ping(argv[1], duplex, blocksize, iterations);
+    MINUS1(waitpid(pid_echo, NULL, 0), fprintf(stderr, "failure to wait pid %d: ", pid_echo); perror(""); return EXIT_FAILURE)
+    return ret;
+}
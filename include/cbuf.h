@@ -21,6 +21,15 @@ cbuf_t *cbuf_alloc(size_t capacity);
  */
 void cbuf_free(cbuf_t *cbuf);
 
+/**
+ * Make the buffer able to hold at least the given capacity. The data into the buffer is kept.
+ *
+ * @param cbuf the buffer
+ * @param capacity the new capacity. If it is not greater than the current one nothing is done
+ * @return 0 on success, -1 on error
+ */
+int cbuf_grow(cbuf_t *cbuf, size_t capacity);
+
 /**
  * Put data into the buffer. Only puts data until the buffer is full.
  *
@@ -82,6 +91,48 @@ ssize_t cbuf_readn(int fd, cbuf_t *cbuf, size_t n);
  */
 ssize_t cbuf_writen(int fd, cbuf_t *cbuf, size_t n);
 
+/**
+ * Get a pointer to the data which is offset bytes after the oldest byte, without removing anything.
+ * Only the contiguous part is returned, so it can be less than the data after offset.
+ *
+ * @param cbuf buffer pointer
+ * @param offset how many bytes to skip
+ * @param data will point to the data
+ * @return how many contiguous bytes data points to, 0 if there is no data after offset
+ */
+size_t cbuf_peek(cbuf_t *cbuf, size_t offset, char **data);
+
+/**
+ * Remove the n oldest bytes from the buffer without reading them.
+ *
+ * @param cbuf buffer pointer
+ * @param n how many bytes to remove. It must not be greater than the buffer size
+ */
+void cbuf_drop(cbuf_t *cbuf, size_t n);
+
+/**
+ * Find the last occurrence of a byte between two offsets from the oldest byte of the buffer.
+ * It is vectorized when the compiler targets SSE2 or AVX2.
+ *
+ * @param cbuf buffer pointer
+ * @param from offset where the search starts
+ * @param to offset where the search ends, excluded
+ * @param c the byte
+ * @return the offset after the last occurrence, 0 if it was not found
+ */
+size_t cbuf_rfind(cbuf_t *cbuf, size_t from, size_t to, char c);
+
+/**
+ * Find the first occurrence of a byte between two offsets from the oldest byte of the buffer.
+ *
+ * @param cbuf buffer pointer
+ * @param from offset where the search starts
+ * @param to offset where the search ends, excluded
+ * @param c the byte
+ * @return the offset after the first occurrence, 0 if it was not found
+ */
+size_t cbuf_find(cbuf_t *cbuf, size_t from, size_t to, char c);
+
 /**
  * Check if the given buffer is full or not.
  *
@@ -3,16 +3,24 @@
 
 #include "./netpipe.h"
 
+struct dispatcher;
+
 /**
- * Run dispatcher thread
- * @return 0 on success, -1 on error
+ * Run the dispatcher thread of the given connections. A single thread handles the messages of all the
+ * remote hosts. When a connection is lost the others are still handled. It also completes the reads whose
+ * timeout expired
+ * @param skts the connections. Their open files tables must be initialized
+ * @param nskts how many connections
+ * @param poll_notify function used to notify the poll handles registered on their files, NULL if none
+ * @return the dispatcher, NULL on error and sets errno
  */
-int netpipefs_dispatcher_run(void);
+struct dispatcher *netpipefs_dispatcher_run(struct netpipefs_socket **skts, int nskts, void (*poll_notify)(void *));
 
 /**
- * Stop dispatcher thread
+ * Stop dispatcher thread and free it
+ * @param dispatcher the dispatcher. If it is NULL nothing is done
  * @return 0 on success, -1 on error
  */
-int netpipefs_dispatcher_stop(void);
+int netpipefs_dispatcher_stop(struct dispatcher *dispatcher);
 
 #endif //DISPATCHER_H
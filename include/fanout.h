@@ -0,0 +1,103 @@
+/** @file
+ * Fan-out netpipes. What a local writer writes into a fan-out netpipe is buffered once and sent to the netpipe with
+ * the same name of every connection, so each remote host reads it like a netpipe written by this host. The remote
+ * hosts which have at least one reader are the subscribers. Each of them is sent what its credit allows, so the
+ * slowest subscriber blocks the writer only until it lags behind the fastest one by the capacity of the buffer.
+ * Then the lagging subscriber skips the data it has not received yet or it is disconnected, according to the policy.
+ * A subscriber receives what is written after it subscribed and the data written without subscribers is discarded.
+ */
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+#include "netpipe.h"
+
+#define DEFAULT_FANOUTLAG 1048576 // bytes a subscriber can lag behind the fastest one
+
+struct netpipefs_socket;
+
+/** Fan-out netpipe */
+struct fanout;
+
+/**
+ * Get the fan-out netpipe with the given path or create it. A reference is taken.
+ *
+ * @param path file's path
+ * @param lag capacity of the buffer, that is how many bytes a subscriber can lag behind the fastest one
+ * @param drop 1 if a lagging subscriber skips the data, 0 if it is disconnected
+ * @param poll_notify function used to notify the registered poll handles
+ * @return the fan-out netpipe, NULL on error and sets errno
+ */
+struct fanout *netpipefs_fanout_get(const char *path, size_t lag, int drop, void (*poll_notify)(void *));
+
+/**
+ * Take a reference to the fan-out netpipe.
+ *
+ * @param fanout the fan-out netpipe
+ */
+void netpipefs_fanout_ref(struct fanout *fanout);
+
+/**
+ * Drop n references to the fan-out netpipe. It is freed when there are no more references.
+ *
+ * @param fanout the fan-out netpipe
+ * @param n how many references should be dropped
+ */
+void netpipefs_fanout_put(struct fanout *fanout, unsigned long n);
+
+/**
+ * Open the fan-out netpipe for writing. The first writer opens the netpipe with the same name of every connection.
+ * It never waits for the subscribers.
+ *
+ * @param fanout the fan-out netpipe
+ * @param skts the connections of the remote hosts
+ * @param nskts how many connections
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipefs_fanout_open(struct fanout *fanout, struct netpipefs_socket **skts, int nskts);
+
+/**
+ * Write into the fan-out netpipe. The data is copied into the buffer, so done is called when there is space
+ * for it. If nonblock is 1 then only the data which fits is written.
+ *
+ * @param fanout the fan-out netpipe
+ * @param buf the data
+ * @param size how many bytes should be written
+ * @param nonblock if 1 then it doesn't wait for space into the buffer
+ * @param done function called with how many bytes were written
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and sets errno. If it returns -1 then done is not called
+ */
+int netpipefs_fanout_write_async(struct fanout *fanout, const char *buf, size_t size, int nonblock, netpipe_done_t done, void *arg);
+
+/**
+ * Get the available events and register a poll handle. The netpipe is writable if there is space into the buffer.
+ *
+ * @param fanout the fan-out netpipe
+ * @param ph the poll handle, NULL if it should not be registered
+ * @param reventsp will be set with the available events
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipefs_fanout_poll(struct fanout *fanout, void *ph, unsigned int *reventsp);
+
+/**
+ * Close the fan-out netpipe. The last writer waits until every subscriber was sent the data into the buffer,
+ * then the netpipe of each connection is closed.
+ *
+ * @param fanout the fan-out netpipe
+ * @param done function called when the netpipe is closed
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and sets errno. If it returns -1 then done is not called
+ */
+int netpipefs_fanout_close_async(struct fanout *fanout, netpipe_done_t done, void *arg);
+
+/**
+ * Called when a netpipe written by the fan-out netpipe can receive more data or its readers changed. It sends
+ * what the subscribers can receive and it drops the reference taken by the caller.
+ *
+ * @param fanout the fan-out netpipe
+ */
+void netpipefs_fanout_notify(struct fanout *fanout);
+
+#endif //FANOUT_H
@@ -0,0 +1,54 @@
+/** @file
+ * Fast path for local applications. An application which opened a netpipe asks for it with an ioctl, then it
+ * connects to the control socket of the daemon and receives a shared memory ring bound to that netpipe. A thread
+ * of the daemon moves the data between the ring and the netpipe, so the reads and writes of the application don't
+ * go through FUSE. The applications which don't ask for it keep using the file as usual.
+ */
+
+#ifndef FASTPATH_H
+#define FASTPATH_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define FASTPATH_PATH_MAX 108   // same as sun_path
+#define FASTPATH_RING 1048576   // capacity of the ring given to the application
+
+/** Where and how the application gets the ring */
+struct netpipefs_attach {
+    char path[FASTPATH_PATH_MAX];   // control socket
+    uint64_t token;                 // sent over the control socket to get the ring
+};
+
+/** ioctl on an open netpipe which returns a struct netpipefs_attach */
+#define NETPIPEFS_IOC_ATTACH _IOR('N', 1, struct netpipefs_attach)
+
+struct netpipe;
+
+/**
+ * Create the control socket and run the thread which accepts the applications.
+ *
+ * @param port port of this host, used to name the control socket
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipefs_fastpath_start(int port);
+
+/**
+ * Stop accepting applications and stop moving data for the applications which are attached. The netpipes
+ * with an application attached are forced to exit. It returns when no thread uses them anymore.
+ */
+void netpipefs_fastpath_stop(void);
+
+/**
+ * Prepare a ring for the given netpipe. The netpipe is open with the given mode on behalf of the application,
+ * without blocking, and it is closed when the application detaches or doesn't connect before the timeout.
+ *
+ * @param file the netpipe
+ * @param mode O_RDONLY or O_WRONLY
+ * @param attach filled with the control socket and the token
+ * @return 0 on success, -1 on error and sets errno. It sets errno to ENOTSUP if the netpipe is read
+ * without readahead, because the data is moved into the ring only after the readahead buffered it
+ */
+int netpipefs_fastpath_attach(struct netpipe *file, int mode, struct netpipefs_attach *attach);
+
+#endif //FASTPATH_H
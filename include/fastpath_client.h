@@ -0,0 +1,90 @@
+/** @file
+ * Client side of the fast path. An application which opened a netpipe attaches to it and then reads or writes
+ * through a shared memory ring, without going through FUSE. See fastpath.h.
+ */
+
+#ifndef FASTPATH_CLIENT_H
+#define FASTPATH_CLIENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Attached netpipe data type */
+typedef struct fastpath_s fastpath_t;
+
+/**
+ * Attach to the netpipe open with the given file descriptor. It must be open with O_RDONLY or O_WRONLY.
+ * The file descriptor stays open and it can be closed only after fastpath_detach().
+ *
+ * @param fd file descriptor of the open netpipe
+ * @return the attached netpipe, NULL on error and sets errno. If the filesystem doesn't support it, errno is
+ * ENOTTY or ENOTSUP
+ */
+fastpath_t *fastpath_attach(int fd);
+
+/**
+ * Write n bytes. It blocks while the ring is full.
+ *
+ * @param fp the attached netpipe
+ * @param buf the data
+ * @param n how many bytes to write
+ * @return number of bytes written, -1 on error and sets errno. It sets errno to EPIPE if the data cannot be
+ * sent anymore
+ */
+ssize_t fastpath_write(fastpath_t *fp, const void *buf, size_t n);
+
+/**
+ * Read at most n bytes. It blocks until there is something to read.
+ *
+ * @param fp the attached netpipe
+ * @param buf data read will be put here
+ * @param n max number of bytes to read
+ * @return number of bytes read, 0 on end of file, -1 on error and sets errno
+ */
+ssize_t fastpath_read(fastpath_t *fp, void *buf, size_t n);
+
+/**
+ * Get a pointer to the free space of the ring, so the data can be written in place. It blocks while the
+ * ring is full.
+ *
+ * @param fp the attached netpipe
+ * @param data will point to the free space
+ * @return how many bytes can be written, -1 on error and sets errno
+ */
+ssize_t fastpath_reserve(fastpath_t *fp, char **data);
+
+/**
+ * Send n bytes written into the space returned by fastpath_reserve().
+ *
+ * @param fp the attached netpipe
+ * @param n how many bytes
+ */
+void fastpath_commit(fastpath_t *fp, size_t n);
+
+/**
+ * Get a pointer to the data into the ring, so it can be read in place. It blocks until there is something
+ * to read. The data stays valid until fastpath_consume() is called.
+ *
+ * @param fp the attached netpipe
+ * @param data will point to the data
+ * @return how many bytes can be read, 0 on end of file, -1 on error and sets errno
+ */
+ssize_t fastpath_peek(fastpath_t *fp, char **data);
+
+/**
+ * Mark as read n bytes returned by fastpath_peek().
+ *
+ * @param fp the attached netpipe
+ * @param n how many bytes
+ */
+void fastpath_consume(fastpath_t *fp, size_t n);
+
+/**
+ * Detach from the netpipe. A writer waits until all the data is sent.
+ *
+ * @param fp the attached netpipe
+ * @return 0 on success, -1 if some data was not sent
+ */
+int fastpath_detach(fastpath_t *fp);
+
+#endif //FASTPATH_CLIENT_H
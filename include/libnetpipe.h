@@ -0,0 +1,193 @@
+/** @file
+ * Client library which speaks the netpipefs protocol. An application connects to a host running netpipefs, or to
+ * another application using this library, and then opens, reads and writes netpipes without mounting anything.
+ * Each connection has its own files and its own thread which handles the messages of the remote host.
+ */
+
+#ifndef LIBNETPIPE_H
+#define LIBNETPIPE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Connection data type */
+typedef struct np_conn np_conn_t;
+
+/** Open netpipe data type */
+typedef struct np_file np_file_t;
+
+/** Settings of a connection. They have the same meaning of the netpipefs options with the same name */
+struct np_options {
+    long timeout;       // milliseconds to wait for the remote host
+    size_t readahead;
+    size_t writeahead;
+    const char *spooldir; // directory where the data which doesn't fit into the writeahead is spilled, NULL to disable it
+    size_t spoolmax;    // 0 for the default
+    int busypoll;
+    size_t readmin;     // 0 for the default
+    int readtime;
+    size_t earlydata;
+    size_t earlymax;    // 0 for the default
+    int zerocopy;
+    int shmsize;
+    int debug;          // print debug strings on stderr
+};
+
+/**
+ * Establish a connection with the remote host. The remote host connects to the given local port too, so it must be
+ * run with --hostport equal to port. If SIGPIPE has the default action then it is ignored, so a lost connection
+ * gives EPIPE.
+ *
+ * @param hostip ip address of the remote host, "localhost" to use AF_UNIX sockets
+ * @param hostport port of the remote host
+ * @param port local port
+ * @param options settings of the connection, NULL to use the defaults
+ * @return the connection, NULL on error and sets errno. On timeout errno is ETIMEDOUT
+ */
+np_conn_t *np_connect(const char *hostip, int hostport, int port, const struct np_options *options);
+
+/**
+ * Close the connection. All its files must be closed before.
+ *
+ * @param conn the connection
+ * @return 0 on success, -1 on error and sets errno
+ */
+int np_disconnect(np_conn_t *conn);
+
+/**
+ * Open a netpipe. Like a FIFO, it waits until there is at least one reader and one writer, on any side of the
+ * connection, unless O_NONBLOCK is given.
+ *
+ * @param conn the connection
+ * @param path name of the netpipe, like the name of a file into the mountpoint of netpipefs
+ * @param flags O_RDONLY, O_WRONLY or O_RDWR, optionally with O_NONBLOCK. A writer can add O_DIRECT to write messages:
+ * each np_write() is read whole by a single np_read(). With O_RDWR the netpipe is full-duplex:
+ * each host reads what the other one writes
+ * @return the open netpipe, NULL on error and sets errno. With O_NONBLOCK it sets errno to EAGAIN if there isn't
+ * at least one reader and one writer
+ */
+np_file_t *np_open(np_conn_t *conn, const char *path, int flags);
+
+/**
+ * Write n bytes. It blocks while the remote host cannot take them, unless the netpipe is open with O_NONBLOCK.
+ *
+ * @param file the netpipe open with O_WRONLY or O_RDWR
+ * @param buf the data
+ * @param n how many bytes to write
+ * @return number of bytes written, -1 on error and sets errno. It sets errno to EPIPE if there are no readers and
+ * to EAGAIN if nothing can be written without blocking
+ */
+ssize_t np_write(np_file_t *file, const void *buf, size_t n);
+
+/**
+ * Read at most n bytes. It blocks until there is something to read, unless the netpipe is open with O_NONBLOCK.
+ * Like a pipe, it returns what is available: it waits only for the read minimum of the netpipe, see np_setreadmin().
+ *
+ * @param file the netpipe open with O_RDONLY or O_RDWR
+ * @param buf data read will be put here
+ * @param n max number of bytes to read
+ * @return number of bytes read, 0 on end of file, -1 on error and sets errno. It sets errno to EAGAIN if there
+ * is nothing to read without blocking
+ */
+ssize_t np_read(np_file_t *file, void *buf, size_t n);
+
+/**
+ * Set how many bytes a blocking np_read() waits for, like VMIN of a terminal, and how long it waits for them after
+ * the first one, like VTIME. The defaults are the readmin and readtime settings of the connection.
+ *
+ * @param file the netpipe open with O_RDONLY or O_RDWR
+ * @param min bytes to wait for, 0 for the default. A read of less bytes waits for all of them
+ * @param msec milliseconds to wait for min bytes after the first one, then the read returns what it has. 0 waits forever
+ * @return 0 on success, -1 on error and sets errno
+ */
+int np_setreadmin(np_file_t *file, size_t min, int msec);
+
+/**
+ * Split the data into records ended by the given byte, for example '\n'. Then np_read() returns only whole records,
+ * as many as fit into its buffer, or the beginning of a record longer than the buffer.
+ *
+ * @param file the netpipe open with O_RDONLY or O_RDWR
+ * @param delimiter the byte which ends the records, -1 to read a byte stream again
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EBUSY if a read is pending
+ */
+int np_setdelimiter(np_file_t *file, int delimiter);
+
+/**
+ * Make the readers of the netpipe a consumer group: each np_read() takes a single message or record, whichever
+ * reader is waiting, and the writer can send one for every waiting read, so the readers can be scaled out. The
+ * netpipe must be written with O_DIRECT or have a delimiter, see np_setdelimiter().
+ *
+ * @param file the netpipe open with O_RDONLY or O_RDWR
+ * @param group 1 to enable it, 0 to disable it
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EBUSY if a read is pending
+ */
+int np_setgroup(np_file_t *file, int group);
+
+/**
+ * Wait until everything written before is read by the remote readers or, with datasync, sent within their readahead.
+ *
+ * @param file the netpipe open with O_WRONLY or O_RDWR
+ * @param datasync 0 to wait for the data to be read, 1 to wait for it to be sent
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EPIPE if the readers closed
+ */
+int np_fsync(np_file_t *file, int datasync);
+
+/**
+ * Send an urgent message, like a cancel or a heartbeat. It is sent at once, ahead of the data which is waiting to be
+ * sent, and the remote readers get it with np_read_urgent() instead of np_read(). It never blocks.
+ *
+ * @param file the netpipe open with O_WRONLY or O_RDWR
+ * @param buf the message
+ * @param n size of the message, at most 256 bytes
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EPIPE if there are no readers and to EMSGSIZE
+ * if the message is too large
+ */
+int np_send_urgent(np_file_t *file, const void *buf, size_t n);
+
+/**
+ * Take the oldest urgent message received, whose arrival is notified by POLLPRI of np_poll(). At most 16 messages
+ * are kept, then the oldest ones are discarded. If the message is longer than n the rest of it is discarded.
+ *
+ * @param file the netpipe open with O_RDONLY or O_RDWR
+ * @param buf the message will be put here
+ * @param n size of buf
+ * @return the size of the message, -1 on error and sets errno. It sets errno to EAGAIN if there are no urgent messages
+ */
+ssize_t np_read_urgent(np_file_t *file, void *buf, size_t n);
+
+/**
+ * Close the netpipe. A writer waits until the buffered data is sent.
+ *
+ * @param file the netpipe
+ * @return 0 on success, -1 on error and sets errno. The netpipe is freed anyway
+ */
+int np_close(np_file_t *file);
+
+/**
+ * Get a file descriptor which becomes readable when the events of a netpipe polled with np_poll() change.
+ * It can be used with poll(), select() or epoll. It must not be read or closed: when it is readable call
+ * np_poll_clear() and then poll again every netpipe.
+ *
+ * @param conn the connection
+ * @return the file descriptor
+ */
+int np_poll_fd(np_conn_t *conn);
+
+/**
+ * Make the file descriptor of np_poll_fd() not readable anymore.
+ *
+ * @param conn the connection
+ */
+void np_poll_clear(np_conn_t *conn);
+
+/**
+ * Get the available events of the netpipe, the same that poll() gives for a file into the mountpoint of
+ * netpipefs. The file descriptor of np_poll_fd() becomes readable the next time they change.
+ *
+ * @param file the netpipe
+ * @param revents set with the POLLIN, POLLPRI, POLLOUT, POLLHUP and POLLERR events
+ * @return 0 on success, -1 on error and sets errno
+ */
+int np_poll(np_file_t *file, short *revents);
+
+#endif //LIBNETPIPE_H
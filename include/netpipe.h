@@ -2,11 +2,55 @@
 #define NETPIPE_H
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
 #include "options.h"
 #include "cbuf.h"
+#include "spool.h"
+#include "waitq.h"
 
 #define DEFAULT_READAHEAD 0
 #define DEFAULT_WRITEAHEAD 0
+#define DEFAULT_BUSYPOLL 0
+#define DEFAULT_READMIN 1   // a blocking read returns as soon as this many bytes are available
+#define DEFAULT_READTIME 0  // milliseconds a read waits for readmin bytes after the first one. 0 means forever
+#define DEFAULT_EARLYDATA 0 // bytes a remote writer can send before the netpipe is open locally. 0 means disabled
+#define DEFAULT_EARLYMAX 16777216 // bytes which can be sent early to all the netpipes of a connection
+#define DEFAULT_LINGER 0    // milliseconds the last writer's close waits for the data to be read. 0 means forever
+#define DEFAULT_SPOOLMAX 67108864 // bytes of the spool file of each netpipe, used when the writeahead buffer is full
+#define NETPIPE_MESSAGES 0x10000 // ORed to the open mode of a writer: each write is a message
+#define NETPIPE_MSG_MAX 131072   // max size of a message
+#define NETPIPE_URGENT_MAX 256   // max size of an urgent message
+#define NETPIPE_URGENT_QUEUE 16  // urgent messages kept for the readers, then the oldest one is dropped
+
+/** Read minimum and read timeout of an open netpipe. See netpipe_set_readmin() */
+struct netpipefs_readmin {
+    uint32_t min;   // bytes a blocking read waits for, 0 for the default
+    uint32_t time;  // milliseconds a read waits for min bytes after the first one. 0 means forever
+};
+
+/** ioctl on a netpipe open for reading which sets its struct netpipefs_readmin */
+#define NETPIPEFS_IOC_READMIN _IOW('N', 2, struct netpipefs_readmin)
+
+/** ioctl on a netpipe open for reading which sets its record delimiter, -1 to disable it. See netpipe_set_delimiter() */
+#define NETPIPEFS_IOC_DELIMITER _IOW('N', 3, int32_t)
+
+/** ioctl on a netpipe open for reading which makes its readers a consumer group, 0 to disable it. See netpipe_set_group() */
+#define NETPIPEFS_IOC_GROUP _IOW('N', 6, int32_t)
+
+/** Urgent message of an open netpipe. See netpipe_send_urgent() */
+struct netpipefs_urgent {
+    uint32_t size;  // bytes of data
+    char data[NETPIPE_URGENT_MAX];
+};
+
+/** ioctl on a netpipe open for writing which sends a struct netpipefs_urgent ahead of the data */
+#define NETPIPEFS_IOC_URGENT _IOW('N', 4, struct netpipefs_urgent)
+
+/** ioctl on a netpipe open for reading which takes the oldest struct netpipefs_urgent received */
+#define NETPIPEFS_IOC_URGENT_READ _IOR('N', 5, struct netpipefs_urgent)
 
 /** Print debug info about the given file */
 #define DEBUGFILE(file) \
@@ -25,30 +69,92 @@
     } while(0)
 
 
+/**
+ * Function called when an asynchronous operation is done. It is called exactly once, by the caller
+ * of the asynchronous function if the operation can be done immediately, otherwise by the thread
+ * which completes it, without holding any lock.
+ *
+ * @param arg argument given to the asynchronous function
+ * @param bytes result of the operation, -1 on error
+ * @param error error number if bytes is -1
+ */
+typedef void (*netpipe_done_t)(void *arg, ssize_t bytes, int error);
+
+/**
+ * Function called by the dispatcher when the data of a read request is arriving from the socket, so
+ * that the reader can move it without copying it into the request's buffer. It is called with the
+ * file lock held.
+ *
+ * @param arg argument given to the read function
+ * @param fd socket from which data should be read
+ * @param size exactly how many bytes must be read from fd
+ * @return 0 on success, -1 on error
+ */
+typedef int (*netpipe_splice_t)(void *arg, int fd, size_t size);
+
+struct netpipefs_socket;
+struct fanout;
+struct relay;
+struct netpipe_urgent;
+
 /** Structure for a file in netpipefs */
 struct netpipe {
     const char *path;
+    struct netpipefs_socket *skt; // connection on which the file is open
+    unsigned long hash;   // cached hash of the path
+    struct netpipe *next; // next file into the same bucket of the open files table
+    unsigned long nlookup; // kernel references to this file. It is not freed until they are forgotten
     int open_mode;  // netpipe was open locally with this mode
     int force_exit; // operations on the netpipe should immediately end
     int writers;    // number of writers
     int readers;    // number of readers
     cbuf_t *buffer; // circular buffer
+    spool_t *spool; // data written when the buffer was full, which is sent after it. NULL if nothing was spilled yet
+    int spool_failed; // the spool could not be created, so the writers wait like without it
     size_t remotemax;  // max number of bytes that can be sent
     size_t remotesize; // number of bytes sent
-    pthread_cond_t canopen; // wait for at least one reader and one writer
-    pthread_cond_t close;   // wait that the buffer is flushed before close
+    size_t acked;      // number of bytes read by the remote readers since the netpipe was created
+    size_t readahead;  // credit given to the remote writers without read requests
+    size_t remote_readahead; // credit given by the remote host without read requests
     pthread_mutex_t mtx;    // netpipe lock
     struct netpipe_req_l *req_l; // FIFO list of read or write requests
+    struct netpipe_req *open_reqs;  // requests waiting for at least one reader and one writer
+    struct netpipe_req *close_reqs; // requests waiting that the buffer is flushed before close
+    struct netpipe_req *fsync_reqs; // requests waiting that what was written before them is sent or read
     struct poll_handle *poll_handles;
+    waitq_spin_t spin;  // how long the waiters spin before they block
+    size_t zc_ring;     // bytes at the beginning of the buffer which were sent but are still used by the kernel
+    unsigned int zc_pending; // MSG_ZEROCOPY sends not completed yet. The file is not freed until they are completed
+    int zc_release;     // the file should be released when the sends are completed
+    int (*zc_remove_open_file)(struct netpipe *); // used to release the file
+    struct fanout *fanout;  // fan-out netpipe which writes this file, NULL if none
+    struct relay *relay;    // relay which reads or writes this file, NULL if none. It cannot be open locally meanwhile
+    int messages;   // each write is a message which is read by a single read
+    size_t granted; // credit given to the writer beyond the readahead
+    size_t readmin; // a blocking read is completed when it has this many bytes
+    int readtime;   // milliseconds a read waits for readmin bytes after the first one. 0 means forever
+    int delimiter;  // the reads return whole records ended by this byte, -1 if disabled
+    size_t delim_scanned; // bytes of the buffer already searched for the delimiter
+    size_t delim_last;    // offset after the last delimiter into the buffer, 0 if there isn't
+    int group;      // consumer group: each read takes a single record or message and every pending read is given credit
+    size_t unit_last; // bytes of the last message or record read. A consumer group expects the next ones as long
+    int early;      // the writers can send before a reader opened, because the remote host granted it
+    size_t early_granted; // credit granted to the writer before a reader opened, taken from the early budget
+    int provisioned; // declared at mount time with this mode, -1 if not. Its writers never wait for a reader
+    struct netpipe *rdhalf; // read half of a full-duplex netpipe, not into the open files table. NULL if none
+    struct netpipe *wrhalf; // file which owns this read half, whose lock it uses. NULL if this is not a read half
+    struct netpipe_urgent *urgent; // urgent messages received and not read yet, oldest first
+    int nurgent;    // length of the urgent list
 };
 
 /**
  * Allocates new memory for a new file structure with the given path.
  *
  * @param path file's path
+ * @param skt connection on which the file is open
  * @return the created file structure or NULL on error and it sets errno
  */
-struct netpipe *netpipe_alloc(const char *path);
+struct netpipe *netpipe_alloc(const char *path, struct netpipefs_socket *skt);
 
 /**
  * Frees the memory allocated for the given file.
@@ -77,6 +183,9 @@ int netpipe_unlock(struct netpipe *file);
 
 /**
  * Open the given netpipe. If nonblock is 0 then it waits until there is at least one reader and one writer.
+ * With O_RDWR the netpipe is full-duplex: what this host writes is read by the remote host and what the
+ * remote host writes is read by this host, each direction with its own buffer and credit. It waits until
+ * the remote host opens it for reading, usually with O_RDWR too.
  * If nonblock is 1 but there isn't at least one writer and on reader then this function returns NULL
  * and errno is set to EAGAIN.
  *
@@ -88,14 +197,59 @@ int netpipe_unlock(struct netpipe *file);
 int netpipe_open(struct netpipe *file, int mode, int nonblock);
 
 /**
- * Updates the netpipe and notifies that it was open remotely with the specified mode.
+ * Like netpipe_open() but it doesn't wait for at least one reader and one writer. The result
+ * is given to done, which is called with 0 on success or -1 and the error. If the writer ORs
+ * NETPIPE_MESSAGES to the mode then the netpipe keeps the boundaries of the messages: each write
+ * is a message which is read whole by a single read. All the writers must use the same mode.
+ *
+ * @param file the netpipe that should be open
+ * @param mode open mode, optionally with NETPIPE_MESSAGES
+ * @param nonblock 1 will mean that open shouldn't wait for at least one reader and one writer
+ * @param done function called when the netpipe is open or the open fails
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and it sets errno. It sets errno to EBUSY if the netpipe is used by a relay
+ * and to EACCES if it was provisioned with the other mode. It sets errno to EPERM if it is open with another mode
+ * or, with O_RDWR, if it is already used in one direction. If it returns -1 then done is not called
+ *
+ * A writer doesn't wait for a reader if the remote host granted it some early data, see netpipe_early_grant(),
+ * or if the netpipe was provisioned for writing, see netpipe_provision().
+ */
+int netpipe_open_async(struct netpipe *file, int mode, int nonblock, netpipe_done_t done, void *arg);
+
+/**
+ * Updates the netpipe and notifies that it was open remotely with the specified mode. With O_RDWR the netpipe
+ * becomes full-duplex: then a remote writer is counted by its read half and a remote reader by the file.
  *
  * @param file the netpipe that was open remotely
- * @param mode open mode
+ * @param mode open mode, optionally with NETPIPE_MESSAGES
  * @return 0 on success, -1 on error
  */
 int netpipe_open_update(struct netpipe *file, int mode);
 
+/**
+ * Let the remote writer which just opened the netpipe send the early data of the connection before a reader
+ * opens it. The data is kept into the buffer until a reader takes it. Nothing is granted if the netpipe has
+ * readers or if the early budget of the connection is exhausted. The grant completes the opens of the writer.
+ *
+ * @param file the netpipe that was open remotely by a writer
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_early_grant(struct netpipe *file);
+
+/**
+ * Provision the netpipe declared at mount time, before it is open. Both the hosts declare it with opposite modes
+ * and the same window, so neither needs the other's to start: the reader's host gives the remote writers a
+ * readahead of window bytes and the writers of the other host send up to window bytes without waiting for a
+ * reader, like the early data. The buffer is allocated now, so the opens don't allocate it. The caller keeps a
+ * lookup reference to the netpipe, so it outlives its opens and closes.
+ *
+ * @param file the netpipe
+ * @param mode O_RDONLY if it is read on this host, O_WRONLY if it is written
+ * @param window bytes the writers can send before they are read
+ * @return 0 on success, -1 on error and it sets errno. It sets errno to EBUSY if the netpipe is open
+ */
+int netpipe_provision(struct netpipe *file, int mode, size_t window);
+
 /**
  * Send "size" bytes to the remote host. This function will block (if nonblock is 0) when the remote netpipe
  * is full, otherwise if nonblock is 1 then it doesn't block and returns data that was sent without
@@ -111,6 +265,40 @@ int netpipe_open_update(struct netpipe *file, int mode);
  */
 ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int nonblock);
 
+/**
+ * Like netpipe_send() but it never blocks. If the data cannot be sent immediately then it is copied
+ * and the request is queued, so the given buffer can be reused as soon as this function returns.
+ * done is called with how much data was sent.
+ *
+ * @param file pointer to the netpipe
+ * @param buf data that should be sent
+ * @param size how much data should be sent
+ * @param nonblock if it is 1 then only the data that can be sent immediately is sent
+ * @param done function called when the request is done
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called. If the netpipe
+ * keeps the boundaries of the messages it sets errno to EMSGSIZE if size is greater than NETPIPE_MSG_MAX, and to
+ * EAGAIN if nonblock is 1 but the whole message cannot be sent immediately
+ */
+int netpipe_send_async(struct netpipe *file, const char *buf, size_t size, int nonblock, netpipe_done_t done, void *arg);
+
+/**
+ * Like netpipe_send_async() but data is read from the given pipe. The bytes that can be sent
+ * immediately are spliced into the socket without being copied into user space, while the bytes
+ * that must wait are read into memory before this function returns. If nonblock is 1 then the
+ * bytes which cannot be sent are left into the pipe, and so are the bytes which could not be read
+ * if reading the pipe fails after something was sent: then done reports a short write.
+ *
+ * @param file pointer to the netpipe
+ * @param fd pipe with the data
+ * @param size how much data should be sent
+ * @param nonblock if it is 1 then only the data that can be sent immediately is sent
+ * @param done function called when the request is done
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+int netpipe_send_fd_async(struct netpipe *file, int fd, size_t size, int nonblock, netpipe_done_t done, void *arg);
+
 /**
  * Receive data from remote host by reading from socket.
  *
@@ -122,20 +310,105 @@ ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int non
 int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *)) ;
 
 /**
- * Read "size" bytes from netpipe. Data read is put into the given buffer. If nonblock
- * is zero then this function will block until all the bytes are read from the netpipe.
- * When nonblock is 1 then this function will not block and will read all the available
- * data and will return immediately. If nonblock is 1 but the netpipe is empty then it
+ * Read at most "size" bytes from netpipe. Data read is put into the given buffer. If nonblock
+ * is zero then this function will block until the read minimum of the netpipe is available,
+ * or "size" bytes if it is smaller, and then it reads all the available data. If the read
+ * timeout of the netpipe is set, the read returns what it has when the timeout expires after
+ * the first byte. When nonblock is 1 then this function will not block and will read all the
+ * available data and will return immediately. If nonblock is 1 but the netpipe is empty then it
  * return -1 and errno is set to EAGAIN.
  *
  * @param file pointer to netpipe structure
  * @param buf where to put data read
- * @param size how many bytes should be moved from the netpipe to the buffer
- * @param nonblock if 1 then it will not block waiting for all the bytes required
+ * @param size max number of bytes moved from the netpipe to the buffer
+ * @param nonblock if 1 then it will not block waiting for the read minimum
  * @return how much data was read or -1 on error
  */
 ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock);
 
+/**
+ * Like netpipe_read() but it never blocks. If the data is not available then the request is queued
+ * and the buffer is filled later by the dispatcher, so it must be valid until done is called.
+ * done is called with how much data was read. If the netpipe keeps the boundaries of the messages
+ * then the request is completed with exactly one message, and what doesn't fit into the buffer is
+ * discarded. If it has a record delimiter then the request is completed with whole records.
+ *
+ * @param file pointer to netpipe structure
+ * @param buf where to put data read
+ * @param size how many bytes should be moved from the netpipe to the buffer
+ * @param nonblock if 1 then only the available data is read
+ * @param done function called when the request is done
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+int netpipe_read_async(struct netpipe *file, char *buf, size_t size, int nonblock, netpipe_done_t done, void *arg);
+
+/**
+ * Like netpipe_read_async() but if the request is queued and its read minimum arrives with a single
+ * message then splice is called to move the data from the socket, instead of filling the buffer.
+ * In this case done is called with the size given to splice but the buffer is left untouched.
+ * The messages of a netpipe which keeps their boundaries and the records are never spliced.
+ *
+ * @param file pointer to netpipe structure
+ * @param buf where to put data read if it is not spliced
+ * @param size how many bytes should be moved from the netpipe to the buffer
+ * @param nonblock if 1 then only the available data is read
+ * @param splice function used to move the data from the socket
+ * @param done function called when the request is done
+ * @param arg argument passed to splice and done
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+int netpipe_read_splice_async(struct netpipe *file, char *buf, size_t size, int nonblock, netpipe_splice_t splice,
+                              netpipe_done_t done, void *arg);
+
+/**
+ * Complete the first pending read with the data it has, if its timer expired, and the close of the last
+ * writer, if it waited longer than the linger time, discarding what was not sent. The netpipe is closed
+ * anyway but that close fails with ETIMEDOUT. Called by the dispatcher when the timer started by a read or
+ * by a close expires.
+ *
+ * @param file pointer to netpipe structure
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_timeout(struct netpipe *file);
+
+/**
+ * Set the read minimum and the read timeout of the netpipe. They apply to the reads which are
+ * queued after this call. They are ignored if the netpipe keeps the boundaries of the messages.
+ *
+ * @param file pointer to netpipe structure
+ * @param readmin bytes a blocking read waits for. If it is 0 then the default is used
+ * @param readtime milliseconds a read waits for readmin bytes after the first one. 0 means forever
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_set_readmin(struct netpipe *file, size_t readmin, int readtime);
+
+/**
+ * Set the byte which ends the records of the netpipe. Then a read returns the whole records which fit into its
+ * buffer, or the beginning of a record longer than the buffer, and a nonblocking read fails with EAGAIN until a
+ * record arrived. What is left after the last record is returned when there are no writers. The read minimum
+ * and the read timeout are ignored and the data is never spliced.
+ *
+ * @param file pointer to netpipe structure
+ * @param delimiter the byte, from 0 to 255, or -1 to return to a byte stream
+ * @return 0 on success, -1 on error and it sets errno to EINVAL if the delimiter is not valid or the netpipe
+ * keeps the boundaries of the messages, to EBUSY if a read is pending
+ */
+int netpipe_set_delimiter(struct netpipe *file, int delimiter);
+
+/**
+ * Make the readers of the netpipe a consumer group, which shares the messages or the records: each read takes
+ * a single message or record, whichever reader is waiting, and the writer is given the credit to send one for
+ * every pending read instead of one at a time, so the throughput grows with the number of readers. A byte
+ * stream is not affected.
+ *
+ * @param file pointer to netpipe structure
+ * @param group 1 to enable it, 0 to disable it
+ * @return 0 on success, -1 on error and it sets errno to EINVAL if group is not valid, to EBUSY if a read is
+ * pending
+ */
+int netpipe_set_group(struct netpipe *file, int group);
+
 /**
  * Notify the netpipe that the remote host read "size" bytes.
  *
@@ -147,7 +420,8 @@ ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock)
 int netpipe_read_update(struct netpipe *file, size_t size, void (*poll_notify)(void *));
 
 /**
- * Notify the netpipe that there are some readers waiting for "size" bytes.
+ * Notify the netpipe that there are some readers waiting for "size" bytes. If nobody opened it for
+ * reading yet then the writers can send the data early.
  *
  * @param file pointer to netpipe structure
  * @param size how many bytes the remote host is waiting for
@@ -160,14 +434,85 @@ int netpipe_read_request(struct netpipe *file, size_t size, void (*poll_notify)(
  * Do polling by setting the available events and registering a poll handle.
  *
  * @param file the file to be polled
- * @param ph pointer to pollhandle
+ * @param ph pointer to pollhandle. If NULL then the events are set but no poll handle is registered. A poll handle
+ * already registered is not registered again
  * @param reventsp will be set with the available events
  * @return
  */
 int netpipe_poll(struct netpipe *file, void *ph, unsigned int *reventsp);
 
 /**
- * Closes the netpipe.
+ * Remove the given poll handle without notifying it, so that it can be freed while the netpipe is still open.
+ *
+ * @param file the polled file
+ * @param ph the poll handle. Nothing is done if it is not registered
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_poll_forget(struct netpipe *file, void *ph);
+
+/**
+ * Wait until everything written into the netpipe before this call has been read by the remote readers or,
+ * with datasync, sent to the remote host within the credit given by its readers, so it is into their buffer
+ * or on the way. The netpipe stays open. done is called with 0 when it happens or with -1 and the error, EPIPE
+ * if there are no readers or they close meanwhile.
+ *
+ * @param file pointer to netpipe structure open for writing
+ * @param datasync 0 to wait for the data to be read, 1 to wait for it to be sent
+ * @param done function called when the data is read or sent
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+int netpipe_fsync_async(struct netpipe *file, int datasync, netpipe_done_t done, void *arg);
+
+/**
+ * Like netpipe_fsync_async() but it waits.
+ *
+ * @param file pointer to netpipe structure open for writing
+ * @param datasync 0 to wait for the data to be read, 1 to wait for it to be sent
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_fsync(struct netpipe *file, int datasync);
+
+/**
+ * Send an urgent message to the readers of the netpipe. It is sent at once, ahead of the data buffered or
+ * waiting for credit, and the readers take it with netpipe_read_urgent() apart from the data. It never waits.
+ *
+ * @param file pointer to netpipe structure open for writing
+ * @param buf the message
+ * @param size size of the message, from 1 to NETPIPE_URGENT_MAX bytes
+ * @return 0 on success, -1 on error and it sets errno to EBADF if the netpipe is not open for writing, to
+ * EMSGSIZE if the size is not valid, to EPIPE if there are no readers
+ */
+int netpipe_send_urgent(struct netpipe *file, const char *buf, size_t size);
+
+/**
+ * Called when an urgent message sent by the remote host arrives. It is kept for the local readers, or
+ * forwarded if the netpipe is relayed, and the poll handles are notified. It is discarded if nobody reads.
+ *
+ * @param file pointer to netpipe structure
+ * @param buf the message
+ * @param size size of the message
+ * @param poll_notify function used to notify the registered poll handles
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipe_recv_urgent(struct netpipe *file, const char *buf, size_t size, void (*poll_notify)(void *));
+
+/**
+ * Take the oldest urgent message received. If it is longer than size the rest of it is discarded.
+ *
+ * @param file pointer to netpipe structure open for reading
+ * @param buf the message will be put here
+ * @param size size of buf
+ * @return the size of the message copied into buf, -1 on error and it sets errno to EBADF if the netpipe
+ * is not open for reading, to EAGAIN if there are no urgent messages
+ */
+ssize_t netpipe_read_urgent(struct netpipe *file, char *buf, size_t size);
+
+/**
+ * Closes the netpipe. The last writer waits until what it wrote is read, at most the linger time of the
+ * connection if it has one, then the data left is discarded and it fails with ETIMEDOUT after closing the
+ * netpipe. If the connection has asyncclose it returns at once
+ * and the buffer is drained in background: the netpipe is closed for the remote host when it is drained.
  *
  * @param file pointer to netpipe structure
  * @param mode netpipe was open with this mode
@@ -175,7 +520,22 @@ int netpipe_poll(struct netpipe *file, void *ph, unsigned int *reventsp);
  * @param poll_notify pointer to a function that will be called to notify each registered poll handle
  * @return 0 on success, -1 on error
  */
-int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(const char *), void (*poll_notify)(void *));
+int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *));
+
+/**
+ * Like netpipe_close() but it doesn't wait for the buffer to be flushed. done is called with 0
+ * when the netpipe is closed or with -1 and the error.
+ *
+ * @param file pointer to netpipe structure
+ * @param mode netpipe was open with this mode
+ * @param remove_open_file pointer to a function used to remove the open file safely from any data structure before it is freed
+ * @param poll_notify pointer to a function that will be called to notify each registered poll handle
+ * @param done function called when the netpipe is closed
+ * @param arg argument passed to done
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+int netpipe_close_async(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *),
+                        netpipe_done_t done, void *arg);
 
 /**
  * Update the netpipe because the remote host closed with the given mode.
@@ -186,7 +546,69 @@ int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(const
  * @param poll_notify pointer to a function that will be called to notify each registered poll handle
  * @return 0 on success, -1 on error
  */
-int netpipe_close_update(struct netpipe *file, int mode, int (*remove_open_file)(const char *), void (*poll_notify)(void *));
+int netpipe_close_update(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *));
+
+/**
+ * Drop nlookup kernel references to the file. When there are no more references and the file
+ * is not open by anyone then it is freed.
+ *
+ * @param file pointer to netpipe structure
+ * @param nlookup how many references should be dropped
+ * @param remove_open_file pointer to a function used to remove the open file safely from any data structure before it is freed.
+ * It returns 1 if the file was referenced again meanwhile, so it was not removed
+ * @return 0 on success, -1 on error
+ */
+int netpipe_forget(struct netpipe *file, unsigned long nlookup, int (*remove_open_file)(struct netpipe *));
+
+/**
+ * Open the netpipe for writing on behalf of the given fan-out netpipe. It doesn't wait for the readers and the
+ * fan-out netpipe is notified each time the remote host can receive more data or the readers change.
+ *
+ * @param file pointer to netpipe structure
+ * @param fanout the fan-out netpipe
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EPERM if the netpipe is open for reading and
+ * to EBUSY if it is already written by a fan-out netpipe or used by a relay
+ */
+int netpipe_fanout_attach(struct netpipe *file, struct fanout *fanout);
+
+/**
+ * Stop notifying the fan-out netpipe. The netpipe is still open and it should be closed with netpipe_close_async().
+ *
+ * @param file pointer to netpipe structure
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipe_fanout_detach(struct netpipe *file);
+
+/**
+ * Send to the remote host at most size bytes, as many as it can receive. It never blocks and it never buffers.
+ *
+ * @param file pointer to netpipe structure
+ * @param buf data that should be sent
+ * @param size how much data should be sent
+ * @return how much data was sent, -1 on error and sets errno. It sets errno to EPIPE if there are no readers
+ */
+ssize_t netpipe_fanout_send(struct netpipe *file, const char *buf, size_t size);
+
+/**
+ * Open the netpipe on behalf of the given relay, without waiting for the remote host. The relay is notified each
+ * time the remote host can receive more data or the readers or the writers change, and the data received is given
+ * to it. A relay which reads the netpipe doesn't get what is left into the buffer by a relay which ended.
+ *
+ * @param file pointer to netpipe structure
+ * @param mode O_RDONLY if the relay reads the netpipe, O_WRONLY if it writes it, optionally with NETPIPE_MESSAGES
+ * @param relay the relay
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EBUSY if the netpipe is open locally or it is
+ * already used by a fan-out netpipe or a relay
+ */
+int netpipe_relay_attach(struct netpipe *file, int mode, struct relay *relay);
+
+/**
+ * Stop notifying the relay. The netpipe is still open and it should be closed with netpipe_close_async().
+ *
+ * @param file pointer to netpipe structure
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipe_relay_detach(struct netpipe *file);
 
 /**
  * Forces all the operations on this netpipe to stop and immediately end.
@@ -2,18 +2,70 @@
 #define NETPIPEFS_SOCKET_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 #include "netpipe.h"
+#include "shmring.h"
 
 #define AF_UNIX_LABEL "AF_UNIX"
 #define AF_INET_LABEL "AF_INET"
 #define DEFAULT_PORT 7000
 #define DEFAULT_TIMEOUT 8000    // Massimo tempo, espresso in millisecondi, per avviare una connessione socket
 #define CONNECT_INTERVAL 500    // Ogni quanti millisecondi riprovare la connect se fallisce
+#define DEFAULT_ZEROCOPY 0      // payloads of at least this size are sent with MSG_ZEROCOPY. 0 means disabled
+#define ALIGNED_WRITE_MIN 65536 // smaller payloads are not page-aligned: they are not worth the padding
+#define DEFAULT_SHMSIZE 1048576 // capacity of each shared memory ring used with AF_UNIX sockets. 0 means disabled
 
+/**
+ * Function called when the kernel doesn't need anymore the data sent with MSG_ZEROCOPY. It is called by
+ * the dispatcher, in the same order of the sends, without holding any lock.
+ *
+ * @param arg argument given to the send function
+ * @param size how many bytes of data were sent
+ */
+typedef void (*zerocopy_done_t)(void *arg, size_t size);
+
+struct open_files_table;
+
+/** Timer sent to the dispatcher. It holds a lookup reference to the file, which the dispatcher forgets */
+struct netpipefs_timer {
+    struct netpipe *file;
+    struct timespec deadline;   // CLOCK_MONOTONIC time when the first read or the close of the file should be completed
+};
+
+/** Connection with the remote host. Every file is open on a connection */
 struct netpipefs_socket {
     int fd;     // socket file descriptor
     pthread_mutex_t wr_mtx; // protect write
+    size_t readahead;   // local settings, taken from the options when the connection is established
+    size_t writeahead;
+    const char *spooldir; // directory of the spool files of the writers, NULL if disabled
+    size_t spoolmax;    // bytes of each spool file
+    int busypoll;
+    size_t readmin;
+    int readtime;
+    int timerfd;        // where the timers are sent to the dispatcher, -1 if it is not running
+    size_t earlydata;   // credit granted to each remote writer before the netpipe is open locally
+    size_t earlymax;    // max credit granted early to all the netpipes
+    size_t early_used;  // credit granted early which no reader took yet. Updated atomically
+    int asyncclose;     // the last writer's close doesn't wait for the buffer to be drained
+    int linger;         // milliseconds the last writer's close waits for the buffer to be drained. 0 means forever
+    unsigned long draining; // closes which returned but whose buffer is still drained. Updated atomically
+    struct open_files_table *files; // files open on this connection
     size_t remote_readahead;
+    size_t zerocopy;    // payloads of at least this size are sent with MSG_ZEROCOPY. 0 if disabled
+    uint32_t zc_next;   // id that the kernel will give to the next MSG_ZEROCOPY send
+    int zc_reaping;     // the dispatcher is calling the completion functions
+    struct zerocopy_ticket *zc_head;    // FIFO list of sends whose data is still used by the kernel
+    struct zerocopy_ticket *zc_tail;
+    size_t wr_bytes;    // bytes written into the socket since the connection was established
+    size_t remote_align;    // payloads are sent page-aligned with this page size because the remote host maps them. 0 if it doesn't
+    char *zc_map;       // area where payloads are mapped with TCP_ZEROCOPY_RECEIVE. NULL if it is not supported
+    size_t zc_map_len;
+    shmring_t *shm_tx;  // shared memory ring where messages are written instead of the socket. NULL if not used
+    shmring_t *shm_rx;  // shared memory ring from which messages are read
+    struct netpipefs_socket *relay_to;  // the netpipes written by the remote host are forwarded to this connection. NULL if none
 };
 
 /** Header sent before each message */
@@ -22,20 +74,22 @@ enum netpipefs_header {
     CLOSE,
     READ,
     READ_REQUEST,
-    WRITE
+    WRITE,
+    WRITE_ALIGNED,  // WRITE message whose data starts at a page-aligned offset of the stream, after some padding
+    URGENT          // message which overtakes the data of the netpipe
 };
 
 
 
 /**
- * Establish a socket connection with a maximum time expressed my the given timeout value.
+ * Establish a socket connection with the host given by the options, within the timeout of the options.
  *
  * @param netpipefs_socket socket structure
- * @param timeout maximum time allowed to establish the connection. Expressed in milliseconds.
+ * @param options host, ports, timeout and settings of the connection
  *
  * @return 0 on success, -1 on error and sets errno. On timeout it returns -1 and sets errno to ETIMEDOUT
  */
-int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long timeout);
+int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, const struct netpipefs_options *options);
 
 /**
  * Closes socket connection.
@@ -46,6 +100,63 @@ int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long
  */
 int end_socket_connection(struct netpipefs_socket *netpipefs_socket);
 
+/**
+ * Share a memory ring per direction with the remote host, which must call this function too. The rings are
+ * exchanged over the AF_UNIX socket, then every message is written into them and the socket is used only to
+ * know if the remote host is gone.
+ *
+ * @param skt netpipefs socket structure. Its socket must be AF_UNIX
+ * @param size capacity of the ring where this host writes
+ * @return 1 on success, 0 if the socket was closed, -1 on error and sets errno
+ */
+int socket_shm_connect(struct netpipefs_socket *skt, size_t size);
+
+/**
+ * Get the file descriptor which becomes readable when a message arrives. See socket_ready().
+ *
+ * @param skt netpipefs socket structure
+ * @return the socket or the data doorbell of the shared memory ring
+ */
+int socket_pollfd(struct netpipefs_socket *skt);
+
+/**
+ * Check if a message can be read without waiting on the file descriptor returned by socket_pollfd(). It always
+ * returns 0 without shared memory, otherwise it arms the doorbell of the ring when it returns 0.
+ *
+ * @param skt netpipefs socket structure
+ * @return 1 if there is a message, 0 otherwise
+ */
+int socket_ready(struct netpipefs_socket *skt);
+
+/**
+ * Read n bytes of a message, from the socket or the shared memory ring.
+ *
+ * @param skt netpipefs socket structure
+ * @param buf data read will be put here
+ * @param n how many bytes to read
+ * @return number of bytes read or -1 on error or 0 if the socket was closed
+ */
+ssize_t read_socket(struct netpipefs_socket *skt, void *buf, size_t n);
+
+/**
+ * Read n bytes of a message and put them into the circular buffer.
+ *
+ * @param skt netpipefs socket structure
+ * @param cbuf buffer pointer
+ * @param n how many bytes to read
+ * @return number of bytes read or -1 on error or 0 if the socket was closed
+ */
+ssize_t read_socket_cbuf(struct netpipefs_socket *skt, cbuf_t *cbuf, size_t n);
+
+/**
+ * Read and discard n bytes of a message, from the socket or the shared memory ring.
+ *
+ * @param skt netpipefs socket structure
+ * @param n how many bytes to discard. It should be greater than 0
+ * @return number of bytes discarded or -1 on error or 0 if the socket was closed
+ */
+ssize_t skip_socket(struct netpipefs_socket *skt, size_t n);
+
 /**
  * Read from socket the header and sets the header pointer and the path pointer
  *
@@ -90,6 +201,19 @@ int send_close_message(struct netpipefs_socket *skt, const char *path, int mode)
  */
 int send_write_message(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size);
 
+/**
+ * Send WRITE message like the function send_write_message() but data is spliced from the given pipe
+ * into the socket, so it is never copied into user space.
+ *
+ * @param skt netpipefs socket structure
+ * @param path file path
+ * @param fd pipe from which data is read
+ * @param size how much data should be sent
+ *
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int send_splice_message(struct netpipefs_socket *skt, const char *path, int fd, size_t size);
+
 /**
  * Send WRITE message like the function send_write_message() but get data from file buffer
  *
@@ -101,6 +225,75 @@ int send_write_message(struct netpipefs_socket *skt, const char *path, const cha
  */
 int send_flush_message(struct netpipefs_socket *skt, struct netpipe *file, size_t size);
 
+/**
+ * Send WRITE message like the function send_write_message() but if size is at least the zerocopy
+ * threshold then data is sent with MSG_ZEROCOPY, so the buffer cannot be modified or freed until
+ * done is called. If the kernel runs out of memory for zerocopy sends then the rest is copied.
+ *
+ * @param skt netpipefs socket structure
+ * @param path file path
+ * @param buf data
+ * @param size how much data should be sent
+ * @param done function called when the buffer is not used anymore
+ * @param arg argument passed to done
+ * @param pending set to 1 if done will be called, 0 if the data was copied and the buffer can be reused immediately
+ *
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int send_write_message_zc(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size,
+                          zerocopy_done_t done, void *arg, int *pending);
+
+/**
+ * Send WRITE message like the function send_flush_message() but data is not removed from the file buffer.
+ * If size is at least the zerocopy threshold then data is sent with MSG_ZEROCOPY.
+ *
+ * @param skt netpipefs socket structure
+ * @param file the file
+ * @param offset how many bytes of the file buffer were already sent
+ * @param size how much data should be sent
+ * @param ordered if 1 then done is called even if data was copied, after the previous sends are done
+ * @param done function called when the data is not used anymore
+ * @param arg argument passed to done
+ * @param pending set to 1 if done will be called, 0 if the data was copied and can be removed immediately
+ *
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int send_flush_message_zc(struct netpipefs_socket *skt, struct netpipe *file, size_t offset, size_t size, int ordered,
+                          zerocopy_done_t done, void *arg, int *pending);
+
+/**
+ * Read the zerocopy completions from the socket error queue and call the functions of the sends which
+ * are done. It doesn't block.
+ *
+ * @param skt netpipefs socket structure
+ * @return 0 on success, -1 on error
+ */
+int netpipefs_zerocopy_reap(struct netpipefs_socket *skt);
+
+/**
+ * Call the functions of all the sends still in flight, as if they were done. Used when the connection
+ * is not used anymore.
+ *
+ * @param skt netpipefs socket structure
+ */
+void netpipefs_zerocopy_abort(struct netpipefs_socket *skt);
+
+/**
+ * Read size bytes of payload from the socket. If the payload is mapped with TCP_ZEROCOPY_RECEIVE then iov is filled
+ * with the mapped pages, while the parts which cannot be mapped are copied into buf at the same offset.
+ * With shared memory iov points into the ring. Otherwise everything is copied into buf. The mapped pages are
+ * valid until the next call, the data into the ring until the next read.
+ *
+ * @param skt netpipefs socket structure
+ * @param buf buffer of at least size bytes
+ * @param size how many bytes should be read
+ * @param iov will point to the data, in order
+ * @param iovcnt max number of elements of iov. It is set with how many elements are used
+ *
+ * @return how many bytes were read, 0 if the socket was closed, -1 on error
+ */
+ssize_t recv_mapped(struct netpipefs_socket *skt, char *buf, size_t size, struct iovec *iov, int *iovcnt);
+
 /**
  * Send READ message
  *
@@ -123,4 +316,16 @@ int send_read_message(struct netpipefs_socket *skt, const char *path, size_t siz
  */
 int send_read_request_message(struct netpipefs_socket *skt, const char *path, size_t size);
 
+/**
+ * Send URGENT message and its data
+ *
+ * @param skt netpipefs socket structure
+ * @param path file path
+ * @param buf the message
+ * @param size size of the message
+ *
+ * @return > 0 on success, 0 if the socket was closed, -1 on error
+ */
+int send_urgent_message(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size);
+
 #endif //NETPIPEFS_SOCKET_H
@@ -4,63 +4,74 @@
 #include "netpipe.h"
 
 /**
- * Initialize the open files table
+ * Initialize the open files table of the given connection
+ *
+ * @param skt the connection
  *
  * @return 0 on success, -1 on error and sets errno
  */
-int netpipefs_open_files_table_init(void);
+int netpipefs_open_files_table_init(struct netpipefs_socket *skt);
 
 /**
- * Destroy the open files tables. All the files are freed.
+ * Destroy the open files tables of the given connection. All the files are freed.
+ *
+ * @param skt the connection
+ * @param poll_destroy function used to destroy the poll handles which are still registered, NULL if none
  *
  * @return 0 on success, -1 on error and sets errno
  */
-int netpipefs_open_files_table_destroy(void);
+int netpipefs_open_files_table_destroy(struct netpipefs_socket *skt, void (*poll_destroy)(void *));
 
 /**
  * Returns the file structure for the given path or NULL if it doesn't exist
  *
+ * @param skt the connection
  * @param path file's path
  *
  * @return the file structure or NULL if it doesn't exist
  */
-struct netpipe *netpipefs_get_open_file(const char *path);
+struct netpipe *netpipefs_get_open_file(struct netpipefs_socket *skt, const char *path);
 
 /**
- * Removes the file with key path from the open file table. The file structure is also freed.
+ * Removes the file from the open file table of its connection. The file is not removed if the kernel
+ * holds a reference to it. The file structure is not freed.
  *
- * @param path file's path
+ * @param file the file
  *
- * @return 0 on success, -1 on error
+ * @return 0 on success, 1 if the file is referenced by the kernel, -1 on error and sets errno. It sets errno
+ * to ENOENT if the file is not into the table
  */
-int netpipefs_remove_open_file(const char *path);
+int netpipefs_remove_open_file(struct netpipe *file);
 
 /**
  * Returns the file structure for the given path or NULL if it doesn't exist
  *
+ * @param skt the connection
  * @param path file's path
  *
  * @return the file structure or NULL if it doesn't exist
  */
-struct netpipe *netpipefs_get_or_create_open_file(const char *path, int *just_created);
+struct netpipe *netpipefs_get_or_create_open_file(struct netpipefs_socket *skt, const char *path, int *just_created);
 
 /**
- * Destroy given poll handle
- * @param ph poll handle to be destroyed
- */
-void netpipefs_poll_destroy(void *ph);
-
-/**
- * Notify who is interested to the given poll handle which will be destroyed after notification.
- * @param ph poll handle
+ * Like netpipefs_get_or_create_open_file() but it also takes a kernel reference to the file, so it is
+ * not freed until netpipe_forget() is called. The reference is taken atomically with the lookup.
+ *
+ * @param skt the connection
+ * @param path file's path
+ *
+ * @return the file structure or NULL on error and it sets errno
  */
-void netpipefs_poll_notify(void *ph);
+struct netpipe *netpipefs_lookup_open_file(struct netpipefs_socket *skt, const char *path);
 
 /**
- * Forces all the operations on any netpipe to immediately end.
+ * Forces all the operations on any netpipe of the given connection to immediately end.
+ *
+ * @param skt the connection
+ * @param poll_notify function used to notify the registered poll handles
  *
  * @return 0 on success, -1 on error
  */
-int netpipefs_shutdown(void);
+int netpipefs_shutdown(struct netpipefs_socket *skt, void (*poll_notify)(void *));
 
 #endif //OPENFILES_H
@@ -6,7 +6,13 @@
 #define NETPIPEFS_OPTIONS_H
 
 #define FUSE_USE_VERSION 29 //fuse version 2.9. Needed by fuse.h
-#include <fuse.h>
+#include <stdio.h>
+#include <stddef.h>
+
+struct fuse_args;
+
+#define DEFAULT_WORKERS 4 // number of threads which process FUSE requests
+#define DEFAULT_MAXIO 131072 // max size of a read or write request sent by the kernel
 
 /** Definition for command line options */
 struct netpipefs_options {
@@ -22,6 +28,27 @@ struct netpipefs_options {
     int delayconnect;
     size_t writeahead;
     size_t readahead;
+    char *spooldir; // directory where the data which doesn't fit into the writeahead is spilled. NULL if disabled
+    size_t spoolmax;    // bytes which can be spilled for each netpipe
+    int busypoll;   // microseconds spent busy polling before blocking. 0 means disabled
+    int readmin;    // bytes a blocking read waits for
+    int readtime;   // milliseconds a read waits for readmin bytes after the first one. 0 means forever
+    size_t earlydata;   // bytes a remote writer can send before the netpipe is open locally. 0 means disabled
+    size_t earlymax;    // bytes which can be sent early to all the netpipes of a connection
+    int asyncclose; // the last writer's close returns at once and the data is drained in background
+    int linger;     // milliseconds the last writer's close waits for the data to be read. 0 means forever
+    int workers;    // number of threads which process FUSE requests
+    int maxio;      // max_read and max_write mount options
+    int clonefd;    // each worker reads requests from its own clone of /dev/fuse
+    int zerocopy;   // payloads of at least this size are sent with MSG_ZEROCOPY. 0 means disabled
+    int zerocopyrecv;   // large payloads are mapped with TCP_ZEROCOPY_RECEIVE
+    int shmsize;    // capacity of the shared memory rings used with AF_UNIX sockets. 0 means disabled
+    char *peers;    // file with the remote hosts. NULL if there is only the one given by hostip and hostport
+    char *fanout;   // directory whose netpipes are written to every peer. NULL if disabled
+    int fanoutlag;  // bytes a subscriber of a fan-out netpipe can lag behind the fastest one
+    int fanoutdrop; // a lagging subscriber skips the data instead of being disconnected
+    char *relay;    // pairs "<source>:<destination>" of peers. The netpipes written by the source are forwarded to the destination
+    char *pipes;    // file with the netpipes provisioned at mount time. NULL if none
     /*int intr;
     int intr_signal;*/
 };
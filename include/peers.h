@@ -0,0 +1,97 @@
+/** @file
+ * Remote hosts of the mount. With --peers each host has a directory into the mountpoint which contains the
+ * netpipes shared with it, otherwise there is only the host given by --hostip and its netpipes are into the root.
+ * All the connections are handled by the same dispatcher.
+ */
+
+#ifndef PEERS_H
+#define PEERS_H
+
+#include "options.h"
+#include "netpipefs_socket.h"
+
+#define PEER_NAME_MAX 64    // max length of a peer's name, terminator included
+#define PEER_HOST_MAX 64
+#define PIPE_NAME_MAX 256   // max length of the name of a provisioned netpipe, terminator included
+
+/** Netpipe declared at mount time */
+struct netpipefs_pipe {
+    char path[PIPE_NAME_MAX + 1];   // its path, "/<name>"
+    int mode;       // O_RDONLY if it is read on this host, O_WRONLY if it is written
+    size_t window;  // bytes the writers can send before they are read
+};
+
+/** Remote host and its connection */
+struct netpipefs_peer {
+    char name[PEER_NAME_MAX];   // directory with its netpipes. Empty if they are into the root
+    char hostip[PEER_HOST_MAX];
+    struct netpipefs_options options;   // the command line options with the host and the ports of this peer
+    struct netpipefs_socket skt;
+    struct netpipefs_pipe *pipes;   // netpipes shared with this peer which are provisioned at mount time
+    int npipes;
+};
+
+/** The remote hosts. Declared in peers.c */
+extern struct netpipefs_peer *netpipefs_peers;
+extern int netpipefs_npeers;
+
+/**
+ * Create the peers. If the options have a peers file then there is a peer for each line of it, with the
+ * format "<name> <hostip> <hostport> <port>". Empty lines and lines starting with '#' are skipped. Otherwise
+ * there is one unnamed peer with the host and the ports of the options. The relay pairs of the options set which
+ * connections forward their netpipes to another one.
+ *
+ * @param options command line options
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EINVAL and prints the line if the file or a relay
+ * pair is not valid
+ */
+int netpipefs_peers_init(const struct netpipefs_options *options);
+
+/**
+ * Read the netpipes which are provisioned at mount time. Each line of the file is "<name> <r|w> <window>", or
+ * "<peer>/<name> <r|w> <window>" with many peers, and the remote host must declare the same netpipe with the
+ * other mode and the same window. Empty lines and lines starting with '#' are skipped.
+ *
+ * @param path the file
+ * @return 0 on success, -1 on error and sets errno. It sets errno to EINVAL and prints the line if the file is
+ * not valid
+ */
+int netpipefs_peers_load_pipes(const char *path);
+
+/**
+ * Create the provisioned netpipes of every peer. They are never freed until the connections are closed.
+ * The open files tables must be created.
+ *
+ * @return 0 on success, -1 on error and sets errno
+ */
+int netpipefs_peers_provision(void);
+
+/**
+ * Free the peers. Their connections must be closed.
+ */
+void netpipefs_peers_free(void);
+
+/**
+ * Establish the connections with all the peers at the same time.
+ *
+ * @return 0 if all the connections are established, -1 on error and sets errno
+ */
+int netpipefs_peers_connect(void);
+
+/**
+ * Find the peer with the given name.
+ *
+ * @param name the name
+ * @return the peer, NULL if it doesn't exist
+ */
+struct netpipefs_peer *netpipefs_peer_by_name(const char *name);
+
+/**
+ * Forces all the operations on any netpipe of any peer to immediately end.
+ *
+ * @param poll_notify function used to notify the registered poll handles
+ * @return 0 on success, -1 on error
+ */
+int netpipefs_peers_shutdown(void (*poll_notify)(void *));
+
+#endif //PEERS_H
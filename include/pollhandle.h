@@ -0,0 +1,53 @@
+/** @file
+ * Poll handles of FUSE. The netpipes keep them as opaque pointers, so they don't depend on FUSE.
+ * A thread of netpipefs can poll a netpipe too, with a poll handle which writes into a pipe.
+ */
+
+#ifndef POLLHANDLE_H
+#define POLLHANDLE_H
+
+/** Poll handle notified by writing into a pipe, so the netpipe can be waited with poll() on the read end */
+struct netpipefs_pollpipe {
+    int fd[2];
+};
+
+/**
+ * Destroy the given FUSE poll handle. Nothing is done for a pipe poll handle, which belongs to its thread
+ * @param ph the poll handle
+ */
+void netpipefs_poll_destroy(void *ph);
+
+/**
+ * Notify the given FUSE poll handle and destroy it, or write into the pipe of a pipe poll handle
+ * @param ph the poll handle
+ */
+void netpipefs_poll_notify(void *ph);
+
+/**
+ * Create the pipe of a pipe poll handle
+ * @param pp the pipe poll handle
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int netpipefs_pollpipe_init(struct netpipefs_pollpipe *pp);
+
+/**
+ * The poll handle which should be registered with netpipe_poll(). It is told apart from the FUSE ones
+ * by netpipefs_poll_notify() and netpipefs_poll_destroy()
+ * @param pp the pipe poll handle
+ * @return the opaque poll handle
+ */
+void *netpipefs_pollpipe_handle(struct netpipefs_pollpipe *pp);
+
+/**
+ * Read and discard the notifications written into the pipe
+ * @param pp the pipe poll handle
+ */
+void netpipefs_pollpipe_clear(struct netpipefs_pollpipe *pp);
+
+/**
+ * Close the pipe. The poll handle must not be registered anymore, see netpipe_poll_forget()
+ * @param pp the pipe poll handle
+ */
+void netpipefs_pollpipe_destroy(struct netpipefs_pollpipe *pp);
+
+#endif //POLLHANDLE_H
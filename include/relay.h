@@ -0,0 +1,71 @@
+/** @file
+ * Relays. The netpipes written by a remote host can be forwarded to the netpipe with the same name of another
+ * connection, so that this host is a gateway between them. The data of a relayed netpipe is moved from one socket
+ * to the other with splice(), without being copied into user space, and the source is given only the credit of the
+ * destination, so the flow control works end to end. The relay is started when the remote host opens the netpipe
+ * for writing and nobody has it open locally. It ends when every writer has closed and the data has been forwarded,
+ * or when the readers of the destination close, and then the netpipe is closed on both connections.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <sys/types.h>
+#include "netpipe.h"
+
+#define RELAY_PIPE_SIZE 1048576 // capacity of the pipe used to splice the data between the sockets
+
+struct netpipefs_socket;
+
+/** Relay of a netpipe */
+struct relay;
+
+/**
+ * Start forwarding the given netpipe, which is written by its remote host, to the netpipe with the same name of
+ * the destination. It is open for reading and the other for writing on behalf of the relay, without waiting.
+ *
+ * @param file the netpipe written by the remote host
+ * @param dst connection with the destination
+ * @param poll_notify function used to notify the registered poll handles
+ * @return 0 on success or if the netpipe is already open locally, -1 on error and sets errno
+ */
+int netpipefs_relay_start(struct netpipe *file, struct netpipefs_socket *dst, void (*poll_notify)(void *));
+
+/**
+ * Receive data of the relayed netpipe from the socket. What the destination can receive is forwarded immediately,
+ * the rest is put into the buffer of the netpipe. Called with the lock of the relayed netpipe held.
+ *
+ * @param relay the relay
+ * @param size how many bytes can be read from the socket
+ * @return how much data was received, 0 if the connection was lost, -1 on error
+ */
+ssize_t netpipefs_relay_recv(struct relay *relay, size_t size);
+
+/**
+ * Forward an urgent message of the relayed netpipe to the destination. Called with the lock of the relayed
+ * netpipe held.
+ *
+ * @param relay the relay
+ * @param buf the message
+ * @param size size of the message
+ * @return 0 on success, -1 on error and sets errno to EPIPE if the destination has no readers
+ */
+int netpipefs_relay_urgent(struct relay *relay, const char *buf, size_t size);
+
+/**
+ * Take a reference to the relay.
+ *
+ * @param relay the relay
+ */
+void netpipefs_relay_ref(struct relay *relay);
+
+/**
+ * Called when one of the netpipes of the relay can receive more data or its readers or writers changed. It
+ * forwards the buffered data, gives the destination's credit to the source or ends the relay, and it drops the
+ * reference taken by the caller.
+ *
+ * @param relay the relay
+ */
+void netpipefs_relay_notify(struct relay *relay);
+
+#endif //RELAY_H
@@ -2,6 +2,7 @@
  * Functions readn and writen.
  * From “Advanced Programming In the UNIX Environment” by W. Richard Stevens
  * and Stephen A. Rago, 2013, 3rd Edition, Addison-Wesley.
+ * Function splicen does the same with splice().
  */
 
 #ifndef SCFILES_H
@@ -29,4 +30,15 @@ ssize_t readn(int fd, void *ptr, size_t n);
  */
 ssize_t writen(int fd, void *ptr, size_t n);
 
+/**
+ * Move "n" bytes from fd_in to fd_out without copying them into user space. One of the two
+ * file descriptors must be a pipe. If splice() is not supported then data is copied.
+ *
+ * @param fd_in file descriptor from which data is read
+ * @param fd_out file descriptor into which data is written
+ * @param n how many bytes to move
+ * @return number of bytes moved or -1 on error or 0 on end of file
+ */
+ssize_t splicen(int fd_in, int fd_out, size_t n);
+
 #endif //SCFILES_H
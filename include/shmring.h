@@ -0,0 +1,166 @@
+/** @file
+ * Byte ring in shared memory used to move data between two processes on the same host without crossing the kernel.
+ * There is one producer and one consumer. The ring lives in a memfd and each side has an eventfd doorbell which is
+ * rung by the other side only when it is sleeping, so the fast path doesn't make any system call.
+ * The ring is shared by sending its file descriptors to the other process.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SHMRING_FDS 3   // memfd, data doorbell and space doorbell
+
+/** Shared memory ring data type */
+typedef struct shmring_s shmring_t;
+
+/**
+ * Creates a new ring with the given capacity.
+ *
+ * @param size how much data the ring can have
+ * @return the created ring, NULL on error and sets errno. If shared memory is not supported errno is ENOSYS
+ */
+shmring_t *shmring_create(size_t size);
+
+/**
+ * Maps a ring created by another process, given its file descriptors. The file descriptors are owned by the
+ * ring even on error.
+ *
+ * @param fds the file descriptors returned by shmring_fds()
+ * @return the ring, NULL on error and sets errno
+ */
+shmring_t *shmring_attach(int fds[SHMRING_FDS]);
+
+/**
+ * Unmaps the ring and closes its file descriptors.
+ *
+ * @param ring the ring
+ */
+void shmring_free(shmring_t *ring);
+
+/**
+ * Get the file descriptors that another process needs to attach the ring.
+ *
+ * @param ring the ring
+ * @return array of SHMRING_FDS file descriptors
+ */
+const int *shmring_fds(shmring_t *ring);
+
+/**
+ * Get the file descriptor which becomes readable when the producer writes data while the consumer is waiting.
+ * See shmring_ready().
+ *
+ * @param ring the ring
+ * @return the data doorbell
+ */
+int shmring_pollfd(shmring_t *ring);
+
+/**
+ * Get the ring capacity.
+ *
+ * @param ring the ring
+ * @return how much data the ring can have
+ */
+size_t shmring_capacity(shmring_t *ring);
+
+/**
+ * Write n bytes into the ring. Blocks while the ring is full. Only the producer calls it.
+ *
+ * @param ring the ring
+ * @param buf the data
+ * @param n how many bytes to write
+ * @param peerfd file descriptor which becomes readable if the other process is gone, -1 if none
+ * @return number of bytes written or -1 on error or 0 if the other process is gone
+ */
+ssize_t shmring_writen(shmring_t *ring, const char *buf, size_t n, int peerfd);
+
+/**
+ * Wait until there is space into the ring and get a pointer to it, so the producer can write the data in place.
+ * Only the contiguous part is returned. Only the producer calls it.
+ *
+ * @param ring the ring
+ * @param data will point to the free space
+ * @param peerfd file descriptor which becomes readable if the other process is gone, -1 if none
+ * @return how many contiguous bytes data points to, 0 if the other process is gone, -1 on error
+ */
+ssize_t shmring_reserve(shmring_t *ring, char **data, int peerfd);
+
+/**
+ * Make visible to the consumer n bytes written into the space returned by shmring_reserve(),
+ * and wake it up if it sleeps.
+ *
+ * @param ring the ring
+ * @param n how many bytes. It must not be greater than the reserved space
+ */
+void shmring_commit(shmring_t *ring, size_t n);
+
+/**
+ * Read n bytes from the given file descriptor and write them into the ring. Blocks while the ring is full.
+ * Only the producer calls it.
+ *
+ * @param ring the ring
+ * @param fd file descriptor from which data is read
+ * @param n how many bytes to move
+ * @param peerfd file descriptor which becomes readable if the other process is gone, -1 if none
+ * @return number of bytes moved or -1 on error or 0 on end of file
+ */
+ssize_t shmring_readfd(shmring_t *ring, int fd, size_t n, int peerfd);
+
+/**
+ * Read n bytes from the ring. Blocks while the ring is empty. Only the consumer calls it.
+ *
+ * @param ring the ring
+ * @param buf data read will be put here
+ * @param n how many bytes to read
+ * @param peerfd file descriptor which becomes readable if the other process is gone, -1 if none
+ * @return number of bytes read or -1 on error or 0 if the other process is gone and the ring is empty
+ */
+ssize_t shmring_readn(shmring_t *ring, char *buf, size_t n, int peerfd);
+
+/**
+ * Get a pointer to the unread data, without waiting. Only the contiguous part is returned.
+ *
+ * @param ring the ring
+ * @param data will point to the data
+ * @return how many contiguous bytes data points to, 0 if the ring is empty
+ */
+size_t shmring_peek(shmring_t *ring, char **data);
+
+/**
+ * Mark as read the n oldest unread bytes. Their space is held, so they stay valid, until shmring_release()
+ * is called. The functions which read or wait release it.
+ *
+ * @param ring the ring
+ * @param n how many bytes. It must not be greater than the unread data
+ */
+void shmring_consume(shmring_t *ring, size_t n);
+
+/**
+ * Give back to the producer the space of the data which was read.
+ *
+ * @param ring the ring
+ */
+void shmring_release(shmring_t *ring);
+
+/**
+ * Release the space which is held and wait until there is data to read.
+ *
+ * @param ring the ring
+ * @param peerfd file descriptor which becomes readable if the other process is gone, -1 if none
+ * @return 1 if there is data, 0 if the other process is gone and the ring is empty, -1 on error
+ */
+int shmring_wait(shmring_t *ring, int peerfd);
+
+/**
+ * Release the space which is held and check if there is data to read, without waiting. If the ring is empty
+ * then the data doorbell is armed: the file descriptor returned by shmring_pollfd() becomes readable
+ * when data is written.
+ *
+ * @param ring the ring
+ * @return 1 if there is data, 0 otherwise
+ */
+int shmring_ready(shmring_t *ring);
+
+#endif //SHMRING_H
@@ -3,8 +3,9 @@
 
 #include "options.h" // needed for fuse version
 #include <signal.h>
+#include <fuse_lowlevel.h>
 
-int netpipefs_set_signal_handlers(sigset_t *set, struct fuse_chan *ch, struct fuse *fu);
+int netpipefs_set_signal_handlers(sigset_t *set, struct fuse_chan *ch, struct fuse_session *se);
 
 int netpipefs_remove_signal_handlers(void);
 
@@ -9,6 +9,8 @@
 #include <sys/un.h>
 #include <netinet/in.h>
 
+#define SOCK_MAX_FDS 8  // max number of file descriptors sent with a single message
+
 /**
  * Establish a double connection with the host: one by connect to the remote host and another one by accepting a
  * connection from remote host. If the remote host has not yet called this function, the connection will be tried
@@ -48,4 +50,26 @@ int sock_write_h(int fd_skt, void *data, size_t size);
  */
 int sock_read_h(int fd_skt, void **ptr);
 
+/**
+ * Send the given file descriptors over an AF_UNIX socket with SCM_RIGHTS, together with one byte of data.
+ *
+ * @param fd_skt AF_UNIX socket
+ * @param fds the file descriptors
+ * @param n how many file descriptors. At most SOCK_MAX_FDS
+ *
+ * @return 1 on success, -1 on error and sets errno
+ */
+int sock_send_fds(int fd_skt, const int *fds, int n);
+
+/**
+ * Receive exactly n file descriptors sent with sock_send_fds().
+ *
+ * @param fd_skt AF_UNIX socket
+ * @param fds will be set with the received file descriptors
+ * @param n how many file descriptors are expected. At most SOCK_MAX_FDS
+ *
+ * @return 1 on success, 0 if the socket was closed, -1 on error and sets errno
+ */
+int sock_recv_fds(int fd_skt, int *fds, int n);
+
 #endif //SOCKETCONN_H
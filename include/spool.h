@@ -0,0 +1,87 @@
+/** @file
+ * Spool file on local disk which holds the data that a writer cannot put into the writeahead buffer of a netpipe.
+ * It is a byte ring over a file mapped in memory: data is appended by copying it into the mapping and the kernel
+ * writes it back to the disk in background, so the writer never waits for the disk. The file is unlinked as soon
+ * as it is created and its space is allocated up front, so a full disk is reported when the spool is created.
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Spool data type */
+typedef struct spool_s spool_t;
+
+/**
+ * Creates a new spool into the given directory.
+ *
+ * @param dir directory of the spool file
+ * @param capacity how much data the spool can have
+ * @return the created spool, NULL on error and sets errno. If there is not enough disk space errno is ENOSPC
+ */
+spool_t *spool_create(const char *dir, size_t capacity);
+
+/**
+ * Unmaps and closes the spool file. The data which was not taken is lost.
+ *
+ * @param spool the spool
+ */
+void spool_free(spool_t *spool);
+
+/**
+ * Get the spool capacity.
+ *
+ * @param spool the spool
+ * @return how much data the spool can have
+ */
+size_t spool_capacity(spool_t *spool);
+
+/**
+ * Get how much data is into the spool.
+ *
+ * @param spool the spool
+ * @return how much data was put and not dropped yet
+ */
+size_t spool_size(spool_t *spool);
+
+/**
+ * Append data to the spool. Only puts data until the spool is full.
+ *
+ * @param spool the spool
+ * @param data the data
+ * @param size how much of the data should be put
+ * @return how much data was put
+ */
+size_t spool_put(spool_t *spool, const char *data, size_t size);
+
+/**
+ * Read at most n bytes from the given file descriptor and append them to the spool. Only reads until the spool
+ * is full.
+ *
+ * @param fd file descriptor
+ * @param spool the spool
+ * @param n how many bytes to read
+ * @return number of bytes read or -1 on error or 0 on end of file
+ */
+ssize_t spool_readn(int fd, spool_t *spool, size_t n);
+
+/**
+ * Get a pointer to the oldest data, without removing it. Only the contiguous part is returned.
+ *
+ * @param spool the spool
+ * @param data will point to the data
+ * @return how many contiguous bytes data points to, 0 if the spool is empty
+ */
+size_t spool_peek(spool_t *spool, char **data);
+
+/**
+ * Remove the n oldest bytes from the spool.
+ *
+ * @param spool the spool
+ * @param n how many bytes. It must not be greater than the data into the spool
+ */
+void spool_drop(spool_t *spool, size_t n);
+
+#endif //SPOOL_H
@@ -0,0 +1,103 @@
+/** @file
+ * Futex-based wait primitive used by threads blocked on a netpipe request. The waker completes the
+ * request while holding the netpipe lock, defers the wake up into a wake list and wakes the waiters
+ * only after the lock is released. The waiter never needs to take the netpipe lock again.
+ */
+
+#ifndef WAITQ_H
+#define WAITQ_H
+
+#include <stdint.h>
+
+/** Node on which a single thread waits until it is completed */
+typedef struct waitq_node {
+    uint32_t state;          // futex word
+    struct waitq_node *next; // next node into a wake list
+    void (*callback)(struct waitq_node *node); // if not NULL it is called on completion instead of waking a waiter
+} waitq_node_t;
+
+/** List of completed nodes which should be woken up when the lock is released */
+typedef struct waitq_wakelist {
+    waitq_node_t *head;
+    waitq_node_t *tail;
+} waitq_wakelist_t;
+
+#define WAITQ_WAKELIST_INIT { NULL, NULL }
+
+/** Self-tuning spin state shared by the waiters of the same object */
+typedef struct waitq_spin {
+    long estimate; // how many nanoseconds a waiter usually spins before its node is completed
+} waitq_spin_t;
+
+#define WAITQ_SPIN_INIT { 0 }
+
+/**
+ * Initialize the given node as not completed.
+ *
+ * @param node the node
+ */
+void waitq_node_init(waitq_node_t *node);
+
+/**
+ * Initialize the given node as not completed. Nobody waits on this node: when it is completed
+ * the callback is called by the thread which completes it, after the lock is released.
+ *
+ * @param node the node
+ * @param callback function called on completion. It can free the node
+ */
+void waitq_node_init_callback(waitq_node_t *node, void (*callback)(waitq_node_t *node));
+
+/**
+ * Block the calling thread until the node is completed by calling waitq_wake() or waitq_wake_all().
+ * It returns immediately if the node is already completed.
+ *
+ * @param node the node
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int waitq_wait(waitq_node_t *node);
+
+/**
+ * Like waitq_wait() but the calling thread busy waits for a while before it blocks. How long it spins
+ * adapts to how long the previous waits took: if the node is usually completed while spinning, the spin
+ * time grows up to max_spin, otherwise it shrinks and the waiter blocks almost immediately.
+ *
+ * @param node the node
+ * @param spin spin state
+ * @param max_spin maximum spin time expressed in nanoseconds. If <= 0 then it does not spin at all
+ * @return 0 on success, -1 on error and it sets errno
+ */
+int waitq_wait_spin(waitq_node_t *node, waitq_spin_t *spin, long max_spin);
+
+/**
+ * Complete the node and wake up its waiter, if any, or call its callback. After this call the node
+ * can be freed at any time by the waiter so it must not be accessed anymore.
+ *
+ * @param node the node
+ */
+void waitq_wake(waitq_node_t *node);
+
+/**
+ * Check if the node was completed.
+ *
+ * @param node the node
+ * @return 1 if completed, 0 otherwise
+ */
+int waitq_done(waitq_node_t *node);
+
+/**
+ * Add the node to the wake list. The node will be completed by waitq_wake_all().
+ *
+ * @param wl the wake list
+ * @param node the node
+ */
+void waitq_defer(waitq_wakelist_t *wl, waitq_node_t *node);
+
+/**
+ * Complete all the nodes of the wake list and wake up their waiters. It should be called
+ * without holding any lock. The list will be empty.
+ *
+ * @param wl the wake list
+ */
+void waitq_wake_all(waitq_wakelist_t *wl);
+
+#endif //WAITQ_H
@@ -0,0 +1,58 @@
+#
+# Functions shared by the benchmark scripts, which source this file. bench_run() mounts two netpipefs connected
+# to each other on this host and unmounts them at the end: build netpipefs, and the example which the benchmark
+# runs, into ./bin before running it.
+#
+
+prod=./tmp/prod     # mountpoint of the writers
+cons=./tmp/cons     # mountpoint of the readers
+buffer=131072       # readahead and writeahead of both the mountpoints
+hostip=localhost    # address the two mountpoints connect to
+
+# Mount the two netpipefs, run the given command and unmount them. The first two arguments are the options added
+# to the mount of the writers and to the mount of the readers
+bench_run() {
+  popts=$1
+  copts=$2
+  shift 2
+
+  mkdir -p $prod $cons
+  ./bin/netpipefs -p 12345 --hostip=$hostip --hostport=6789 --writeahead=$buffer --readahead=$buffer $popts -delayconnect $prod
+  ./bin/netpipefs --port=6789 --hostip=$hostip --hostport=12345 --writeahead=$buffer --readahead=$buffer $copts $cons
+  sleep 1
+
+  "$@"
+
+  fusermount -u $prod
+  fusermount -u $cons
+  sleep 1
+}
+
+# user + system clock ticks of the netpipefs process mounted on the given mountpoint
+cputicks() {
+  pid=$(pgrep -f "netpipefs.* $1\$")
+  awk '{ print $14 + $15 }' /proc/$pid/stat
+}
+
+# Print the CPU time of the given clock ticks and how many CPU seconds they are for each GB of the given megabytes
+cpu_report() {
+  awk -v ticks=$1 -v hz=$(getconf CLK_TCK) -v mb=$2 \
+    'BEGIN { printf "cpu=%.2fs %.2f cpu seconds/GB\n", ticks / hz, ticks / hz * 1024 / mb }'
+}
+
+# Write the given megabytes into a netpipe of the writers' mount, with blocks of the given size, and read them from
+# the readers' mount, printing the throughput
+bench_transfer() {
+  dd if=/dev/zero of=$prod/data bs=$2 count=$(( $1 * 1048576 / $2 )) 2> /dev/null &
+  dd if=$cons/data of=/dev/null bs=$2 2>&1 | grep -a copied
+  wait
+}
+
+# Like bench_transfer() but it also prints the CPU time spent by the two netpipefs processes
+bench_transfer_cpu() {
+  before=$(( $(cputicks $prod) + $(cputicks $cons) ))
+  bench_transfer $1 $2
+  after=$(( $(cputicks $prod) + $(cputicks $cons) ))
+
+  cpu_report $(( $after - $before )) $1
+}
@@ -0,0 +1,21 @@
+#
+# Measures the opens per second and the small-write throughput on localhost, with the workers sharing
+# the /dev/fuse queue and then with -clonefd. Run it on different revisions to compare two frontends.
+#
+
+. "$(dirname "$0")/bench_common.sh"
+
+if [ $# -lt 3 ]; then
+  echo "error: missing opens, block size or bytes" >&2
+  printf "usage: %s <opens> <block_size> <bytes> [workers]\n" $0
+  exit 1
+fi
+opens=$1
+bs=$2
+bytes=$3
+workers=${4:-4}
+
+echo "[Shared queue] workers=$workers"
+bench_run "--workers=$workers" "--workers=$workers" ./bin/openbench $prod $cons $opens $bs $bytes
+echo "[Clone fd    ] workers=$workers"
+bench_run "--workers=$workers -clonefd" "--workers=$workers -clonefd" ./bin/openbench $prod $cons $opens $bs $bytes
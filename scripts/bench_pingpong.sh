@@ -0,0 +1,27 @@
+#
+# Runs the ping-pong latency benchmark on localhost twice: first with blocking waits and then with busy
+# polling enabled, so that the p50/p99 round trip times can be compared. Each run measures the two netpipes
+# ping and pong and then a single full-duplex netpipe open with O_RDWR.
+#
+
+. "$(dirname "$0")/bench_common.sh"
+
+if [ $# -lt 2 ]; then
+  echo "error: missing block size or iterations" >&2
+  printf "usage: %s <block_size> <iterations> [busypoll_usec]\n" $0
+  exit 1
+fi
+bs=$1
+iterations=$2
+busypoll=${3:-50}
+
+# the two netpipes and then the full-duplex one
+pingpong() {
+  ./bin/pingpong $prod $cons $bs $iterations
+  ./bin/pingpong $prod $cons $bs $iterations rdwr
+}
+
+echo "[Blocking ] busypoll=0"
+bench_run "--busypoll=0" "--busypoll=0" pingpong
+echo "[Busy poll] busypoll=$busypoll us"
+bench_run "--busypoll=$busypoll" "--busypoll=$busypoll" pingpong
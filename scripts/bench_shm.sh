@@ -0,0 +1,19 @@
+#
+# Measures the throughput between two mountpoints on the same host when the messages go through the AF_UNIX
+# socket and when they go through the shared memory rings.
+#
+
+. "$(dirname "$0")/bench_common.sh"
+
+if [ $# -lt 1 ]; then
+  echo "error: missing size" >&2
+  printf "usage: %s <megabytes> [block_size]\n" $0
+  exit 1
+fi
+megabytes=$1
+bs=${2:-131072}
+
+echo "[AF_UNIX socket] bs=$bs"
+bench_run "--shmsize=0" "--shmsize=0" bench_transfer $megabytes $bs
+echo "[Shared memory ] bs=$bs"
+bench_run "" "" bench_transfer $megabytes $bs
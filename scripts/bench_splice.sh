@@ -0,0 +1,20 @@
+#
+# Measures the CPU time spent by the two netpipefs processes to move data on localhost, first with
+# splice enabled and then with it disabled, and prints the CPU seconds per GB.
+#
+
+. "$(dirname "$0")/bench_common.sh"
+
+if [ $# -lt 1 ]; then
+  echo "error: missing size" >&2
+  printf "usage: %s <megabytes> [block_size]\n" $0
+  exit 1
+fi
+megabytes=$1
+bs=${2:-131072}
+nosplice="-o no_splice_read,no_splice_write,no_splice_move"
+
+echo "[Splice ] bs=$bs"
+bench_run "" "" bench_transfer_cpu $megabytes $bs
+echo "[Copy   ] bs=$bs"
+bench_run "$nosplice" "$nosplice" bench_transfer_cpu $megabytes $bs
@@ -0,0 +1,25 @@
+#
+# Measures the CPU time spent by the two netpipefs processes to move data over a TCP connection on the loopback
+# interface, copying the payloads, sending them with MSG_ZEROCOPY, mapping them with TCP_ZEROCOPY_RECEIVE and
+# with both, and prints the CPU seconds per GB.
+#
+
+. "$(dirname "$0")/bench_common.sh"
+
+if [ $# -lt 1 ]; then
+  echo "error: missing size" >&2
+  printf "usage: %s <megabytes> [block_size]\n" $0
+  exit 1
+fi
+megabytes=$1
+bs=${2:-1048576}
+hostip=127.0.0.1 # TCP instead of the AF_UNIX socket used for localhost
+
+echo "[Copy         ] bs=$bs"
+bench_run "" "" bench_transfer_cpu $megabytes $bs
+echo "[Send zerocopy] bs=$bs"
+bench_run "--zerocopy=65536" "" bench_transfer_cpu $megabytes $bs
+echo "[Recv zerocopy] bs=$bs"
+bench_run "" "-zerocopyrecv" bench_transfer_cpu $megabytes $bs
+echo "[Both         ] bs=$bs"
+bench_run "--zerocopy=65536" "-zerocopyrecv" bench_transfer_cpu $megabytes $bs
@@ -3,6 +3,12 @@
 #include <string.h>
 #include "../include/cbuf.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct cbuf_s {
     char *data;
     size_t head;
@@ -39,6 +45,26 @@ void cbuf_free(cbuf_t *cbuf) {
     }
 }
 
+int cbuf_grow(cbuf_t *cbuf, size_t capacity) {
+    size_t size = cbuf_size(cbuf);
+    char *data;
+
+    if (capacity <= cbuf->capacity) return 0;
+    data = (char *) malloc(sizeof(char) * capacity);
+    if (data == NULL) return -1;
+
+    // the data is moved to the beginning
+    cbuf_get(cbuf, data, size);
+    free(cbuf->data);
+    cbuf->data = data;
+    cbuf->capacity = capacity;
+    cbuf->tail = 0;
+    cbuf->head = size;
+    cbuf->isfull = 0;
+
+    return 0;
+}
+
 size_t cbuf_put(cbuf_t *cbuf, const char *data, size_t size) {
     if (cbuf->capacity == 0) return 0;
 
@@ -154,6 +180,84 @@ ssize_t cbuf_writen(int fd, cbuf_t *cbuf, size_t n) {
     return(n - nleft); /* return >= 0 */
 }
 
+/** Position after the last c into data, 0 if there isn't. The data is compared 32 or 16 bytes at a time with AVX2 or SSE2 */
+static size_t last_byte(const char *data, size_t len, char c) {
+    size_t i = len;
+#if defined(__AVX2__)
+    const __m256i pattern = _mm256_set1_epi8(c);
+    unsigned int mask;
+
+    while (i >= 32) {
+        i -= 32;
+        mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (data + i)), pattern));
+        if (mask != 0) return i + 32 - __builtin_clz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i pattern = _mm_set1_epi8(c);
+    unsigned int mask;
+
+    while (i >= 16) {
+        i -= 16;
+        mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (data + i)), pattern));
+        if (mask != 0) return i + 32 - __builtin_clz(mask);
+    }
+#endif
+    while (i > 0) {
+        i--;
+        if (data[i] == c) return i + 1;
+    }
+
+    return 0;
+}
+
+size_t cbuf_rfind(cbuf_t *cbuf, size_t from, size_t to, char c) {
+    size_t found = 0, len, pos;
+    char *data;
+
+    while (from < to && (len = cbuf_peek(cbuf, from, &data)) > 0) {
+        if (len > to - from) len = to - from;
+        if ((pos = last_byte(data, len, c)) > 0) found = from + pos;
+        from += len;
+    }
+
+    return found;
+}
+
+size_t cbuf_find(cbuf_t *cbuf, size_t from, size_t to, char c) {
+    size_t len;
+    char *data, *pos;
+
+    while (from < to && (len = cbuf_peek(cbuf, from, &data)) > 0) {
+        if (len > to - from) len = to - from;
+        if ((pos = (char *) memchr(data, c, len)) != NULL) return from + (size_t) (pos - data) + 1;
+        from += len;
+    }
+
+    return 0;
+}
+
+size_t cbuf_peek(cbuf_t *cbuf, size_t offset, char **data) {
+    size_t start, linear_len, size = cbuf_size(cbuf);
+    if (offset >= size) return 0;
+
+    start = cbuf->tail + offset;
+    if (start >= cbuf->capacity) start -= cbuf->capacity;
+    if (cbuf->head > start) linear_len = cbuf->head - start;
+    else linear_len = cbuf->capacity - start;
+    if (linear_len > size - offset) linear_len = size - offset;
+
+    *data = cbuf->data + start;
+    return linear_len;
+}
+
+void cbuf_drop(cbuf_t *cbuf, size_t n) {
+    if (n == 0) return;
+
+    cbuf->tail += n;
+    if (cbuf->tail >= cbuf->capacity) cbuf->tail -= cbuf->capacity;
+    cbuf->isfull = 0;
+}
+
 ssize_t cbuf_readn(int fd, cbuf_t *cbuf, size_t n) {
     char *dataptr;
     if (cbuf->capacity == 0) return 0;
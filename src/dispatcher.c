@@ -3,73 +3,98 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <string.h>
+#include <time.h>
 #include "../include/options.h"
 #include "../include/dispatcher.h"
 #include "../include/utils.h"
 #include "../include/scfiles.h"
 #include "../include/openfiles.h"
 #include "../include/netpipefs_socket.h"
+#include "../include/relay.h"
+
+/** Timer of a read or of a close waited by the dispatcher */
+struct dispatcher_timer {
+    struct netpipefs_timer timer;
+    struct dispatcher_timer *next;
+};
 
 struct dispatcher {
     pthread_t tid;  // dispatcher's thread id
     int pipefd[2];  // used to communicate with main thread
+    int stop;       // checked when the dispatcher doesn't wait for the pipe
+    struct netpipefs_socket **skts; // connections whose messages are handled
+    int nskts;
+    void (*poll_notify)(void *);
+    int timerfd[2]; // the timers of the files are written into it
+    struct dispatcher_timer *timers; // sorted by deadline
 };
 
-static struct dispatcher dispatcher = {0, {-1,-1} };
-
-extern struct netpipefs_socket netpipefs_socket;
-
-static int on_open(char *path) {
+static int on_open(struct dispatcher *dispatcher, struct netpipefs_socket *skt, char *path) {
     int bytes, mode, just_created = 0;
 
-    bytes = readn(netpipefs_socket.fd, &mode, sizeof(int));
+    bytes = read_socket(skt, &mode, sizeof(int));
     if (bytes <= 0) return bytes;
 
     /* Get the file struct or create it */
-    struct netpipe *file = netpipefs_get_or_create_open_file(path, &just_created);
+    struct netpipe *file = netpipefs_get_or_create_open_file(skt, path, &just_created);
     if (file == NULL) return -1;
 
     DEBUG("remote[%s] OPEN %d\n", path, mode);
     bytes = netpipe_open_update(file, mode);
     if (bytes == -1) {
-        if (just_created) {
-            netpipefs_remove_open_file(path);
+        // the kernel may have looked it up meanwhile
+        if (just_created && netpipefs_remove_open_file(file) != 1)
             netpipe_free(file, NULL); // for sure there is no poll handle
-        }
         return -1;
     }
 
+    // this host is a gateway for the netpipes written by the remote host
+    if ((mode & O_ACCMODE) == O_WRONLY && skt->relay_to != NULL) {
+        MINUS1(netpipefs_relay_start(file, skt->relay_to, dispatcher->poll_notify), DEBUG("relay[%s] failed: %s\n", path, strerror(errno)))
+    } else if ((mode & O_ACCMODE) == O_WRONLY) { // the writer can start sending before the netpipe is open locally
+        MINUS1(netpipe_early_grant(file), return -1)
+    }
+
     return 1; // > 0
 }
 
-static int on_close(char *path) {
+static int on_close(struct dispatcher *dispatcher, struct netpipefs_socket *skt, char *path) {
     int bytes, mode;
-    bytes = readn(netpipefs_socket.fd, &mode, sizeof(int));
+    bytes = read_socket(skt, &mode, sizeof(int));
     if (bytes <= 0) return bytes;
 
-    struct netpipe *file = netpipefs_get_open_file(path);
+    struct netpipe *file = netpipefs_get_open_file(skt, path);
     if (file == NULL) return -1;
 
     DEBUG("remote[%s] CLOSE %d\n", path, mode);
-    MINUS1(netpipe_close_update(file, mode, &netpipefs_remove_open_file, &netpipefs_poll_notify), return -1)
+    MINUS1(netpipe_close_update(file, mode, &netpipefs_remove_open_file, dispatcher->poll_notify), return -1)
 
     return bytes; // > 0
 }
 
-static int on_write(char *path) {
+/** Read and discard the padding of a WRITE_ALIGNED message */
+static int skip_padding(struct netpipefs_socket *skt) {
+    int bytes;
+    size_t pad;
+
+    bytes = read_socket(skt, &pad, sizeof(size_t));
+    if (bytes <= 0 || pad == 0) return bytes;
+
+    return skip_socket(skt, pad);
+}
+
+static int on_write(struct dispatcher *dispatcher, struct netpipefs_socket *skt, char *path, int aligned) {
     int bytes;
     size_t size;
 
-    struct netpipe *file = netpipefs_get_open_file(path);
-    if (file == NULL) {
-        errno = ENOENT;
-        return -1;
-    }
+    struct netpipe *file = netpipefs_get_open_file(skt, path);
 
     /* Read how much data can be read from socket */
-    bytes = readn(netpipefs_socket.fd, &size, sizeof(size_t));
+    bytes = read_socket(skt, &size, sizeof(size_t));
     if (bytes <= 0) {
         DEBUG("bytes <= 0\n");
         return bytes;
@@ -79,8 +104,17 @@ static int on_write(char *path) {
         return -1;
     }
 
+    /* The data starts after the padding */
+    if (aligned && (bytes = skip_padding(skt)) <= 0) return bytes;
+
+    // nobody can read it anymore: the connection is kept
+    if (file == NULL) {
+        DEBUG("remote[%s] WRITE %ld bytes discarded: not open\n", path, size);
+        return skip_socket(skt, size);
+    }
+
     DEBUG("remote[%s] WRITE %ld bytes\n", path, size);
-    bytes = netpipe_recv(file, size, &netpipefs_poll_notify);
+    bytes = netpipe_recv(file, size, dispatcher->poll_notify);
     if (bytes <= 0) {
         if (errno == EPIPE) {
             DEBUG("on write broken pipe\n");
@@ -92,129 +126,363 @@ static int on_write(char *path) {
     return bytes;
 }
 
-static int on_read(char *path) {
+static int on_read(struct dispatcher *dispatcher, struct netpipefs_socket *skt, char *path) {
     int err, bytes;
     size_t size;
 
-    bytes = readn(netpipefs_socket.fd, &size, sizeof(size_t));
+    bytes = read_socket(skt, &size, sizeof(size_t));
     if (bytes <= 0) return bytes;
     if (size <= 0) {
         EINVAL;
         return -1;
     }
 
-    struct netpipe *file = netpipefs_get_open_file(path);
+    struct netpipe *file = netpipefs_get_open_file(skt, path);
     if (file == NULL) return -1;
 
     DEBUG("remote[%s] READ %ld bytes\n", path, size);
-    err = netpipe_read_update(file, size, &netpipefs_poll_notify);
+    err = netpipe_read_update(file, size, dispatcher->poll_notify);
     if (err == -1) return -1;
 
     return bytes;
 }
 
-static int on_read_request(char *path) {
+static int on_read_request(struct dispatcher *dispatcher, struct netpipefs_socket *skt, char *path) {
     int err, bytes;
     size_t size;
 
-    bytes = readn(netpipefs_socket.fd, &size, sizeof(size_t));
+    bytes = read_socket(skt, &size, sizeof(size_t));
     if (bytes <= 0) return bytes;
     if (size <= 0) {
         EINVAL;
         return -1;
     }
 
-    struct netpipe *file = netpipefs_get_open_file(path);
+    struct netpipe *file = netpipefs_get_open_file(skt, path);
     if (file == NULL) return -1;
 
     DEBUG("remote[%s] READ_REQUEST %ld bytes\n", path, size);
-    err = netpipe_read_request(file, size, &netpipefs_poll_notify);
+    err = netpipe_read_request(file, size, dispatcher->poll_notify);
     if (err == -1) return -1;
 
     return bytes;
 }
 
-static void *netpipefs_dispatcher_fun(void *unused) {
-    int bytes = 1, err, run = 1, nfds;
+static int on_urgent(struct dispatcher *dispatcher, struct netpipefs_socket *skt, char *path) {
+    int bytes;
+    size_t size;
+    char buf[NETPIPE_URGENT_MAX];
+
+    bytes = read_socket(skt, &size, sizeof(size_t));
+    if (bytes <= 0) return bytes;
+    if (size == 0 || size > NETPIPE_URGENT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    bytes = read_socket(skt, buf, size);
+    if (bytes <= 0) return bytes;
+
+    // nobody can read it anymore: the connection is kept
+    struct netpipe *file = netpipefs_get_open_file(skt, path);
+    if (file == NULL) {
+        DEBUG("remote[%s] URGENT %ld bytes discarded: not open\n", path, size);
+        return bytes;
+    }
+
+    DEBUG("remote[%s] URGENT %ld bytes\n", path, size);
+    MINUS1(netpipe_recv_urgent(file, buf, size, dispatcher->poll_notify), return -1)
+
+    return bytes;
+}
+
+/** Compare two deadlines */
+static int deadline_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec) return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
 
+/** Take the timers written into the pipe and insert them by deadline */
+static void timers_recv(struct dispatcher *dispatcher) {
+    struct netpipefs_timer timer;
+    struct dispatcher_timer *new, **curr;
+
+    while (read(dispatcher->timerfd[0], &timer, sizeof(struct netpipefs_timer)) == sizeof(struct netpipefs_timer)) {
+        new = (struct dispatcher_timer *) malloc(sizeof(struct dispatcher_timer));
+        if (new == NULL) { // the read waits for its minimum
+            perror("dispatcher. malloc() failed");
+            MINUS1(netpipe_forget(timer.file, 1, &netpipefs_remove_open_file), perror("dispatcher. forget failed"))
+            continue;
+        }
+        new->timer = timer;
+        curr = &(dispatcher->timers);
+        while (*curr != NULL && deadline_cmp(&((*curr)->timer.deadline), &(timer.deadline)) <= 0) curr = &((*curr)->next);
+        new->next = *curr;
+        *curr = new;
+    }
+}
+
+/**
+ * Complete the reads whose timer expired. If all is 1 then every timer is removed.
+ *
+ * @param timeout set with the time until the next deadline
+ * @return timeout, NULL if there are no timers
+ */
+static struct timeval *timers_expire(struct dispatcher *dispatcher, int all, struct timeval *timeout) {
+    struct dispatcher_timer *first;
+    struct timespec now;
+
+    if (dispatcher->timers == NULL) return NULL;
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &now), perror("dispatcher. clock_gettime() failed"); return NULL)
+
+    while ((first = dispatcher->timers) != NULL && (all || deadline_cmp(&(first->timer.deadline), &now) <= 0)) {
+        dispatcher->timers = first->next;
+        if (!all) MINUS1(netpipe_timeout(first->timer.file), perror("dispatcher. timeout failed"))
+        MINUS1(netpipe_forget(first->timer.file, 1, &netpipefs_remove_open_file), perror("dispatcher. forget failed"))
+        free(first);
+    }
+    if (first == NULL) return NULL;
+
+    timeout->tv_sec = first->timer.deadline.tv_sec - now.tv_sec;
+    timeout->tv_usec = (first->timer.deadline.tv_nsec - now.tv_nsec) / 1000;
+    if (timeout->tv_usec < 0) {
+        timeout->tv_sec--;
+        timeout->tv_usec += 1000000;
+    }
+    return timeout;
+}
+
+/**
+ * Wait until the socket or the pipe can be read. If busypoll is greater than zero then the set is polled
+ * without blocking for at most busypoll microseconds before blocking into select().
+ *
+ * @param nfds highest file descriptor into the set
+ * @param set file descriptors to be checked
+ * @param rd_set will be set with the ready file descriptors
+ * @param busypoll microseconds of busy polling
+ * @param timeout max time to wait, NULL to wait forever
+ * @return the number of ready file descriptors, -1 on error
+ */
+static int dispatcher_select(int nfds, fd_set *set, fd_set *rd_set, long busypoll, struct timeval *timeout) {
+    struct timespec start, spent;
+    struct timeval nowait;
+    int ready;
+
+    if (busypoll > 0 && clock_gettime(CLOCK_MONOTONIC, &start) == 0) {
+        do {
+            *rd_set = *set;
+            nowait.tv_sec = 0;
+            nowait.tv_usec = 0;
+            ready = select(nfds+1, rd_set, NULL, NULL, &nowait);
+            if (ready != 0) return ready;
+            spent = elapsed_time(&start);
+        } while (spent.tv_sec * 1000000L + spent.tv_nsec / 1000L < busypoll);
+    }
+
+    *rd_set = *set;
+    return select(nfds+1, rd_set, NULL, NULL, timeout);
+}
+
+/**
+ * Handle one message of the given connection
+ *
+ * @return greater than zero on success, 0 if the connection is lost, -1 on error
+ */
+static int dispatch_message(struct dispatcher *dispatcher, struct netpipefs_socket *skt) {
+    int bytes;
+    enum netpipefs_header header;
+    char peek;
+
+    /* The socket is also readable when a MSG_ZEROCOPY send completes */
+    if (skt->zerocopy > 0) {
+        MINUS1(netpipefs_zerocopy_reap(skt), perror("dispatcher. failed to read zerocopy completions"))
+        if (recv(skt->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+    }
+
+    char *path = NULL;
+    if ((bytes = read_socket_header(skt, &header, &path)) == -1) {
+        perror("dispatcher. failed to read socket message");
+    } else if (bytes > 0) {
+        switch (header) {
+            case OPEN:
+                bytes = on_open(dispatcher, skt, path);
+                if (bytes == -1) perror("on_open");
+                break;
+            case CLOSE:
+                bytes = on_close(dispatcher, skt, path);
+                if (bytes == -1) perror("on_close");
+                break;
+            case WRITE:
+            case WRITE_ALIGNED:
+                bytes = on_write(dispatcher, skt, path, header == WRITE_ALIGNED);
+                if (bytes == -1) perror("on_write");
+                break;
+            case READ:
+                bytes = on_read(dispatcher, skt, path);
+                if (bytes == -1) perror("on_read");
+                break;
+            case READ_REQUEST:
+                bytes = on_read_request(dispatcher, skt, path);
+                if (bytes == -1) perror("on_read_request");
+                break;
+            case URGENT:
+                bytes = on_urgent(dispatcher, skt, path);
+                if (bytes == -1) perror("on_urgent");
+                break;
+            default:
+                break;
+        }
+        free(path);
+    }
+
+    return bytes;
+}
+
+/** Like dispatcher_select() but it doesn't wait */
+static int dispatcher_select_nowait(int nfds, fd_set *set, fd_set *rd_set) {
+    struct timeval nowait;
+    nowait.tv_sec = 0;
+    nowait.tv_usec = 0;
+    *rd_set = *set;
+    return select(nfds+1, rd_set, NULL, NULL, &nowait);
+}
+
+static void *netpipefs_dispatcher_fun(void *arg) {
+    struct dispatcher *dispatcher = (struct dispatcher *) arg;
+    struct netpipefs_socket *skt;
+    int i, err, nfds, pollfd, live = dispatcher->nskts, busypoll = 0, bytes;
+    int *ready = (int *) calloc(dispatcher->nskts, sizeof(int));
+    long last_wait = 0; // how many microseconds the dispatcher waited for the last message
+    struct timespec start, waited;
+    struct timeval timeout, *next_timer = NULL;
     fd_set set, rd_set;
+    EQNULL(ready, perror("dispatcher. calloc() failed"); return 0)
+
+    /* With shared memory the messages arrive into a ring, the socket becomes readable only when it is closed */
     FD_ZERO(&set);
-    FD_SET(netpipefs_socket.fd, &set);
-    FD_SET(dispatcher.pipefd[0], &set);
-    nfds = netpipefs_socket.fd > dispatcher.pipefd[0] ? netpipefs_socket.fd : dispatcher.pipefd[0];
+    FD_SET(dispatcher->pipefd[0], &set);
+    FD_SET(dispatcher->timerfd[0], &set);
+    nfds = dispatcher->pipefd[0] > dispatcher->timerfd[0] ? dispatcher->pipefd[0] : dispatcher->timerfd[0];
+    for (i = 0; i < dispatcher->nskts; i++) {
+        skt = dispatcher->skts[i];
+        pollfd = socket_pollfd(skt);
+        FD_SET(skt->fd, &set);
+        FD_SET(pollfd, &set);
+        if (skt->fd > nfds) nfds = skt->fd;
+        if (pollfd > nfds) nfds = pollfd;
+        if (skt->busypoll > busypoll) busypoll = skt->busypoll;
+    }
+
+    while (live > 0) {
+        /* The rings which have data and whose doorbell is not rung are not waited for */
+        int nready = 0;
+        for (i = 0; i < dispatcher->nskts; i++) {
+            ready[i] = dispatcher->skts[i] != NULL && socket_ready(dispatcher->skts[i]);
+            nready += ready[i];
+        }
 
-    while(run) {
-        rd_set = set;
-        err = select(nfds+1, &rd_set, NULL, NULL, NULL);
+        if (nready > 0) {
+            last_wait = 0;
+            if (__atomic_load_n(&(dispatcher->stop), __ATOMIC_ACQUIRE)) break;
+            // the other connections are checked without waiting
+            err = nready < live ? dispatcher_select_nowait(nfds, &set, &rd_set) : 0;
+        } else {
+            /* Busy poll only while messages arrive close to each other, otherwise block immediately */
+            MINUS1(clock_gettime(CLOCK_MONOTONIC, &start), perror("dispatcher. clock_gettime() failed"); break)
+            err = dispatcher_select(nfds, &set, &rd_set, last_wait <= busypoll ? busypoll:0, next_timer);
+            waited = elapsed_time(&start);
+            last_wait = waited.tv_sec * 1000000L + waited.tv_nsec / 1000L;
+        }
         if (err == -1) { // an error occurred then stop running
             perror("dispatcher. select() failed");
-            run = 0;
-        } else if (FD_ISSET(dispatcher.pipefd[0], &rd_set)) {  // pipe can be read then stop running;
-            run = 0;
-        } else {    // can read from socket
-            enum netpipefs_header header;
-            char *path = NULL;
-            if ((bytes = read_socket_header(&netpipefs_socket, &header, &path)) == -1) {
-                perror("dispatcher. failed to read socket message");
-            } else if (bytes > 0) {
-                switch (header) {
-                    case OPEN:
-                        bytes = on_open(path);
-                        if (bytes == -1) perror("on_open");
-                        break;
-                    case CLOSE:
-                        bytes = on_close(path);
-                        if (bytes == -1) perror("on_close");
-                        break;
-                    case WRITE:
-                        bytes = on_write(path);
-                        if (bytes == -1) perror("on_write");
-                        break;
-                    case READ:
-                        bytes = on_read(path);
-                        if (bytes == -1) perror("on_read");
-                        break;
-                    case READ_REQUEST:
-                        bytes = on_read_request(path);
-                        if (bytes == -1) perror("on_read_request");
-                    default:
-                        break;
-                }
-                free(path);
+            break;
+        }
+
+        if (err > 0) {
+            if (FD_ISSET(dispatcher->pipefd[0], &rd_set)) break; // pipe can be read then stop running
+            if (FD_ISSET(dispatcher->timerfd[0], &rd_set)) timers_recv(dispatcher);
+            for (i = 0; i < dispatcher->nskts; i++) {
+                skt = dispatcher->skts[i];
+                if (skt != NULL && (FD_ISSET(skt->fd, &rd_set) || FD_ISSET(socket_pollfd(skt), &rd_set))) ready[i] = 1;
             }
+        }
 
-            run = bytes > 0;
+        /* One message from each ready connection, so a busy host doesn't starve the others */
+        for (i = 0; i < dispatcher->nskts; i++) {
+            if (!ready[i]) continue;
+            skt = dispatcher->skts[i];
+            bytes = dispatch_message(dispatcher, skt);
+            if (bytes <= 0) { // stop handling this connection
+                if (bytes == 0) DEBUG("dispatcher has lost socket connection\n");
+                FD_CLR(skt->fd, &set);
+                FD_CLR(socket_pollfd(skt), &set);
+                __atomic_store_n(&(skt->timerfd), -1, __ATOMIC_RELEASE);
+                dispatcher->skts[i] = NULL;
+                live--;
+            }
         }
+
+        next_timer = timers_expire(dispatcher, 0, &timeout);
     }
-    if (bytes == 0)
-        DEBUG("dispatcher has lost socket connection\n");
 
+    free(ready);
     return 0;
 }
 
-int netpipefs_dispatcher_run(void) {
+struct dispatcher *netpipefs_dispatcher_run(struct netpipefs_socket **skts, int nskts, void (*poll_notify)(void *)) {
     int err;
-    MINUS1(pipe(dispatcher.pipefd), return -1)
+    struct dispatcher *dispatcher = (struct dispatcher *) malloc(sizeof(struct dispatcher));
+    EQNULL(dispatcher, return NULL)
+    dispatcher->skts = (struct netpipefs_socket **) malloc(sizeof(struct netpipefs_socket *) * nskts);
+    EQNULL(dispatcher->skts, free(dispatcher); return NULL)
+
+    MINUS1(pipe(dispatcher->pipefd), free(dispatcher->skts); free(dispatcher); return NULL)
+    if (pipe(dispatcher->timerfd) == -1 || fcntl(dispatcher->timerfd[0], F_SETFL, O_NONBLOCK) == -1
+        || fcntl(dispatcher->timerfd[1], F_SETFL, O_NONBLOCK) == -1) {
+        err = errno;
+        close(dispatcher->pipefd[0]); close(dispatcher->pipefd[1]); free(dispatcher->skts); free(dispatcher);
+        errno = err;
+        return NULL;
+    }
+    dispatcher->stop = 0;
+    memcpy(dispatcher->skts, skts, sizeof(struct netpipefs_socket *) * nskts);
+    dispatcher->nskts = nskts;
+    dispatcher->poll_notify = poll_notify;
+    dispatcher->timers = NULL;
 
-    PTH(err, pthread_create(&(dispatcher.tid), NULL, &netpipefs_dispatcher_fun, NULL), return -1)
+    PTH(err, pthread_create(&(dispatcher->tid), NULL, &netpipefs_dispatcher_fun, dispatcher),
+        close(dispatcher->pipefd[0]); close(dispatcher->pipefd[1]); close(dispatcher->timerfd[0]); close(dispatcher->timerfd[1]);
+        free(dispatcher->skts); free(dispatcher); errno = err; return NULL)
 
-    return 0;
+    for (int i = 0; i < nskts; i++) __atomic_store_n(&(skts[i]->timerfd), dispatcher->timerfd[1], __ATOMIC_RELEASE);
+
+    return dispatcher;
 }
 
-int netpipefs_dispatcher_stop(void) {
+int netpipefs_dispatcher_stop(struct dispatcher *dispatcher) {
     int err;
-    if (dispatcher.pipefd[1] == -1) return 0; // already stopped
+    if (dispatcher == NULL) return 0; // not running
 
     /* Close write end. Dispatcher will wake up and stop running */
-    MINUS1(close(dispatcher.pipefd[1]), return -1)
-    dispatcher.pipefd[1] = -1;
+    __atomic_store_n(&(dispatcher->stop), 1, __ATOMIC_RELEASE);
+    MINUS1(close(dispatcher->pipefd[1]), return -1)
 
-    PTH(err, pthread_join(dispatcher.tid, NULL), return -1)
+    PTH(err, pthread_join(dispatcher->tid, NULL), return -1)
     DEBUG("dispatcher stopped\n");
 
+    /* The reads whose timer is pending keep waiting for their minimum */
+    for (int i = 0; i < dispatcher->nskts; i++)
+        if (dispatcher->skts[i] != NULL) __atomic_store_n(&(dispatcher->skts[i]->timerfd), -1, __ATOMIC_RELEASE);
+    timers_recv(dispatcher);
+    timers_expire(dispatcher, 1, NULL);
+    close(dispatcher->timerfd[0]);
+    close(dispatcher->timerfd[1]);
+
     /* Close the read end of the pipe */
-    close(dispatcher.pipefd[0]);
-    dispatcher.pipefd[0] = -1;
+    close(dispatcher->pipefd[0]);
+    free(dispatcher->skts);
+    free(dispatcher);
 
     return 0;
-}
\ No newline at end of file
+}
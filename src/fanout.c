@@ -0,0 +1,501 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <poll.h>
+#include "../include/fanout.h"
+#include "../include/netpipe.h"
+#include "../include/openfiles.h"
+#include "../include/cbuf.h"
+#include "../include/utils.h"
+
+/** Remote host which receives the data */
+struct subscriber {
+    struct netpipe *file;   // netpipe of its connection, open for writing by the fan-out netpipe
+    size_t sent;            // bytes of the buffer already sent to it
+    int active;             // it has at least one reader. Only the active subscribers hold data into the buffer
+};
+
+/** Write or close request waiting for the buffer */
+struct fanout_req {
+    const char *buf;
+    size_t size;
+    size_t bytes_processed;
+    size_t initial; // bytes already written before the request was queued
+    char *copy;     // buffer owned by the request, if any
+    netpipe_done_t done;
+    void *arg;
+    struct fanout_req *next;
+};
+
+/** Linked list of poll handles */
+struct fanout_poll_handle {
+    void *ph;
+    struct fanout_poll_handle *next;
+};
+
+struct fanout {
+    char *path;
+    unsigned long nref;     // references. Protected by the list lock
+    struct fanout *next;    // next fan-out netpipe into the list
+    pthread_mutex_t mtx;
+    int writers;
+    int drop;               // policy for the lagging subscribers
+    cbuf_t *buffer;         // data written and not sent yet to every active subscriber
+    struct subscriber *subs;
+    int nsubs;
+    struct fanout_req *write_head;  // FIFO list of writes waiting for space into the buffer
+    struct fanout_req *write_tail;
+    struct fanout_req *close_reqs;  // the last writer waits until the buffer is sent
+    struct fanout_poll_handle *poll_handles;
+    void (*poll_notify)(void *);
+};
+
+/* Fan-out netpipes which are referenced */
+static struct fanout *fanouts = NULL;
+static pthread_mutex_t fanouts_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fanout *fanout_alloc(const char *path, size_t lag, int drop, void (*poll_notify)(void *)) {
+    int err;
+    struct fanout *fanout = (struct fanout *) calloc(1, sizeof(struct fanout));
+    EQNULL(fanout, return NULL)
+
+    if ((fanout->path = strdup(path)) == NULL) goto error;
+    if ((fanout->buffer = cbuf_alloc(lag)) == NULL) goto error;
+    PTH(err, pthread_mutex_init(&(fanout->mtx), NULL), goto error)
+    fanout->drop = drop;
+    fanout->poll_notify = poll_notify;
+
+    return fanout;
+
+error:
+    err = errno;
+    if (fanout->buffer) cbuf_free(fanout->buffer);
+    free(fanout->path);
+    free(fanout);
+    errno = err;
+    return NULL;
+}
+
+static void fanout_free(struct fanout *fanout) {
+    struct fanout_poll_handle *ph;
+
+    while ((ph = fanout->poll_handles) != NULL) {
+        fanout->poll_handles = ph->next;
+        if (fanout->poll_notify) fanout->poll_notify(ph->ph);
+        free(ph);
+    }
+    pthread_mutex_destroy(&(fanout->mtx));
+    cbuf_free(fanout->buffer);
+    free(fanout->subs);
+    free(fanout->path);
+    free(fanout);
+}
+
+struct fanout *netpipefs_fanout_get(const char *path, size_t lag, int drop, void (*poll_notify)(void *)) {
+    int err;
+    struct fanout *fanout;
+
+    PTH(err, pthread_mutex_lock(&fanouts_mtx), return NULL)
+
+    for (fanout = fanouts; fanout != NULL && strcmp(fanout->path, path) != 0; fanout = fanout->next);
+    if (fanout == NULL && (fanout = fanout_alloc(path, lag, drop, poll_notify)) != NULL) {
+        fanout->next = fanouts;
+        fanouts = fanout;
+    }
+    if (fanout != NULL) fanout->nref++;
+
+    err = errno;
+    pthread_mutex_unlock(&fanouts_mtx);
+    errno = err;
+
+    return fanout;
+}
+
+void netpipefs_fanout_ref(struct fanout *fanout) {
+    int err;
+
+    PTH(err, pthread_mutex_lock(&fanouts_mtx), perror("fanout reference"); return)
+    fanout->nref++;
+    PTH(err, pthread_mutex_unlock(&fanouts_mtx), perror("fanout reference"))
+}
+
+void netpipefs_fanout_put(struct fanout *fanout, unsigned long n) {
+    int err, release = 0;
+    struct fanout **prev;
+
+    PTH(err, pthread_mutex_lock(&fanouts_mtx), perror("fanout release"); return)
+
+    fanout->nref -= n;
+    if (fanout->nref == 0) {
+        for (prev = &fanouts; *prev != fanout; prev = &((*prev)->next));
+        *prev = fanout->next;
+        release = 1;
+    }
+
+    PTH(err, pthread_mutex_unlock(&fanouts_mtx), perror("fanout release"))
+    if (release) fanout_free(fanout);
+}
+
+/** Used when nobody is waiting for the close of a subscriber */
+static void subscriber_close_done(void *arg, ssize_t bytes, int error) {
+    if (bytes == -1) DEBUG("fanout close failed: %s\n", strerror(error));
+}
+
+/** Close the netpipe of the i-th subscriber and remove it */
+static void fanout_unsubscribe(struct fanout *fanout, int i) {
+    struct netpipe *file = fanout->subs[i].file;
+
+    MINUS1(netpipe_fanout_detach(file), perror("fanout detach"))
+    MINUS1(netpipe_close_async(file, O_WRONLY, &netpipefs_remove_open_file, fanout->poll_notify, &subscriber_close_done, NULL),
+           DEBUG("fanout close failed: %s\n", strerror(errno)))
+    MINUS1(netpipe_forget(file, 1, &netpipefs_remove_open_file), DEBUG("fanout forget failed: %s\n", strerror(errno)))
+
+    fanout->subs[i] = fanout->subs[fanout->nsubs - 1];
+    fanout->nsubs--;
+}
+
+/**
+ * Send to the subscriber what its credit allows. A subscriber which has readers again receives
+ * only the data written from now on.
+ *
+ * @return 0 on success, -1 if the subscriber should be removed
+ */
+static int fanout_send(struct fanout *fanout, struct subscriber *sub) {
+    char *data = NULL;
+    size_t size;
+    ssize_t bytes;
+
+    if (!sub->active) sub->sent = cbuf_size(fanout->buffer);
+
+    do {
+        size = cbuf_peek(fanout->buffer, sub->sent, &data);
+        bytes = netpipe_fanout_send(sub->file, data, size);
+        if (bytes == -1) {
+            if (errno != EPIPE) return -1;
+            sub->active = 0; // no readers
+            return 0;
+        }
+        sub->active = 1;
+        sub->sent += bytes;
+    } while (bytes > 0 && (size_t) bytes == size && sub->sent < cbuf_size(fanout->buffer));
+
+    return 0;
+}
+
+/** Drop the data which was sent to every active subscriber */
+static void fanout_trim(struct fanout *fanout) {
+    int i;
+    size_t sent = cbuf_size(fanout->buffer);
+
+    for (i = 0; i < fanout->nsubs; i++)
+        if (fanout->subs[i].active && fanout->subs[i].sent < sent) sent = fanout->subs[i].sent;
+    if (sent == 0) return;
+
+    cbuf_drop(fanout->buffer, sent);
+    for (i = 0; i < fanout->nsubs; i++)
+        if (fanout->subs[i].active) fanout->subs[i].sent -= sent;
+}
+
+/**
+ * Move the data of the pending writes into the buffer. The completed requests are added to the done list.
+ *
+ * @return how many bytes were moved
+ */
+static size_t fanout_fill(struct fanout *fanout, struct fanout_req **done) {
+    size_t bytes, moved = 0;
+    struct fanout_req *req;
+
+    while ((req = fanout->write_head) != NULL) {
+        bytes = cbuf_put(fanout->buffer, req->buf + req->bytes_processed, req->size - req->bytes_processed);
+        req->bytes_processed += bytes;
+        moved += bytes;
+        if (req->bytes_processed < req->size) break;
+
+        fanout->write_head = req->next;
+        if (fanout->write_tail == req) fanout->write_tail = NULL;
+        req->next = *done;
+        *done = req;
+    }
+
+    return moved;
+}
+
+/**
+ * Apply the policy to the subscribers which lag behind the fastest one by the capacity of the buffer.
+ *
+ * @return 1 if there was at least one lagging subscriber, 0 otherwise
+ */
+static int fanout_lagging(struct fanout *fanout) {
+    int i, found = 0;
+    size_t fastest = 0;
+    struct subscriber *sub;
+
+    if (!cbuf_full(fanout->buffer)) return 0;
+
+    for (i = 0; i < fanout->nsubs; i++)
+        if (fanout->subs[i].active && fanout->subs[i].sent > fastest) fastest = fanout->subs[i].sent;
+
+    for (i = 0; i < fanout->nsubs;) {
+        sub = &(fanout->subs[i]);
+        if (sub->active && fastest - sub->sent >= cbuf_capacity(fanout->buffer)) {
+            found = 1;
+            if (fanout->drop) {
+                DEBUG("fanout[%s] lagging subscriber skips %ld bytes\n", fanout->path, fastest - sub->sent);
+                sub->sent = fastest;
+            } else {
+                DEBUG("fanout[%s] lagging subscriber is disconnected\n", fanout->path);
+                fanout_unsubscribe(fanout, i);
+                continue;
+            }
+        }
+        i++;
+    }
+
+    return found;
+}
+
+/**
+ * Send what the subscribers can receive and move the pending writes into the buffer until nothing changes.
+ * The completed requests are added to the done list. The caller must hold the lock.
+ */
+static void fanout_update(struct fanout *fanout, struct fanout_req **done) {
+    int i, changed;
+    struct fanout_req *req;
+
+    do {
+        for (i = 0; i < fanout->nsubs;) {
+            if (fanout_send(fanout, &(fanout->subs[i])) == -1) {
+                DEBUG("fanout[%s] subscriber lost: %s\n", fanout->path, strerror(errno));
+                fanout_unsubscribe(fanout, i);
+                continue;
+            }
+            i++;
+        }
+        fanout_trim(fanout);
+
+        changed = fanout_fill(fanout, done) > 0;
+        if (!changed && fanout->write_head != NULL) changed = fanout_lagging(fanout);
+    } while (changed);
+
+    // the last writer was waiting for the buffer to be sent
+    if (fanout->close_reqs != NULL && fanout->write_head == NULL && cbuf_empty(fanout->buffer)) {
+        while ((req = fanout->close_reqs) != NULL) {
+            fanout->close_reqs = req->next;
+            req->next = *done;
+            *done = req;
+            fanout->writers--;
+        }
+        if (fanout->writers == 0) {
+            while (fanout->nsubs > 0) fanout_unsubscribe(fanout, fanout->nsubs - 1);
+        }
+    }
+}
+
+/** Take the poll handles if the netpipe is writable. The caller must hold the lock */
+static struct fanout_poll_handle *fanout_writable(struct fanout *fanout) {
+    struct fanout_poll_handle *handles = NULL;
+
+    if (!cbuf_full(fanout->buffer)) {
+        handles = fanout->poll_handles;
+        fanout->poll_handles = NULL;
+    }
+
+    return handles;
+}
+
+/** Call done for each completed request and notify the poll handles. The caller must not hold the lock */
+static void fanout_finish(struct fanout *fanout, struct fanout_req *done, struct fanout_poll_handle *handles) {
+    struct fanout_req *req;
+    struct fanout_poll_handle *ph;
+
+    while ((req = done) != NULL) {
+        done = req->next;
+        req->done(req->arg, req->initial + req->bytes_processed, 0);
+        free(req->copy);
+        free(req);
+    }
+
+    while ((ph = handles) != NULL) {
+        handles = ph->next;
+        if (fanout->poll_notify) fanout->poll_notify(ph->ph);
+        free(ph);
+    }
+}
+
+int netpipefs_fanout_open(struct fanout *fanout, struct netpipefs_socket **skts, int nskts) {
+    int i;
+    struct netpipe *file;
+    struct fanout_req *done = NULL;
+    struct fanout_poll_handle *handles;
+
+    NOTZERO(pthread_mutex_lock(&(fanout->mtx)), return -1)
+
+    // the first writer opens the netpipe of each connection
+    if (fanout->writers == 0) {
+        free(fanout->subs);
+        fanout->nsubs = 0;
+        fanout->subs = (struct subscriber *) calloc(nskts > 0 ? nskts : 1, sizeof(struct subscriber));
+        if (fanout->subs == NULL) {
+            pthread_mutex_unlock(&(fanout->mtx));
+            return -1;
+        }
+
+        for (i = 0; i < nskts; i++) {
+            if ((file = netpipefs_lookup_open_file(skts[i], fanout->path)) == NULL) {
+                DEBUG("fanout[%s] cannot open: %s\n", fanout->path, strerror(errno));
+                continue;
+            }
+            if (netpipe_fanout_attach(file, fanout) == -1) {
+                DEBUG("fanout[%s] cannot open: %s\n", fanout->path, strerror(errno));
+                MINUS1(netpipe_forget(file, 1, &netpipefs_remove_open_file), DEBUG("fanout forget failed: %s\n", strerror(errno)))
+                continue;
+            }
+            fanout->subs[fanout->nsubs].file = file;
+            fanout->nsubs++;
+        }
+    }
+    fanout->writers++;
+    DEBUG("fanout[%s] %d writers, %d subscribers\n", fanout->path, fanout->writers, fanout->nsubs);
+
+    fanout_update(fanout, &done);
+    handles = fanout_writable(fanout);
+
+    NOTZERO(pthread_mutex_unlock(&(fanout->mtx)), return -1)
+    fanout_finish(fanout, done, handles);
+
+    return 0;
+}
+
+int netpipefs_fanout_write_async(struct fanout *fanout, const char *buf, size_t size, int nonblock, netpipe_done_t done, void *arg) {
+    struct fanout_req *req, *prev, *completed = NULL;
+    struct fanout_poll_handle *handles;
+    size_t remaining;
+    int err;
+
+    EQNULL(req = (struct fanout_req *) calloc(1, sizeof(struct fanout_req)), return -1)
+    req->buf = buf;
+    req->size = size;
+    req->done = done;
+    req->arg = arg;
+
+    NOTZERO(pthread_mutex_lock(&(fanout->mtx)), free(req); return -1)
+
+    if (fanout->write_tail != NULL) fanout->write_tail->next = req;
+    else fanout->write_head = req;
+    fanout->write_tail = req;
+
+    fanout_update(fanout, &completed);
+
+    // the request is still waiting for space into the buffer. It is the last one
+    if (req->bytes_processed < req->size && (nonblock || (req->copy = (char *) malloc(req->size - req->bytes_processed)) == NULL)) {
+        err = nonblock ? EAGAIN : errno;
+        if (fanout->write_head == req) {
+            fanout->write_head = NULL;
+            fanout->write_tail = NULL;
+        } else {
+            for (prev = fanout->write_head; prev->next != req; prev = prev->next);
+            prev->next = NULL;
+            fanout->write_tail = prev;
+        }
+
+        if (req->bytes_processed == 0) {
+            handles = fanout_writable(fanout);
+            pthread_mutex_unlock(&(fanout->mtx));
+            fanout_finish(fanout, completed, handles);
+            free(req);
+            errno = err;
+            return -1;
+        }
+        req->next = completed;
+        completed = req;
+    } else if (req->bytes_processed < req->size) {
+        // the caller's buffer can be reused as soon as this function returns
+        remaining = req->size - req->bytes_processed;
+        memcpy(req->copy, req->buf + req->bytes_processed, remaining);
+        req->initial = req->bytes_processed;
+        req->buf = req->copy;
+        req->size = remaining;
+        req->bytes_processed = 0;
+    }
+    handles = fanout_writable(fanout);
+
+    NOTZERO(pthread_mutex_unlock(&(fanout->mtx)), return -1)
+    fanout_finish(fanout, completed, handles);
+
+    return 0;
+}
+
+int netpipefs_fanout_poll(struct fanout *fanout, void *ph, unsigned int *reventsp) {
+    struct fanout_poll_handle *p, *newph = NULL;
+
+    if (ph != NULL) {
+        EQNULL(newph = (struct fanout_poll_handle *) malloc(sizeof(struct fanout_poll_handle)), return -1)
+        newph->ph = ph;
+    }
+
+    NOTZERO(pthread_mutex_lock(&(fanout->mtx)), free(newph); return -1)
+
+    // a handle already registered is not added again
+    for (p = fanout->poll_handles; newph != NULL && p != NULL; p = p->next) {
+        if (p->ph == ph) {
+            free(newph);
+            newph = NULL;
+        }
+    }
+    if (newph != NULL) {
+        newph->next = fanout->poll_handles;
+        fanout->poll_handles = newph;
+    }
+
+    if (!cbuf_full(fanout->buffer)) *reventsp |= POLLOUT;
+
+    NOTZERO(pthread_mutex_unlock(&(fanout->mtx)), return -1)
+
+    return 0;
+}
+
+int netpipefs_fanout_close_async(struct fanout *fanout, netpipe_done_t done, void *arg) {
+    struct fanout_req *req, *completed = NULL;
+
+    EQNULL(req = (struct fanout_req *) calloc(1, sizeof(struct fanout_req)), return -1)
+    req->done = done;
+    req->arg = arg;
+
+    NOTZERO(pthread_mutex_lock(&(fanout->mtx)), free(req); return -1)
+
+    if (fanout->writers > 1) {
+        fanout->writers--;
+        req->next = completed;
+        completed = req;
+    } else {
+        req->next = fanout->close_reqs;
+        fanout->close_reqs = req;
+        fanout_update(fanout, &completed);
+    }
+
+    NOTZERO(pthread_mutex_unlock(&(fanout->mtx)), return -1)
+    fanout_finish(fanout, completed, NULL);
+
+    return 0;
+}
+
+void netpipefs_fanout_notify(struct fanout *fanout) {
+    struct fanout_req *completed = NULL;
+    struct fanout_poll_handle *handles;
+
+    if (pthread_mutex_lock(&(fanout->mtx)) != 0) {
+        perror("fanout notify");
+        netpipefs_fanout_put(fanout, 1);
+        return;
+    }
+
+    fanout_update(fanout, &completed);
+    handles = fanout_writable(fanout);
+
+    if (pthread_mutex_unlock(&(fanout->mtx)) != 0) perror("fanout notify");
+    fanout_finish(fanout, completed, handles);
+
+    netpipefs_fanout_put(fanout, 1);
+}
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "../include/fastpath.h"
+#include "../include/netpipe.h"
+#include "../include/openfiles.h"
+#include "../include/pollhandle.h"
+#include "../include/options.h"
+#include "../include/shmring.h"
+#include "../include/sock.h"
+#include "../include/scfiles.h"
+#include "../include/utils.h"
+
+#define CTLSOCKNAME "/tmp/netpipefs%d.ctl"
+#define ACCEPT_INTERVAL 1000    // milliseconds between two checks of the applications which didn't connect
+
+/** A netpipe open on behalf of an application */
+struct attachment {
+    uint64_t token;
+    struct netpipe *file;
+    int mode;
+    int fd;                 // connection with the application, -1 until it connects
+    shmring_t *ring;
+    struct timespec created;
+    struct attachment *next;
+};
+
+static struct fastpath {
+    int listenfd;
+    int pipefd[2];              // used to stop the acceptor
+    pthread_t tid;              // acceptor's thread id
+    pthread_mutex_t mtx;
+    pthread_cond_t ended;       // signaled when an active attachment ends
+    struct attachment *pending; // waiting for the application to connect
+    struct attachment *active;  // with a thread moving the data
+    char path[FASTPATH_PATH_MAX];
+} fastpath = { -1, {-1, -1}, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, "" };
+
+/** Remove the given attachment from the list. Returns 1 if it was found, 0 otherwise */
+static int list_remove(struct attachment **list, struct attachment *at) {
+    while (*list != NULL && *list != at) list = &((*list)->next);
+    if (*list == NULL) return 0;
+
+    *list = at->next;
+    return 1;
+}
+
+static struct attachment *list_find(struct attachment *list, uint64_t token) {
+    while (list != NULL && list->token != token) list = list->next;
+    return list;
+}
+
+static void attachment_free(struct attachment *at) {
+    if (at->fd != -1) close(at->fd);
+    shmring_free(at->ring);
+    free(at);
+}
+
+static void close_done(void *arg, ssize_t bytes, int error) {
+    if (bytes == -1) DEBUG("fastpath: close failed: %s\n", strerror(error));
+}
+
+/** Close the netpipe without waiting and free the attachment */
+static void attachment_drop(struct attachment *at) {
+    if (netpipe_close_async(at->file, at->mode, &netpipefs_remove_open_file, &netpipefs_poll_notify, &close_done, NULL) == -1)
+        DEBUG("fastpath: close failed: %s\n", strerror(errno));
+    attachment_free(at);
+}
+
+/** Move the data written by the application from the ring into the netpipe. Returns 0 when the ring is drained */
+static int pump_write(struct attachment *at) {
+    char *data;
+    size_t len;
+    ssize_t sent;
+    int err;
+
+    while (1) {
+        len = shmring_peek(at->ring, &data);
+        if (len == 0) {
+            // the application detached and the ring is empty
+            if ((err = shmring_wait(at->ring, at->fd)) <= 0) return err;
+            continue;
+        }
+
+        sent = netpipe_send(at->file, data, len, 0);
+        if (sent <= 0) return -1;
+        shmring_consume(at->ring, sent);
+        shmring_release(at->ring);
+    }
+}
+
+/**
+ * Move the data of the netpipe into the ring read by the application. Only the data which was buffered by the
+ * readahead is taken, so nothing is taken from the netpipe after the application detached.
+ */
+static void pump_read(struct attachment *at) {
+    char *data;
+    ssize_t len, bytes;
+    unsigned int revents;
+    struct pollfd pfds[2];
+    struct netpipefs_pollpipe pollpipe;
+    void *ph;
+
+    MINUS1(netpipefs_pollpipe_init(&pollpipe), perror("fastpath. failed to create poll pipe"); return)
+    ph = netpipefs_pollpipe_handle(&pollpipe);
+
+    pfds[0].fd = at->fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = pollpipe.fd[0];
+    pfds[1].events = POLLIN;
+    while ((len = shmring_reserve(at->ring, &data, at->fd)) > 0) {
+        // the application detached: don't take more data from the netpipe
+        if (poll(pfds, 1, 0) != 0) break;
+
+        // the handle is registered before reading, so the data which comes after the read notifies it
+        revents = 0;
+        if (netpipe_poll(at->file, ph, &revents) == -1) break;
+        bytes = netpipe_read(at->file, data, len, 1);
+        if (bytes == -1 && errno != EAGAIN) break;
+        if (bytes > 0) {
+            shmring_commit(at->ring, bytes);
+            continue;
+        }
+
+        // nothing is buffered: stop at the end of file, otherwise wait until the netpipe changes or the
+        // application detaches
+        if (revents & (POLLHUP | POLLERR)) break;
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) break;
+        netpipefs_pollpipe_clear(&pollpipe);
+    }
+
+    MINUS1(netpipe_poll_forget(at->file, ph), perror("fastpath. failed to forget poll handle"))
+    netpipefs_pollpipe_destroy(&pollpipe);
+}
+
+static void *pump(void *arg) {
+    struct attachment *at = (struct attachment *) arg;
+    int err = 0;
+    char ack = 1;
+
+    if (at->mode == O_WRONLY) err = pump_write(at);
+    else pump_read(at);
+
+    // a writer which detaches waits for the answer, which is sent when the data is flushed
+    MINUS1(netpipe_close(at->file, at->mode, &netpipefs_remove_open_file, &netpipefs_poll_notify),
+           DEBUG("fastpath: close failed: %s\n", strerror(errno)); err = -1)
+    if (at->mode == O_WRONLY && err == 0) send(at->fd, &ack, sizeof(char), MSG_NOSIGNAL);
+    DEBUG("fastpath: application detached\n");
+
+    PTH(err, pthread_mutex_lock(&(fastpath.mtx)), perror("fastpath. failed to lock"))
+    list_remove(&(fastpath.active), at);
+    attachment_free(at);
+    PTH(err, pthread_cond_broadcast(&(fastpath.ended)), perror("fastpath. failed to signal"))
+    PTH(err, pthread_mutex_unlock(&(fastpath.mtx)), perror("fastpath. failed to unlock"))
+
+    return 0;
+}
+
+/** Read the token sent by the application, give it the ring and run the thread which moves the data */
+static void connect_application(int fd) {
+    int err;
+    uint64_t token;
+    struct attachment *at;
+    pthread_attr_t attr;
+    pthread_t tid;
+    struct timeval tv = { 1, 0 };
+
+    MINUS1(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval)), close(fd); return)
+    if (readn(fd, &token, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        close(fd);
+        return;
+    }
+
+    PTH(err, pthread_mutex_lock(&(fastpath.mtx)), close(fd); return)
+    at = list_find(fastpath.pending, token);
+    if (at != NULL) list_remove(&(fastpath.pending), at);
+    PTH(err, pthread_mutex_unlock(&(fastpath.mtx)), close(fd); return)
+    if (at == NULL) {
+        DEBUG("fastpath: unknown token\n");
+        close(fd);
+        return;
+    }
+
+    at->fd = fd;
+    EQNULL(at->ring = shmring_create(FASTPATH_RING), perror("fastpath. failed to create ring"); attachment_drop(at); return)
+    if (sock_send_fds(fd, shmring_fds(at->ring), SHMRING_FDS) <= 0) {
+        attachment_drop(at);
+        return;
+    }
+
+    PTH(err, pthread_attr_init(&attr), attachment_drop(at); return)
+    PTH(err, pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED), pthread_attr_destroy(&attr); attachment_drop(at); return)
+    PTH(err, pthread_mutex_lock(&(fastpath.mtx)), pthread_attr_destroy(&attr); attachment_drop(at); return)
+    at->next = fastpath.active;
+    fastpath.active = at;
+    PTH(err, pthread_create(&tid, &attr, &pump, at), perror("fastpath. failed to run thread"); fastpath.active = at->next; attachment_drop(at))
+    PTH(err, pthread_mutex_unlock(&(fastpath.mtx)), perror("fastpath. failed to unlock"))
+    pthread_attr_destroy(&attr);
+    DEBUG("fastpath: application attached\n");
+}
+
+/** Drop the attachments which were not claimed before the timeout */
+static void expire_pending(void) {
+    int err;
+    struct timespec waited;
+    struct attachment **curr, *expired = NULL, *at;
+
+    PTH(err, pthread_mutex_lock(&(fastpath.mtx)), return)
+    curr = &(fastpath.pending);
+    while (*curr != NULL) {
+        at = *curr;
+        waited = elapsed_time(&(at->created));
+        if (waited.tv_sec * 1000L + waited.tv_nsec / 1000000L >= netpipefs_options.timeout) {
+            *curr = at->next;
+            at->next = expired;
+            expired = at;
+        } else {
+            curr = &(at->next);
+        }
+    }
+    PTH(err, pthread_mutex_unlock(&(fastpath.mtx)), return)
+
+    while ((at = expired) != NULL) {
+        expired = at->next;
+        DEBUG("fastpath: application didn't connect\n");
+        attachment_drop(at);
+    }
+}
+
+static void *acceptor(void *unused) {
+    int ready, fd;
+    struct pollfd fds[2];
+
+    fds[0].fd = fastpath.listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fastpath.pipefd[0];
+    fds[1].events = POLLIN;
+    while (1) {
+        ready = poll(fds, 2, ACCEPT_INTERVAL);
+        if (ready == -1 && errno != EINTR) {
+            perror("fastpath. poll() failed");
+            break;
+        }
+        if (ready > 0 && fds[1].revents) break; // pipe closed then stop running
+
+        expire_pending();
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            fd = accept(fastpath.listenfd, NULL, NULL);
+            if (fd != -1) connect_application(fd);
+        }
+    }
+
+    return 0;
+}
+
+int netpipefs_fastpath_start(int port) {
+    int err;
+    struct sockaddr_un sa;
+
+    memset(&sa, 0, sizeof(struct sockaddr_un));
+    sa.sun_family = AF_UNIX;
+    snprintf(fastpath.path, FASTPATH_PATH_MAX, CTLSOCKNAME, port);
+    strcpy(sa.sun_path, fastpath.path);
+
+    MINUS1(fastpath.listenfd = socket(AF_UNIX, SOCK_STREAM, 0), return -1)
+    unlink(fastpath.path); // left by a previous mount
+    MINUS1(bind(fastpath.listenfd, (struct sockaddr *) &sa, sizeof(struct sockaddr_un)), goto error)
+    MINUS1(chmod(fastpath.path, 0600), goto error) // only the user who mounted can attach
+    MINUS1(listen(fastpath.listenfd, SOMAXCONN), goto error)
+    MINUS1(pipe(fastpath.pipefd), goto error)
+    PTH(err, pthread_create(&(fastpath.tid), NULL, &acceptor, NULL), goto error)
+
+    return 0;
+
+error:
+    err = errno;
+    if (fastpath.pipefd[0] != -1) {
+        close(fastpath.pipefd[0]);
+        close(fastpath.pipefd[1]);
+        fastpath.pipefd[0] = fastpath.pipefd[1] = -1;
+    }
+    close(fastpath.listenfd);
+    fastpath.listenfd = -1;
+    unlink(fastpath.path);
+    errno = err;
+    return -1;
+}
+
+void netpipefs_fastpath_stop(void) {
+    int err;
+    struct attachment *at;
+    if (fastpath.listenfd == -1) return; // not running
+
+    /* Close write end. The acceptor will wake up and stop running */
+    close(fastpath.pipefd[1]);
+    PTH(err, pthread_join(fastpath.tid, NULL), perror("fastpath. failed to join"))
+    close(fastpath.pipefd[0]);
+    close(fastpath.listenfd);
+    unlink(fastpath.path);
+    fastpath.pipefd[0] = fastpath.pipefd[1] = fastpath.listenfd = -1;
+
+    PTH(err, pthread_mutex_lock(&(fastpath.mtx)), return)
+    while ((at = fastpath.pending) != NULL) {
+        fastpath.pending = at->next;
+        attachment_drop(at);
+    }
+
+    /* Wake up the threads which move the data and wait for them */
+    for (at = fastpath.active; at != NULL; at = at->next) {
+        shutdown(at->fd, SHUT_RDWR);
+        MINUS1(netpipe_force_exit(at->file, &netpipefs_poll_notify), perror("fastpath. failed to force exit"))
+    }
+    while (fastpath.active != NULL) {
+        PTH(err, pthread_cond_wait(&(fastpath.ended), &(fastpath.mtx)), break)
+    }
+    PTH(err, pthread_mutex_unlock(&(fastpath.mtx)), perror("fastpath. failed to unlock"))
+}
+
+/** Get a random token. Returns 0 on success, -1 on error */
+static int new_token(uint64_t *token) {
+    int fd;
+    ssize_t bytes;
+
+    MINUS1(fd = open("/dev/urandom", O_RDONLY), return -1)
+    bytes = readn(fd, token, sizeof(uint64_t));
+    close(fd);
+    if (bytes != sizeof(uint64_t)) {
+        if (bytes != -1) errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+int netpipefs_fastpath_attach(struct netpipe *file, int mode, struct netpipefs_attach *attach) {
+    int err;
+    struct attachment *at;
+
+    if (fastpath.listenfd == -1) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (mode != O_RDONLY && mode != O_WRONLY) {
+        errno = EINVAL;
+        return -1;
+    }
+    // the ring is a byte stream
+    if (file->messages) {
+        errno = EINVAL;
+        return -1;
+    }
+    // a reader only takes what the readahead buffered, so it cannot lose data when the application detaches
+    if (mode == O_RDONLY && file->readahead == 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    EQNULL(at = (struct attachment *) malloc(sizeof(struct attachment)), return -1)
+    at->file = file;
+    at->mode = mode;
+    at->fd = -1;
+    at->ring = NULL;
+    if (new_token(&(at->token)) == -1 || clock_gettime(CLOCK_MONOTONIC, &(at->created)) == -1) {
+        free(at);
+        return -1;
+    }
+
+    /* The application has the file open, so there is the other end too */
+    MINUS1(netpipe_open(file, mode, 1), free(at); return -1)
+
+    PTH(err, pthread_mutex_lock(&(fastpath.mtx)), attachment_drop(at); return -1)
+    at->next = fastpath.pending;
+    fastpath.pending = at;
+    PTH(err, pthread_mutex_unlock(&(fastpath.mtx)), return -1)
+
+    memset(attach, 0, sizeof(struct netpipefs_attach));
+    strcpy(attach->path, fastpath.path);
+    attach->token = at->token;
+
+    return 0;
+}
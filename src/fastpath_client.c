@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../include/fastpath.h"
+#include "../include/fastpath_client.h"
+#include "../include/shmring.h"
+#include "../include/sock.h"
+#include "../include/scfiles.h"
+#include "../include/utils.h"
+
+struct fastpath_s {
+    int fd;         // connection with the daemon. It is closed by the daemon when it is gone
+    int mode;
+    shmring_t *ring;
+};
+
+fastpath_t *fastpath_attach(int fd) {
+    int flags, err, fds[SHMRING_FDS];
+    struct netpipefs_attach attach;
+    struct sockaddr_un sa;
+    fastpath_t *fp;
+
+    MINUS1(flags = fcntl(fd, F_GETFL), return NULL)
+    if ((flags & O_ACCMODE) != O_RDONLY && (flags & O_ACCMODE) != O_WRONLY) {
+        errno = EINVAL;
+        return NULL;
+    }
+    MINUS1(ioctl(fd, NETPIPEFS_IOC_ATTACH, &attach), return NULL)
+
+    EQNULL(fp = (fastpath_t *) malloc(sizeof(fastpath_t)), return NULL)
+    fp->mode = flags & O_ACCMODE;
+    fp->ring = NULL;
+    MINUS1(fp->fd = socket(AF_UNIX, SOCK_STREAM, 0), free(fp); return NULL)
+
+    memset(&sa, 0, sizeof(struct sockaddr_un));
+    sa.sun_family = AF_UNIX;
+    attach.path[FASTPATH_PATH_MAX - 1] = '\0';
+    strcpy(sa.sun_path, attach.path);
+    MINUS1(connect(fp->fd, (struct sockaddr *) &sa, sizeof(struct sockaddr_un)), goto error)
+    MINUS1(send(fp->fd, &(attach.token), sizeof(uint64_t), MSG_NOSIGNAL), goto error)
+
+    err = sock_recv_fds(fp->fd, fds, SHMRING_FDS);
+    if (err == 0) errno = EACCES; // the token expired
+    if (err <= 0) goto error;
+    EQNULL(fp->ring = shmring_attach(fds), goto error)
+
+    return fp;
+
+error:
+    err = errno;
+    close(fp->fd);
+    free(fp);
+    errno = err;
+    return NULL;
+}
+
+ssize_t fastpath_reserve(fastpath_t *fp, char **data) {
+    ssize_t len = shmring_reserve(fp->ring, data, fp->fd);
+    if (len == 0) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return len;
+}
+
+void fastpath_commit(fastpath_t *fp, size_t n) {
+    shmring_commit(fp->ring, n);
+}
+
+ssize_t fastpath_write(fastpath_t *fp, const void *buf, size_t n) {
+    ssize_t done = shmring_writen(fp->ring, (const char *) buf, n, fp->fd);
+    if (done == 0 && n > 0) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return done;
+}
+
+ssize_t fastpath_peek(fastpath_t *fp, char **data) {
+    size_t len = shmring_peek(fp->ring, data);
+    int err;
+
+    if (len > 0) return len;
+    err = shmring_wait(fp->ring, fp->fd);
+    if (err <= 0) return err;
+
+    return shmring_peek(fp->ring, data);
+}
+
+void fastpath_consume(fastpath_t *fp, size_t n) {
+    shmring_consume(fp->ring, n);
+    shmring_release(fp->ring);
+}
+
+ssize_t fastpath_read(fastpath_t *fp, void *buf, size_t n) {
+    char *data;
+    ssize_t len = fastpath_peek(fp, &data);
+    if (len <= 0) return len;
+
+    if ((size_t) len > n) len = n;
+    memcpy(buf, data, len);
+    fastpath_consume(fp, len);
+
+    return len;
+}
+
+int fastpath_detach(fastpath_t *fp) {
+    char c;
+    ssize_t bytes;
+    int err = 0;
+
+    if (fp->mode == O_WRONLY) {
+        /* The daemon answers when the ring is empty and the data is flushed, it closes without answering on error */
+        shutdown(fp->fd, SHUT_WR);
+        while ((bytes = read(fp->fd, &c, 1)) == -1 && errno == EINTR);
+        if (bytes != 1) err = -1;
+    }
+
+    close(fp->fd);
+    shmring_free(fp->ring);
+    free(fp);
+
+    return err;
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "../include/libnetpipe.h"
+#include "../include/options.h"
+#include "../include/netpipe.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/openfiles.h"
+#include "../include/dispatcher.h"
+#include "../include/utils.h"
+
+/* Only debug is used by the library. It is set by the last connection */
+struct netpipefs_options netpipefs_options;
+
+struct np_conn {
+    struct netpipefs_socket skt;
+    struct dispatcher *dispatcher;
+    int pipefd[2];  // the poll handle of the netpipes polled by the application writes into it
+    char *spooldir; // copy of the setting, which the connection uses until it is closed
+};
+
+struct np_file {
+    struct netpipe *file;
+    np_conn_t *conn;
+    int mode;
+    int nonblock;
+};
+
+/* The connection is the poll handle */
+static void np_poll_notify(void *ph) {
+    np_conn_t *conn = (np_conn_t *) ph;
+    char c = 1;
+
+    // it is already readable if the pipe is full
+    if (write(conn->pipefd[1], &c, sizeof(char)) == -1 && errno != EAGAIN)
+        DEBUG("libnetpipe: poll notify failed: %s\n", strerror(errno));
+}
+
+np_conn_t *np_connect(const char *hostip, int hostport, int port, const struct np_options *options) {
+    int err;
+    struct netpipefs_options opts;
+    np_conn_t *conn;
+
+    memset(&opts, 0, sizeof(struct netpipefs_options));
+    opts.hostip = (char *) hostip;
+    opts.hostport = hostport;
+    opts.port = port;
+    opts.timeout = options ? options->timeout : DEFAULT_TIMEOUT;
+    opts.readahead = options ? options->readahead : DEFAULT_READAHEAD;
+    opts.writeahead = options ? options->writeahead : DEFAULT_WRITEAHEAD;
+    opts.spoolmax = options && options->spoolmax > 0 ? options->spoolmax : DEFAULT_SPOOLMAX;
+    opts.busypoll = options ? options->busypoll : DEFAULT_BUSYPOLL;
+    opts.readmin = options && options->readmin > 0 ? options->readmin : DEFAULT_READMIN;
+    opts.readtime = options ? options->readtime : DEFAULT_READTIME;
+    opts.earlydata = options ? options->earlydata : DEFAULT_EARLYDATA;
+    opts.earlymax = options && options->earlymax > 0 ? options->earlymax : DEFAULT_EARLYMAX;
+    opts.zerocopy = options ? options->zerocopy : DEFAULT_ZEROCOPY;
+    opts.shmsize = options ? options->shmsize : DEFAULT_SHMSIZE;
+    netpipefs_options.debug = options ? options->debug : 0;
+
+    // a lost connection gives EPIPE instead of killing the application
+    struct sigaction sa;
+    MINUS1(sigaction(SIGPIPE, NULL, &sa), return NULL)
+    if (sa.sa_handler == SIG_DFL) {
+        sa.sa_handler = SIG_IGN;
+        MINUS1(sigaction(SIGPIPE, &sa, NULL), return NULL)
+    }
+
+    EQNULL(conn = (np_conn_t *) calloc(1, sizeof(np_conn_t)), return NULL)
+    PTH(err, pthread_mutex_init(&(conn->skt.wr_mtx), NULL), free(conn); return NULL)
+    MINUS1(pipe(conn->pipefd), goto error_mtx)
+    MINUS1(fcntl(conn->pipefd[0], F_SETFL, O_NONBLOCK), goto error_pipe)
+    MINUS1(fcntl(conn->pipefd[1], F_SETFL, O_NONBLOCK), goto error_pipe)
+    if (options && options->spooldir) EQNULL(conn->spooldir = strdup(options->spooldir), goto error_pipe)
+    opts.spooldir = conn->spooldir;
+
+    MINUS1(establish_socket_connection(&(conn->skt), &opts), goto error_pipe)
+    MINUS1(netpipefs_open_files_table_init(&(conn->skt)), goto error_socket)
+    struct netpipefs_socket *skt = &(conn->skt);
+    EQNULL(conn->dispatcher = netpipefs_dispatcher_run(&skt, 1, &np_poll_notify), goto error_table)
+
+    return conn;
+
+error_table:
+    err = errno;
+    netpipefs_open_files_table_destroy(&(conn->skt), NULL);
+    errno = err;
+error_socket:
+    err = errno;
+    end_socket_connection(&(conn->skt));
+    errno = err;
+error_pipe:
+    err = errno;
+    free(conn->spooldir);
+    close(conn->pipefd[0]);
+    close(conn->pipefd[1]);
+    errno = err;
+error_mtx:
+    err = errno;
+    pthread_mutex_destroy(&(conn->skt.wr_mtx));
+    free(conn);
+    errno = err;
+    return NULL;
+}
+
+int np_disconnect(np_conn_t *conn) {
+    int err, ret = 0;
+
+    MINUS1(netpipefs_shutdown(&(conn->skt), &np_poll_notify), ret = -1)
+    MINUS1(netpipefs_dispatcher_stop(conn->dispatcher), ret = -1)
+    netpipefs_zerocopy_abort(&(conn->skt));
+    MINUS1(netpipefs_open_files_table_destroy(&(conn->skt), NULL), ret = -1)
+    MINUS1(end_socket_connection(&(conn->skt)), ret = -1)
+
+    PTH(err, pthread_mutex_destroy(&(conn->skt.wr_mtx)), ret = -1)
+    close(conn->pipefd[0]);
+    close(conn->pipefd[1]);
+    free(conn->spooldir);
+    free(conn);
+
+    return ret;
+}
+
+np_file_t *np_open(np_conn_t *conn, const char *path, int flags) {
+    int err;
+    char name[NAME_MAX + 2];
+    np_file_t *file;
+
+    if (path[0] == '/') path++;
+    if (path[0] == '\0' || strchr(path, '/') != NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (strlen(path) > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY && (flags & O_ACCMODE) != O_WRONLY && (flags & O_ACCMODE) != O_RDWR) {
+        errno = EINVAL;
+        return NULL;
+    }
+    name[0] = '/';
+    strcpy(name + 1, path);
+
+    EQNULL(file = (np_file_t *) malloc(sizeof(np_file_t)), return NULL)
+    file->conn = conn;
+    file->mode = flags & O_ACCMODE;
+    file->nonblock = (flags & O_NONBLOCK) != 0;
+
+    /* Like the kernel does, the file is referenced while it is being open */
+    EQNULL(file->file = netpipefs_lookup_open_file(&(conn->skt), name), free(file); return NULL)
+    err = netpipe_open(file->file, flags & O_DIRECT ? file->mode | NETPIPE_MESSAGES : file->mode, file->nonblock) == -1 ? errno : 0;
+    MINUS1(netpipe_forget(file->file, 1, &netpipefs_remove_open_file), if (err == 0) err = errno)
+
+    if (err != 0) {
+        free(file);
+        errno = err;
+        return NULL;
+    }
+
+    return file;
+}
+
+ssize_t np_write(np_file_t *file, const void *buf, size_t n) {
+    if (file->mode == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return netpipe_send(file->file, (const char *) buf, n, file->nonblock);
+}
+
+ssize_t np_read(np_file_t *file, void *buf, size_t n) {
+    ssize_t bytes;
+    unsigned int revents = 0;
+
+    if (file->mode == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    bytes = netpipe_read(file->file, (char *) buf, n, 1);
+    // a message or a record is not returned until it arrived whole
+    if (bytes == -1 && errno == EAGAIN && !file->nonblock) bytes = 0;
+    if (bytes != 0 || n == 0) return bytes;
+
+    if (file->nonblock) {
+        // nothing is buffered: it is the end of file only if there are no writers
+        MINUS1(netpipe_poll(file->file, NULL, &revents), return -1)
+        if (revents & POLLIN) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return 0;
+    }
+
+    // nothing is buffered: wait for the read minimum
+    return netpipe_read(file->file, (char *) buf, n, 0);
+}
+
+int np_setreadmin(np_file_t *file, size_t min, int msec) {
+    if (file->mode == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (msec < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return netpipe_set_readmin(file->file, min, msec);
+}
+
+int np_setdelimiter(np_file_t *file, int delimiter) {
+    if (file->mode == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return netpipe_set_delimiter(file->file, delimiter);
+}
+
+int np_setgroup(np_file_t *file, int group) {
+    if (file->mode == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return netpipe_set_group(file->file, group);
+}
+
+int np_fsync(np_file_t *file, int datasync) {
+    if (file->mode == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return netpipe_fsync(file->file, datasync);
+}
+
+int np_send_urgent(np_file_t *file, const void *buf, size_t n) {
+    if (file->mode == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return netpipe_send_urgent(file->file, (const char *) buf, n);
+}
+
+ssize_t np_read_urgent(np_file_t *file, void *buf, size_t n) {
+    if (file->mode == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return netpipe_read_urgent(file->file, (char *) buf, n);
+}
+
+int np_close(np_file_t *file) {
+    int ret = netpipe_close(file->file, file->mode, &netpipefs_remove_open_file, &np_poll_notify);
+    free(file);
+
+    return ret;
+}
+
+int np_poll_fd(np_conn_t *conn) {
+    return conn->pipefd[0];
+}
+
+void np_poll_clear(np_conn_t *conn) {
+    char discard[64];
+    while (read(conn->pipefd[0], discard, sizeof(discard)) > 0);
+}
+
+int np_poll(np_file_t *file, short *revents) {
+    unsigned int events = 0;
+
+    MINUS1(netpipe_poll(file->file, file->conn, &events), return -1)
+    *revents = (short) events;
+
+    return 0;
+}
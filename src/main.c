@@ -1,345 +1,1068 @@
+#define _GNU_SOURCE // O_DIRECT
 #include "../include/options.h"
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "../include/signal_handler.h"
 #include "../include/utils.h"
 #include "../include/dispatcher.h"
 #include "../include/netpipe.h"
 #include "../include/openfiles.h"
+#include "../include/pollhandle.h"
 #include "../include/netpipefs_socket.h"
+#include "../include/fastpath.h"
+#include "../include/peers.h"
+#include "../include/fanout.h"
 
-/* Socket communication */
-struct netpipefs_socket netpipefs_socket;
+#define ENTRY_TIMEOUT 1.0   // seconds for which names are cached by the kernel
+#define ATTR_TIMEOUT 1.0    // seconds for which attributes are cached by the kernel
+
+#define SPLICE_MIN 16384    // smaller reads are copied: splicing them costs more than copying
+#define MAPPED_IOV 16       // max number of pieces of a read reply whose data is mapped from the socket
+
+#define DRAINING_XATTR "user.netpipefs.draining" // closes of the directory's peers which are still draining
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+/* With --peers each remote host has a directory. Their nodeids follow the root */
+#define MULTIPEER (netpipefs_peers[0].name[0] != '\0')
+#define PEER_DIR_ID(i) (FUSE_ROOT_ID + 1 + (fuse_ino_t) (i))
+
+/* With --fanout the directory of the fan-out netpipes follows the directories of the peers */
+#define FANOUT_DIR_ID PEER_DIR_ID(netpipefs_npeers)
+
+/* The nodeid of a fan-out netpipe is the address of its struct with the lowest bit set, so it is never a netpipe */
+#define FANOUT_TAG ((fuse_ino_t) 1)
+
+/* Handles the messages of all the remote hosts */
+static struct dispatcher *dispatcher = NULL;
+
+/* Connections of all the remote hosts, written by the fan-out netpipes */
+static struct netpipefs_socket **peer_skts = NULL;
+
+/* FUSE session and channel */
+static struct fuse_session *session = NULL;
+static struct fuse_chan *channel = NULL;
+
+/** Open or create request which is waiting for at least one reader and one writer */
+struct open_request {
+    fuse_req_t req;
+    struct fuse_file_info fi;
+    struct fuse_entry_param e;
+    int create; // the request holds a lookup reference which is dropped on failure
+};
+
+/** Read request which is waiting for data */
+struct read_request {
+    fuse_req_t req;
+    struct netpipefs_socket *skt;
+    char buf[];
+};
+
+/** Returns 1 if the given inode is the root, the directory of a peer or the directory of the fan-out netpipes */
+static int node_is_dir(fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return 1;
+    if (netpipefs_options.fanout != NULL && ino == FANOUT_DIR_ID) return 1;
+    return MULTIPEER && ino >= PEER_DIR_ID(0) && ino < PEER_DIR_ID(netpipefs_npeers);
+}
+
+/** Returns 1 if the given inode is a fan-out netpipe */
+static int node_is_fanout(fuse_ino_t ino) {
+    return !node_is_dir(ino) && (ino & FANOUT_TAG);
+}
+
+static struct fanout *node_fanout(fuse_ino_t ino) {
+    return (struct fanout *) (ino & ~FANOUT_TAG);
+}
+
+/** Get the peer whose netpipes are into the given directory, NULL if it has none */
+static struct netpipefs_peer *node_peer(fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return MULTIPEER ? NULL : &netpipefs_peers[0];
+    if (!node_is_dir(ino) || ino == FANOUT_DIR_ID) return NULL;
+
+    return &netpipefs_peers[ino - PEER_DIR_ID(0)];
+}
+
+/**
+ * Fill the attributes of the given inode. The nodeid of a file is the address of its netpipe
+ * while the inode number is the hash of its path, so it is the same on every lookup and mount.
+ */
+static void node_stat(fuse_ino_t ino, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if (node_is_dir(ino)) {
+        stbuf->st_ino = ino;
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        if (ino == FUSE_ROOT_ID && MULTIPEER) stbuf->st_nlink += netpipefs_npeers + (netpipefs_options.fanout != NULL);
+    } else if (node_is_fanout(ino)) {
+        stbuf->st_ino = ino;
+        stbuf->st_mode = S_IFREG | 0222;
+        stbuf->st_nlink = 1;
+    } else {
+        stbuf->st_ino = ((struct netpipe *) ino)->hash;
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+    }
+}
+
+/** Fill the entry of the given inode */
+static void node_entry(fuse_ino_t ino, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = ino;
+    e->attr_timeout = ATTR_TIMEOUT;
+    e->entry_timeout = ENTRY_TIMEOUT;
+    node_stat(e->ino, &(e->attr));
+}
+
+/** Get the path of the file with the given name. It returns -1 and sets errno if the name is too long */
+static int node_path(const char *name, char *path) {
+    if (strlen(name) > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    path[0] = '/';
+    strcpy(path + 1, name);
+
+    return 0;
+}
+
+/**
+ * Get the file with the given name or create it. A lookup reference is taken.
+ *
+ * @param skt connection with the remote host which shares the file
+ * @param name file's name
+ * @return the file, NULL on error and it sets errno
+ */
+static struct netpipe *node_lookup(struct netpipefs_socket *skt, const char *name) {
+    char path[NAME_MAX + 2];
+    MINUS1(node_path(name, path), return NULL)
+
+    return netpipefs_lookup_open_file(skt, path);
+}
+
+/**
+ * Get the fan-out netpipe with the given name or create it. A reference is taken.
+ *
+ * @param name file's name
+ * @return the nodeid of the fan-out netpipe, 0 on error and it sets errno
+ */
+static fuse_ino_t node_lookup_fanout(const char *name) {
+    char path[NAME_MAX + 2];
+    struct fanout *fanout;
+    MINUS1(node_path(name, path), return 0)
+
+    fanout = netpipefs_fanout_get(path, netpipefs_options.fanoutlag, netpipefs_options.fanoutdrop, &netpipefs_poll_notify);
+    EQNULL(fanout, return 0)
+
+    return (fuse_ino_t) fanout | FANOUT_TAG;
+}
+
+static void node_forget(struct netpipe *file, unsigned long nlookup) {
+    if (netpipe_forget(file, nlookup, &netpipefs_remove_open_file) == -1)
+        DEBUG("forget failed: %s\n", strerror(errno));
+}
+
+/** Reply with the given error. It never replies with success */
+static void reply_error(fuse_req_t req, int error) {
+    fuse_reply_err(req, error != 0 ? error : EIO);
+}
 
 /**
  * Initialize filesystem
  *
- * The return value will passed in the `private_data` field of
- * `struct fuse_context` to all file operations, and as a
- * parameter to the destroy() method. It overrides the initial
- * value provided to fuse_main() / fuse_new().
+ * Called before any other filesystem method
  */
-static void* init_callback(struct fuse_conn_info *conn) {
-    /* Useful fact: the fuse_context is set up before this function is called, and fuse_get_context()->private_data
-     * returns the user_data passed to fuse_main(). */
-    struct fuse *fuse = fuse_get_context()->fuse;
-    int err;
+static void netpipefs_init(void *userdata, struct fuse_conn_info *conn) {
+    int err, i;
+    struct netpipefs_peer *peer;
+
+    /* Writes larger than a page. max_write is already limited to the channel's buffer */
+    if (conn->capable & FUSE_CAP_BIG_WRITES) conn->want |= FUSE_CAP_BIG_WRITES;
+
+    /* Move payloads between /dev/fuse and the socket with splice(). It can be disabled with
+     * -o no_splice_read,no_splice_write,no_splice_move */
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
     if (netpipefs_options.delayconnect) {
         /* Connect */
-        err = establish_socket_connection(&netpipefs_socket, netpipefs_options.timeout);
+        err = netpipefs_peers_connect();
         if (err == -1) {
             perror("unable to establish socket communication");
-            fuse_exit(fuse);
-            return 0;
+            fuse_session_exit(session);
+            return;
+        }
+    }
+
+    /* Create open files tables */
+    for (i = 0; i < netpipefs_npeers; i++) {
+        if (netpipefs_open_files_table_init(&(netpipefs_peers[i].skt)) == -1) {
+            perror("failed to create file table");
+            fuse_session_exit(session);
+            return;
         }
     }
 
-    /* Create open files table */
-    if (netpipefs_open_files_table_init() == -1) {
-        perror("failed to create file table");
-        fuse_exit(fuse);
-        return 0;
+    /* Create the netpipes declared at mount time */
+    if (netpipefs_peers_provision() == -1) {
+        perror("failed to provision the netpipes");
+        fuse_session_exit(session);
+        return;
     }
 
     /* Run dispatcher */
-    err = netpipefs_dispatcher_run();
-    if (err == -1) {
+    peer_skts = (struct netpipefs_socket **) malloc(sizeof(struct netpipefs_socket *) * netpipefs_npeers);
+    if (peer_skts != NULL) {
+        for (i = 0; i < netpipefs_npeers; i++) peer_skts[i] = &(netpipefs_peers[i].skt);
+        dispatcher = netpipefs_dispatcher_run(peer_skts, netpipefs_npeers, &netpipefs_poll_notify);
+    }
+    if (dispatcher == NULL) {
         perror("failed to run dispatcher");
-        fuse_exit(fuse);
-        return 0;
+        fuse_session_exit(session);
+        return;
     }
 
+    /* Local applications can bypass FUSE. The filesystem works without it */
+    err = netpipefs_fastpath_start(netpipefs_peers[0].options.port);
+    if (err == -1) perror("fast path disabled");
+
     /* Print a resume */
     DEBUG("dispatcher running\n");
-    DEBUG("connection established: %s\n", (strcmp(netpipefs_options.hostip, "localhost") == 0 ? AF_UNIX_LABEL:AF_INET_LABEL));
-    DEBUG("host=%s:%d\n", netpipefs_options.hostip, netpipefs_options.hostport);
-    DEBUG("local port=%d\n", netpipefs_options.port);
+    for (i = 0; i < netpipefs_npeers; i++) {
+        peer = &netpipefs_peers[i];
+        if (MULTIPEER) DEBUG("peer %s\n", peer->name);
+        DEBUG("connection established: %s%s\n", (strcmp(peer->hostip, "localhost") == 0 ? AF_UNIX_LABEL:AF_INET_LABEL),
+              peer->skt.shm_tx != NULL ? " (shared memory)" : "");
+        DEBUG("host=%s:%d\n", peer->hostip, peer->options.hostport);
+        DEBUG("local port=%d\n", peer->options.port);
+        DEBUG("host max readahead=%ld\n", peer->skt.remote_readahead);
+        DEBUG("provisioned netpipes=%d\n", peer->npipes);
+        DEBUG("zerocopy=%ld%s\n", peer->skt.zerocopy, peer->skt.zerocopy == 0 && netpipefs_options.zerocopy > 0 ? " (not supported)" : "");
+        DEBUG("zerocopy receive=%s, host=%s\n", peer->skt.zc_map != NULL ? "on" : "off", peer->skt.remote_align > 0 ? "on" : "off");
+    }
     DEBUG("max readahead=%ld\n", netpipefs_options.readahead);
     DEBUG("max writeahead=%ld\n", netpipefs_options.writeahead);
-    DEBUG("host max readahead=%ld\n", netpipefs_socket.remote_readahead);
-
-    return 0;
+    if (netpipefs_options.spooldir != NULL)
+        DEBUG("spool=%s, max=%ld\n", netpipefs_options.spooldir, netpipefs_options.spoolmax);
+    DEBUG("busy poll=%d us\n", netpipefs_options.busypoll);
+    DEBUG("async close=%s, linger=%d ms\n", netpipefs_options.asyncclose ? "on" : "off", netpipefs_options.linger);
+    DEBUG("workers=%d%s\n", netpipefs_options.multithreaded ? netpipefs_options.workers : 1, netpipefs_options.clonefd ? " (clone fd)" : "");
+    DEBUG("max write=%u\n", conn->max_write);
 }
 
 /**
  * Clean up filesystem
  *
- * Called on filesystem exit.
+ * Called on filesystem exit
  */
-static void destroy_callback(void *privatedata) {
-    int err;
+static void netpipefs_destroy(void *userdata) {
+    int err, i;
+    struct netpipefs_socket *skt;
     DEBUG("destroy() callback\n");
 
+    /* Stop moving data for the attached applications */
+    netpipefs_fastpath_stop();
+
     /* Stop dispatcher thread */
-    err = netpipefs_dispatcher_stop();
+    err = netpipefs_dispatcher_stop(dispatcher);
     if (err == -1) perror("failed to stop dispatcher thread");
+    dispatcher = NULL;
+
+    for (i = 0; i < netpipefs_npeers; i++) {
+        skt = &(netpipefs_peers[i].skt);
+
+        /* The kernel will not report the completions of the sends in flight anymore */
+        netpipefs_zerocopy_abort(skt);
 
-    /* Destroy open files table */
-    err = netpipefs_open_files_table_destroy();
-    if (err == -1) perror("failed to destroy file table");
+        /* Destroy open files table */
+        err = netpipefs_open_files_table_destroy(skt, &netpipefs_poll_destroy);
+        if (err == -1) perror("failed to destroy file table");
 
-    /* Destroy socket and socket's mutex */
-    err = end_socket_connection(&netpipefs_socket);
-    if (err == -1) perror("failed to close socket connection");
+        /* Destroy socket */
+        err = end_socket_connection(skt);
+        if (err == -1) perror("failed to close socket connection");
+    }
 
-    PTH(err, pthread_mutex_destroy(&(netpipefs_socket.wr_mtx)), perror("failed to destroy socket's mutex"))
+    /* Destroy the sockets' mutexes */
+    netpipefs_peers_free();
+    free(peer_skts);
+    peer_skts = NULL;
 }
 
 /**
- * Get file attributes.
- *
- * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
- * ignored. The 'st_ino' field is ignored except if the 'use_ino'
- * mount option is given. In that case it is passed to userspace,
- * but libfuse and the kernel will still assign a different
- * inode for internal use (called the "nodeid").
+ * Look up a directory entry by name and get its attributes. Every file
+ * exists: the pipe is created when it is open. With --peers the root
+ * contains only the directories of the peers and of the fan-out netpipes.
  */
-static int getattr_callback(const char *path, struct stat *stbuf) {
-    memset(stbuf, 0, sizeof(struct stat));
+static void netpipefs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    struct netpipe *file;
+    struct netpipefs_peer *peer;
+    fuse_ino_t ino;
 
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    } else {
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
+    if (!node_is_dir(parent)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
     }
 
-    return 0;
+    if (parent == FANOUT_DIR_ID) {
+        if ((ino = node_lookup_fanout(name)) == 0) {
+            reply_error(req, errno);
+            return;
+        }
+        node_entry(ino, &e);
+        if (fuse_reply_entry(req, &e) != 0) netpipefs_fanout_put(node_fanout(ino), 1);
+        return;
+    }
+
+    if ((peer = node_peer(parent)) == NULL) {
+        // the directories are never forgotten
+        if (netpipefs_options.fanout != NULL && strcmp(name, netpipefs_options.fanout) == 0) {
+            node_entry(FANOUT_DIR_ID, &e);
+        } else if ((peer = netpipefs_peer_by_name(name)) != NULL) {
+            node_entry(PEER_DIR_ID(peer - netpipefs_peers), &e);
+        } else {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    file = node_lookup(&(peer->skt), name);
+    if (file == NULL) {
+        reply_error(req, errno);
+        return;
+    }
+
+    node_entry((fuse_ino_t) file, &e);
+    if (fuse_reply_entry(req, &e) != 0) node_forget(file, 1);
 }
 
 /**
- * Open a file. Open flags are available in fi->flags. The following rules
- * apply.
- *
- *  - Creation (O_CREAT, O_EXCL, O_NOCTTY) flags will be
- *    filtered out / handled by the kernel.
- *
- *  - Access modes (O_RDONLY, O_WRONLY, O_RDWR, O_EXEC, O_SEARCH)
- *    should be used by the filesystem to check if the operation is
- *    permitted.  If the ``-o default_permissions`` mount option is
- *    given, this check is already done by the kernel before calling
- *    open() and may thus be omitted by the filesystem.
- *
- *  - When writeback caching is enabled, the kernel may send
- *    read requests even for files opened with O_WRONLY. The
- *    filesystem should be prepared to handle this.
- *
- *  - When writeback caching is disabled, the filesystem is
- *    expected to properly handle the O_APPEND flag and ensure
- *    that each write is appending to the end of the file.
- *
- *  - When writeback caching is enabled, the kernel will
- *    handle O_APPEND. However, unless all changes to the file
- *    come through the kernel this will not work reliably. The
- *    filesystem should thus either ignore the O_APPEND flag
- *    (and let the kernel handle it), or return an error
- *    (indicating that reliably O_APPEND is not available).
- *
- * Filesystem may store an arbitrary file handle (pointer,
- * index, etc) in fi->fh, and use this in other all other file
- * operations (read, write, flush, release, fsync).
- *
- * Filesystem may also implement stateless file I/O and not store
- * anything in fi->fh.
- *
- * There are also some flags (direct_io, keep_cache) which the
- * filesystem may set in fi, to change the way the file is opened.
- * See fuse_file_info structure in <fuse_common.h> for more details.
- *
- * If this request is answered with an error code of ENOSYS
- * and FUSE_CAP_NO_OPEN_SUPPORT is set in
- * `fuse_conn_info.capable`, this is treated as success and
- * future calls to open will also succeed without being send
- * to the filesystem process.
+ * Forget about an inode. The nlookup parameter indicates the number of
+ * lookups previously performed on this inode.
+ */
+static void netpipefs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    if (node_is_fanout(ino)) netpipefs_fanout_put(node_fanout(ino), nlookup);
+    else if (!node_is_dir(ino)) node_forget((struct netpipe *) ino, nlookup);
+    fuse_reply_none(req);
+}
+
+/**
+ * Get file attributes
+ */
+static void netpipefs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat stbuf;
+    node_stat(ino, &stbuf);
+    fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+/**
+ * Set file attributes. It does nothing but it's needed to support
+ * truncate on open.
+ */
+static void netpipefs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct stat stbuf;
+    node_stat(ino, &stbuf);
+    fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+/** Used when nobody is waiting for the close */
+static void close_done(void *arg, ssize_t bytes, int error) {
+    if (bytes == -1) DEBUG("close failed: %s\n", strerror(error));
+}
+
+/** Called when the open request is done */
+static void open_done(void *arg, ssize_t bytes, int error) {
+    struct open_request *op = (struct open_request *) arg;
+    struct netpipe *file = (struct netpipe *) op->fi.fh;
+    int mode = op->fi.flags & O_ACCMODE;
+    int err;
+
+    if (bytes == -1) {
+        reply_error(op->req, error);
+        if (op->create) node_forget(file, 1);
+        free(op);
+        return;
+    }
+
+    if (op->create) err = fuse_reply_create(op->req, &(op->e), &(op->fi));
+    else err = fuse_reply_open(op->req, &(op->fi));
+
+    // the process which opened the file was interrupted: the kernel will never release it
+    if (err == -ENOENT) {
+        netpipe_close_async(file, mode, &netpipefs_remove_open_file, &netpipefs_poll_notify, &close_done, NULL);
+        if (op->create) node_forget(file, 1);
+    }
+    free(op);
+}
+
+/**
+ * Open the given file. The reply is sent when there is at least one reader and one writer.
  *
+ * @param req request handle
+ * @param file the file
+ * @param fi file information
+ * @param create if 1 then it is a create request which holds a lookup reference to the file
  */
-static int open_callback(const char *path, struct fuse_file_info *fi) {
-    int err, just_created = 0;
+static void do_open(fuse_req_t req, struct netpipe *file, struct fuse_file_info *fi, int create) {
+    int err;
     int mode = fi->flags & O_ACCMODE;
     int nonblock = fi->flags & O_NONBLOCK;
-    struct netpipe *file = NULL;
-
-    /* Get the file struct or create it */
-    file = netpipefs_get_or_create_open_file(path, &just_created);
-    if (file == NULL) return -errno;
-
-    err = netpipe_open(file, mode, nonblock);
-    if (err == -1) {
-        if (just_created) {
-            netpipefs_remove_open_file(path);
-            netpipe_free(file, NULL); // for sure there is no poll handle
-        }
-        return -errno;
+    int messages = fi->flags & O_DIRECT ? NETPIPE_MESSAGES : 0; // like the packet mode of pipe2()
+    struct open_request *op = (struct open_request *) malloc(sizeof(struct open_request));
+    if (op == NULL) {
+        err = errno;
+        goto error;
     }
 
     fi->fh = (uint64_t) file;
     fi->direct_io = 1;   // avoid kernel caching
     fi->nonseekable = 1; // seeking will not be allowed
 
-    return 0;
+    op->req = req;
+    op->fi = *fi;
+    op->create = create;
+    if (create) node_entry((fuse_ino_t) file, &(op->e));
+
+    if (netpipe_open_async(file, mode | messages, nonblock, &open_done, op) == -1) {
+        err = errno;
+        free(op);
+        goto error;
+    }
+
+    return;
+
+error:
+    reply_error(req, err);
+    if (create) node_forget(file, 1);
 }
 
 /**
- * Create and open a file
- *
- * If the file does not exist, first create it with the specified
- * mode, and then open it.
+ * Open the given fan-out netpipe for writing. The reply is sent immediately.
  *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the mknod() and open() methods
- * will be called instead.
+ * @param req request handle
+ * @param ino nodeid of the fan-out netpipe
+ * @param fi file information
+ * @param create if 1 then it is a create request which holds a reference to the fan-out netpipe
+ */
+static void do_open_fanout(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int create) {
+    struct fuse_entry_param e;
+    struct fanout *fanout = node_fanout(ino);
+    int err;
+
+    if ((fi->flags & O_ACCMODE) != O_WRONLY) {
+        fuse_reply_err(req, EPERM);
+        if (create) netpipefs_fanout_put(fanout, 1);
+        return;
+    }
+    if (fi->flags & O_DIRECT) { // the peers read a byte stream
+        fuse_reply_err(req, EINVAL);
+        if (create) netpipefs_fanout_put(fanout, 1);
+        return;
+    }
+
+    fi->fh = (uint64_t) ino;
+    fi->direct_io = 1;
+    fi->nonseekable = 1;
+
+    if (netpipefs_fanout_open(fanout, peer_skts, netpipefs_npeers) == -1) {
+        reply_error(req, errno);
+        if (create) netpipefs_fanout_put(fanout, 1);
+        return;
+    }
+
+    if (create) {
+        node_entry(ino, &e);
+        err = fuse_reply_create(req, &e, fi);
+    } else {
+        err = fuse_reply_open(req, fi);
+    }
+
+    // the process which opened the file was interrupted: the kernel will never release it
+    if (err == -ENOENT) {
+        netpipefs_fanout_close_async(fanout, &close_done, NULL);
+        if (create) netpipefs_fanout_put(fanout, 1);
+    }
+}
+
+/**
+ * Open a file. The reply is sent when the file has at least one reader
+ * and one writer, so no thread is waiting meanwhile.
+ */
+static void netpipefs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (node_is_dir(ino)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    if (node_is_fanout(ino)) do_open_fanout(req, ino, fi, 0);
+    else do_open(req, (struct netpipe *) ino, fi, 0);
+}
+
+/**
+ * Create and open a file
  */
-static int create_callback(const char *path, mode_t mode, struct fuse_file_info *fi) {
+static void netpipefs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct netpipe *file;
+    struct netpipefs_peer *peer;
+    fuse_ino_t ino;
     DEBUG("create() callback\n");
-    return open_callback(path, fi);
+
+    if (!node_is_dir(parent)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (parent == FANOUT_DIR_ID) {
+        if ((ino = node_lookup_fanout(name)) == 0) reply_error(req, errno);
+        else do_open_fanout(req, ino, fi, 1);
+        return;
+    }
+    if ((peer = node_peer(parent)) == NULL) { // only the directories are into the root
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    file = node_lookup(&(peer->skt), name);
+    if (file == NULL) {
+        reply_error(req, errno);
+        return;
+    }
+
+    do_open(req, file, fi, 1);
 }
 
-/** Read data from an open file
- *
- * Read should return exactly the number of bytes requested except
- * on EOF or error, otherwise the rest of the data will be
- * substituted with zeroes.	 An exception to this is when the
- * 'direct_io' mount option is specified, in which case the return
- * value of the read system call will reflect the return value of
- * this operation.
+/** Called when the read request is done */
+static void read_done(void *arg, ssize_t bytes, int error) {
+    struct read_request *rr = (struct read_request *) arg;
+
+    // the request is NULL if read_splice() has already replied
+    if (rr->req != NULL && bytes == -1) reply_error(rr->req, error);
+    else if (rr->req != NULL) fuse_reply_buf(rr->req, rr->buf, bytes);
+    free(rr);
+}
+
+/** Reply to the read request with data spliced from the socket into /dev/fuse */
+static int read_splice(void *arg, int fd, size_t size) {
+    struct read_request *rr = (struct read_request *) arg;
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    int err;
+
+    bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+    bufv.buf[0].fd = fd;
+
+    err = fuse_reply_data(rr->req, &bufv, FUSE_BUF_SPLICE_MOVE);
+    rr->req = NULL;
+
+    // the data was taken from the socket even if the reader was interrupted
+    return err == 0 || err == -ENOENT ? 0 : -1;
+}
+
+/**
+ * Reply to the read request with data mapped from the socket or taken from the shared memory ring,
+ * so it is copied only into /dev/fuse
  */
-static int read_callback(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    //path is NULL because flag_nullpath_ok = 1
+static int read_mapped(void *arg, int fd, size_t size) {
+    struct read_request *rr = (struct read_request *) arg;
+    struct iovec iov[MAPPED_IOV];
+    int err, iovcnt = MAPPED_IOV;
+
+    if (recv_mapped(rr->skt, rr->buf, size, iov, &iovcnt) <= 0) return -1;
+
+    err = fuse_reply_iov(rr->req, iov, iovcnt);
+    rr->req = NULL;
+
+    return err == 0 || err == -ENOENT ? 0 : -1;
+}
+
+/**
+ * Read data. If the data is not available the request is queued and the
+ * reply is sent by the dispatcher when the data arrives. Large requests
+ * which are completed by a single message are spliced from the socket,
+ * or mapped if TCP_ZEROCOPY_RECEIVE is enabled, or written into /dev/fuse
+ * directly from the shared memory ring.
+ */
+static void netpipefs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
     struct netpipe *file = (struct netpipe *) fi->fh;
     int nonblock = fi->flags & O_NONBLOCK;
+    int err;
+    struct read_request *rr;
+
+    if (node_is_fanout(fi->fh)) { // open only for writing
+        fuse_reply_err(req, EBADF);
+        return;
+    }
 
-    int bytes = netpipe_read(file, buf, size, nonblock);
-    if (bytes == -1) return -errno;
-    return bytes;
+    rr = (struct read_request *) malloc(sizeof(struct read_request) + size);
+    if (rr == NULL) {
+        reply_error(req, errno);
+        return;
+    }
+    rr->req = req;
+    rr->skt = file->skt;
+
+    if ((size >= ALIGNED_WRITE_MIN && rr->skt->zc_map != NULL) || (size >= SPLICE_MIN && rr->skt->shm_rx != NULL))
+        err = netpipe_read_splice_async(file, rr->buf, size, nonblock, &read_mapped, &read_done, rr);
+    else if (size >= SPLICE_MIN) err = netpipe_read_splice_async(file, rr->buf, size, nonblock, &read_splice, &read_done, rr);
+    else err = netpipe_read_async(file, rr->buf, size, nonblock, &read_done, rr);
+    if (err == -1) {
+        reply_error(req, errno);
+        free(rr);
+    }
 }
 
-/** Write data to an open file
- *
- * Write should return exactly the number of bytes requested
- * except on error.	 An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
- *
- * Unless FUSE_CAP_HANDLE_KILLPRIV is disabled, this method is
- * expected to reset the setuid and setgid bits.
+/** Called when the write request is done */
+static void write_done(void *arg, ssize_t bytes, int error) {
+    fuse_req_t req = (fuse_req_t) arg;
+
+    if (bytes == -1) reply_error(req, error);
+    else fuse_reply_write(req, bytes);
+}
+
+/**
+ * Write data. If the data cannot be sent or buffered the request is queued
+ * and the reply is sent by the dispatcher when the remote host can receive it.
+ * Data which is still into the /dev/fuse pipe is spliced into the socket.
+ * The data of a fan-out netpipe is copied once into its buffer.
  */
-static int write_callback(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    //path is NULL because flag_nullpath_ok = 1
+static void netpipefs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
     struct netpipe *file = (struct netpipe *) fi->fh;
     int nonblock = fi->flags & O_NONBLOCK;
+    struct fuse_buf *buf = &(bufv->buf[bufv->idx]);
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec membuf = FUSE_BUFVEC_INIT(size);
+    int err, left;
+
+    if (node_is_fanout(fi->fh) && bufv->count == 1 && !(buf->flags & FUSE_BUF_IS_FD)) {
+        err = netpipefs_fanout_write_async(node_fanout(fi->fh), (char *) buf->mem + bufv->off, size, nonblock, &write_done, req);
+    } else if (node_is_fanout(fi->fh)) {
+        membuf.buf[0].mem = malloc(size);
+        if (membuf.buf[0].mem == NULL) {
+            reply_error(req, errno);
+            return;
+        }
+        err = fuse_buf_copy(&membuf, bufv, 0) == (ssize_t) size ? 0 : -1;
+        if (err == 0) err = netpipefs_fanout_write_async(node_fanout(fi->fh), membuf.buf[0].mem, size, nonblock, &write_done, req);
+        else errno = EIO;
+        free(membuf.buf[0].mem);
+    } else if (bufv->count == 1 && (buf->flags & FUSE_BUF_IS_FD)) {
+        err = netpipe_send_fd_async(file, buf->fd, size, nonblock, &write_done, req);
+        // only if every byte was taken, otherwise libfuse resets the pipe so what is left isn't taken by the next write
+        if (err == 0 && ioctl(buf->fd, FIONREAD, &left) == 0 && left == 0) bufv->idx = bufv->count;
+    } else if (bufv->count == 1) {
+        err = netpipe_send_async(file, (char *) buf->mem + bufv->off, size, nonblock, &write_done, req);
+    } else {
+        membuf.buf[0].mem = malloc(size);
+        if (membuf.buf[0].mem == NULL) {
+            reply_error(req, errno);
+            return;
+        }
+        err = fuse_buf_copy(&membuf, bufv, 0) == (ssize_t) size ? 0 : -1;
+        if (err == 0) err = netpipe_send_async(file, membuf.buf[0].mem, size, nonblock, &write_done, req);
+        else errno = EIO;
+        free(membuf.buf[0].mem);
+    }
 
-    int bytes = netpipe_send(file, buf, size, nonblock);
-    if (bytes == -1) return -errno;
-    return bytes;
+    if (err == -1) reply_error(req, errno);
 }
 
 /**
  * Poll for IO readiness events
- *
- * Note: If ph is non-NULL, the client should notify
- * when IO readiness events occur by calling
- * fuse_notify_poll() with the specified ph.
- *
- * Regardless of the number of times poll with a non-NULL ph
- * is received, single notification is enough to clear all.
- * Notifying more times incurs overhead but doesn't harm
- * correctness.
- *
- * The callee is responsible for destroying ph with
- * fuse_pollhandle_destroy() when no longer in use.
- *
- * Introduced in version 2.8
  */
-static int poll_callback(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *reventsp) {
-    //path is NULL because flag_nullpath_ok = 1
+static void netpipefs_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct fuse_pollhandle *ph) {
     struct netpipe *file = (struct netpipe *) fi->fh;
-    if (ph == NULL) return 0;
+    unsigned int revents = 0;
+    int err;
 
-    int err = netpipe_poll(file, ph, reventsp);
-    if (err == -1) return -errno;
+    if (node_is_fanout(fi->fh)) err = netpipefs_fanout_poll(node_fanout(fi->fh), ph, &revents);
+    else err = netpipe_poll(file, ph, &revents);
+    if (err == -1) {
+        if (ph) netpipefs_poll_destroy(ph);
+        reply_error(req, errno);
+        return;
+    }
 
-    return 0;
+    fuse_reply_poll(req, revents);
 }
 
-/** Release an open file
- *
- * Release is called when there are no more references to an open
- * file: all file descriptors are closed and all memory mappings
- * are unmapped.
- *
- * For every open() call there will be exactly one release() call
- * with the same flags and file handle.  It is possible to
- * have a file opened more than once, in which case only the last
- * release will mean, that no more reads/writes will happen on the
- * file.  The return value of release is ignored.
+/** Called when the file is closed or synchronized */
+static void release_done(void *arg, ssize_t bytes, int error) {
+    fuse_req_t req = (fuse_req_t) arg;
+    fuse_reply_err(req, bytes == -1 ? error : 0);
+}
+
+/**
+ * Release an open file. If the last writer closes the file, the reply is
+ * sent when the buffer is flushed.
  */
-static int release_callback(const char *path, struct fuse_file_info *fi) {
-    //path is NULL because flag_nullpath_ok = 1
+static void netpipefs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     int mode = fi->flags & O_ACCMODE;
     struct netpipe *file = (struct netpipe *) fi->fh;
+    int err;
+
+    if (node_is_fanout(fi->fh)) err = netpipefs_fanout_close_async(node_fanout(fi->fh), &release_done, req);
+    else err = netpipe_close_async(file, mode, &netpipefs_remove_open_file, &netpipefs_poll_notify, &release_done, req);
+    if (err == -1) fuse_reply_err(req, errno);
+}
 
-    int ret = netpipe_close(file, mode, &netpipefs_remove_open_file, &netpipefs_poll_notify);
-    if (ret == -1) return -errno;
-    return 0; //ignored
+/**
+ * Synchronize a file open for writing. The reply is sent when what was written before is read
+ * by the remote readers or, with datasync, sent within their readahead.
+ */
+static void netpipefs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    if (node_is_fanout(fi->fh) || (fi->flags & O_ACCMODE) == O_RDONLY) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    MINUS1(netpipe_fsync_async((struct netpipe *) fi->fh, datasync, &release_done, req), fuse_reply_err(req, errno))
 }
 
 /**
- * Change the size of a file. It does nothing but it's needed to
- * support write callback.
- * */
-static int truncate_callback(const char *path, off_t newsize) {
+ * Ioctl on an open file. NETPIPEFS_IOC_ATTACH gives to the application what it needs
+ * to get a shared memory ring bound to the file. NETPIPEFS_IOC_READMIN sets the read
+ * minimum and the read timeout of the file, NETPIPEFS_IOC_DELIMITER its record delimiter.
+ */
+static void netpipefs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+                            unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+    struct netpipe *file = (struct netpipe *) fi->fh;
+    struct netpipefs_attach attach;
+    struct netpipefs_readmin readmin;
+    struct netpipefs_urgent urgent;
+    ssize_t bytes;
+    int32_t delimiter, group;
+
+    if (flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if ((unsigned int) cmd == NETPIPEFS_IOC_READMIN && !node_is_dir(ino) && !node_is_fanout(ino)) {
+        if (in_bufsz < sizeof(struct netpipefs_readmin)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&readmin, in_buf, sizeof(struct netpipefs_readmin));
+        if ((fi->flags & O_ACCMODE) == O_WRONLY) fuse_reply_err(req, EBADF);
+        else if (readmin.time > INT_MAX) fuse_reply_err(req, EINVAL);
+        else if (netpipe_set_readmin(file, readmin.min, (int) readmin.time) == -1) reply_error(req, errno);
+        else fuse_reply_ioctl(req, 0, NULL, 0);
+        return;
+    }
+    if ((unsigned int) cmd == NETPIPEFS_IOC_DELIMITER && !node_is_dir(ino) && !node_is_fanout(ino)) {
+        if (in_bufsz < sizeof(int32_t)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&delimiter, in_buf, sizeof(int32_t));
+        if ((fi->flags & O_ACCMODE) == O_WRONLY) fuse_reply_err(req, EBADF);
+        else if (netpipe_set_delimiter(file, delimiter) == -1) reply_error(req, errno);
+        else fuse_reply_ioctl(req, 0, NULL, 0);
+        return;
+    }
+    if ((unsigned int) cmd == NETPIPEFS_IOC_GROUP && !node_is_dir(ino) && !node_is_fanout(ino)) {
+        if (in_bufsz < sizeof(int32_t)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&group, in_buf, sizeof(int32_t));
+        if ((fi->flags & O_ACCMODE) == O_WRONLY) fuse_reply_err(req, EBADF);
+        else if (netpipe_set_group(file, group) == -1) reply_error(req, errno);
+        else fuse_reply_ioctl(req, 0, NULL, 0);
+        return;
+    }
+    if ((unsigned int) cmd == NETPIPEFS_IOC_URGENT && !node_is_dir(ino) && !node_is_fanout(ino)) {
+        if (in_bufsz < sizeof(struct netpipefs_urgent)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&urgent, in_buf, sizeof(struct netpipefs_urgent));
+        if ((fi->flags & O_ACCMODE) == O_RDONLY) fuse_reply_err(req, EBADF);
+        else if (netpipe_send_urgent(file, urgent.data, urgent.size) == -1) reply_error(req, errno);
+        else fuse_reply_ioctl(req, 0, NULL, 0);
+        return;
+    }
+    if ((unsigned int) cmd == NETPIPEFS_IOC_URGENT_READ && !node_is_dir(ino) && !node_is_fanout(ino)) {
+        if (out_bufsz < sizeof(struct netpipefs_urgent)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memset(&urgent, 0, sizeof(struct netpipefs_urgent));
+        if ((fi->flags & O_ACCMODE) == O_WRONLY) fuse_reply_err(req, EBADF);
+        else if ((bytes = netpipe_read_urgent(file, urgent.data, NETPIPE_URGENT_MAX)) == -1) reply_error(req, errno);
+        else {
+            urgent.size = (uint32_t) bytes;
+            fuse_reply_ioctl(req, 0, &urgent, sizeof(struct netpipefs_urgent));
+        }
+        return;
+    }
+    if ((unsigned int) cmd != NETPIPEFS_IOC_ATTACH || node_is_dir(ino) || node_is_fanout(ino)) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    if (out_bufsz < sizeof(struct netpipefs_attach)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    if (netpipefs_fastpath_attach(file, fi->flags & O_ACCMODE, &attach) == -1) reply_error(req, errno);
+    else fuse_reply_ioctl(req, 0, &attach, sizeof(struct netpipefs_attach));
+}
+
+/** Add a directory entry to the buffer. The offset of the next entry is the buffer size */
+static void dirbuf_add(fuse_req_t req, char *buf, size_t *bufsize, size_t capacity, const char *name) {
+    struct stat stbuf;
+    size_t entsize = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+    if (*bufsize + entsize > capacity) return;
+    node_stat(FUSE_ROOT_ID, &stbuf);
+    fuse_add_direntry(req, buf + *bufsize, entsize, name, &stbuf, *bufsize + entsize);
+    *bufsize += entsize;
+}
+
+/**
+ * Read directory. The directories with netpipes are always empty, with
+ * --peers the root contains the directories of the peers and of the
+ * fan-out netpipes.
+ */
+static void netpipefs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    char *buf, *fanout;
+    size_t bufsize = 0, capacity;
+    int i, npeers;
+
+    if (!node_is_dir(ino)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    fanout = ino == FUSE_ROOT_ID ? netpipefs_options.fanout : NULL;
+    npeers = ino == FUSE_ROOT_ID && MULTIPEER ? netpipefs_npeers : 0;
+    capacity = fuse_add_direntry(req, NULL, 0, "..", NULL, 0) * 2;
+    for (i = 0; i < npeers; i++) capacity += fuse_add_direntry(req, NULL, 0, netpipefs_peers[i].name, NULL, 0);
+    if (fanout != NULL) capacity += fuse_add_direntry(req, NULL, 0, fanout, NULL, 0);
+    if ((buf = (char *) malloc(capacity)) == NULL) {
+        reply_error(req, errno);
+        return;
+    }
+
+    dirbuf_add(req, buf, &bufsize, capacity, ".");
+    dirbuf_add(req, buf, &bufsize, capacity, "..");
+    for (i = 0; i < npeers; i++) dirbuf_add(req, buf, &bufsize, capacity, netpipefs_peers[i].name);
+    if (fanout != NULL) dirbuf_add(req, buf, &bufsize, capacity, fanout);
+
+    if ((size_t) off < bufsize) fuse_reply_buf(req, buf + off, bufsize - off < size ? bufsize - off : size);
+    else fuse_reply_buf(req, NULL, 0);
+    free(buf);
+}
+
+/**
+ * Get an extended attribute of a directory. "user.netpipefs.draining" is the number of closes
+ * which returned to the application while their data is still sent, see -asyncclose.
+ */
+static void netpipefs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    char value[32];
+    struct netpipefs_peer *peer = node_peer(ino);
+    unsigned long draining = 0;
+    int i, len;
+
+    if (!node_is_dir(ino) || strcmp(name, DRAINING_XATTR) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+
+    // the root with many peers counts all of them
+    for (i = 0; i < netpipefs_npeers; i++) {
+        if (peer == NULL || peer == &netpipefs_peers[i])
+            draining += __atomic_load_n(&(netpipefs_peers[i].skt.draining), __ATOMIC_ACQUIRE);
+    }
+    len = snprintf(value, sizeof(value), "%lu", draining);
+
+    if (size == 0) fuse_reply_xattr(req, len);
+    else if (size < (size_t) len) fuse_reply_err(req, ERANGE);
+    else fuse_reply_buf(req, value, len);
+}
+
+static const struct fuse_lowlevel_ops netpipefs_oper = {
+    .init = netpipefs_init,
+    .destroy = netpipefs_destroy,
+    .lookup = netpipefs_lookup,
+    .forget = netpipefs_forget,
+    .getattr = netpipefs_getattr,
+    .setattr = netpipefs_setattr,
+    .open = netpipefs_open,
+    .create = netpipefs_create,
+    .read = netpipefs_read,
+    .write_buf = netpipefs_write_buf,
+    .release = netpipefs_release,
+    .fsync = netpipefs_fsync,
+    .readdir = netpipefs_readdir,
+    .poll = netpipefs_poll,
+    .ioctl = netpipefs_ioctl,
+    .getxattr = netpipefs_getxattr,
+};
+
+/* Channel operations of a cloned /dev/fuse descriptor. They do what libfuse does for its own channel */
+static int clone_chan_receive(struct fuse_chan **chp, char *buf, size_t size) {
+    ssize_t res;
+
+    do {
+        res = read(fuse_chan_fd(*chp), buf, size);
+    } while (res == -1 && errno == ENOENT); // the request was interrupted
+
+    if (res == -1) {
+        if (errno == ENODEV) { // unmounted
+            fuse_session_exit(session);
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN) perror("fuse: reading device");
+        return -errno;
+    }
+
+    return (int) res;
+}
+
+static int clone_chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count) {
+    if (iov != NULL && writev(fuse_chan_fd(ch), iov, (int) count) == -1) {
+        // ENOENT means that the request was interrupted
+        if (!fuse_session_exited(session) && errno != ENOENT) perror("fuse: writing device");
+        return -errno;
+    }
+
     return 0;
 }
 
-/** Read directory
+static void clone_chan_destroy(struct fuse_chan *ch) {
+    close(fuse_chan_fd(ch));
+}
+
+/**
+ * Clone the /dev/fuse descriptor of the given channel. Requests read from the clone are replied on
+ * it, so the kernel keeps a separate queue of pending requests for each clone.
  *
- * The filesystem may choose between two modes of operation:
+ * @param ch the mounted channel
+ * @return the new channel or NULL on error and it sets errno
+ */
+static struct fuse_chan *clone_chan(struct fuse_chan *ch) {
+    static struct fuse_chan_ops clone_chan_ops = {
+        .receive = clone_chan_receive,
+        .send = clone_chan_send,
+        .destroy = clone_chan_destroy,
+    };
+    uint32_t masterfd = (uint32_t) fuse_chan_fd(ch);
+    struct fuse_chan *clone;
+    int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    MINUS1(fd, return NULL)
+
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    clone = fuse_chan_new(&clone_chan_ops, fd, fuse_chan_bufsize(ch), NULL);
+    EQNULL(clone, close(fd); errno = ENOMEM; return NULL)
+
+    return clone;
+}
+
+/**
+ * Receive and process requests until the session ends. Requests which cannot be completed
+ * immediately are replied later, so a worker never waits for a pipe.
  *
- * 1) The readdir implementation ignores the offset parameter, and
- * passes zero to the filler function's offset.  The filler
- * function will not return '1' (unless an error happens), so the
- * whole directory is read in a single readdir operation.
+ * @param arg the channel
+ */
+static void *netpipefs_worker(void *arg) {
+    struct fuse_chan *ch = (struct fuse_chan *) arg;
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = (char *) malloc(sizeof(char) * bufsize);
+    int res;
+
+    if (buf == NULL) {
+        perror("failed to allocate worker's buffer");
+        fuse_session_exit(session);
+        return NULL;
+    }
+
+    // the buffer is freed also when the worker is cancelled while waiting for a request
+    pthread_cleanup_push(&free, buf);
+    while (!fuse_session_exited(session)) {
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf fbuf = { .mem = buf, .size = bufsize };
+
+        res = fuse_session_receive_buf(session, &fbuf, &tmpch);
+        if (res == -EINTR) continue;
+        if (res <= 0) break;
+
+        // the worker cannot be cancelled while it is processing a request
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        fuse_session_process_buf(session, &fbuf, tmpch);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    pthread_cleanup_pop(1);
+
+    fuse_session_exit(session);
+
+    return NULL;
+}
+
+/**
+ * Run a fixed pool of workers. The calling thread is one of them and it uses the given channel.
+ * If clonefd is 1 then every other worker reads from its own clone of the channel. The clones
+ * are returned because pending requests are replied on them until the session is destroyed.
  *
- * 2) The readdir implementation keeps track of the offsets of the
- * directory entries.  It uses the offset parameter and always
- * passes non-zero offset to the filler function.  When the buffer
- * is full (or an error happens) the filler function will return
- * '1'.
+ * @param ch the channel
+ * @param nworkers number of workers
+ * @param clonefd 1 if each worker should have its own channel
+ * @param clones where the cloned channels are returned. It should have nworkers - 1 elements
+ * @return 0 on success, -1 on error
  */
-static int readdir_callback(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    //path is NULL because flag_nullpath_ok = 1
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+static int netpipefs_loop(struct fuse_chan *ch, int nworkers, int clonefd, struct fuse_chan **clones) {
+    int i, err, started = 0;
+    pthread_t *tids = NULL;
+
+    if (nworkers > 1) {
+        tids = (pthread_t *) malloc(sizeof(pthread_t) * (nworkers - 1));
+        EQNULL(tids, return -1)
+    }
+
+    for (i = 0; i < nworkers - 1; i++) {
+        clones[i] = NULL;
+        if (clonefd && (clones[i] = clone_chan(ch)) == NULL) {
+            perror("failed to clone /dev/fuse, the queue will be shared");
+            clonefd = 0;
+        }
+        if ((err = pthread_create(&tids[i], NULL, &netpipefs_worker, clones[i] ? clones[i] : ch)) != 0) {
+            errno = err;
+            perror("failed to run worker");
+            break;
+        }
+        started++;
+    }
+
+    netpipefs_worker(ch);
+
+    /* Stop the workers which are waiting for requests */
+    for (i = 0; i < started; i++) pthread_cancel(tids[i]);
+    for (i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+
+    fuse_session_reset(session);
+
     return 0;
 }
 
-static const struct fuse_operations netpipefs_oper = {
-    .destroy = destroy_callback,
-    .init = init_callback,
-    .getattr = getattr_callback,
-    .open = open_callback,
-    .create = create_callback,
-    .read = read_callback,
-    .write = write_callback,
-    .release = release_callback,
-    .truncate = truncate_callback,
-    .readdir = readdir_callback,
-    .poll = poll_callback,
-    .flag_nullpath_ok = 1,
-    .flag_nopath = 1
-    /* The following operations will not receive path information:
-     * read, write, flush, release, fallocate, fsync, readdir,
-     * releasedir, fsyncdir, lock, ioctl and poll.
-     * They will depend on the fuse_file_info structure's fh value instead.
-     */
-};
-
 int main(int argc, char** argv) {
-    int ret, err;
+    int ret, i, nworkers = 0;
+    struct fuse_chan **clones = NULL;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     /* Parse options */
@@ -349,57 +1072,77 @@ int main(int argc, char** argv) {
         return ret == -1 ? EXIT_FAILURE:EXIT_SUCCESS;
     }
 
-    /* Init socket mutex */
-    PTHERR(err, pthread_mutex_init(&(netpipefs_socket.wr_mtx), NULL), netpipefs_opt_free(&args); return EXIT_FAILURE)
+    /* Read the peers and init their sockets' mutexes */
+    if (netpipefs_peers_init(&netpipefs_options) == -1) {
+        perror("unable to read the peers");
+        netpipefs_opt_free(&args);
+        return EXIT_FAILURE;
+    }
+    if (netpipefs_options.fanout != NULL && netpipefs_peer_by_name(netpipefs_options.fanout) != NULL) {
+        fprintf(stderr, "the fan-out directory %s has the name of a peer\n", netpipefs_options.fanout);
+        netpipefs_peers_free();
+        netpipefs_opt_free(&args);
+        return EXIT_FAILURE;
+    }
+    if (netpipefs_options.pipes != NULL && netpipefs_peers_load_pipes(netpipefs_options.pipes) == -1) {
+        perror("unable to read the provisioned netpipes");
+        netpipefs_peers_free();
+        netpipefs_opt_free(&args);
+        return EXIT_FAILURE;
+    }
 
     // if delay connect or it will use af_unix sockets
     if (!netpipefs_options.delayconnect) {
         /* Connect before mounting */
-        ret = establish_socket_connection(&netpipefs_socket, netpipefs_options.timeout);
+        ret = netpipefs_peers_connect();
         if (ret == -1) {
             perror("unable to establish socket communication");
+            netpipefs_peers_free();
             netpipefs_opt_free(&args);
             return EXIT_FAILURE;
         }
     }
 
     /* Mount the filesystem */
-    struct fuse_chan *ch = fuse_mount(netpipefs_options.mountpoint, &args);
-    if (ch == NULL) {
+    channel = fuse_mount(netpipefs_options.mountpoint, &args);
+    if (channel == NULL) {
         ret = -1;
         goto end;
     }
 
     /* Initialize FUSE */
-    struct fuse *fuse = fuse_new(ch, &args, &netpipefs_oper, sizeof(struct fuse_operations), NULL);
-    if(fuse == NULL) {
+    session = fuse_lowlevel_new(&args, &netpipefs_oper, sizeof(struct fuse_lowlevel_ops), NULL);
+    if (session == NULL) {
         perror("unable to initialize FUSE");
-        fuse_unmount(netpipefs_options.mountpoint, ch);
+        fuse_unmount(netpipefs_options.mountpoint, channel);
+        ret = -1;
         goto end;
     }
+    fuse_session_add_chan(session, channel);
 
     /* Run the filesystem in foreground or background */
     ret = fuse_daemonize(netpipefs_options.foreground);
     if (ret == -1) {
         perror("failed to run the filesystem in foreground or background");
-        fuse_unmount(netpipefs_options.mountpoint, ch);
+        fuse_unmount(netpipefs_options.mountpoint, channel);
+        ret = -1;
         goto destroy;
     }
 
     /* Handle signals */
     sigset_t set;
-    if (netpipefs_set_signal_handlers(&set, ch, fuse) == -1) {
+    if (netpipefs_set_signal_handlers(&set, channel, session) == -1) {
         perror("failed to run signal handler thread");
-        fuse_unmount(netpipefs_options.mountpoint, ch);
+        fuse_unmount(netpipefs_options.mountpoint, channel);
+        ret = -1;
         goto destroy;
     }
 
-    /* Run fuse loop. Block until CTRL+C or fusermount -u */
-    if (netpipefs_options.multithreaded)
-        ret = fuse_loop_mt(fuse);
-    else
-        ret = fuse_loop(fuse);
-
+    /* Run the workers. Block until CTRL+C or fusermount -u */
+    nworkers = netpipefs_options.multithreaded ? netpipefs_options.workers : 1;
+    clones = (struct fuse_chan **) calloc(nworkers, sizeof(struct fuse_chan *));
+    if (clones == NULL) ret = -1;
+    else ret = netpipefs_loop(channel, nworkers, netpipefs_options.clonefd, clones);
     if (ret != 0)
         perror("fuse loop");
 
@@ -407,10 +1150,13 @@ int main(int argc, char** argv) {
         perror("unable to stop signal handler");
 
 destroy:
-    fuse_destroy(fuse);
+    fuse_session_destroy(session);
+    for (i = 0; clones != NULL && i < nworkers - 1; i++)
+        if (clones[i]) fuse_chan_destroy(clones[i]);
+    free(clones);
 end:
     netpipefs_opt_free(&args);
     free(netpipefs_options.mountpoint);
 
     return ret != 0 ? EXIT_FAILURE:EXIT_SUCCESS;
-}
\ No newline at end of file
+}
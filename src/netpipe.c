@@ -1,20 +1,59 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 #include "../include/netpipe.h"
 #include "../include/utils.h"
 #include "../include/netpipefs_socket.h"
 #include "../include/scfiles.h"
+#include "../include/waitq.h"
+#include "../include/fanout.h"
+#include "../include/relay.h"
 
 #define NOT_OPEN (-1)
 
 /** How many bytes can be sent to the remote host */
 #define available_remote(file) ((file)->remotemax - (file)->remotesize)
 
-extern struct netpipefs_socket netpipefs_socket;
+/**
+ * The last writer must wait before closing: until the buffer is flushed or, if it sent early and no reader
+ * opened yet, until a reader takes the data
+ */
+#define close_waits(file) ((file)->readers > 0 ? !flushed(file) \
+    : (file)->early && (!flushed(file) || (file)->remotesize > 0))
+
+/** How many bytes were spilled into the spool file and are sent after the buffer */
+#define spooled(file) ((file)->spool != NULL ? spool_size((file)->spool) : 0)
+
+/** Nothing written is waiting to be sent, neither into the buffer nor into the spool */
+#define flushed(file) (cbuf_empty((file)->buffer) && spooled(file) == 0)
+
+/** How many bytes were written by the writers which were not read yet. The remote readers read up to it */
+#define written_upto(file) ((file)->acked + (file)->remotesize + cbuf_size((file)->buffer) - (file)->zc_ring \
+    + spooled(file))
+
+/** There is at least one writer and one reader, or the writers can send early */
+#define can_transfer(file) ((file)->writers > 0 && ((file)->readers > 0 || (file)->early))
+
+/** The netpipe which is read locally: the read half of a full-duplex netpipe, otherwise the file itself */
+#define read_half(file) ((file)->rdhalf != NULL ? (file)->rdhalf : (file))
+
+/** The file into the open files table: the one which owns the given read half, otherwise the file itself */
+#define owner_of(file) ((file)->wrhalf != NULL ? (file)->wrhalf : (file))
+
+/** How many bytes of the local buffer were not sent yet */
+#define unsent_locally(file) (cbuf_size((file)->buffer) - (file)->zc_ring)
+
+/** Length of the payload, sent before each message */
+#define MSG_HEADER sizeof(uint32_t)
+
 
 /** Linked list of poll handles */
 struct poll_handle {
@@ -22,13 +61,37 @@ struct poll_handle {
     struct poll_handle *next;
 };
 
-/** Netpipe read or write request */
+/** Urgent message received, into a linked list */
+struct netpipe_urgent {
+    size_t size;
+    struct netpipe_urgent *next;
+    char data[];
+};
+
+/** Netpipe open, close, read or write request */
 typedef struct netpipe_req {
+    struct netpipe *file;
+    int mode;
     char *buf;
     size_t bytes_processed;
     size_t size;
+    size_t initial; // bytes already processed before the request was queued
+    size_t header;  // bytes processed which are not data of the caller
+    size_t min;     // a read is completed when initial + bytes_processed reaches it
+    struct timespec deadline; // when a read which has less than min bytes is completed anyway
+    int timed;      // the deadline is set
+    int datasync;   // an fsync which waits for the data to be sent, not read
     int error;
-    pthread_cond_t waiting;
+    char *copy;     // buffer owned by the request, if any
+    netpipe_done_t done; // called when the request is done
+    void *arg;           // argument passed to done
+    netpipe_splice_t splice; // if not NULL, used to move data from the socket to the reader
+    int (*remove_open_file)(struct netpipe *); // used by close requests
+    void (*poll_notify)(void *);           // used by close requests
+    unsigned int zc_pending;  // MSG_ZEROCOPY sends of the buffer not completed yet
+    int parked;               // the request is done but the kernel still uses its buffer
+    int discarded;            // a close which gave up on the data left: it closes but it fails
+    waitq_node_t waiting;     // completed when the request is done
     struct netpipe_req *next; // next request
 } netpipe_req_t;
 
@@ -37,9 +100,78 @@ typedef struct netpipe_req_l {
     netpipe_req_t *tail;   // last request
 } netpipe_req_l;
 
+/** Used by the blocking operations to wait for their asynchronous version */
+struct netpipe_sync {
+    waitq_node_t node;
+    ssize_t bytes;
+    int error;
+};
+
 /** Loop for each request */
 #define foreach_request(file, req) for((req) = ((file)->req_l)->head; (req) != NULL; (req) = (req)->next)
 
+/** The request which has the given node */
+#define request_of(node) ((netpipe_req_t *) ((char *) (node) - offsetof(netpipe_req_t, waiting)))
+
+static void netpipe_data_done(waitq_node_t *node);
+static void netpipe_open_done(waitq_node_t *node);
+static void netpipe_close_done(waitq_node_t *node);
+static int netpipe_close_unlock(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *));
+static int netpipe_release_unlock(struct netpipe *file, int (*remove_open_file)(struct netpipe *));
+static size_t send_data(struct netpipe *file, waitq_wakelist_t *wakelist);
+
+/**
+ * Allocates a new request. The callback is called when the request is completed.
+ *
+ * @param file the file
+ * @param mode open mode
+ * @param done function called with the result of the request
+ * @param arg argument passed to done
+ * @param callback function called on completion
+ * @return the request, NULL on error and it sets errno
+ */
+static netpipe_req_t *netpipe_new_request(struct netpipe *file, int mode, netpipe_done_t done, void *arg, void (*callback)(waitq_node_t *)) {
+    netpipe_req_t *new_req = (netpipe_req_t *) malloc(sizeof(netpipe_req_t));
+    if (new_req == NULL) return NULL;
+
+    new_req->file = file;
+    new_req->mode = mode;
+    new_req->size = 0;
+    new_req->buf = NULL;
+    new_req->bytes_processed = 0;
+    new_req->initial = 0;
+    new_req->header = 0;
+    new_req->min = 0;
+    new_req->timed = 0;
+    new_req->datasync = 0;
+    new_req->error = 0;
+    new_req->copy = NULL;
+    new_req->done = done;
+    new_req->arg = arg;
+    new_req->splice = NULL;
+    new_req->remove_open_file = NULL;
+    new_req->poll_notify = NULL;
+    new_req->zc_pending = 0;
+    new_req->parked = 0;
+    new_req->discarded = 0;
+    new_req->next = NULL;
+    waitq_node_init_callback(&(new_req->waiting), callback);
+
+    return new_req;
+}
+
+/**
+ * Add the given request to the end of the list of pending requests.
+ *
+ * @param file the file to which the request will be added
+ * @param req the request, allocated by netpipe_new_request() with the netpipe_data_done callback
+ */
+static void netpipe_append_request(struct netpipe *file, netpipe_req_t *req) {
+    if ((file->req_l)->tail != NULL) ((file->req_l)->tail)->next = req;
+    (file->req_l)->tail = req;
+    if ((file->req_l)->head == NULL) (file->req_l)->head = req;
+}
+
 /**
  * Add a new read or write request to the given file.
  *
@@ -47,47 +179,242 @@ typedef struct netpipe_req_l {
  * @param buf request's buffer
  * @param size how many bytes should be processed
  * @param mode if O_RDONLY then the request is a read request. If O_WRONLY then the request is write request
+ * @param done function called with the result of the request
+ * @param arg argument passed to done
  * @return the request added, NULL on error and it sets errno
  */
-static netpipe_req_t *netpipe_add_request(struct netpipe *file, char *buf, size_t size, int mode) {
-    int err;
-    netpipe_req_t *new_req = (netpipe_req_t *) malloc(sizeof(netpipe_req_t));
+static netpipe_req_t *netpipe_add_request(struct netpipe *file, char *buf, size_t size, int mode, netpipe_done_t done, void *arg) {
+    netpipe_req_t *new_req = netpipe_new_request(file, mode, done, arg, &netpipe_data_done);
     if (new_req == NULL) return NULL;
 
     new_req->size = size;
     new_req->buf = buf;
-    new_req->bytes_processed = 0;
-    new_req->error = 0;
+    netpipe_append_request(file, new_req);
 
-    if ((err = pthread_cond_init(&(new_req->waiting), NULL)) != 0) {
-        errno = err;
-        free(new_req);
-        return NULL;
+    return new_req;
+}
+
+/**
+ * Remove the given request from the list of pending requests without completing it.
+ *
+ * @param file the file which has the request
+ * @param req the request to be removed
+ */
+static void netpipe_remove_request(struct netpipe *file, netpipe_req_t *req) {
+    netpipe_req_t *prev = NULL, *curr;
+
+    foreach_request(file, curr) {
+        if (curr == req) {
+            if (prev == NULL) (file->req_l)->head = curr->next;
+            else prev->next = curr->next;
+            if ((file->req_l)->tail == curr) (file->req_l)->tail = prev;
+            return;
+        }
+        prev = curr;
     }
+}
 
-    // add to the end of the list
-    new_req->next = NULL;
-    if ((file->req_l)->tail != NULL) ((file->req_l)->tail)->next = new_req;
-    (file->req_l)->tail = new_req;
-    if ((file->req_l)->head == NULL) (file->req_l)->head = new_req;
+/**
+ * Pop the first pending request and add it to the wake list. Its waiter will be woken up when
+ * the wake list is processed, that is after the file lock is released. If the kernel is still
+ * using the request's buffer then it is completed when the zerocopy sends are completed.
+ *
+ * @param file the file which has the request
+ * @param wakelist list of requests that will be woken up
+ * @return the next pending request
+ */
+static netpipe_req_t *netpipe_complete_head(struct netpipe *file, waitq_wakelist_t *wakelist) {
+    netpipe_req_l *req_list = file->req_l;
+    netpipe_req_t *req = req_list->head;
 
-    return new_req;
+    req_list->head = req->next;
+    if (req_list->tail == req) req_list->tail = NULL;
+    if (req->zc_pending > 0) req->parked = 1;
+    else waitq_defer(wakelist, &(req->waiting));
+
+    return req_list->head;
+}
+
+/**
+ * Complete all the pending requests with the given error.
+ *
+ * @param file the file which has the requests
+ * @param error error set to each request
+ * @param wakelist list of requests that will be woken up
+ */
+static void netpipe_complete_all(struct netpipe *file, int error, waitq_wakelist_t *wakelist) {
+    netpipe_req_t *req = (file->req_l)->head;
+
+    while (req != NULL) {
+        req->error = error;
+        req = netpipe_complete_head(file, wakelist);
+    }
+}
+
+/**
+ * Complete all the requests of the given list with the given error.
+ *
+ * @param list list of open or close requests
+ * @param error error set to each request
+ * @param wakelist list of requests that will be completed
+ */
+static void netpipe_complete_list(netpipe_req_t **list, int error, waitq_wakelist_t *wakelist) {
+    netpipe_req_t *req;
+
+    while ((req = *list) != NULL) {
+        *list = req->next;
+        req->error = error;
+        waitq_defer(wakelist, &(req->waiting));
+    }
+}
+
+/** Revert the open with the given mode */
+static void netpipe_undo_open(struct netpipe *file, int mode) {
+    if (mode == O_RDONLY) {
+        file->readers--;
+        if (file->readers == 0) file->open_mode = NOT_OPEN; // revert to unopen
+    } else if (mode == O_WRONLY || mode == O_RDWR) {
+        file->writers--;
+        if (mode == O_RDWR) file->rdhalf->readers--;
+        if (file->writers == 0) file->open_mode = NOT_OPEN; // revert to unopen
+    }
 }
 
 /**
- * Destroy pending request
+ * Complete all the requests waiting for at least one reader and one writer. If the error is not zero
+ * then each open is reverted.
  *
- * @param req the request to be destroyed
- * @return 0 on success, -1 on error
+ * @param file the file
+ * @param error error set to each request
+ * @param wakelist list of requests that will be completed
  */
-static int netpipe_destroy_request(netpipe_req_t *req) {
-    int err, ret = 0;
-    if ((err = pthread_cond_destroy(&(req->waiting))) != 0) { errno = err; ret = -1; }
+static void netpipe_complete_opens(struct netpipe *file, int error, waitq_wakelist_t *wakelist) {
+    netpipe_req_t *req;
+
+    if (error) {
+        for (req = file->open_reqs; req != NULL; req = req->next)
+            netpipe_undo_open(file, req->mode);
+    }
+    netpipe_complete_list(&(file->open_reqs), error, wakelist);
+}
+
+/** Called when a read or write request is completed */
+static void netpipe_data_done(waitq_node_t *node) {
+    netpipe_req_t *req = request_of(node);
+    netpipe_done_t done = req->done;
+    void *arg = req->arg;
+    size_t processed = req->initial + req->bytes_processed;
+    ssize_t bytes = processed > req->header ? processed - req->header : 0;
+    int error = 0;
+
+    if (bytes == 0 && req->mode == O_WRONLY) {
+        bytes = -1;
+        error = req->error ? req->error : EPIPE;
+    } else if (bytes == 0 && req->error && req->error != EPIPE) { // EPIPE on read means end of file
+        bytes = -1;
+        error = req->error;
+    }
+
+    free(req->copy);
     free(req);
-    return ret;
+    done(arg, bytes, error);
+}
+
+/** Called when there is at least one reader and one writer, when the open fails or when an fsync is completed */
+static void netpipe_open_done(waitq_node_t *node) {
+    netpipe_req_t *req = request_of(node);
+    netpipe_done_t done = req->done;
+    void *arg = req->arg;
+    int error = req->error;
+
+    free(req);
+    done(arg, error ? -1 : 0, error);
+}
+
+/** Called when the buffer is flushed. The close is finished by the thread which completes the request */
+static void netpipe_close_done(waitq_node_t *node) {
+    netpipe_req_t *req = request_of(node);
+    netpipe_done_t done = req->done;
+    void *arg = req->arg;
+    int ret = -1, error = req->error;
+
+    // on error the file may be already freed
+    if (!error) {
+        if (netpipe_lock(req->file) != 0) error = errno;
+        else if ((ret = netpipe_close_unlock(req->file, req->mode, req->remove_open_file, req->poll_notify)) == -1) error = errno;
+        else if (req->discarded) {
+            ret = -1;
+            error = ETIMEDOUT;
+        }
+    }
+
+    free(req);
+    done(arg, ret, error);
+}
+
+static void netpipe_sync_init(struct netpipe_sync *sync) {
+    waitq_node_init(&(sync->node));
+    sync->bytes = 0;
+    sync->error = 0;
+}
+
+static void netpipe_sync_done(void *arg, ssize_t bytes, int error) {
+    struct netpipe_sync *sync = (struct netpipe_sync *) arg;
+    sync->bytes = bytes;
+    sync->error = error;
+    waitq_wake(&(sync->node));
+}
+
+/**
+ * Wait until the asynchronous operation is done. If busy polling is enabled and file is
+ * not NULL then the waiter spins for a while before it blocks.
+ *
+ * @param sync the operation
+ * @param file the file whose spin state is used or NULL to block immediately
+ * @return the result of the operation, -1 on error and it sets errno
+ */
+static ssize_t netpipe_sync_wait(struct netpipe_sync *sync, struct netpipe *file) {
+    int err;
+
+    if (file != NULL) err = waitq_wait_spin(&(sync->node), &(file->spin), file->skt->busypoll * 1000L);
+    else err = waitq_wait(&(sync->node));
+    if (err == -1) return -1;
+
+    if (sync->bytes == -1) errno = sync->error;
+    return sync->bytes;
+}
+
+/** Fan-out netpipe and relay which use the file */
+struct netpipe_users {
+    struct fanout *fanout;
+    struct relay *relay;
+};
+
+/**
+ * Take a reference to the fan-out netpipe and to the relay which use the file, so that they can be notified
+ * after the file lock is released. The caller must hold the file lock.
+ */
+static void netpipe_users_hold(struct netpipe *file, struct netpipe_users *users) {
+    users->fanout = file->fanout;
+    users->relay = file->relay;
+    if (users->fanout != NULL) netpipefs_fanout_ref(users->fanout);
+    if (users->relay != NULL) netpipefs_relay_ref(users->relay);
+}
+
+/** Notify the users taken by netpipe_users_hold() and drop their references */
+static void netpipe_users_notify(struct netpipe_users *users) {
+    if (users->fanout != NULL) netpipefs_fanout_notify(users->fanout);
+    if (users->relay != NULL) netpipefs_relay_notify(users->relay);
 }
 
-struct netpipe *netpipe_alloc(const char *path) {
+/** Give back to the connection the credit granted early, because a reader took it or nobody will */
+static void early_release(struct netpipe *file) {
+    if (file->early_granted == 0) return;
+    __atomic_sub_fetch(&(file->skt->early_used), file->early_granted, __ATOMIC_ACQ_REL);
+    file->early_granted = 0;
+}
+
+struct netpipe *netpipe_alloc(const char *path, struct netpipefs_socket *skt) {
     int err;
     struct netpipe *file = (struct netpipe *) malloc(sizeof(struct netpipe));
     EQNULL(file, return NULL)
@@ -113,40 +440,73 @@ struct netpipe *netpipe_alloc(const char *path) {
         return NULL;
     }
 
-    if ((err = pthread_cond_init(&(file->canopen), NULL)) != 0) {
-        errno = err;
-        goto error;
-    }
-
-    if ((err = pthread_cond_init(&(file->close), NULL)) != 0) {
-        errno = err;
-        pthread_cond_destroy(&(file->canopen));
-        goto error;
-    }
-
     file->buffer = cbuf_alloc(0);
+    file->spool = NULL;
+    file->spool_failed = 0;
+    file->hash = 0;
+    file->next = NULL;
+    file->nlookup = 0;
     file->open_mode = NOT_OPEN;
     file->force_exit = 0;
     file->writers = 0;
     file->readers = 0;
-    file->remotemax = netpipefs_socket.remote_readahead;
+    file->skt = skt;
+    file->readahead = skt->readahead;
+    file->remote_readahead = skt->remote_readahead;
+    file->remotemax = skt->remote_readahead;
     file->remotesize = 0;
+    file->acked = 0;
     file->poll_handles = NULL;
+    file->open_reqs = NULL;
+    file->close_reqs = NULL;
+    file->fsync_reqs = NULL;
+    file->spin = (waitq_spin_t) WAITQ_SPIN_INIT;
+    file->zc_ring = 0;
+    file->zc_pending = 0;
+    file->zc_release = 0;
+    file->zc_remove_open_file = NULL;
+    file->fanout = NULL;
+    file->relay = NULL;
+    file->messages = 0;
+    file->granted = 0;
+    file->readmin = skt->readmin > 0 ? skt->readmin : DEFAULT_READMIN;
+    file->readtime = skt->readtime;
+    file->delimiter = -1;
+    file->delim_scanned = 0;
+    file->delim_last = 0;
+    file->group = 0;
+    file->unit_last = 0;
+    file->early = 0;
+    file->early_granted = 0;
+    file->provisioned = NOT_OPEN;
+    file->rdhalf = NULL;
+    file->wrhalf = NULL;
+    file->urgent = NULL;
+    file->nurgent = 0;
 
     return file;
+}
 
-error:
-    free(file->req_l);
-    free((void*) file->path);
-    pthread_mutex_destroy(&(file->mtx));
-    free(file);
-    return NULL;
+/** Discard the urgent messages which were not read */
+static void urgent_drop(struct netpipe *file) {
+    struct netpipe_urgent *msg;
+
+    while ((msg = file->urgent) != NULL) {
+        file->urgent = msg->next;
+        free(msg);
+    }
+    file->nurgent = 0;
 }
 
 int netpipe_free(struct netpipe *file, void (*poll_destroy)(void *)) {
     int ret = 0, err;
 
+    early_release(file);
+    urgent_drop(file);
+    if (file->rdhalf != NULL) MINUS1(netpipe_free(file->rdhalf, NULL), ret = -1)
+
     cbuf_free(file->buffer);
+    spool_free(file->spool);
     free((void*) file->path);
 
     struct poll_handle *ph = file->poll_handles;
@@ -158,19 +518,15 @@ int netpipe_free(struct netpipe *file, void (*poll_destroy)(void *)) {
         free(oldph);
     }
 
-    /* free pending requests */
-    netpipe_req_t *req = (file->req_l)->head;
-    netpipe_req_t *oldreq;
-    while(req != NULL) {
-        oldreq = req;
-        req = req->next;
-        if (netpipe_destroy_request(oldreq) == -1) ret = -1;
-    }
-    file->req_l->head = NULL;
+    /* pending requests belong to who is waiting for them: complete them with an error */
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
+    netpipe_complete_all(file, EPIPE, &wakelist);
+    netpipe_complete_list(&(file->open_reqs), EPIPE, &wakelist);
+    netpipe_complete_list(&(file->close_reqs), EPIPE, &wakelist);
+    netpipe_complete_list(&(file->fsync_reqs), EPIPE, &wakelist);
+    waitq_wake_all(&wakelist);
     free(file->req_l);
 
-    if ((err = pthread_cond_destroy(&(file->canopen))) != 0) { errno = err; ret = -1; }
-    if ((err = pthread_cond_destroy(&(file->close))) != 0) { errno = err; ret = -1; }
     if ((err = pthread_mutex_destroy(&(file->mtx))) != 0) { errno = err; ret = -1; }
 
     free(file);
@@ -179,121 +535,212 @@ int netpipe_free(struct netpipe *file, void (*poll_destroy)(void *)) {
 }
 
 int netpipe_lock(struct netpipe *file) {
-    int err = pthread_mutex_lock(&(file->mtx));
+    int err = pthread_mutex_lock(&(owner_of(file)->mtx));
     if (err != 0) errno = err;
     return err;
 }
 
 int netpipe_unlock(struct netpipe *file) {
-    int err = pthread_mutex_unlock(&(file->mtx));
+    int err = pthread_mutex_unlock(&(owner_of(file)->mtx));
     if (err != 0) errno = err;
     return err;
 }
 
-int netpipe_open(struct netpipe *file, int mode, int nonblock) {
-    int err, bytes;
+/**
+ * Give the file a read half, so that it is full-duplex. A file which is already used in one direction cannot
+ * become full-duplex. The caller must hold the file lock.
+ *
+ * @return 0 on success, -1 on error and it sets errno
+ */
+static int duplex_attach(struct netpipe *file) {
+    struct netpipe *half;
 
-    /* both read and write access is not allowed */
-    if (mode == O_RDWR) {
+    if (file->rdhalf != NULL) return 0;
+    if (file->readers > 0 || file->writers > 0 || !flushed(file) || file->relay != NULL
+        || file->fanout != NULL || file->provisioned != NOT_OPEN) {
         errno = EPERM;
         return -1;
     }
 
+    EQNULL(half = netpipe_alloc(file->path, file->skt), return -1)
+    half->wrhalf = file;
+    half->open_mode = O_RDONLY;
+    half->nlookup = 1; // it is freed with the file which owns it
+    file->rdhalf = half;
+    DEBUG("duplex[%s]\n", file->path);
+
+    return 0;
+}
+
+int netpipe_open_async(struct netpipe *file, int mode, int nonblock, netpipe_done_t done, void *arg) {
+    int bytes, messages = mode & NETPIPE_MESSAGES;
+    netpipe_req_t *req;
+
+    mode &= ~NETPIPE_MESSAGES;
+    if (mode != O_WRONLY) messages = 0;
+
     NOTZERO(netpipe_lock(file), return -1)
 
     if (file->force_exit) {
         errno = ENOENT;
+        netpipe_unlock(file);
         return -1;
     }
 
     if (file->open_mode != NOT_OPEN && file->open_mode != mode) {
         errno = EPERM;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    if (file->relay != NULL) {
+        errno = EBUSY;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    if (file->provisioned != NOT_OPEN && file->provisioned != mode) {
+        errno = EACCES;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    /* The writers must agree on the boundaries of the data */
+    if (mode == O_WRONLY && file->writers > 0 && file->messages != (messages != 0)) {
+        errno = EINVAL;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    /* A full-duplex netpipe is open only with O_RDWR locally, but the remote host can use it in one direction */
+    if ((mode == O_RDWR && duplex_attach(file) == -1) || (mode != O_RDWR && file->rdhalf != NULL)) {
+        if (mode != O_RDWR) errno = EPERM;
+        netpipe_unlock(file);
         return -1;
     }
 
-    /* Update readers and writers */
+    /* Update readers and writers. The reader takes what was sent early */
     if (mode == O_RDONLY) file->readers++;
     else if (mode == O_WRONLY) file->writers++;
+    else { // this host writes the file and reads its read half
+        file->writers++;
+        file->rdhalf->readers++;
+    }
+    if (mode == O_RDONLY) early_release(file);
+    // the reader's host already gave the window of a provisioned netpipe
+    if (mode == O_WRONLY && file->provisioned == O_WRONLY && file->readers == 0) file->early = 1;
 
-    if (nonblock && (file->readers == 0 || file->writers == 0)) {
+    if (nonblock && !can_transfer(file)) {
         errno = EAGAIN;
         goto undo_open;
     }
 
-    /* Notify who's waiting for readers/writers */
-    PTH(err, pthread_cond_broadcast(&(file->canopen)), goto undo_open)
-
-    bytes = send_open_message(&netpipefs_socket, file->path, mode);
+    bytes = send_open_message(file->skt, file->path, mode | messages);
     if (bytes <= 0) { // cannot write over socket
         goto undo_open;
     }
 
     file->open_mode = mode;
-    /* Wait for at least one writer and one reader */
-    while (!file->force_exit && (file->readers == 0 || file->writers == 0)) {
-        PTH(err, pthread_cond_wait(&(file->canopen), &(file->mtx)), goto undo_open)
-    }
+    if (mode == O_WRONLY) file->messages = messages != 0;
+    DEBUGFILE(file);
 
-    if (file->force_exit) {
-        errno = ENOENT;
-        goto undo_open;
+    /* Wait for at least one writer and one reader */
+    if (!can_transfer(file)) {
+        req = netpipe_new_request(file, mode, done, arg, &netpipe_open_done);
+        if (req == NULL) goto undo_open;
+        req->next = file->open_reqs;
+        file->open_reqs = req;
+
+        NOTZERO(netpipe_unlock(file), return -1)
+        return 0;
     }
 
-    DEBUGFILE(file);
-
     NOTZERO(netpipe_unlock(file), goto undo_open)
+    done(arg, 0, 0);
 
     return 0;
 
 undo_open:
-    if (mode == O_RDONLY) {
-        file->readers--;
-        if (file->readers == 0) file->open_mode = NOT_OPEN; // revert to unopen
-    } else if (mode == O_WRONLY) {
-        file->writers--;
-        if (file->writers == 0) file->open_mode = NOT_OPEN; // revert to unopen
-    }
+    netpipe_undo_open(file, mode);
     netpipe_unlock(file);
 
     return -1;
 }
 
-int netpipe_open_update(struct netpipe *file, int mode) {
-    int err;
-    size_t buffer_capacity;
+int netpipe_open(struct netpipe *file, int mode, int nonblock) {
+    struct netpipe_sync sync;
+    netpipe_sync_init(&sync);
 
-    if (mode == O_RDWR) {
-        errno = EPERM;
-        return -1;
-    }
+    MINUS1(netpipe_open_async(file, mode, nonblock, &netpipe_sync_done, &sync), return -1)
 
-    NOTZERO(netpipe_lock(file), return -1)
+    return netpipe_sync_wait(&sync, NULL);
+}
+
+/**
+ * Count a remote reader or writer of the file. The caller must hold the file lock.
+ *
+ * @param file the file or the read half which the remote host opened
+ * @param mode O_RDONLY or O_WRONLY
+ * @param messages the remote writer writes messages
+ * @param wakelist completed requests are added to this list
+ * @return 0 on success, -1 on error and it sets errno
+ */
+static int open_update_locked(struct netpipe *file, int mode, int messages, waitq_wakelist_t *wakelist) {
+    size_t buffer_capacity;
 
     if (mode == O_RDONLY) file->readers++;
-    else if (mode == O_WRONLY) file->writers++;
+    else if (mode == O_WRONLY && file->writers++ == 0) file->messages = messages;
+    if (mode == O_RDONLY) file->early = 0;
 
-    /* Alloc buffer */
-    buffer_capacity = mode == O_WRONLY ? netpipefs_options.readahead : netpipefs_options.writeahead;
-    if (cbuf_capacity(file->buffer) == 0 && buffer_capacity > 0) {
+    /* Alloc buffer. With messages it can hold a whole message besides the readahead */
+    buffer_capacity = mode == O_WRONLY ? file->readahead : file->skt->writeahead;
+    if (mode == O_WRONLY && file->messages) buffer_capacity += NETPIPE_MSG_MAX + MSG_HEADER;
+    if (cbuf_capacity(file->buffer) < buffer_capacity && cbuf_empty(file->buffer)) {
         cbuf_free(file->buffer);
         file->buffer = cbuf_alloc(buffer_capacity);
-        if (file->buffer == NULL) goto undo_open;
+        if (file->buffer == NULL) {
+            if (mode == O_RDONLY) file->readers--;
+            else if (mode == O_WRONLY) file->writers--;
+            return -1;
+        }
     }
 
     DEBUGFILE(file);
 
-    PTH(err, pthread_cond_broadcast(&(file->canopen)), netpipe_unlock(file); goto undo_open)
-
-    NOTZERO(netpipe_unlock(file), goto undo_open)
+    /* Complete who's waiting for readers/writers */
+    if (file->readers > 0 && file->writers > 0)
+        netpipe_complete_opens(file, 0, wakelist);
+    // the last writer was waiting for a reader to take what it sent early
+    if (file->close_reqs != NULL && !close_waits(file))
+        netpipe_complete_list(&(file->close_reqs), 0, wakelist);
 
     return 0;
+}
 
-undo_open:
-    if (mode == O_RDONLY) file->readers--;
-    else if (mode == O_WRONLY) file->writers--;
+int netpipe_open_update(struct netpipe *file, int mode) {
+    int err, messages = (mode & NETPIPE_MESSAGES) != 0;
+    struct netpipe_users users;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
 
-    netpipe_unlock(file);
-    return -1;
+    mode &= ~NETPIPE_MESSAGES;
+
+    NOTZERO(netpipe_lock(file), return -1)
+
+    // the remote host reads the file and writes its read half
+    if (mode == O_RDWR) {
+        err = duplex_attach(file);
+        if (err == 0) err = open_update_locked(file, O_RDONLY, 0, &wakelist);
+        if (err == 0 && (err = open_update_locked(file->rdhalf, O_WRONLY, 0, &wakelist)) == -1) file->readers--;
+    } else {
+        err = open_update_locked(mode == O_WRONLY ? read_half(file) : file, mode, messages, &wakelist);
+    }
+    netpipe_users_hold(file, &users);
+
+    NOTZERO(netpipe_unlock(file), waitq_wake_all(&wakelist); return -1)
+    waitq_wake_all(&wakelist);
+    netpipe_users_notify(&users);
+
+    return err;
 }
 
 /**
@@ -309,7 +756,7 @@ static int do_send(struct netpipe *file, char *bufptr, size_t size, size_t *byte
     *bytes_sent = size < available_remote(file) ? size : available_remote(file);
     if (*bytes_sent == 0) return 1;
 
-    bytes = send_write_message(&netpipefs_socket, file->path, bufptr, *bytes_sent);
+    bytes = send_write_message(file->skt, file->path, bufptr, *bytes_sent);
     if (bytes <= 0) return bytes;
 
     *bytes_sent = bytes;
@@ -319,21 +766,139 @@ static int do_send(struct netpipe *file, char *bufptr, size_t size, size_t *byte
 }
 
 /**
- * Flush data which means that data available from local file buffer is sent to the host.
+ * Unlock the file. If the file was released while the kernel was using its data, then it is released now.
  *
- * @param file the file to be flushed
+ * @return 0 on success, -1 on error and it sets errno
+ */
+static int netpipe_zc_unlock(struct netpipe *file) {
+    if (file->zc_pending == 0 && file->zc_release) {
+        file->zc_release = 0;
+        return netpipe_release_unlock(file, file->zc_remove_open_file);
+    }
+
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+}
+
+/** Called when the kernel doesn't use anymore the data of a request sent with MSG_ZEROCOPY */
+static void netpipe_zc_req_done(void *arg, size_t size) {
+    netpipe_req_t *req = (netpipe_req_t *) arg;
+    struct netpipe *file = req->file;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
+
+    NOTZERO(netpipe_lock(file), perror("zerocopy completion"); return)
+
+    req->zc_pending--;
+    file->zc_pending--;
+    if (req->parked && req->zc_pending == 0)
+        waitq_defer(&wakelist, &(req->waiting));
+
+    MINUS1(netpipe_zc_unlock(file), perror("zerocopy completion"))
+    waitq_wake_all(&wakelist);
+}
+
+/** Called when the kernel doesn't use anymore the data of the buffer sent with MSG_ZEROCOPY */
+static void netpipe_zc_ring_done(void *arg, size_t size) {
+    struct netpipe *file = (struct netpipe *) arg;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
+
+    NOTZERO(netpipe_lock(file), perror("zerocopy completion"); return)
+
+    cbuf_drop(file->buffer, size);
+    file->zc_ring -= size;
+    file->zc_pending--;
+
+    // who is closing was waiting for the buffer to be flushed
+    if (flushed(file)) netpipe_complete_list(&(file->close_reqs), 0, &wakelist);
+    // the spool and the pending requests can be moved into the buffer
+    if (!file->force_exit && (file->readers > 0 || file->early)) send_data(file, &wakelist);
+
+    MINUS1(netpipe_zc_unlock(file), perror("zerocopy completion"))
+    waitq_wake_all(&wakelist);
+}
+
+/**
+ * Like do_send() but data of the given pending request is sent with MSG_ZEROCOPY if it is large enough.
+ * In that case the request is not completed until the kernel doesn't use its buffer anymore.
+ *
+ * @param file the file
+ * @param req the request which owns the data
  * @param bytes_sent will be set with how many bytes were sent
  * @return 1 on success and it sets datasent, 0 if connection was lost, -1 on error
  */
-static int do_flush(struct netpipe *file, size_t *bytes_sent) {
-    int bytes;
-    size_t available_locally;
+static int do_send_req(struct netpipe *file, netpipe_req_t *req, char *bufptr, size_t size, size_t *bytes_sent) {
+    int bytes, pending = 0;
 
-    available_locally = cbuf_size(file->buffer);
-    *bytes_sent = available_locally < available_remote(file) ? available_locally : available_remote(file);
+    *bytes_sent = size < available_remote(file) ? size : available_remote(file);
     if (*bytes_sent == 0) return 1;
 
-    bytes = send_flush_message(&netpipefs_socket, file, *bytes_sent);
+    if (file->skt->zerocopy > 0 && *bytes_sent >= file->skt->zerocopy) {
+        bytes = send_write_message_zc(file->skt, file->path, bufptr, *bytes_sent, &netpipe_zc_req_done, req, &pending);
+        if (pending) {
+            req->zc_pending++;
+            file->zc_pending++;
+        }
+    } else {
+        bytes = send_write_message(file->skt, file->path, bufptr, *bytes_sent);
+    }
+    if (bytes <= 0) return bytes;
+
+    *bytes_sent = bytes;
+    file->remotesize += *bytes_sent;
+
+    return 1;
+}
+
+/**
+ * Like do_send() but data is spliced from the given pipe.
+ *
+ * @param file the file
+ * @param bytes_sent will be set with how many bytes were sent
+ * @return 1 on success and it sets datasent, 0 if connection was lost, -1 on error
+ */
+static int do_send_fd(struct netpipe *file, int fd, size_t size, size_t *bytes_sent) {
+    int bytes;
+
+    *bytes_sent = size < available_remote(file) ? size : available_remote(file);
+    if (*bytes_sent == 0) return 1;
+
+    bytes = send_splice_message(file->skt, file->path, fd, *bytes_sent);
+    if (bytes <= 0) return bytes;
+
+    *bytes_sent = bytes;
+    file->remotesize += *bytes_sent;
+
+    return 1;
+}
+
+/**
+ * Flush data which means that data available from local file buffer is sent to the host.
+ *
+ * @param file the file to be flushed
+ * @param bytes_sent will be set with how many bytes were sent
+ * @return 1 on success and it sets datasent, 0 if connection was lost, -1 on error
+ */
+static int do_flush(struct netpipe *file, size_t *bytes_sent) {
+    int bytes, pending = 0;
+    size_t available_locally;
+
+    available_locally = unsent_locally(file);
+    *bytes_sent = available_locally < available_remote(file) ? available_locally : available_remote(file);
+    if (*bytes_sent == 0) return 1;
+
+    // Data still used by the kernel is at the beginning of the buffer, so what is sent after it must be removed after it
+    if (file->zc_ring > 0 || (file->skt->zerocopy > 0 && *bytes_sent >= file->skt->zerocopy)) {
+        bytes = send_flush_message_zc(file->skt, file, file->zc_ring, *bytes_sent, file->zc_ring > 0,
+                                      &netpipe_zc_ring_done, file, &pending);
+        if (pending) {
+            file->zc_pending++;
+            if (bytes > 0) file->zc_ring += bytes;
+        } else if (bytes > 0) {
+            cbuf_drop(file->buffer, bytes);
+        }
+    } else {
+        bytes = send_flush_message(file->skt, file, *bytes_sent);
+    }
     if (bytes <= 0) return bytes;
 
     *bytes_sent = bytes;
@@ -349,7 +914,7 @@ static int do_flush(struct netpipe *file, size_t *bytes_sent) {
  * @param poll_notify function used to notify
  */
 static void loop_poll_notify(struct netpipe *file, void (*poll_notify)(void *)) {
-    struct poll_handle *currph = file->poll_handles;
+    struct poll_handle *currph = owner_of(file)->poll_handles; // the read half is polled through its owner
     struct poll_handle *oldph;
     while(currph) {
         if (poll_notify) poll_notify(currph->ph); // caller should free currph->ph
@@ -357,32 +922,412 @@ static void loop_poll_notify(struct netpipe *file, void (*poll_notify)(void *))
         currph = currph->next;
         free(oldph);
     }
-    file->poll_handles = NULL;
+    owner_of(file)->poll_handles = NULL;
 }
 
-ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int nonblock) {
+/** How many bytes can be spilled into the spool. It is drained through the buffer, so there must be one */
+static size_t spill_space(struct netpipe *file) {
+    if (file->spool == NULL || cbuf_capacity(file->buffer) == 0) return 0;
+    return spool_capacity(file->spool) - spool_size(file->spool);
+}
+
+/**
+ * Create the spool before the first write which doesn't fit into the buffer. The lock is released meanwhile,
+ * because allocating the file may be slow and the dispatcher would wait for it.
+ *
+ * @param size bytes the writer is going to write
+ */
+static void spool_prepare(struct netpipe *file, size_t size) {
+    spool_t *spool;
+
+    NOTZERO(netpipe_lock(file), return)
+    if (file->spool != NULL || file->spool_failed || cbuf_capacity(file->buffer) == 0
+        || cbuf_size(file->buffer) + size <= cbuf_capacity(file->buffer)) {
+        netpipe_unlock(file);
+        return;
+    }
+    netpipe_unlock(file);
+
+    spool = spool_create(file->skt->spooldir, file->skt->spoolmax);
+    if (spool == NULL) DEBUG("spool[%s] %s\n", file->path, strerror(errno));
+
+    NOTZERO(netpipe_lock(file), spool_free(spool); return)
+    if (spool == NULL) file->spool_failed = 1;
+    else if (file->spool == NULL) { // otherwise another writer created it meanwhile
+        file->spool = spool;
+        spool = NULL;
+    }
+    netpipe_unlock(file);
+    spool_free(spool);
+}
+
+/**
+ * Append to the spool the data which doesn't fit into the buffer.
+ *
+ * @param fd if not -1 then data is read from this pipe instead of buf
+ * @return how many bytes were spilled
+ */
+static size_t spill(struct netpipe *file, const char *buf, int fd, size_t size) {
+    ssize_t bytes;
+
+    if (spill_space(file) == 0) return 0;
+    if (fd == -1) return spool_put(file->spool, buf, size);
+    bytes = spool_readn(fd, file->spool, size);
+    return bytes > 0 ? bytes : 0;
+}
+
+/** Move the oldest spilled data into the buffer, until it is full. Returns how many bytes were moved */
+static size_t unspill(struct netpipe *file) {
+    size_t moved = 0, size, bytes;
+    char *data;
+
+    while ((size = spooled(file) > 0 ? spool_peek(file->spool, &data) : 0) > 0) {
+        bytes = cbuf_put(file->buffer, data, size);
+        if (bytes == 0) break;
+        spool_drop(file->spool, bytes);
+        moved += bytes;
+    }
+
+    return moved;
+}
+
+/** How many bytes a write can send, put into the buffer or spill without waiting */
+static size_t send_space(struct netpipe *file) {
+    size_t space = cbuf_capacity(file->buffer) - cbuf_size(file->buffer) + spill_space(file);
+
+    if ((unsent_locally(file) == 0 && spooled(file) == 0) || cbuf_capacity(file->buffer) == 0)
+        space += available_remote(file);
+    return space;
+}
+
+/**
+ * Copy the given data after the header of a message.
+ *
+ * @param fd if not -1 then data is read from this pipe instead of buf
+ * @return the message, NULL on error and it sets errno
+ */
+static char *msg_frame(const char *buf, int fd, size_t size) {
+    uint32_t header = htonl((uint32_t) size);
+    char *msg = (char *) malloc(MSG_HEADER + size);
+    EQNULL(msg, return NULL)
+
+    memcpy(msg, &header, MSG_HEADER);
+    if (fd == -1) {
+        memcpy(msg + MSG_HEADER, buf, size);
+    } else if (readn(fd, msg + MSG_HEADER, size) != (ssize_t) size) {
+        free(msg);
+        errno = EIO;
+        return NULL;
+    }
+
+    return msg;
+}
+
+/**
+ * Get the length of the first message into the buffer.
+ *
+ * @param len will be set with the length of its payload
+ * @return 1 if its header was received, 0 otherwise
+ */
+static int msg_length(struct netpipe *file, size_t *len) {
+    uint32_t header;
+    size_t got = 0, n;
+    char *data;
+
+    if (cbuf_size(file->buffer) < MSG_HEADER) return 0;
+    while (got < MSG_HEADER) {
+        n = cbuf_peek(file->buffer, got, &data);
+        if (n > MSG_HEADER - got) n = MSG_HEADER - got;
+        memcpy((char *) &header + got, data, n);
+        got += n;
+    }
+    *len = ntohl(header);
+
+    return 1;
+}
+
+/** How many bytes of the buffer the first message takes, 0 if it wasn't received whole */
+static size_t msg_ready(struct netpipe *file) {
+    size_t len;
+
+    if (!msg_length(file, &len) || cbuf_size(file->buffer) < MSG_HEADER + len) return 0;
+    return MSG_HEADER + len;
+}
+
+/**
+ * Move the first message from the buffer to buf. What doesn't fit is discarded.
+ *
+ * @param msgsize how many bytes of the buffer the message takes
+ * @return how many bytes were copied
+ */
+static size_t msg_get(struct netpipe *file, char *buf, size_t size, size_t msgsize) {
+    size_t len = msgsize - MSG_HEADER, copied = len < size ? len : size;
+
+    cbuf_drop(file->buffer, MSG_HEADER);
+    cbuf_get(file->buffer, buf, copied);
+    cbuf_drop(file->buffer, len - copied);
+    file->unit_last = msgsize;
+
+    return copied;
+}
+
+/**
+ * Tell the writer that the given bytes were read. Like the writer does, the credit given beyond
+ * the readahead is reduced.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error
+ */
+static int read_ack(struct netpipe *file, size_t size) {
+    file->granted -= size < file->granted ? size : file->granted;
+    return send_read_message(file->skt, file->path, size);
+}
+
+/** How many bytes the pending reads are waiting for */
+static size_t read_pending(struct netpipe *file) {
+    size_t pending = 0;
+    netpipe_req_t *req;
+
+    foreach_request(file, req) pending += req->size - req->bytes_processed;
+    return pending;
+}
+
+/**
+ * Give the writer the credit to send what the pending reads are waiting for.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error
+ */
+static int read_grant(struct netpipe *file) {
+    size_t pending = read_pending(file);
+    int bytes;
+
+    if (file->granted >= pending) return 1;
+
+    bytes = send_read_request_message(file->skt, file->path, pending - file->granted);
+    if (bytes <= 0) return bytes;
+    file->granted = pending;
+
+    return 1;
+}
+
+/**
+ * Make the buffer able to hold what the writer can still send beyond the pending reads. The credit is not
+ * taken back when a read is completed before it has all its bytes, so what the writer sends for it is kept.
+ *
+ * @return 0 on success, -1 on error and it sets errno
+ */
+static int read_reserve(struct netpipe *file) {
+    size_t credit = file->readahead + file->granted, pending = read_pending(file);
+
+    if (credit <= pending + cbuf_capacity(file->buffer)) return 0;
+    MINUS1(cbuf_grow(file->buffer, credit - pending), errno = ENOMEM; return -1)
+
+    return 0;
+}
+
+/**
+ * Start the timer of the given request, which expires after msec milliseconds. The dispatcher calls
+ * netpipe_timeout() when it expires. Without the dispatcher the request keeps waiting.
+ */
+static void timer_arm(struct netpipe *file, netpipe_req_t *req, int msec) {
+    struct netpipefs_timer timer;
+    int fd = __atomic_load_n(&(file->skt->timerfd), __ATOMIC_ACQUIRE);
+
+    if (msec <= 0 || req->timed || fd == -1) return;
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &(req->deadline)), return)
+    req->deadline.tv_sec += msec / 1000;
+    req->deadline.tv_nsec += (msec % 1000) * 1000000L;
+    if (req->deadline.tv_nsec >= 1000000000L) {
+        req->deadline.tv_sec++;
+        req->deadline.tv_nsec -= 1000000000L;
+    }
+    req->timed = 1;
+
+    // the timer is smaller than PIPE_BUF, so it is written whole or not at all. It holds the file into the table
+    timer.file = owner_of(file);
+    timer.deadline = req->deadline;
+    __atomic_add_fetch(&(timer.file->nlookup), 1, __ATOMIC_ACQ_REL);
+    if (write(fd, &timer, sizeof(struct netpipefs_timer)) != sizeof(struct netpipefs_timer)) {
+        DEBUG("timer[%s] lost: %s\n", file->path, strerror(errno));
+        __atomic_sub_fetch(&(timer.file->nlookup), 1, __ATOMIC_ACQ_REL); // the file is open, it isn't released
+        req->timed = 0;
+    }
+}
+
+/**
+ * Give the writer the credit to fill the buffer with the given bytes. The buffer grows to hold them.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error and it sets errno
+ */
+static int grant_upto(struct netpipe *file, size_t needed) {
+    int bytes;
+
+    if (file->readahead + file->granted >= needed) return 1;
+    MINUS1(cbuf_grow(file->buffer, needed), errno = ENOMEM; return -1)
+
+    bytes = send_read_request_message(file->skt, file->path, needed - file->readahead - file->granted);
+    if (bytes <= 0) return bytes;
+    file->granted = needed - file->readahead;
+
+    return 1;
+}
+
+/** How many reads are pending */
+static size_t read_count(struct netpipe *file) {
+    size_t count = 0;
+    netpipe_req_t *req;
+
+    foreach_request(file, req) count++;
+    return count;
+}
+
+/**
+ * Give the writer enough credit to send the message waited by the first pending read. Until its
+ * header arrives the message is expected to fill the read. What the writer sends after it goes
+ * into the buffer, which can hold the readahead and a whole message. A consumer group is given the
+ * credit for the other pending reads too, a message as long as the last one for each of them.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error
+ */
+static int msg_grant(struct netpipe *file) {
+    netpipe_req_t *req = (file->req_l)->head;
+    size_t len, needed;
+
+    if (req == NULL) return 1;
+    if (!msg_length(file, &len)) len = req->size;
+    if (len > NETPIPE_MSG_MAX) len = NETPIPE_MSG_MAX;
+    needed = MSG_HEADER + len;
+    if (file->group) needed += (read_count(file) - 1) * file->unit_last;
+
+    return grant_upto(file, needed);
+}
+
+/** Search the delimiter into the data which arrived since the last call */
+static void delim_scan(struct netpipe *file) {
+    size_t size = cbuf_size(file->buffer), found;
+
+    if (file->delim_scanned >= size) return;
+    found = cbuf_rfind(file->buffer, file->delim_scanned, size, (char) file->delimiter);
+    if (found > 0) file->delim_last = found;
+    file->delim_scanned = size;
+}
+
+/**
+ * How many bytes of the buffer a read of the given size takes: the whole records which fit into it,
+ * or only the first one in a consumer group, or the beginning of a record which is longer than the read.
+ *
+ * @return the bytes, 0 if the read must wait for the rest of a record
+ */
+static size_t delim_ready(struct netpipe *file, size_t size) {
+    size_t found;
+
+    if (file->group) {
+        found = cbuf_find(file->buffer, 0, file->delim_last < size ? file->delim_last : size, (char) file->delimiter);
+        if (found > 0) return found;
+    } else if (file->delim_last > 0 && file->delim_last <= size) {
+        return file->delim_last;
+    } else if (file->delim_last > size && (found = cbuf_rfind(file->buffer, 0, size, (char) file->delimiter)) > 0) {
+        return found;
+    }
+
+    return cbuf_size(file->buffer) >= size ? size : 0;
+}
+
+/** Move the first bytes of the buffer to buf and tell the writer they were read */
+static int delim_get(struct netpipe *file, char *buf, size_t size) {
+    cbuf_get(file->buffer, buf, size);
+    file->delim_scanned -= size;
+    file->delim_last = file->delim_last > size ? file->delim_last - size : 0;
+    file->unit_last = size;
+
+    return read_ack(file, size);
+}
+
+/**
+ * Give the writer enough credit to fill the first pending read with a record. What the writer sends
+ * goes into the buffer, so it grows to hold the whole read. A consumer group is given the credit for
+ * a record as long as the last one for each pending read, unless the first record is longer.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error
+ */
+static int delim_grant(struct netpipe *file) {
+    netpipe_req_t *req = (file->req_l)->head;
+    size_t needed;
+
+    if (req == NULL) return 1;
+    if (!file->group || file->unit_last == 0) return grant_upto(file, req->size);
+
+    // the buffer holds what was granted but not the first record: it can fill the read like without a group
+    needed = read_count(file) * file->unit_last;
+    if (cbuf_size(file->buffer) >= needed && needed < req->size) needed = req->size;
+
+    return grant_upto(file, needed);
+}
+
+/**
+ * Start sending the given data. If the request cannot be completed immediately, it is queued and
+ * completed later by the dispatcher.
+ *
+ * @param fd if not -1 then data is read from this pipe instead of buf. What can be sent immediately is
+ * spliced into the socket, the rest is read into memory
+ * @param copy if 1 then the data which is not sent immediately is copied, so the caller's buffer can be reused
+ * @return 0 on success, -1 on error and it sets errno. done is not called on error
+ *
+ * If the netpipe keeps the boundaries of the messages then the data is copied after its header and it is sent
+ * as a whole, after the messages which are waiting.
+ */
+static int netpipe_send_start(struct netpipe *file, const char *buf, int fd, size_t size, int nonblock, int copy,
+                              netpipe_done_t done, void *arg) {
     int err;
-    char *bufptr = (char *) buf;
-    size_t sent = 0, bytes, remaining = size;
+    char *bufptr = (char *) buf, *owned = NULL, *msg = NULL;
+    size_t sent = 0, bytes, remaining = size, header = 0;
+    ssize_t bytes_read;
+    netpipe_req_t *request = NULL;
+
+    // the spool is created before the lock is taken. A message needs room for its header too
+    if (file->skt->spooldir != NULL) spool_prepare(file, MSG_HEADER + size);
 
     NOTZERO(netpipe_lock(file), return -1)
 
-    if (file->force_exit || file->readers == 0) {
+    if (file->force_exit || (file->readers == 0 && !file->early)) {
         errno = EPIPE;
         netpipe_unlock(file);
         return -1;
     }
 
-    // If host can receive data and local buffer is empty or buffer has zero capacity
+    if (file->messages && size > NETPIPE_MSG_MAX) {
+        errno = EMSGSIZE;
+        netpipe_unlock(file);
+        return -1;
+    }
+    if (file->messages && size > 0) {
+        if (nonblock && ((file->req_l)->head != NULL || send_space(file) < MSG_HEADER + size)) {
+            errno = EAGAIN;
+            netpipe_unlock(file);
+            return -1;
+        }
+        EQNULL(msg = msg_frame(buf, fd, size), netpipe_unlock(file); return -1)
+        // a message is never sent in part: the request which waits to send the rest is allocated before
+        if (!nonblock) {
+            EQNULL(request = netpipe_new_request(file, O_WRONLY, done, arg, &netpipe_data_done),
+                   netpipe_unlock(file); free(msg); return -1)
+        }
+        bufptr = msg;
+        fd = -1;
+        header = MSG_HEADER;
+        remaining = size = MSG_HEADER + size;
+    }
+
+    // If host can receive data and local buffer and spool are empty or buffer has zero capacity
     // Directly send data
-    if (available_remote(file) > 0 && (cbuf_empty(file->buffer) || cbuf_capacity(file->buffer) == 0)) {
-        err = do_send(file, bufptr, size, &bytes);
+    if (available_remote(file) > 0 && ((unsent_locally(file) == 0 && spooled(file) == 0) || cbuf_capacity(file->buffer) == 0)) {
+        if (fd != -1) err = do_send_fd(file, fd, size, &bytes);
+        else err = do_send(file, bufptr, size, &bytes);
         if (err <= 0) {
             netpipe_unlock(file);
             return -1;
         }
 
-        bufptr += bytes;
+        if (fd == -1) bufptr += bytes;
         sent += bytes;
         remaining -= bytes;
         DEBUG("send[%s] %ld bytes\n", file->path, bytes);
@@ -390,58 +1335,187 @@ ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int non
 
     // If there is space into the buffer and this request need to send more data
     // Put data from this request into the buffer (writeahead). Data put will be 0 if the buffer is full or has 0 capacity
-    if (remaining > 0) {
-        bytes = cbuf_put(file->buffer, bufptr, remaining);
+    // or if there is data into the spool, which goes into the buffer first
+    if (remaining > 0 && spooled(file) == 0) {
+        if (fd != -1) {
+            bytes_read = cbuf_readn(fd, file->buffer, remaining);
+            bytes = bytes_read > 0 ? bytes_read : 0;
+        } else {
+            bytes = cbuf_put(file->buffer, bufptr, remaining);
+        }
         if (bytes > 0) DEBUG("writeahead[%s] %ld bytes\n", file->path, bytes);
 
-        bufptr += bytes;
+        if (fd == -1) bufptr += bytes;
+        sent += bytes;
+        remaining -= bytes;
+    }
+
+    // If the buffer is full spill the rest into the spool, so the writer doesn't wait
+    if (remaining > 0) {
+        bytes = spill(file, bufptr, fd, remaining);
+        if (bytes > 0) DEBUG("spill[%s] %ld bytes\n", file->path, bytes);
+
+        if (fd == -1) bufptr += bytes;
         sent += bytes;
         remaining -= bytes;
     }
 
     // If all the bytes were sent or nonblock
-    if (remaining == 0 || nonblock) {
-        if (sent == 0) errno = EAGAIN;
-        netpipe_unlock(file);
-        return sent;
+    if (remaining == 0 || nonblock) goto completed;
+
+    if (msg != NULL) { // the request owns the message
+        owned = msg;
+        msg = NULL;
+    } else if (copy || fd != -1) {
+        owned = (char *) malloc(sizeof(char) * remaining);
+        if (owned == NULL) goto error;
+        if (fd != -1 && readn(fd, owned, remaining) != (ssize_t) remaining) {
+            free(owned);
+            goto error;
+        }
+        if (fd == -1) memcpy(owned, bufptr, remaining);
+        bufptr = owned;
     }
 
-    netpipe_req_t *request = netpipe_add_request(file, bufptr, remaining, O_WRONLY);
-    while(!file->force_exit && request->bytes_processed != remaining && !request->error) {
-        PTH(err, pthread_cond_wait(&(request->waiting), &(file->mtx)), netpipe_unlock(file); return -1)
+    if (request != NULL) { // the message
+        request->size = remaining;
+        request->buf = bufptr;
+        netpipe_append_request(file, request);
+    } else if ((request = netpipe_add_request(file, bufptr, remaining, O_WRONLY, done, arg)) == NULL) {
+        free(owned);
+        goto error;
     }
+    request->copy = owned;
+    request->initial = sent;
+    request->header = header;
 
-    sent += request->bytes_processed;
+    /* The request is completed and removed from the list by who processes it */
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+
+error:
     if (sent == 0) {
-        if (request->error) {
-            errno = request->error;
-        } else if (file->force_exit) {
-            errno = EPIPE;
-        }
-        sent = -1;
+        netpipe_unlock(file);
+        free(msg);
+        free(request);
+        return -1;
     }
+completed:
+    netpipe_unlock(file);
+    free(msg);
+    free(request); // the request allocated for a message which was not needed
+    done(arg, sent > header ? sent - header : 0, 0);
+    return 0;
+}
 
-    err = netpipe_destroy_request(request);
-    if (err == -1 && sent == 0)
-        sent = -1;
-    NOTZERO(netpipe_unlock(file), return -1)
+int netpipe_send_async(struct netpipe *file, const char *buf, size_t size, int nonblock, netpipe_done_t done, void *arg) {
+    return netpipe_send_start(file, buf, -1, size, nonblock, 1, done, arg);
+}
 
-    return sent;
+int netpipe_send_fd_async(struct netpipe *file, int fd, size_t size, int nonblock, netpipe_done_t done, void *arg) {
+    return netpipe_send_start(file, NULL, fd, size, nonblock, 0, done, arg);
 }
 
-int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
-    int err;
+ssize_t netpipe_send(struct netpipe *file, const char *buf, size_t size, int nonblock) {
+    struct netpipe_sync sync;
+    netpipe_sync_init(&sync);
+
+    // the caller's buffer is valid until this function returns, so there is no need to copy it
+    MINUS1(netpipe_send_start(file, buf, -1, size, nonblock, 0, &netpipe_sync_done, &sync), return -1)
+
+    return netpipe_sync_wait(&sync, file);
+}
+
+/**
+ * Receive data of a netpipe which keeps the boundaries of the messages. The data goes into the buffer
+ * and the pending reads take the messages which arrived whole. The caller must hold the file lock.
+ *
+ * @param wakelist completed requests are added to this list
+ * @return how much data was received, 0 if connection was lost, -1 on error
+ */
+static ssize_t recv_messages(struct netpipe *file, size_t size, waitq_wakelist_t *wakelist) {
+    ssize_t bytes;
+    size_t msgsize, acked = 0;
+    netpipe_req_t *req;
+
+    // the writer is given only the credit which the buffer can hold
+    bytes = read_socket_cbuf(file->skt, file->buffer, size);
+    if (bytes <= 0) return bytes;
+    if ((size_t) bytes != size) DEBUG("cannot write locally: buffer is full. SOMETHING IS WRONG!\n");
+
+    req = (file->req_l)->head;
+    while (req != NULL && (msgsize = msg_ready(file)) > 0) {
+        req->bytes_processed = msg_get(file, req->buf, req->size, msgsize);
+        DEBUG("read[%s] %ld bytes\n", file->path, req->bytes_processed);
+        acked += msgsize;
+        req = netpipe_complete_head(file, wakelist);
+    }
+
+    if (acked > 0 && (bytes = read_ack(file, acked)) <= 0) return bytes;
+    if ((bytes = msg_grant(file)) <= 0) return bytes;
+
+    return size;
+}
+
+/**
+ * Receive data of a netpipe which has a record delimiter. The data goes into the buffer, where the
+ * delimiter is searched, and the pending reads take the records which arrived whole. The caller must
+ * hold the file lock.
+ *
+ * @param wakelist completed requests are added to this list
+ * @return how much data was received, 0 if connection was lost, -1 on error
+ */
+static ssize_t recv_records(struct netpipe *file, size_t size, waitq_wakelist_t *wakelist) {
     ssize_t bytes;
+    size_t n;
+    netpipe_req_t *req;
+
+    // the writer is given only the credit which the buffer can hold
+    bytes = read_socket_cbuf(file->skt, file->buffer, size);
+    if (bytes <= 0) return bytes;
+    if ((size_t) bytes != size) DEBUG("cannot write locally: buffer is full. SOMETHING IS WRONG!\n");
+    delim_scan(file);
+
+    req = (file->req_l)->head;
+    while (req != NULL && (n = delim_ready(file, req->size)) > 0) {
+        if ((bytes = delim_get(file, req->buf, n)) <= 0) return bytes;
+        req->bytes_processed = n;
+        DEBUG("read[%s] %ld bytes\n", file->path, n);
+        req = netpipe_complete_head(file, wakelist);
+    }
+
+    if ((bytes = delim_grant(file)) <= 0) return bytes;
+
+    return size;
+}
+
+int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
+    ssize_t bytes, ret = size;
     char *bufptr;
     netpipe_req_t *req;
-    netpipe_req_l *req_list;
-    size_t toberead, dataread = 0;
+    size_t toberead, space, dataread = 0;
+    int spliced;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
+    struct netpipe_users users = { NULL, NULL };
 
     NOTZERO(netpipe_lock(file), return -1)
+    file = read_half(file); // the remote host writes the read half of a full-duplex netpipe
+
+    // the data is forwarded to another connection, then the relay sends what it can
+    if (file->relay != NULL) {
+        ret = netpipefs_relay_recv(file->relay, size);
+        netpipe_users_hold(file, &users);
+        goto end;
+    }
+
+    if (file->messages || file->delimiter != -1) {
+        ret = file->messages ? recv_messages(file, size, &wakelist) : recv_records(file, size, &wakelist);
+        if (ret > 0 && poll_notify) loop_poll_notify(file, poll_notify);
+        goto end;
+    }
 
     // Move data from buffer to pending requests
-    req_list = file->req_l;
-    req = req_list->head;
+    req = (file->req_l)->head;
     while(req != NULL && !cbuf_empty(file->buffer)) {
         bufptr = req->buf + req->bytes_processed;
         toberead = req->size - req->bytes_processed;
@@ -452,12 +1526,8 @@ int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *))
         dataread += bytes;
         DEBUG("buffered read[%s] %ld bytes\n", file->path, bytes);
         req->bytes_processed += bytes;
-        if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return dataread);
-            if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-            req_list->head = req;
-        }
+        if (req->bytes_processed == req->size)
+            req = netpipe_complete_head(file, &wakelist);
     }
 
     size_t remaining = size;
@@ -467,60 +1537,195 @@ int netpipe_recv(struct netpipe *file, size_t size, void (*poll_notify)(void *))
         toberead = req->size - req->bytes_processed;
         if (toberead > remaining) toberead = remaining;
 
-        bytes = readn(netpipefs_socket.fd, bufptr, toberead);
+        // the request can be completed by this message: the reader can take it from the socket by itself
+        spliced = req->splice != NULL && req->initial == 0 && req->bytes_processed == 0 && toberead >= req->min;
+        if (spliced) {
+            bytes = req->splice(req->arg, file->skt->fd, toberead) == -1 ? -1 : (ssize_t) toberead;
+        } else {
+            bytes = read_socket(file->skt, bufptr, toberead);
+        }
         if (bytes <= 0) {
-            netpipe_unlock(file);
-            return bytes;
+            ret = bytes;
+            goto end;
         }
         dataread += bytes;
         DEBUG("read[%s] %ld bytes\n", file->path, bytes);
 
         req->bytes_processed += bytes;
         remaining -= bytes;
-        if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return dataread);
-            if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-            req_list->head = req;
-        }
+        if (spliced || req->bytes_processed == req->size)
+            req = netpipe_complete_head(file, &wakelist);
     }
 
     // Put remaining data from socket to the buffer (readahead)
-    if (remaining > 0 && cbuf_capacity(file->buffer) > 0) {
-        bytes = cbuf_readn(netpipefs_socket.fd, file->buffer, remaining);
+    space = cbuf_capacity(file->buffer) - cbuf_size(file->buffer);
+    if (remaining > 0 && space > 0) {
+        bytes = read_socket_cbuf(file->skt, file->buffer, remaining < space ? remaining : space);
         if (bytes <= 0) {
-            netpipe_unlock(file);
-            return bytes;
+            ret = bytes;
+            goto end;
         }
-        if ((size_t) bytes != remaining) DEBUG("cannot write locally: buffer is full. SOMETHING IS WRONG!\n");
-        if (dataread + bytes != size) DEBUG("cannot read all data from socket. SOMETHING IS WRONG!\n");
+        remaining -= bytes;
 
         DEBUG("readahead[%s] %ld bytes\n", file->path, bytes);
     }
 
+    // sent beyond the credit, like by the source of a relay which ended: it is discarded to keep the connection
+    if (remaining > 0) {
+        DEBUG("remote[%s] WRITE %ld bytes discarded: buffer is full\n", file->path, remaining);
+        if ((bytes = skip_socket(file->skt, remaining)) <= 0) {
+            ret = bytes;
+            goto end;
+        }
+    }
+
+    // the first read returns what it has if it is enough, otherwise it waits for more until its timer expires
+    if (req != NULL && req->initial + req->bytes_processed > 0) {
+        if (req->initial + req->bytes_processed >= req->min) netpipe_complete_head(file, &wakelist);
+        else timer_arm(file, req, file->readtime);
+    }
+
     /* Send read message */
     if (dataread > 0) {
-        bytes = send_read_message(&netpipefs_socket, file->path, dataread);
+        bytes = read_ack(file, dataread);
         if (bytes <= 0) {
-            netpipe_unlock(file);
-            return bytes;
+            ret = bytes;
+            goto end;
         }
     }
+    MINUS1(read_reserve(file), ret = -1; goto end)
 
     if (poll_notify) loop_poll_notify(file, poll_notify);
     DEBUGFILE(file);
 
+end:
+    NOTZERO(netpipe_unlock(file), ret = -1)
+    /* Wake up who is waiting for the completed requests */
+    waitq_wake_all(&wakelist);
+    netpipe_users_notify(&users);
+
+    return ret;
+}
+
+int netpipe_read_async(struct netpipe *file, char *buf, size_t size, int nonblock, netpipe_done_t done, void *arg) {
+    return netpipe_read_splice_async(file, buf, size, nonblock, NULL, done, arg);
+}
+
+/**
+ * Read a message of a netpipe which keeps their boundaries. The caller must hold the file lock which is
+ * released by this function. The request takes the first message which arrived whole, if no other read
+ * is waiting, otherwise it is queued and the writer is given the credit to send the message.
+ *
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+static int netpipe_read_message_unlock(struct netpipe *file, char *buf, size_t size, int nonblock,
+                                       netpipe_done_t done, void *arg) {
+    int err = 0;
+    size_t msgsize, read = 0;
+    netpipe_req_t *request;
+
+    if ((file->req_l)->head == NULL && (msgsize = msg_ready(file)) > 0) {
+        read = msg_get(file, buf, size, msgsize);
+        DEBUG("buffered read[%s] %ld bytes\n", file->path, read);
+        if ((err = read_ack(file, msgsize)) <= 0) err = err == 0 ? ECONNRESET : errno;
+        else err = 0;
+        goto completed;
+    }
+
+    if (file->writers == 0) goto completed;
+    if (nonblock) {
+        errno = EAGAIN;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    request = netpipe_add_request(file, buf, size, O_RDONLY, done, arg);
+    if (request == NULL) {
+        netpipe_unlock(file);
+        return -1;
+    }
+    if (msg_grant(file) <= 0) {
+        netpipe_remove_request(file, request);
+        free(request);
+        goto completed;
+    }
+
+    /* The request is completed and removed from the list by who processes it */
     NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
 
-    return size;
+completed:
+    netpipe_unlock(file);
+    // the data was taken but the writer could not be told: the connection is lost
+    if (err) done(arg, -1, err);
+    else done(arg, read, 0);
+    return 0;
 }
 
-ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock) {
+/**
+ * Read the records of a netpipe which has a record delimiter. The caller must hold the file lock which
+ * is released by this function. The request takes the records which arrived whole, if no other read is
+ * waiting, otherwise it is queued and the writer is given the credit to fill it.
+ *
+ * @return 0 on success, -1 on error and it sets errno. If it returns -1 then done is not called
+ */
+static int netpipe_read_record_unlock(struct netpipe *file, char *buf, size_t size, int nonblock,
+                                      netpipe_done_t done, void *arg) {
+    int err = 0;
+    size_t read = 0;
+    netpipe_req_t *request;
+
+    if ((file->req_l)->head == NULL) {
+        read = delim_ready(file, size);
+        // the last record may not have its delimiter
+        if (read == 0 && file->writers == 0) read = cbuf_size(file->buffer) < size ? cbuf_size(file->buffer) : size;
+        if (read > 0) {
+            if ((err = delim_get(file, buf, read)) <= 0) err = err == 0 ? ECONNRESET : errno;
+            else err = 0;
+            DEBUG("buffered read[%s] %ld bytes\n", file->path, read);
+            goto completed;
+        }
+    }
+
+    if (file->writers == 0) goto completed;
+    if (nonblock) {
+        errno = EAGAIN;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    request = netpipe_add_request(file, buf, size, O_RDONLY, done, arg);
+    if (request == NULL) {
+        netpipe_unlock(file);
+        return -1;
+    }
+    if (delim_grant(file) <= 0) {
+        netpipe_remove_request(file, request);
+        free(request);
+        goto completed;
+    }
+
+    /* The request is completed and removed from the list by who processes it */
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+
+completed:
+    netpipe_unlock(file);
+    // the data was taken but the writer could not be told: the connection is lost
+    if (err) done(arg, -1, err);
+    else done(arg, read, 0);
+    return 0;
+}
+
+int netpipe_read_splice_async(struct netpipe *file, char *buf, size_t size, int nonblock, netpipe_splice_t splice,
+                              netpipe_done_t done, void *arg) {
     int err;
     char *bufptr = (char *) buf;
-    size_t read, remaining;
+    size_t read, min;
+    netpipe_req_t *request;
 
     NOTZERO(netpipe_lock(file), return -1)
+    file = read_half(file);
 
     if (file->force_exit) {
         errno = EPIPE;
@@ -528,113 +1733,291 @@ ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock)
         return -1;
     }
 
+    if (file->messages) return netpipe_read_message_unlock(file, buf, size, nonblock, done, arg);
+    if (file->delimiter != -1) return netpipe_read_record_unlock(file, buf, size, nonblock, done, arg);
+
     // Read from buffer (readahead). Bytes read can be zero if the buffer is empty or the capacity is zero
     read = cbuf_get(file->buffer, bufptr, size);
     if (read > 0) {
-        err = send_read_message(&netpipefs_socket, file->path, read);
-        if (err <= 0) {
-            netpipe_unlock(file);
-            return read;
-        }
+        err = read_ack(file, read);
+        if (err <= 0) goto completed;
         DEBUG("buffered read[%s] %ld bytes\n", file->path, read);
         bufptr += read;
     }
-    // If all the bytes were read
-    if (read == size || nonblock) {
-        if (read == 0) errno = EAGAIN;
-        netpipe_unlock(file);
-        return read;
-    }
 
-    if (file->writers == 0) {
-        netpipe_unlock(file);
-        return read;
+    // If enough bytes were read or there are no writers
+    min = file->readmin < size ? file->readmin : size;
+    if (read >= min || nonblock || file->writers == 0) goto completed;
+
+    request = netpipe_add_request(file, bufptr, size - read, O_RDONLY, done, arg);
+    if (request == NULL) {
+        if (read == 0) {
+            netpipe_unlock(file);
+            return -1;
+        }
+        goto completed;
     }
+    request->initial = read;
+    request->min = min;
+    request->splice = splice;
 
-    remaining = size - read;
-    netpipe_req_t *request = netpipe_add_request(file, bufptr, remaining, O_RDONLY);
-    err = send_read_request_message(&netpipefs_socket, file->path, remaining);
+    err = read_grant(file);
     if (err <= 0) {
+        netpipe_remove_request(file, request);
         free(request);
+        goto completed;
+    }
+    if (read > 0) timer_arm(file, request, file->readtime);
+
+    /* The request is completed and removed from the list by who processes it */
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+
+completed:
+    netpipe_unlock(file);
+    done(arg, read, 0);
+    return 0;
+}
+
+ssize_t netpipe_read(struct netpipe *file, char *buf, size_t size, int nonblock) {
+    struct netpipe_sync sync;
+    netpipe_sync_init(&sync);
+
+    MINUS1(netpipe_read_async(file, buf, size, nonblock, &netpipe_sync_done, &sync), return -1)
+
+    return netpipe_sync_wait(&sync, file);
+}
+
+/** Returns 1 if the deadline of the given timed request has passed */
+static int timer_expired(netpipe_req_t *req, const struct timespec *now) {
+    return req->timed && (now->tv_sec > req->deadline.tv_sec
+        || (now->tv_sec == req->deadline.tv_sec && now->tv_nsec >= req->deadline.tv_nsec));
+}
+
+int netpipe_timeout(struct netpipe *file) {
+    int err = 0;
+    struct timespec now;
+    netpipe_req_t *req;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
+
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &now), return -1)
+    NOTZERO(netpipe_lock(file), return -1)
+
+    // the read which started the timer may be completed already
+    req = (read_half(file)->req_l)->head;
+    if (req != NULL && req->initial + req->bytes_processed > 0 && timer_expired(req, &now)) {
+        DEBUG("read timeout[%s] %ld bytes\n", file->path, req->initial + req->bytes_processed);
+        netpipe_complete_head(read_half(file), &wakelist);
+        err = read_reserve(read_half(file));
+    }
+
+    // the last writer lingered too long: the data which was not read is discarded
+    if ((req = file->close_reqs) != NULL && timer_expired(req, &now)) {
+        DEBUG("linger timeout[%s] %ld bytes\n", file->path, cbuf_size(file->buffer));
+        if (file->zc_ring == 0) cbuf_drop(file->buffer, cbuf_size(file->buffer));
+        if (spooled(file) > 0) spool_drop(file->spool, spool_size(file->spool));
+        for (; req != NULL; req = req->next) req->discarded = 1;
+        netpipe_complete_list(&(file->close_reqs), 0, &wakelist);
+    }
+
+    NOTZERO(netpipe_unlock(file), err = -1)
+    waitq_wake_all(&wakelist);
+
+    return err;
+}
+
+int netpipe_set_readmin(struct netpipe *file, size_t readmin, int readtime) {
+    NOTZERO(netpipe_lock(file), return -1)
+    file = read_half(file);
+    file->readmin = readmin > 0 ? readmin : DEFAULT_READMIN;
+    file->readtime = readtime;
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    return 0;
+}
+
+int netpipe_set_delimiter(struct netpipe *file, int delimiter) {
+    int err = 0;
+
+    if (delimiter < -1 || delimiter > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    NOTZERO(netpipe_lock(file), return -1)
+    file = read_half(file);
+    if (file->messages) {
+        err = EINVAL;
+    } else if ((file->req_l)->head != NULL) {
+        err = EBUSY;
+    } else {
+        file->delimiter = delimiter;
+        file->delim_scanned = 0;
+        file->delim_last = 0;
+        if (delimiter != -1) delim_scan(file);
+    }
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int netpipe_set_group(struct netpipe *file, int group) {
+    int err = 0;
+
+    if (group != 0 && group != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    NOTZERO(netpipe_lock(file), return -1)
+    file = read_half(file);
+    if ((file->req_l)->head != NULL) err = EBUSY;
+    else file->group = group;
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int netpipe_early_grant(struct netpipe *file) {
+    size_t size = file->skt->earlydata;
+    int bytes = 1;
+
+    if (size == 0) return 0;
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (file->force_exit || file->readers > 0 || file->writers == 0 || file->early_granted > 0 || file->relay != NULL
+        || file->provisioned != NOT_OPEN || file->rdhalf != NULL) {
+        NOTZERO(netpipe_unlock(file), return -1)
+        return 0;
+    }
+    if (__atomic_add_fetch(&(file->skt->early_used), size, __ATOMIC_ACQ_REL) > file->skt->earlymax) {
+        __atomic_sub_fetch(&(file->skt->early_used), size, __ATOMIC_ACQ_REL);
+        DEBUG("early[%s] no budget left\n", file->path);
+        NOTZERO(netpipe_unlock(file), return -1)
+        return 0;
+    }
+
+    file->early_granted = size;
+    bytes = grant_upto(file, file->readahead + file->granted + size);
+    if (bytes <= 0) early_release(file);
+    DEBUGFILE(file);
+
+    NOTZERO(netpipe_unlock(file), return -1)
+    return bytes == -1 ? -1 : 0;
+}
+
+int netpipe_provision(struct netpipe *file, int mode, size_t window) {
+    size_t capacity = mode == O_RDONLY ? window : file->skt->writeahead;
+    cbuf_t *buffer;
+
+    if (mode != O_RDONLY && mode != O_WRONLY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (file->readers > 0 || file->writers > 0) {
+        errno = EBUSY;
         netpipe_unlock(file);
-        return read;
+        return -1;
     }
-    while(!file->force_exit && request->bytes_processed != remaining && !request->error) {
-        PTH(err, pthread_cond_wait(&(request->waiting), &(file->mtx)), netpipe_unlock(file); return -1)
+
+    if (cbuf_capacity(file->buffer) < capacity) {
+        EQNULL(buffer = cbuf_alloc(capacity), netpipe_unlock(file); return -1)
+        cbuf_free(file->buffer);
+        file->buffer = buffer;
     }
 
-    read += request->bytes_processed;
-    if (read == 0) {
-        errno = EPIPE;
-        if ((request->error && request->error != EPIPE) || file->force_exit) {
-            errno = request->error;
-            read = -1;
-        }
+    file->provisioned = mode;
+    if (mode == O_RDONLY) {
+        file->readahead = window;
+    } else {
+        file->remote_readahead = window;
+        file->remotemax = window;
     }
+    DEBUGFILE(file);
 
-    err = netpipe_destroy_request(request);
-    if (err == -1 && read == 0)
-        read = -1;
     NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+}
+
+/* Complete the fsync requests whose data was read by the remote readers or, with datasync, sent */
+static void fsync_update(struct netpipe *file, waitq_wakelist_t *wakelist) {
+    netpipe_req_t **reqp = &(file->fsync_reqs), *req;
 
-    return read;
+    while ((req = *reqp) != NULL) {
+        if (file->acked + (req->datasync ? file->remotesize : 0) >= req->size) {
+            *reqp = req->next;
+            waitq_defer(wakelist, &(req->waiting));
+        } else {
+            reqp = &(req->next);
+        }
+    }
 }
 
 /**
  * Send data to remote host.
  *
  * @param file the file
+ * @param wakelist completed requests are added to this list
  * @return number of bytes sent, 0 if connection is lost, -1 on error
  */
-static size_t send_data(struct netpipe *file) {
+static size_t send_data(struct netpipe *file, waitq_wakelist_t *wakelist) {
     int err;
     size_t datasent = 0, remaining, bytes;
-    netpipe_req_l *req_list;
     netpipe_req_t *req;
     char *bufptr;
 
-    // Flush buffer: send data from buffer
+    // Flush buffer: send data from buffer, then from the spool through the buffer
     err = do_flush(file, &bytes);
     if (err <= 0) return -1;
+    datasent = bytes;
+    while (unspill(file) > 0 && available_remote(file) > 0) {
+        err = do_flush(file, &bytes);
+        if (err <= 0) return -1;
+        datasent += bytes;
+    }
 
-    if (bytes > 0) {
-        datasent = bytes;
-        DEBUG("flush[%s] %ld bytes\n", file->path, bytes);
-        if (file->writers == 0) PTH(err, pthread_cond_signal(&(file->close)), return -1)
+    if (datasent > 0) {
+        DEBUG("flush[%s] %ld bytes\n", file->path, datasent);
+        // who is closing was waiting for the buffer to be flushed
+        if (flushed(file)) netpipe_complete_list(&(file->close_reqs), 0, wakelist);
     }
 
-    // If host can still receive data
+    // If host can still receive data and nothing is left into the spool
     // Handle requests: send data from pending requests
-    req_list = file->req_l;
-    req = req_list->head;
-    while(available_remote(file) > 0 && req != NULL) {
+    req = (file->req_l)->head;
+    while(available_remote(file) > 0 && spooled(file) == 0 && req != NULL) {
         bufptr = req->buf + req->bytes_processed;
         remaining = req->size - req->bytes_processed;
 
-        err = do_send(file, bufptr, remaining, &bytes);
+        err = do_send_req(file, req, bufptr, remaining, &bytes);
         if (err <= 0) {
             if (err == 0) req->error = ECONNRESET; //TODO ENOTCONN
             else req->error = errno;
-            PTH(err, pthread_cond_signal(&(req->waiting)), err = -1)
-            if (req_list->tail == req) req_list->tail = NULL;
-            req_list->head = req->next;
+            netpipe_complete_head(file, wakelist);
             return err;
         }
         DEBUG("send[%s] %ld bytes\n", file->path, bytes);
         datasent += bytes;
 
         req->bytes_processed += bytes;
-        if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return datasent)
-            if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-        }
+        if (req->bytes_processed == req->size)
+            req = netpipe_complete_head(file, wakelist);
     }
-    req_list->head = req;
 
     // If there are pending requests and there is space into the buffer
     // Put data from requests into the buffer (Writeahead)
-    while(req != NULL && !cbuf_full(file->buffer) && cbuf_capacity(file->buffer) > 0) {
+    while(req != NULL && spooled(file) == 0 && !cbuf_full(file->buffer) && cbuf_capacity(file->buffer) > 0) {
         bufptr = req->buf + req->bytes_processed;
         remaining = req->size - req->bytes_processed;
 
@@ -643,83 +2026,124 @@ static size_t send_data(struct netpipe *file) {
 
         datasent += bytes;
         req->bytes_processed += bytes;
-        if (req->bytes_processed == req->size) {
-            PTH(err, pthread_cond_signal(&(req->waiting)), return datasent)
-            if (req_list->tail == req) req_list->tail = NULL;
-            req = req->next;
-        }
+        if (req->bytes_processed == req->size)
+            req = netpipe_complete_head(file, wakelist);
+    }
+
+    // Then spill them into the spool
+    while(req != NULL && (bytes = spill(file, req->buf + req->bytes_processed, -1, req->size - req->bytes_processed)) > 0) {
+        DEBUG("spill[%s] %ld bytes\n", file->path, bytes);
+
+        datasent += bytes;
+        req->bytes_processed += bytes;
+        if (req->bytes_processed == req->size)
+            req = netpipe_complete_head(file, wakelist);
     }
-    req_list->head = req;
+    if (file->fsync_reqs != NULL) fsync_update(file, wakelist);
 
     return datasent;
 }
 
 int netpipe_read_request(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
     int err;
+    struct netpipe_users users;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
 
     NOTZERO(netpipe_lock(file), return -1)
 
     file->remotemax += size;
+    // nobody opened it for reading yet: the remote host lets the writers send early
+    if (file->readers == 0 && file->writers > 0 && !file->early) {
+        DEBUG("early[%s] %ld bytes\n", file->path, size);
+        file->early = 1;
+        netpipe_complete_opens(file, 0, &wakelist);
+    }
 
-    err = send_data(file);
+    err = send_data(file, &wakelist);
     if (err > 0 && poll_notify) loop_poll_notify(file, poll_notify);
+    netpipe_users_hold(file, &users);
 
     DEBUGFILE(file);
 
-    NOTZERO(netpipe_unlock(file), return -1)
+    NOTZERO(netpipe_unlock(file), err = -1)
+    waitq_wake_all(&wakelist);
+    netpipe_users_notify(&users);
 
     return err;
 }
 
 int netpipe_read_update(struct netpipe *file, size_t size, void (*poll_notify)(void *)) {
     int err;
+    struct netpipe_users users;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
 
     NOTZERO(netpipe_lock(file), return -1)
 
     file->remotemax -= size;
-    if (file->remotemax < netpipefs_socket.remote_readahead)
-        file->remotemax = netpipefs_socket.remote_readahead;
+    if (file->remotemax < file->remote_readahead)
+        file->remotemax = file->remote_readahead;
     file->remotesize -= size;
+    file->acked += size;
 
-    err = send_data(file);
+    err = send_data(file, &wakelist);
     if (err > 0 && poll_notify) loop_poll_notify(file, poll_notify);
+    netpipe_users_hold(file, &users);
 
     DEBUGFILE(file);
 
-    NOTZERO(netpipe_unlock(file), return -1)
+    NOTZERO(netpipe_unlock(file), err = -1)
+    waitq_wake_all(&wakelist);
+    netpipe_users_notify(&users);
 
     return err;
 }
 
 int netpipe_poll(struct netpipe *file, void *ph, unsigned int *reventsp) {
-    struct poll_handle *newph = (struct poll_handle *) malloc(sizeof(struct poll_handle));
-    if (newph == NULL) return -1;
-    newph->ph = ph;
+    struct netpipe *half;
+    struct poll_handle *newph = NULL;
+    if (ph != NULL) {
+        newph = (struct poll_handle *) malloc(sizeof(struct poll_handle));
+        if (newph == NULL) return -1;
+        newph->ph = ph;
+    }
 
     MINUS1(netpipe_lock(file), free(newph); return -1)
 
-    // add poll handle
-    newph->next = file->poll_handles;
-    file->poll_handles = newph;
+    // add poll handle. A handle already registered is not added again
+    for (struct poll_handle *p = file->poll_handles; newph != NULL && p != NULL; p = p->next) {
+        if (p->ph == ph) {
+            free(newph);
+            newph = NULL;
+        }
+    }
+    if (newph != NULL) {
+        newph->next = file->poll_handles;
+        file->poll_handles = newph;
+    }
 
     // cannot work on this file
     if (file->force_exit) {
         *reventsp |= POLLHUP;
         *reventsp |= POLLERR;
-    } else if (file->open_mode == O_RDONLY) { // read mode
-        if (!cbuf_empty(file->buffer) || file->writers > 0) {
-            // can readahead because there is data, no matter how many writers there are
-            *reventsp |= POLLIN;
-        } else if (file->writers == 0) { // no data is available, can't read
-            *reventsp |= POLLHUP;
+    } else {
+        if (file->open_mode == O_RDONLY || file->open_mode == O_RDWR) { // read mode
+            half = read_half(file);
+            if (!cbuf_empty(half->buffer) || half->writers > 0) {
+                // can readahead because there is data, no matter how many writers there are
+                *reventsp |= POLLIN;
+            } else if (half->writers == 0) { // no data is available, can't read
+                *reventsp |= POLLHUP;
+            }
+            if (half->urgent != NULL) *reventsp |= POLLPRI; // an urgent message can be read
         }
-    } else { // write mode
-        // no readers. cannot write
-        if (file->readers == 0) {
-            *reventsp |= POLLERR;
-        } else if (available_remote(file) + (cbuf_capacity(file->buffer) - cbuf_size(file->buffer)) > 0) { // writable
-            // can send directly or can writeahead
-            *reventsp |= POLLOUT;
+        if (file->open_mode != O_RDONLY) { // write mode
+            // no readers. cannot write
+            if (file->readers == 0 && !file->early) {
+                *reventsp |= POLLERR;
+            } else if (available_remote(file) + (cbuf_capacity(file->buffer) - cbuf_size(file->buffer)) + spill_space(file) > 0) { // writable
+                // can send directly or can writeahead
+                *reventsp |= POLLOUT;
+            }
         }
     }
 
@@ -729,9 +2153,270 @@ int netpipe_poll(struct netpipe *file, void *ph, unsigned int *reventsp) {
     return 0;
 }
 
-int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(const char *), void (*poll_notify)(void *)) {
+int netpipe_poll_forget(struct netpipe *file, void *ph) {
+    struct poll_handle **curr, *found;
+
+    NOTZERO(netpipe_lock(file), return -1)
+    curr = &(file->poll_handles);
+    while (*curr != NULL && (*curr)->ph != ph) curr = &((*curr)->next);
+    if ((found = *curr) != NULL) *curr = found->next;
+    NOTZERO(netpipe_unlock(file), free(found); return -1)
+    free(found);
+
+    return 0;
+}
+
+/**
+ * Free the file if it has no readers and no writers, no data is in flight and the kernel forgot it.
+ * The caller must hold the file lock which is released by this function. The lookup count can grow
+ * without the file lock, so the file is freed only if remove_open_file() really removes it.
+ * If the kernel is still using data sent with MSG_ZEROCOPY then it is released when the sends are completed.
+ *
+ * @return 0 on success, -1 on error and it sets errno
+ */
+static int netpipe_release_unlock(struct netpipe *file, int (*remove_open_file)(struct netpipe *)) {
+    int removed = 0, err = 0;
+    struct netpipe *half;
+
+    // the read half is released with its owner. Once nobody uses it, the netpipe can be used in one direction again
+    file = owner_of(file);
+    if ((half = file->rdhalf) != NULL && file->writers == 0 && file->readers == 0 && half->writers == 0
+        && half->readers == 0 && cbuf_empty(half->buffer)) {
+        file->rdhalf = NULL;
+        MINUS1(netpipe_free(half, NULL), err = -1)
+    }
+
+    if (file->writers != 0 || file->readers != 0 || available_remote(file) != 0 || file->rdhalf != NULL
+        || __atomic_load_n(&(file->nlookup), __ATOMIC_ACQUIRE) != 0) {
+        NOTZERO(netpipe_unlock(file), return -1)
+        return 0;
+    }
+
+    if (file->zc_pending > 0) {
+        file->zc_release = 1;
+        file->zc_remove_open_file = remove_open_file;
+        NOTZERO(netpipe_unlock(file), return -1)
+        return 0;
+    }
+
+    if (remove_open_file) MINUS1(removed = remove_open_file(file), err = -1)
+    NOTZERO(netpipe_unlock(file), err = -1)
+    if (removed != 1) MINUS1(netpipe_free(file, NULL), err = -1)
+
+    return err;
+}
+
+/**
+ * Close the netpipe with the given mode. The caller must hold the file lock which is released
+ * by this function. The file is freed if there are no more readers and writers.
+ *
+ * @return 0 on success, -1 on error and it sets errno
+ */
+static int netpipe_close_unlock(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *)) {
     int bytes, err = 0;
+
+    if (mode == O_WRONLY) file->writers--;
+    else if (mode == O_RDONLY) file->readers--;
+
+    // the file can outlive this close, so it can be open again with any mode
+    if ((mode == O_WRONLY && file->writers == 0) || (mode == O_RDONLY && file->readers == 0))
+        file->open_mode = NOT_OPEN;
+
+    // nothing was sent early, so the remote host forgets the credit it granted like this writer does
+    if (mode == O_WRONLY && file->writers == 0 && file->readers == 0 && file->early) {
+        file->early = 0;
+        file->remotemax = file->remote_readahead;
+    }
+
+    // the writer forgets the credit it was given and what it sent, so the next reader must start from a message
+    if (mode == O_RDONLY && file->readers == 0) {
+        if (file->messages) cbuf_drop(file->buffer, cbuf_size(file->buffer));
+        file->granted = 0;
+        urgent_drop(file);
+    }
+
+    if (poll_notify) loop_poll_notify(file, poll_notify);
+
+    bytes = send_close_message(file->skt, file->path, mode);
+    if (bytes <= 0) err = -1;
+
+    DEBUGFILE(file);
+    MINUS1(netpipe_release_unlock(file, remove_open_file), err = -1)
+
+    return err;
+}
+
+/**
+ * Close the read half of a full-duplex netpipe for a local reader. The caller must hold the file lock.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error
+ */
+static int duplex_close_read(struct netpipe *file) {
+    struct netpipe *half = file->rdhalf;
+
+    // like for a reader which closes, the remote writer forgets the credit it was given
+    if (--half->readers == 0) {
+        if (half->messages) cbuf_drop(half->buffer, cbuf_size(half->buffer));
+        half->granted = 0;
+        urgent_drop(half);
+    }
+
+    return send_close_message(file->skt, file->path, O_RDONLY);
+}
+
+/** Called when a close which already returned has drained the buffer or gave up */
+static void netpipe_close_drained(void *arg, ssize_t bytes, int error) {
+    struct netpipefs_socket *skt = (struct netpipefs_socket *) arg;
+
+    __atomic_sub_fetch(&(skt->draining), 1, __ATOMIC_ACQ_REL);
+    if (bytes == -1) DEBUG("drain failed: %s\n", strerror(error));
+}
+
+int netpipe_fsync_async(struct netpipe *file, int datasync, netpipe_done_t done, void *arg) {
+    size_t upto;
+    netpipe_req_t *req;
+
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (file->open_mode != O_WRONLY && file->open_mode != O_RDWR) {
+        errno = EBADF;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    // like a write, it fails if nobody reads: what was sent to the readers may be lost
+    if (file->force_exit || (file->readers == 0 && !file->early)) {
+        NOTZERO(netpipe_unlock(file), return -1)
+        done(arg, -1, EPIPE);
+        return 0;
+    }
+
+    // everything written so far is sent or read already
+    upto = written_upto(file);
+    if (file->acked + (datasync ? file->remotesize : 0) >= upto) {
+        NOTZERO(netpipe_unlock(file), return -1)
+        done(arg, 0, 0);
+        return 0;
+    }
+
+    EQNULL(req = netpipe_new_request(file, O_WRONLY, done, arg, &netpipe_open_done), netpipe_unlock(file); return -1)
+    req->size = upto;
+    req->datasync = datasync;
+    req->next = file->fsync_reqs;
+    file->fsync_reqs = req;
+    DEBUG("fsync[%s] %ld bytes\n", file->path, upto - file->acked);
+
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+}
+
+int netpipe_fsync(struct netpipe *file, int datasync) {
+    struct netpipe_sync sync;
+    netpipe_sync_init(&sync);
+
+    MINUS1(netpipe_fsync_async(file, datasync, &netpipe_sync_done, &sync), return -1)
+
+    return (int) netpipe_sync_wait(&sync, NULL);
+}
+
+int netpipe_send_urgent(struct netpipe *file, const char *buf, size_t size) {
+    int err = 0, bytes;
+
+    if (size == 0 || size > NETPIPE_URGENT_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    NOTZERO(netpipe_lock(file), return -1)
+    if (file->open_mode != O_WRONLY && file->open_mode != O_RDWR) {
+        err = EBADF;
+    } else if (file->force_exit || file->readers == 0) {
+        err = EPIPE;
+    } else if ((bytes = send_urgent_message(file->skt, file->path, buf, size)) <= 0) { // ahead of the buffered data
+        err = bytes == 0 ? EPIPE : errno;
+    }
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int netpipe_recv_urgent(struct netpipe *file, const char *buf, size_t size, void (*poll_notify)(void *)) {
+    int err = 0;
+    struct netpipe_urgent *msg, **last;
+
+    NOTZERO(netpipe_lock(file), return -1)
+    file = read_half(file); // the remote host writes the read half of a full-duplex netpipe
+
+    if (file->relay != NULL) {
+        // the readers of the destination get it, if there are
+        if (netpipefs_relay_urgent(file->relay, buf, size) == -1 && errno != EPIPE) err = errno;
+    } else if (file->readers > 0 && !file->force_exit) {
+        if (file->nurgent == NETPIPE_URGENT_QUEUE) { // the readers are late: the newest messages matter more
+            msg = file->urgent;
+            file->urgent = msg->next;
+            file->nurgent--;
+            free(msg);
+            DEBUG("urgent[%s] oldest message dropped\n", file->path);
+        }
+        if ((msg = (struct netpipe_urgent *) malloc(sizeof(struct netpipe_urgent) + size)) == NULL) {
+            err = errno;
+        } else {
+            msg->size = size;
+            msg->next = NULL;
+            memcpy(msg->data, buf, size);
+            for (last = &(file->urgent); *last != NULL; last = &((*last)->next));
+            *last = msg;
+            file->nurgent++;
+            if (poll_notify) loop_poll_notify(file, poll_notify);
+        }
+    } else {
+        DEBUG("urgent[%s] %ld bytes discarded: no readers\n", file->path, size);
+    }
+
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t netpipe_read_urgent(struct netpipe *file, char *buf, size_t size) {
+    int err = 0;
+    ssize_t bytes = 0;
+    struct netpipe_urgent *msg;
+
+    NOTZERO(netpipe_lock(file), return -1)
+    if (file->open_mode != O_RDONLY && file->open_mode != O_RDWR) {
+        err = EBADF;
+    } else if ((msg = (file = read_half(file))->urgent) == NULL) {
+        err = EAGAIN;
+    } else {
+        file->urgent = msg->next;
+        file->nurgent--;
+        bytes = msg->size < size ? msg->size : size;
+        memcpy(buf, msg->data, bytes);
+        free(msg);
+    }
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return bytes;
+}
+
+int netpipe_close_async(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *),
+                        netpipe_done_t done, void *arg) {
+    int err, async;
     size_t flushed = 0;
+    netpipe_req_t *req;
 
     NOTZERO(netpipe_lock(file), return -1)
 
@@ -741,105 +2426,274 @@ int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(const
         return -1;
     }
 
-    if (mode == O_WRONLY) {
-        file->writers--;
-        // if there aren't writers and there is something into the buffer
-        if (!file->force_exit && file->writers == 0 && file->readers > 0 && !cbuf_empty(file->buffer)) {
-            // Flush buffer: send data from buffer
-            err = do_flush(file, &flushed);
-            if (err > 0) DEBUG("flush[%s] %ld bytes\n", file->path, flushed);
-            while(!file->force_exit && file->readers > 0 && !cbuf_empty(file->buffer)) {
-                PTH(err, pthread_cond_wait(&(file->close), &(file->mtx)), netpipe_unlock(file); return -1)
+    // the read half of a full-duplex netpipe is closed at once, then it is closed like by a writer. If the
+    // connection is lost the close of the writer fails too
+    if (mode == O_RDWR) {
+        duplex_close_read(file);
+        mode = O_WRONLY;
+    }
+
+    // if the last writer is closing and there is something into the buffer or that a reader didn't take yet
+    if (mode == O_WRONLY && !file->force_exit && file->writers == 1 && close_waits(file)) {
+        // Flush buffer: send data from buffer
+        err = do_flush(file, &flushed);
+        if (err > 0 && flushed > 0) DEBUG("flush[%s] %ld bytes\n", file->path, flushed);
+
+        // Wait until the buffer is flushed. The writer is still counted so the file cannot be freed.
+        // With asyncclose the caller doesn't wait: the request drains the buffer and then closes
+        if (err > 0 && close_waits(file)) {
+            async = file->skt->asyncclose;
+            if (async) req = netpipe_new_request(file, mode, &netpipe_close_drained, file->skt, &netpipe_close_done);
+            else req = netpipe_new_request(file, mode, done, arg, &netpipe_close_done);
+            if (req != NULL) {
+                req->remove_open_file = remove_open_file;
+                req->poll_notify = poll_notify;
+                req->next = file->close_reqs;
+                file->close_reqs = req;
+                timer_arm(file, req, file->skt->linger);
+                if (async) {
+                    __atomic_add_fetch(&(file->skt->draining), 1, __ATOMIC_ACQ_REL);
+                    DEBUG("drain[%s] %ld bytes\n", file->path, cbuf_size(file->buffer));
+                }
+
+                NOTZERO(netpipe_unlock(file), return -1)
+                if (async) done(arg, 0, 0);
+                return 0;
             }
         }
-    } else if (mode == O_RDONLY) {
-        file->readers--;
     }
 
-    if (poll_notify) loop_poll_notify(file, poll_notify);
+    err = netpipe_close_unlock(file, mode, remove_open_file, poll_notify);
+    done(arg, err, err == -1 ? errno : 0);
 
-    bytes = send_close_message(&netpipefs_socket, file->path, mode);
-    if (bytes <= 0) err = -1;
+    return 0;
+}
 
-    DEBUGFILE(file);
-    if (file->writers == 0 && file->readers == 0 && available_remote(file) == 0) {
-        if (remove_open_file) MINUS1(remove_open_file(file->path), err = -1)
-        NOTZERO(netpipe_unlock(file), err = -1)
-        MINUS1(netpipe_free(file, NULL), err = -1)
-    } else {
-        NOTZERO(netpipe_unlock(file), err = -1)
-    }
+int netpipe_close(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *)) {
+    struct netpipe_sync sync;
+    netpipe_sync_init(&sync);
 
-    if (err == -1) return -1;
+    MINUS1(netpipe_close_async(file, mode, remove_open_file, poll_notify, &netpipe_sync_done, &sync), return -1)
 
-    return bytes; // > 0
+    // the file may be freed while waiting, so the waiter cannot spin on it
+    return netpipe_sync_wait(&sync, NULL);
 }
 
-int netpipe_close_update(struct netpipe *file, int mode, int (*remove_open_file)(const char *), void (*poll_notify)(void *)) {
+int netpipe_close_update(struct netpipe *file, int mode, int (*remove_open_file)(struct netpipe *), void (*poll_notify)(void *)) {
     int err;
     netpipe_req_t *req;
+    struct netpipe_users users;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
 
     NOTZERO(netpipe_lock(file), return -1)
+    if (mode == O_WRONLY) file = read_half(file); // the remote writer wrote the read half of a full-duplex netpipe
 
     if (mode == O_WRONLY) {
         file->writers--;
-        if (file->writers == 0) {
-            foreach_request(file, req) { // set error = EPIPE to all write requests
-                req->error = EPIPE;
-                PTH(err, pthread_cond_signal(&(req->waiting)), netpipe_unlock(file); return -1)
+        // the last record may not have its delimiter: the first read takes what is left
+        if (file->writers == 0 && file->delimiter != -1 && !file->messages && (req = (file->req_l)->head) != NULL
+            && !cbuf_empty(file->buffer)) {
+            req->bytes_processed = cbuf_size(file->buffer) < req->size ? cbuf_size(file->buffer) : req->size;
+            if ((err = delim_get(file, req->buf, req->bytes_processed)) <= 0) {
+                req->bytes_processed = 0;
+                req->error = err == 0 ? ECONNRESET : errno;
             }
-            (file->req_l)->head = NULL;
-            (file->req_l)->tail = NULL;
+            netpipe_complete_head(file, &wakelist);
+        }
+        if (file->writers == 0) // set error = EPIPE to all read requests
+            netpipe_complete_all(file, EPIPE, &wakelist);
+        // the writer didn't send early or it gave up: it forgot the credit granted early
+        if (file->writers == 0 && file->readers == 0 && file->early_granted > 0) {
+            early_release(file);
+            file->granted = 0;
         }
     } else if (mode == O_RDONLY) {
         file->readers--;
         if (file->readers == 0) {
             file->remotesize = 0;
-            file->remotemax = netpipefs_socket.remote_readahead;
-            foreach_request(file, req) { // set error = EPIPE to all write requests
-                req->error = EPIPE;
-                PTH(err, pthread_cond_signal(&(req->waiting)), netpipe_unlock(file); return -1)
+            file->remotemax = file->remote_readahead;
+            // the next reader must start from a message
+            if (file->messages && file->zc_ring == 0) cbuf_drop(file->buffer, cbuf_size(file->buffer));
+            if (file->messages && spooled(file) > 0) spool_drop(file->spool, spool_size(file->spool));
+            if (file->provisioned == O_WRONLY && file->writers > 0) {
+                // the window of a provisioned netpipe is granted again: its writers go on like with early data
+                file->early = 1;
+                if (file->close_reqs != NULL && !close_waits(file))
+                    netpipe_complete_list(&(file->close_reqs), 0, &wakelist);
+            } else {
+                // set error = EPIPE to all write requests
+                netpipe_complete_all(file, EPIPE, &wakelist);
+                // nobody will read the buffer: who is closing can close now
+                netpipe_complete_list(&(file->close_reqs), 0, &wakelist);
+                netpipe_complete_list(&(file->fsync_reqs), EPIPE, &wakelist);
             }
-            (file->req_l)->head = NULL;
-            (file->req_l)->tail = NULL;
         }
     }
 
     if (poll_notify) loop_poll_notify(file, poll_notify);
+    netpipe_users_hold(file, &users);
     DEBUGFILE(file);
 
-    if (file->writers == 0 && file->readers == 0 && available_remote(file) == 0) {
-        err = 0;
-        if (remove_open_file) MINUS1(remove_open_file(file->path), err = -1)
-        MINUS1(netpipe_unlock(file), err = -1)
-        MINUS1(netpipe_free(file, NULL), err = -1)
+    err = netpipe_release_unlock(file, remove_open_file);
+    waitq_wake_all(&wakelist);
+    netpipe_users_notify(&users);
 
-        return err;
-    }
+    return err;
+}
 
-    NOTZERO(netpipe_unlock(file), return -1)
+int netpipe_forget(struct netpipe *file, unsigned long nlookup, int (*remove_open_file)(struct netpipe *)) {
+    NOTZERO(netpipe_lock(file), return -1)
+    if (__atomic_sub_fetch(&(file->nlookup), nlookup, __ATOMIC_ACQ_REL) > 0) {
+        NOTZERO(netpipe_unlock(file), return -1)
+        return 0;
+    }
 
-    return 0;
+    return netpipe_release_unlock(file, remove_open_file);
 }
 
 int netpipe_force_exit(struct netpipe *file, void (*poll_notify)(void *)) {
-    int err;
-    netpipe_req_t *req;
+    struct netpipe_users users;
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
 
     MINUS1(netpipe_lock(file), return -1)
 
     file->force_exit = 1;
-    PTH(err, pthread_cond_broadcast(&(file->canopen)), netpipe_unlock(file); return -1)
-    PTH(err, pthread_cond_broadcast(&(file->close)), netpipe_unlock(file); return -1)
 
-    // set error = EPIPE to all write requests
-    foreach_request(file, req) {
-        PTH(err, pthread_cond_signal(&(req->waiting)), netpipe_unlock(file); return -1)
+    // complete all the pending requests
+    netpipe_complete_opens(file, ENOENT, &wakelist);
+    netpipe_complete_list(&(file->close_reqs), ENOENT, &wakelist);
+    netpipe_complete_list(&(file->fsync_reqs), EPIPE, &wakelist);
+    netpipe_complete_all(file, EPIPE, &wakelist);
+    if (file->rdhalf != NULL) {
+        file->rdhalf->force_exit = 1;
+        netpipe_complete_all(file->rdhalf, EPIPE, &wakelist);
     }
     if (poll_notify) loop_poll_notify(file, poll_notify);
+    netpipe_users_hold(file, &users);
 
     DEBUGFILE(file);
-    MINUS1(netpipe_unlock(file), return -1)
+    MINUS1(netpipe_unlock(file), waitq_wake_all(&wakelist); netpipe_users_notify(&users); return -1)
+    waitq_wake_all(&wakelist);
+    // the fan-out netpipe stops sending to this file and the relay ends
+    netpipe_users_notify(&users);
+
+    return 0;
+}
+
+int netpipe_fanout_attach(struct netpipe *file, struct fanout *fanout) {
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (file->force_exit) {
+        errno = ENOENT;
+        goto error;
+    }
+    if (file->open_mode != NOT_OPEN && file->open_mode != O_WRONLY) {
+        errno = EPERM;
+        goto error;
+    }
+    if (file->fanout != NULL || file->relay != NULL) {
+        errno = EBUSY;
+        goto error;
+    }
+
+    file->writers++;
+    if (send_open_message(file->skt, file->path, O_WRONLY) <= 0) {
+        file->writers--;
+        goto error;
+    }
+    file->open_mode = O_WRONLY;
+    file->fanout = fanout;
+    DEBUGFILE(file);
+
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+
+error:
+    netpipe_unlock(file);
+    return -1;
+}
+
+int netpipe_fanout_detach(struct netpipe *file) {
+    NOTZERO(netpipe_lock(file), return -1)
+    file->fanout = NULL;
+    NOTZERO(netpipe_unlock(file), return -1)
+
+    return 0;
+}
+
+ssize_t netpipe_fanout_send(struct netpipe *file, const char *buf, size_t size) {
+    int err;
+    size_t bytes = 0;
+
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (file->force_exit) {
+        errno = ENOENT;
+        netpipe_unlock(file);
+        return -1;
+    }
+    if (file->readers == 0) {
+        errno = EPIPE;
+        netpipe_unlock(file);
+        return -1;
+    }
+
+    if (size > 0) {
+        err = do_send(file, (char *) buf, size, &bytes);
+        if (err <= 0) {
+            if (err == 0) errno = ECONNRESET;
+            netpipe_unlock(file);
+            return -1;
+        }
+        if (bytes > 0) DEBUG("fanout send[%s] %ld bytes\n", file->path, bytes);
+    }
+
+    NOTZERO(netpipe_unlock(file), return -1)
+    return (ssize_t) bytes;
+}
+
+int netpipe_relay_attach(struct netpipe *file, int mode, struct relay *relay) {
+    int messages = mode & NETPIPE_MESSAGES;
+
+    mode &= ~NETPIPE_MESSAGES;
+    NOTZERO(netpipe_lock(file), return -1)
+
+    if (file->force_exit) {
+        errno = ENOENT;
+        goto error;
+    }
+    // open locally or used by someone else
+    if (file->open_mode != NOT_OPEN || file->fanout != NULL || file->relay != NULL) {
+        errno = EBUSY;
+        goto error;
+    }
+
+    // what the source of a relay which ended sent meanwhile is not forwarded
+    if (mode == O_RDONLY) cbuf_drop(file->buffer, cbuf_size(file->buffer));
+
+    if (mode == O_RDONLY) file->readers++;
+    else file->writers++;
+    if (send_open_message(file->skt, file->path, mode | messages) <= 0) {
+        netpipe_undo_open(file, mode);
+        goto error;
+    }
+    file->open_mode = mode;
+    if (mode == O_WRONLY) file->messages = messages != 0;
+    file->relay = relay;
+    DEBUGFILE(file);
+
+    NOTZERO(netpipe_unlock(file), return -1)
+    return 0;
+
+error:
+    netpipe_unlock(file);
+    return -1;
+}
+
+int netpipe_relay_detach(struct netpipe *file) {
+    NOTZERO(netpipe_lock(file), return -1)
+    file->relay = NULL;
+    NOTZERO(netpipe_unlock(file), return -1)
 
     return 0;
-}
\ No newline at end of file
+}
@@ -6,6 +6,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <time.h>
+#include <asm/socket.h>    // SO_ZEROCOPY
+#include <linux/errqueue.h>
+#include <linux/tcp.h>     // TCP_ZEROCOPY_RECEIVE
+#endif
 #include "../include/options.h"
 #include "../include/netpipefs_socket.h"
 #include "../include/scfiles.h"
@@ -15,6 +22,25 @@
 #define UNIX_PATH_MAX 108
 #define BASESOCKNAME "/tmp/sockfile"
 
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
+#define PADDING_SIZE 4096   // padding is written at most this many bytes at a time
+
+static const char padding[PADDING_SIZE];
+
+/** A message whose data was sent with MSG_ZEROCOPY */
+struct zerocopy_ticket {
+    uint32_t first;     // id of the first MSG_ZEROCOPY send
+    uint32_t count;     // how many MSG_ZEROCOPY sends
+    uint32_t remaining; // sends not completed yet
+    size_t size;        // how many bytes were sent
+    zerocopy_done_t done;
+    void *arg;
+    struct zerocopy_ticket *next;
+};
+
 /**
  * Set up a AF_INET address with the given ip and port
  *
@@ -80,22 +106,23 @@ ports_diff:
     return firstport - secondport;
 }
 
-int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long timeout) {
+int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, const struct netpipefs_options *options) {
     int err, fdlisten, fdaccepted, fdconnect, comparison, localhost;
+    size_t align = 0, shmsize = 0, remote_shmsize;
     char *host_received = NULL;
     struct sockaddr *conn_sa;
 
-    size_t host_len = strlen(netpipefs_options.hostip);
+    size_t host_len = strlen(options->hostip);
     if (host_len == 0) return -1;
 
     /* Set the sock addresses used for connect() and accept() */
-    localhost = strcmp(netpipefs_options.hostip, "localhost") == 0;
+    localhost = strcmp(options->hostip, "localhost") == 0;
     if (localhost) { // af_unix
         struct sockaddr_un acc_sa_un;
         struct sockaddr_un conn_sa_un;
-        afunix_address(&conn_sa_un, netpipefs_options.hostport);
+        afunix_address(&conn_sa_un, options->hostport);
         conn_sa = (struct sockaddr *) &conn_sa_un;
-        afunix_address(&acc_sa_un, netpipefs_options.port);
+        afunix_address(&acc_sa_un, options->port);
 
         /* Create accept() socket */
         MINUS1(fdlisten = socket(acc_sa_un.sun_family, SOCK_STREAM, 0), return -1)
@@ -104,11 +131,11 @@ int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long
     } else { // af_inet
         struct sockaddr_in acc_sa_in;
         struct sockaddr_in conn_sa_in;
-        err = afinet_address(&conn_sa_in, netpipefs_options.hostport, netpipefs_options.hostip);
+        err = afinet_address(&conn_sa_in, options->hostport, options->hostip);
         if (err == -1) return -1;
         conn_sa = (struct sockaddr *) &conn_sa_in;
 
-        err = afinet_address(&acc_sa_in, netpipefs_options.port, NULL);
+        err = afinet_address(&acc_sa_in, options->port, NULL);
         if (err == -1) return -1;
 
         /* Create accept() socket */
@@ -122,19 +149,37 @@ int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long
     /* Listen */
     MINUS1(listen(fdlisten, SOMAXCONN), close(fdlisten); close(fdconnect); return -1)
 
-    fdaccepted = sock_connect_while_accept(fdconnect, fdlisten, conn_sa, timeout, CONNECT_INTERVAL);
+    fdaccepted = sock_connect_while_accept(fdconnect, fdlisten, conn_sa, options->timeout, CONNECT_INTERVAL);
     // do not listen for other connections
     close(fdlisten);
     if (localhost)
-        MINUS1(unlink_afunix_socket(netpipefs_options.port), goto error)
+        MINUS1(unlink_afunix_socket(options->port), goto error)
 
     if (fdaccepted == -1) { // double connect failed
         close(fdconnect);
         return -1;
     }
+    netpipefs_socket->readahead = options->readahead;
+    netpipefs_socket->writeahead = options->writeahead;
+    netpipefs_socket->spooldir = options->spooldir;
+    netpipefs_socket->spoolmax = options->spoolmax;
+    netpipefs_socket->busypoll = options->busypoll;
+    netpipefs_socket->readmin = options->readmin;
+    netpipefs_socket->readtime = options->readtime;
+    netpipefs_socket->timerfd = -1;
+    netpipefs_socket->earlydata = options->earlydata;
+    netpipefs_socket->earlymax = options->earlymax;
+    netpipefs_socket->asyncclose = options->asyncclose;
+    netpipefs_socket->linger = options->linger;
+    netpipefs_socket->draining = 0;
+    netpipefs_socket->early_used = 0;
+    netpipefs_socket->zc_map = NULL;
+    netpipefs_socket->zc_map_len = 0;
+    netpipefs_socket->shm_tx = NULL;
+    netpipefs_socket->shm_rx = NULL;
 
     /* send host */
-    err = sock_write_h(fdconnect, (void *) netpipefs_options.hostip, sizeof(char) * (1 + host_len));
+    err = sock_write_h(fdconnect, (void *) options->hostip, sizeof(char) * (1 + host_len));
     if (err <= 0) goto error;
 
     /* read other host */
@@ -142,35 +187,103 @@ int establish_socket_connection(struct netpipefs_socket *netpipefs_socket, long
     if (err <= 0) goto error;
 
     /* compare the hosts */
-    comparison = hostcmp(netpipefs_options.hostip, netpipefs_options.hostport, host_received, netpipefs_options.port);
+    comparison = hostcmp(options->hostip, options->hostport, host_received, options->port);
 
     if (comparison > 0) { // use fdaccepted (acc_sa)
         MINUS1(close(fdconnect), goto error)
         fdconnect = -1;
 
         netpipefs_socket->fd = fdaccepted;
+        netpipefs_socket->wr_bytes = 0;
     } else if (comparison < 0) { // use fdconnect (conn_sa)
         MINUS1(close(fdaccepted), goto error)
         fdaccepted = -1;
 
         netpipefs_socket->fd = fdconnect;
+        netpipefs_socket->wr_bytes = sizeof(size_t) + sizeof(char) * (1 + host_len); // the host was sent
     } else {
         errno = EINVAL;
         goto error;
     }
 
+#ifdef SO_BUSY_POLL
+    /* Let the kernel busy poll the device queue on blocking reads. Best effort: AF_UNIX sockets don't support it */
+    if (options->busypoll > 0 && !localhost)
+        setsockopt(netpipefs_socket->fd, SOL_SOCKET, SO_BUSY_POLL, &netpipefs_socket->busypoll, sizeof(int));
+#endif
+
+    /* Large payloads are sent without copying them. AF_UNIX sockets don't support it */
+    netpipefs_socket->zerocopy = 0;
+    netpipefs_socket->zc_next = 0;
+    netpipefs_socket->zc_reaping = 0;
+    netpipefs_socket->zc_head = NULL;
+    netpipefs_socket->zc_tail = NULL;
+#ifdef HAVE_ZEROCOPY
+    if (options->zerocopy > 0 && !localhost) {
+        int one = 1;
+        if (setsockopt(netpipefs_socket->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(int)) == 0)
+            netpipefs_socket->zerocopy = options->zerocopy;
+        else DEBUG("zerocopy is not supported: %s\n", strerror(errno));
+    }
+#endif
+
+#ifdef TCP_ZEROCOPY_RECEIVE
+    /* Large payloads are mapped instead of copied. The remote host will send them page-aligned */
+    if (options->zerocopyrecv && !localhost) {
+        long pagesize = sysconf(_SC_PAGESIZE);
+        size_t len = ((size_t) options->maxio + pagesize - 1) / pagesize * pagesize;
+        void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, netpipefs_socket->fd, 0);
+        if (map != MAP_FAILED) {
+            netpipefs_socket->zc_map = (char *) map;
+            netpipefs_socket->zc_map_len = len;
+            align = pagesize;
+        } else DEBUG("zerocopy receive is not supported: %s\n", strerror(errno));
+    }
+#endif
+
+    /* Messages are moved through shared memory if both hosts want it */
+    if (localhost && options->shmsize > 0) shmsize = options->shmsize;
+
     /* send local readahead value */
-    err = writen(netpipefs_socket->fd, &netpipefs_options.readahead, sizeof(size_t));
+    err = writen(netpipefs_socket->fd, &netpipefs_socket->readahead, sizeof(size_t));
     if (err <= 0) goto error;
 
+    /* send the page size used to map payloads */
+    err = writen(netpipefs_socket->fd, &align, sizeof(size_t));
+    if (err <= 0) goto error;
+
+    /* send the capacity of the shared memory ring */
+    err = writen(netpipefs_socket->fd, &shmsize, sizeof(size_t));
+    if (err <= 0) goto error;
+    netpipefs_socket->wr_bytes += 3 * sizeof(size_t);
+
     /* read remote readahead value */
     err = readn(netpipefs_socket->fd, &netpipefs_socket->remote_readahead, sizeof(size_t));
     if (err <= 0) goto error;
 
+    /* read remote page size */
+    err = readn(netpipefs_socket->fd, &netpipefs_socket->remote_align, sizeof(size_t));
+    if (err <= 0) goto error;
+
+    /* read remote ring capacity */
+    err = readn(netpipefs_socket->fd, &remote_shmsize, sizeof(size_t));
+    if (err <= 0) goto error;
+
+    if (shmsize > 0 && remote_shmsize > 0) {
+        err = socket_shm_connect(netpipefs_socket, shmsize);
+        if (err <= 0) goto error;
+    }
+
     free(host_received);
     return 0;
 
 error:
+    if (netpipefs_socket->zc_map) munmap(netpipefs_socket->zc_map, netpipefs_socket->zc_map_len);
+    netpipefs_socket->zc_map = NULL;
+    shmring_free(netpipefs_socket->shm_tx);
+    netpipefs_socket->shm_tx = NULL;
+    shmring_free(netpipefs_socket->shm_rx);
+    netpipefs_socket->shm_rx = NULL;
     if (fdaccepted != -1) close(fdaccepted);
     if (fdconnect != -1) close(fdconnect);
     if (host_received) free(host_received);
@@ -178,29 +291,185 @@ error:
 }
 
 int end_socket_connection(struct netpipefs_socket *netpipefs_socket) {
+    if (netpipefs_socket->zc_map) {
+        munmap(netpipefs_socket->zc_map, netpipefs_socket->zc_map_len);
+        netpipefs_socket->zc_map = NULL;
+    }
+    shmring_free(netpipefs_socket->shm_tx);
+    netpipefs_socket->shm_tx = NULL;
+    shmring_free(netpipefs_socket->shm_rx);
+    netpipefs_socket->shm_rx = NULL;
     return close(netpipefs_socket->fd);
 }
 
+int socket_shm_connect(struct netpipefs_socket *skt, size_t size) {
+    int err, fds[SHMRING_FDS];
+
+    EQNULL(skt->shm_tx = shmring_create(size), return -1)
+
+    /* Both hosts send their ring before receiving the other one */
+    err = sock_send_fds(skt->fd, shmring_fds(skt->shm_tx), SHMRING_FDS);
+    if (err > 0)
+        err = sock_recv_fds(skt->fd, fds, SHMRING_FDS);
+    if (err > 0 && (skt->shm_rx = shmring_attach(fds)) == NULL)
+        err = -1;
+    if (err <= 0) {
+        shmring_free(skt->shm_tx);
+        skt->shm_tx = NULL;
+    }
+
+    return err;
+}
+
+int socket_pollfd(struct netpipefs_socket *skt) {
+    return skt->shm_rx != NULL ? shmring_pollfd(skt->shm_rx) : skt->fd;
+}
+
+int socket_ready(struct netpipefs_socket *skt) {
+    return skt->shm_rx != NULL ? shmring_ready(skt->shm_rx) : 0;
+}
+
+ssize_t read_socket(struct netpipefs_socket *skt, void *buf, size_t n) {
+    if (skt->shm_rx != NULL) return shmring_readn(skt->shm_rx, (char *) buf, n, skt->fd);
+    return readn(skt->fd, buf, n);
+}
+
+ssize_t read_socket_cbuf(struct netpipefs_socket *skt, cbuf_t *cbuf, size_t n) {
+    size_t done = 0, len, put;
+    char *data;
+    int err;
+
+    if (skt->shm_rx == NULL) return cbuf_readn(skt->fd, cbuf, n);
+
+    while (done < n) {
+        len = shmring_peek(skt->shm_rx, &data);
+        if (len == 0) {
+            err = shmring_wait(skt->shm_rx, skt->fd);
+            if (err == -1 && done == 0) return -1;
+            if (err <= 0) break;
+            continue;
+        }
+        if (len > n - done) len = n - done;
+
+        put = cbuf_put(cbuf, data, len);
+        shmring_consume(skt->shm_rx, put);
+        done += put;
+        if (put != len) break; // the buffer is full
+    }
+    shmring_release(skt->shm_rx);
+
+    return done;
+}
+
+ssize_t skip_socket(struct netpipefs_socket *skt, size_t n) {
+    char discard[4096];
+    size_t done = 0, len;
+    ssize_t bytes;
+
+    while (done < n) {
+        len = n - done < sizeof(discard) ? n - done : sizeof(discard);
+        bytes = read_socket(skt, discard, len);
+        if (bytes <= 0) return bytes;
+        done += bytes;
+    }
+
+    return done;
+}
+
+/** Like sock_read_h() but the data can be read from the shared memory ring */
+static int skt_read_h(struct netpipefs_socket *skt, void **ptr) {
+    int bytes;
+    size_t size = 0;
+
+    if (skt->shm_rx == NULL) return sock_read_h(skt->fd, ptr);
+
+    bytes = read_socket(skt, &size, sizeof(size_t));
+    if (bytes <= 0) return bytes;
+
+    if (size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (*ptr != NULL) free(*ptr);
+    EQNULL(*ptr = (void*) malloc(size), return -1)
+
+    bytes = read_socket(skt, *ptr, size);
+    if (bytes <= 0) free(*ptr);
+
+    return bytes;
+}
+
+/**
+ * Like writen() but it counts the bytes written into the socket. The caller must hold the write lock.
+ */
+static int skt_writen(struct netpipefs_socket *skt, void *ptr, size_t n) {
+    int bytes;
+
+    if (skt->shm_tx != NULL) bytes = shmring_writen(skt->shm_tx, (const char *) ptr, n, skt->fd);
+    else bytes = writen(skt->fd, ptr, n);
+    if (bytes > 0) skt->wr_bytes += bytes;
+    return bytes;
+}
+
 /**
  * Write to the socket the message header
  *
- * @param fd_skt socket file descriptor
+ * @param skt netpipefs socket structure
  * @param message message header
  * @param path path relative to the message
  * @return 0 if the connection is lost, more than zero on success, -1 on error
  */
-static int send_socket_header(int fd_skt, enum netpipefs_header message, const char *path) {
-    int bytes = writen(fd_skt, &message, sizeof(enum netpipefs_header));
-    if (bytes <= 0) return bytes;
+static int send_socket_header(struct netpipefs_socket *skt, enum netpipefs_header message, const char *path) {
+    size_t len = sizeof(char) * (strlen(path) + 1);
+    int bytes = skt_writen(skt, &message, sizeof(enum netpipefs_header));
+    if (bytes > 0)
+        bytes = skt_writen(skt, &len, sizeof(size_t));
+    if (bytes > 0)
+        bytes = skt_writen(skt, (void *) path, len);
+    return bytes;
+}
+
+/**
+ * Write to the socket the header of a WRITE message and the size of its data. If the remote host maps the
+ * payloads and the data is large enough then it writes a WRITE_ALIGNED message, whose data starts at a
+ * page-aligned offset of the stream.
+ *
+ * @param skt netpipefs socket structure
+ * @param path path relative to the message
+ * @param size how much data will be written
+ * @return 0 if the connection is lost, more than zero on success, -1 on error
+ */
+static int send_write_header(struct netpipefs_socket *skt, const char *path, size_t size) {
+    int bytes;
+    size_t pad, len, align = skt->remote_align;
+
+    if (align == 0 || size < ALIGNED_WRITE_MIN) {
+        bytes = send_socket_header(skt, WRITE, path);
+        if (bytes > 0)
+            bytes = skt_writen(skt, &size, sizeof(size_t));
+        return bytes;
+    }
+
+    bytes = send_socket_header(skt, WRITE_ALIGNED, path);
+    if (bytes > 0)
+        bytes = skt_writen(skt, &size, sizeof(size_t));
+    pad = (align - (skt->wr_bytes + sizeof(size_t)) % align) % align;
+    if (bytes > 0)
+        bytes = skt_writen(skt, &pad, sizeof(size_t));
+    while (bytes > 0 && pad > 0) {
+        len = pad < PADDING_SIZE ? pad : PADDING_SIZE;
+        bytes = skt_writen(skt, (void *) padding, len);
+        pad -= len;
+    }
 
-    bytes = sock_write_h(fd_skt, (void *) path, sizeof(char) * (strlen(path) + 1));
     return bytes;
 }
 
 int read_socket_header(struct netpipefs_socket *skt, enum netpipefs_header *header, char **path) {
-    int bytes = readn(skt->fd, header, sizeof(enum netpipefs_header));
+    int bytes = read_socket(skt, header, sizeof(enum netpipefs_header));
     if (bytes > 0)
-        return sock_read_h(skt->fd, (void **) path);
+        return skt_read_h(skt, (void **) path);
 
     return bytes; // <= 0
 }
@@ -210,9 +479,9 @@ int send_open_message(struct netpipefs_socket *skt, const char *path, int mode)
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
 
-    bytes = send_socket_header(skt->fd, OPEN, path);
+    bytes = send_socket_header(skt, OPEN, path);
     if (bytes > 0) {
-        bytes = writen(skt->fd, &mode, sizeof(int));
+        bytes = skt_writen(skt, &mode, sizeof(int));
     }
 
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
@@ -226,9 +495,9 @@ int send_close_message(struct netpipefs_socket *skt, const char *path, int mode)
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
 
-    bytes = send_socket_header(skt->fd, CLOSE, path);
+    bytes = send_socket_header(skt, CLOSE, path);
     if (bytes > 0) {
-        bytes = writen(skt->fd, &mode, sizeof(int));
+        bytes = skt_writen(skt, &mode, sizeof(int));
     }
 
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
@@ -237,16 +506,36 @@ int send_close_message(struct netpipefs_socket *skt, const char *path, int mode)
     return bytes;
 }
 
+/**
+ * Like cbuf_writen() but data is written into the shared memory ring. The caller must hold the write lock.
+ */
+static int skt_cbuf_writen(struct netpipefs_socket *skt, cbuf_t *cbuf, size_t n) {
+    int bytes;
+    size_t done = 0, len;
+    char *data;
+
+    while (done < n && (len = cbuf_peek(cbuf, 0, &data)) > 0) {
+        if (len > n - done) len = n - done;
+        bytes = skt_writen(skt, data, len);
+        if (bytes <= 0) return done > 0 ? (int) done : bytes;
+        cbuf_drop(cbuf, bytes);
+        done += bytes;
+    }
+
+    return done;
+}
+
 int send_flush_message(struct netpipefs_socket *skt, struct netpipe *file, size_t size) {
     int err, bytes;
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
 
-    bytes = send_socket_header(skt->fd, WRITE, file->path);
-    if (bytes > 0)
-        bytes = writen(skt->fd, &size, sizeof(size_t));
-    if (bytes > 0 && size > 0) {
+    bytes = send_write_header(skt, file->path, size);
+    if (bytes > 0 && size > 0 && skt->shm_tx != NULL) {
+        bytes = skt_cbuf_writen(skt, file->buffer, size);
+    } else if (bytes > 0 && size > 0) {
         bytes = cbuf_writen(skt->fd, file->buffer, size);
+        if (bytes > 0) skt->wr_bytes += bytes;
     }
 
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
@@ -260,9 +549,9 @@ int send_write_message(struct netpipefs_socket *skt, const char *path, const cha
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
 
-    bytes = send_socket_header(skt->fd, WRITE, path);
+    bytes = send_write_header(skt, path, size);
     if (bytes > 0) {
-        bytes = sock_write_h(skt->fd, (void *) buf, size);
+        bytes = skt_writen(skt, (void *) buf, size);
     }
 
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
@@ -271,14 +560,347 @@ int send_write_message(struct netpipefs_socket *skt, const char *path, const cha
     return bytes;
 }
 
+/**
+ * Write n bytes to the socket. If zerocopy is 1 then they are sent with MSG_ZEROCOPY, until the kernel
+ * cannot pin more memory: then zerocopy is set to 0 and the rest is copied.
+ *
+ * @param calls incremented by one for each MSG_ZEROCOPY send
+ * @return number of bytes wrote or -1 on error or 0 on end of file
+ */
+static ssize_t zerocopy_writen(int fd, const char *buf, size_t n, int *zerocopy, uint32_t *calls) {
+    size_t   nleft;
+    ssize_t  nwritten;
+
+    nleft = n;
+    while (nleft > 0) {
+#ifdef HAVE_ZEROCOPY
+        if (*zerocopy) nwritten = send(fd, buf, nleft, MSG_ZEROCOPY);
+        else
+#endif
+        nwritten = write(fd, buf, nleft);
+        if (nwritten < 0) {
+            if (errno == ENOBUFS && *zerocopy) {
+                *zerocopy = 0;
+                continue;
+            }
+            if (nleft == n) return -1; /* error, return -1 */
+            else break; /* error, return amount written so far */
+        } else if (nwritten == 0) break;
+        if (*zerocopy) (*calls)++;
+        nleft -= nwritten;
+        buf += nwritten;
+    }
+    return(n - nleft); /* return >= 0 */
+}
+
+/**
+ * Add the ticket to the list of messages in flight. The caller must hold the write lock.
+ * If no MSG_ZEROCOPY send was done then the ticket is added only if it is ordered and there is a
+ * previous message whose completion function was not called yet, otherwise it is freed.
+ *
+ * @param pending set to 1 if the ticket was added, 0 otherwise
+ */
+static void zerocopy_push(struct netpipefs_socket *skt, struct zerocopy_ticket *ticket, uint32_t calls, size_t size,
+                          int ordered, int *pending) {
+    *pending = 0;
+    if (ticket == NULL) return;
+    if (calls == 0 && !(ordered && (skt->zc_head != NULL || skt->zc_reaping))) {
+        free(ticket);
+        return;
+    }
+
+    ticket->first = skt->zc_next;
+    ticket->count = calls;
+    ticket->remaining = calls;
+    ticket->size = size;
+    ticket->next = NULL;
+    skt->zc_next += calls;
+
+    if (skt->zc_tail != NULL) skt->zc_tail->next = ticket;
+    else skt->zc_head = ticket;
+    skt->zc_tail = ticket;
+    *pending = 1;
+}
+
+int send_write_message_zc(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size,
+                          zerocopy_done_t done, void *arg, int *pending) {
+    int err, bytes, zerocopy;
+    uint32_t calls = 0;
+    struct zerocopy_ticket *ticket;
+
+    EQNULL(ticket = (struct zerocopy_ticket *) malloc(sizeof(struct zerocopy_ticket)), return -1)
+    ticket->done = done;
+    ticket->arg = arg;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), free(ticket); return -1)
+
+    zerocopy = skt->zerocopy > 0 && size >= skt->zerocopy;
+    bytes = send_write_header(skt, path, size);
+    if (bytes > 0)
+        bytes = zerocopy_writen(skt->fd, buf, size, &zerocopy, &calls);
+    if (bytes > 0) skt->wr_bytes += bytes;
+    zerocopy_push(skt, ticket, calls, bytes > 0 ? bytes : 0, 0, pending);
+
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+    if (bytes > 0) DEBUG("sent: WRITE %s %ld <%s DATA>\n", path, size, calls > 0 ? "ZEROCOPY":"COPIED");
+
+    return bytes;
+}
+
+int send_flush_message_zc(struct netpipefs_socket *skt, struct netpipe *file, size_t offset, size_t size, int ordered,
+                          zerocopy_done_t done, void *arg, int *pending) {
+    int err, bytes, zerocopy;
+    uint32_t calls = 0;
+    size_t sent = 0, len;
+    char *data;
+    struct zerocopy_ticket *ticket;
+
+    EQNULL(ticket = (struct zerocopy_ticket *) malloc(sizeof(struct zerocopy_ticket)), return -1)
+    ticket->done = done;
+    ticket->arg = arg;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), free(ticket); return -1)
+
+    zerocopy = skt->zerocopy > 0 && size >= skt->zerocopy;
+    bytes = send_write_header(skt, file->path, size);
+    while (bytes > 0 && sent < size && (len = cbuf_peek(file->buffer, offset + sent, &data)) > 0) {
+        if (len > size - sent) len = size - sent;
+        bytes = zerocopy_writen(skt->fd, data, len, &zerocopy, &calls);
+        if (bytes > 0) sent += bytes;
+        if (bytes > 0) skt->wr_bytes += bytes;
+        if (bytes > 0 && (size_t) bytes != len) break;
+    }
+    if (bytes > 0) bytes = sent;
+    zerocopy_push(skt, ticket, calls, sent, ordered, pending);
+
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+    if (bytes > 0) DEBUG("sent: WRITE %s %ld <%s DATA>\n", file->path, size, calls > 0 ? "ZEROCOPY":"COPIED");
+
+    return bytes;
+}
+
+#ifdef HAVE_ZEROCOPY
+/**
+ * Mark as completed the MSG_ZEROCOPY sends with the ids in the range [lo, hi]. The range can wrap around.
+ */
+static void zerocopy_complete(struct netpipefs_socket *skt, uint32_t lo, uint32_t hi) {
+    struct zerocopy_ticket *ticket;
+    uint32_t i;
+
+    for (ticket = skt->zc_head; ticket != NULL; ticket = ticket->next) {
+        for (i = 0; i < ticket->count; i++) {
+            if ((uint32_t) (ticket->first + i - lo) <= (uint32_t) (hi - lo)) ticket->remaining--;
+        }
+    }
+}
+#endif
+
+/**
+ * Call the completion function of the messages at the head of the list which are done, in order.
+ * If all is 1 then every message is considered done.
+ */
+static void zerocopy_run(struct netpipefs_socket *skt, int all) {
+    int err;
+    struct zerocopy_ticket *done, *last, *ticket;
+
+    while (1) {
+        PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return)
+        done = skt->zc_head;
+        last = NULL;
+        for (ticket = skt->zc_head; ticket != NULL && (all || ticket->remaining == 0); ticket = ticket->next)
+            last = ticket;
+        if (last == NULL) {
+            skt->zc_reaping = 0;
+            PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return)
+            return;
+        }
+        // until the functions are called, the ordered messages sent meanwhile must wait for them
+        skt->zc_reaping = 1;
+        skt->zc_head = last->next;
+        if (skt->zc_head == NULL) skt->zc_tail = NULL;
+        last->next = NULL;
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return)
+
+        while ((ticket = done) != NULL) {
+            done = ticket->next;
+            ticket->done(ticket->arg, ticket->size);
+            free(ticket);
+        }
+    }
+}
+
+int netpipefs_zerocopy_reap(struct netpipefs_socket *skt) {
+#ifdef HAVE_ZEROCOPY
+    int err;
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(skt->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+
+        PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY && serr->ee_errno == 0)
+                zerocopy_complete(skt, serr->ee_info, serr->ee_data);
+        }
+        PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+    }
+
+    zerocopy_run(skt, 0);
+#endif
+    return 0;
+}
+
+void netpipefs_zerocopy_abort(struct netpipefs_socket *skt) {
+    int err;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return)
+    skt->zerocopy = 0;
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return)
+
+    zerocopy_run(skt, 1);
+}
+
+int send_splice_message(struct netpipefs_socket *skt, const char *path, int fd, size_t size) {
+    int err, bytes;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+
+    bytes = send_write_header(skt, path, size);
+    if (bytes > 0 && skt->shm_tx != NULL)
+        bytes = shmring_readfd(skt->shm_tx, fd, size, skt->fd);
+    else if (bytes > 0)
+        bytes = splicen(fd, skt->fd, size);
+    if (bytes > 0) skt->wr_bytes += bytes;
+
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+    if (bytes > 0) DEBUG("sent: WRITE %s %ld <SPLICED DATA>\n", path, size);
+
+    return bytes;
+}
+
+/**
+ * Like recv_mapped() but iov points to the data into the shared memory ring, whose space is held until the next read.
+ * If the data must wait for the producer or there are no more elements in iov then what was taken from the ring is
+ * copied into buf and released, because the producer may need that space.
+ */
+static ssize_t recv_shm(struct netpipefs_socket *skt, char *buf, size_t size, struct iovec *iov, int *iovcnt) {
+    int i, err, n = 0, max = *iovcnt;
+    size_t done = 0, offset, len;
+    char *data;
+
+    while (done < size) {
+        len = shmring_peek(skt->shm_rx, &data);
+        if (len == 0 || n == max) {
+            for (i = 0, offset = 0; i < n; offset += iov[i].iov_len, i++) {
+                if ((char *) iov[i].iov_base != buf + offset) memcpy(buf + offset, iov[i].iov_base, iov[i].iov_len);
+            }
+            if (n > 0) {
+                iov[0].iov_base = buf;
+                iov[0].iov_len = done;
+                n = 1;
+            }
+        }
+        if (len == 0) {
+            err = shmring_wait(skt->shm_rx, skt->fd);
+            if (err <= 0) return err;
+            continue;
+        }
+        if (len > size - done) len = size - done;
+
+        if (n < max) {
+            iov[n].iov_base = data;
+            iov[n].iov_len = len;
+            n++;
+        } else { // iov[0] points to buf
+            memcpy(buf + done, data, len);
+            iov[0].iov_len += len;
+        }
+        shmring_consume(skt->shm_rx, len);
+        done += len;
+    }
+
+    *iovcnt = n;
+    return done;
+}
+
+ssize_t recv_mapped(struct netpipefs_socket *skt, char *buf, size_t size, struct iovec *iov, int *iovcnt) {
+    int n = 0, max = *iovcnt;
+    size_t done = 0, copy;
+    ssize_t bytes;
+#ifdef TCP_ZEROCOPY_RECEIVE
+    struct tcp_zerocopy_receive zc;
+    socklen_t zclen;
+    size_t len, mapped = 0, pagesize = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+
+    if (skt->shm_rx != NULL) return recv_shm(skt, buf, size, iov, iovcnt);
+
+    while (done < size) {
+        copy = size - done;
+#ifdef TCP_ZEROCOPY_RECEIVE
+        len = (size - done) / pagesize * pagesize;
+        if (len > skt->zc_map_len - mapped) len = skt->zc_map_len - mapped;
+        // the last element is kept for the data which is copied
+        if (skt->zc_map != NULL && len > 0 && n < max - 1) {
+            memset(&zc, 0, sizeof(zc));
+            zc.address = (uint64_t) (uintptr_t) (skt->zc_map + mapped);
+            zc.length = len;
+            zclen = sizeof(zc);
+            if (getsockopt(skt->fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zclen) == -1) {
+                DEBUG("cannot map payload: %s\n", strerror(errno));
+            } else if (zc.length > 0) {
+                iov[n].iov_base = skt->zc_map + mapped;
+                iov[n].iov_len = zc.length;
+                n++;
+                mapped += zc.length;
+                done += zc.length;
+                continue;
+            } else if (zc.recv_skip_hint > 0) { // these bytes are not page-aligned
+                copy = zc.recv_skip_hint < copy ? zc.recv_skip_hint : copy;
+            } else { // data didn't arrive yet
+                copy = pagesize < copy ? pagesize : copy;
+            }
+        }
+#endif
+        bytes = readn(skt->fd, buf + done, copy);
+        if (bytes <= 0) return bytes;
+        if ((size_t) bytes != copy) return 0; // end of file
+
+        if (n > 0 && (char *) iov[n-1].iov_base + iov[n-1].iov_len == buf + done) {
+            iov[n-1].iov_len += copy;
+        } else {
+            iov[n].iov_base = buf + done;
+            iov[n].iov_len = copy;
+            n++;
+        }
+        done += copy;
+    }
+
+    *iovcnt = n;
+    return done;
+}
+
 int send_read_message(struct netpipefs_socket *skt, const char *path, size_t size) {
     int err, bytes;
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
 
-    bytes = send_socket_header(skt->fd, READ, path);
+    bytes = send_socket_header(skt, READ, path);
     if (bytes > 0) {
-        bytes = writen(skt->fd, &size, sizeof(size_t));
+        bytes = skt_writen(skt, &size, sizeof(size_t));
     }
 
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
@@ -292,13 +914,30 @@ int send_read_request_message(struct netpipefs_socket *skt, const char *path, si
 
     PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
 
-    bytes = send_socket_header(skt->fd, READ_REQUEST, path);
+    bytes = send_socket_header(skt, READ_REQUEST, path);
     if (bytes > 0) {
-        bytes = writen(skt->fd, &size, sizeof(size_t));
+        bytes = skt_writen(skt, &size, sizeof(size_t));
     }
 
     PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
     if (bytes > 0) DEBUG("sent: READ_REQUEST %s %ld\n", path, size);
 
     return bytes;
-}
\ No newline at end of file
+}
+
+int send_urgent_message(struct netpipefs_socket *skt, const char *path, const char *buf, size_t size) {
+    int err, bytes;
+
+    PTH(err, pthread_mutex_lock(&(skt->wr_mtx)), return -1)
+
+    bytes = send_socket_header(skt, URGENT, path);
+    if (bytes > 0)
+        bytes = skt_writen(skt, &size, sizeof(size_t));
+    if (bytes > 0)
+        bytes = skt_writen(skt, (void *) buf, size);
+
+    PTH(err, pthread_mutex_unlock(&(skt->wr_mtx)), return -1)
+    if (bytes > 0) DEBUG("sent: URGENT %s %ld\n", path, size);
+
+    return bytes;
+}
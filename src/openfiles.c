@@ -1,127 +1,288 @@
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include "../include/openfiles.h"
+#include "../include/netpipefs_socket.h"
 #include "../include/utils.h"
-#include "../include/icl_hash.h"
 
-#define NBUCKETS 128 // number of buckets used for the open files hash table
+#define NBUCKETS 128 // initial number of buckets of the open files hash table
+#define NSTRIPES 64  // number of locks. Bucket i is protected by lock i % NSTRIPES
+#define MAX_LOAD 1   // the table doubles when there are more than MAX_LOAD files per bucket
 
-extern struct netpipefs_socket netpipefs_socket;
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
 
-static icl_hash_t *open_files_table = NULL; // hash table with all the open files. Each file has its path as key
-static pthread_mutex_t open_files_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* Each lock is padded to its own cache line to avoid false sharing between stripes */
+union stripe {
+    pthread_rwlock_t lock;
+    char pad[128];
+};
 
-int netpipefs_open_files_table_init(void) {
-    // destroys the table if it already exists
-    if (open_files_table != NULL) MINUS1(netpipefs_open_files_table_destroy(), return -1)
+/* Hash table with all the open files. Each file has its path as key and the files into the same
+ * bucket are chained by their next field. The number of buckets is always a power of two and a
+ * multiple of NSTRIPES, so all the files of a bucket hash to the same stripe even after a resize. */
+struct open_files_table {
+    struct netpipe **buckets;
+    size_t nbuckets;
+    size_t count; // number of files into the table
+    union stripe stripes[NSTRIPES];
+};
 
-    open_files_table = icl_hash_create(NBUCKETS, NULL, NULL);
-    if (open_files_table == NULL) return -1;
+/* FNV-1a hash of the given string */
+static unsigned long hash_path(const char *path) {
+    unsigned long hash = FNV_OFFSET;
+    while (*path != '\0') {
+        hash ^= (unsigned char) *path++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
 
-    return 0;
+static pthread_rwlock_t *stripe_of(struct open_files_table *table, unsigned long hash) {
+    return &(table->stripes[hash & (NSTRIPES - 1)].lock);
 }
 
-int netpipefs_shutdown(void) {
+/* Should be called while holding the stripe of the given hash */
+static struct netpipe **find_link(struct open_files_table *table, const char *path, unsigned long hash) {
+    struct netpipe **link = &(table->buckets[hash & (table->nbuckets - 1)]);
+    while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, path) != 0))
+        link = &((*link)->next);
+    return link;
+}
+
+/* Acquires every stripe so no one is using the buckets */
+static int lock_all(struct open_files_table *table) {
     int i, err;
-    struct icl_entry_s *entry; // hash table entry
-    char *path; // entry's key
-    struct netpipe *file; // entry's value
-
-    PTH(err, pthread_mutex_lock(&open_files_mtx), return -1)
-
-    if (open_files_table != NULL) {
-        icl_hash_foreach(open_files_table, i, entry, path, file) {
-            err = netpipe_force_exit(file, &netpipefs_poll_notify);
-            if (err == -1) {
-                pthread_mutex_unlock(&open_files_mtx);
-                return -1;
-            }
+    for (i = 0; i < NSTRIPES; i++) {
+        if ((err = pthread_rwlock_wrlock(&(table->stripes[i].lock))) != 0) {
+            while (--i >= 0) pthread_rwlock_unlock(&(table->stripes[i].lock));
+            errno = err;
+            return -1;
         }
     }
+    return 0;
+}
 
-    PTH(err, pthread_mutex_unlock(&open_files_mtx), return -1)
+static void unlock_all(struct open_files_table *table) {
+    int i;
+    for (i = NSTRIPES - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&(table->stripes[i].lock));
+}
+
+/* Doubles the number of buckets. The files are moved by using their cached hash */
+static int table_grow(struct open_files_table *table) {
+    size_t i, nbuckets;
+    struct netpipe **buckets, *file, *next;
+
+    MINUS1(lock_all(table), return -1)
+
+    // someone else has already done it
+    if (__atomic_load_n(&(table->count), __ATOMIC_RELAXED) <= table->nbuckets * MAX_LOAD) {
+        unlock_all(table);
+        return 0;
+    }
+
+    nbuckets = table->nbuckets * 2;
+    buckets = (struct netpipe **) calloc(nbuckets, sizeof(struct netpipe *));
+    EQNULL(buckets, unlock_all(table); return -1)
+
+    for (i = 0; i < table->nbuckets; i++) {
+        file = table->buckets[i];
+        while (file != NULL) {
+            next = file->next;
+            file->next = buckets[file->hash & (nbuckets - 1)];
+            buckets[file->hash & (nbuckets - 1)] = file;
+            file = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    __atomic_store_n(&(table->nbuckets), nbuckets, __ATOMIC_RELAXED);
+    unlock_all(table);
 
     return 0;
 }
 
-void netpipefs_poll_destroy(void *ph) {
-    fuse_pollhandle_destroy((struct fuse_pollhandle *) ph);
-}
+int netpipefs_open_files_table_init(struct netpipefs_socket *skt) {
+    int i, err;
+    struct open_files_table *table;
+
+    // destroys the table if it already exists
+    if (skt->files != NULL) MINUS1(netpipefs_open_files_table_destroy(skt, NULL), return -1)
 
-void netpipefs_poll_notify(void *ph) {
-    fuse_notify_poll((struct fuse_pollhandle *) ph);
-    netpipefs_poll_destroy(ph);
+    table = (struct open_files_table *) malloc(sizeof(struct open_files_table));
+    EQNULL(table, return -1)
+    table->buckets = (struct netpipe **) calloc(NBUCKETS, sizeof(struct netpipe *));
+    EQNULL(table->buckets, free(table); return -1)
+    table->nbuckets = NBUCKETS;
+    table->count = 0;
+
+    for (i = 0; i < NSTRIPES; i++) {
+        if ((err = pthread_rwlock_init(&(table->stripes[i].lock), NULL)) != 0) {
+            while (--i >= 0) pthread_rwlock_destroy(&(table->stripes[i].lock));
+            free(table->buckets);
+            free(table);
+            errno = err;
+            return -1;
+        }
+    }
+
+    skt->files = table;
+
+    return 0;
 }
 
-static void openfiles_free_netpipe(void *np) {
-    struct netpipe *file = (struct netpipe *) np;
-    netpipe_free(file, &netpipefs_poll_destroy);
+int netpipefs_shutdown(struct netpipefs_socket *skt, void (*poll_notify)(void *)) {
+    int i, err, ret = 0;
+    size_t b;
+    struct netpipe *file;
+    struct open_files_table *table = skt->files;
+
+    if (table == NULL) return 0;
+
+    // one stripe at a time: the buckets of a stripe cannot be moved while it is held
+    for (i = 0; i < NSTRIPES && ret != -1; i++) {
+        PTH(err, pthread_rwlock_rdlock(&(table->stripes[i].lock)), return -1)
+        for (b = i; b < table->nbuckets && ret != -1; b += NSTRIPES) {
+            for (file = table->buckets[b]; file != NULL && ret != -1; file = file->next)
+                ret = netpipe_force_exit(file, poll_notify);
+        }
+        PTH(err, pthread_rwlock_unlock(&(table->stripes[i].lock)), return -1)
+    }
+
+    return ret;
 }
 
-int netpipefs_open_files_table_destroy(void) {
-    if (open_files_table == NULL) return 0;
+int netpipefs_open_files_table_destroy(struct netpipefs_socket *skt, void (*poll_destroy)(void *)) {
+    int i, ret = 0;
+    size_t b;
+    struct netpipe *file, *next;
+    struct open_files_table *table = skt->files;
 
-    if (icl_hash_destroy(open_files_table, NULL, &openfiles_free_netpipe) == -1)
-        return -1;
-    open_files_table = NULL;
-    return 0;
+    if (table == NULL) return 0;
+
+    for (b = 0; b < table->nbuckets; b++) {
+        file = table->buckets[b];
+        while (file != NULL) {
+            next = file->next;
+            MINUS1(netpipe_free(file, poll_destroy), ret = -1)
+            file = next;
+        }
+    }
+
+    for (i = 0; i < NSTRIPES; i++)
+        pthread_rwlock_destroy(&(table->stripes[i].lock));
+    free(table->buckets);
+    free(table);
+    skt->files = NULL;
+
+    return ret;
 }
 
-struct netpipe *netpipefs_get_open_file(const char *path) {
+struct netpipe *netpipefs_get_open_file(struct netpipefs_socket *skt, const char *path) {
     int err;
-    struct netpipe *file = NULL;
-
-    PTH(err, pthread_mutex_lock(&open_files_mtx), return NULL)
+    unsigned long hash;
+    struct netpipe *file;
+    pthread_rwlock_t *stripe;
+    struct open_files_table *table = skt->files;
 
-    if (open_files_table == NULL) {
+    if (table == NULL) {
         errno = EPERM;
-    } else {
-        file = icl_hash_find(open_files_table, (char *) path);
+        return NULL;
     }
 
-    PTH(err, pthread_mutex_unlock(&open_files_mtx), return NULL)
+    hash = hash_path(path);
+    stripe = stripe_of(table, hash);
+    PTH(err, pthread_rwlock_rdlock(stripe), return NULL)
+    file = *find_link(table, path, hash);
+    PTH(err, pthread_rwlock_unlock(stripe), return NULL)
 
     return file;
 }
 
-int netpipefs_remove_open_file(const char *path) {
-    int deleted, err;
-    PTH(err, pthread_mutex_lock(&open_files_mtx), return -1)
+int netpipefs_remove_open_file(struct netpipe *file) {
+    int deleted = -1, err;
+    unsigned long hash;
+    struct netpipe **link;
+    pthread_rwlock_t *stripe;
+    struct open_files_table *table = file->skt->files;
 
-    if (open_files_table == NULL) {
+    if (table == NULL) {
         errno = EPERM;
-        deleted = -1;
+        return -1;
+    }
+
+    hash = hash_path(file->path);
+    stripe = stripe_of(table, hash);
+    PTH(err, pthread_rwlock_wrlock(stripe), return -1)
+    link = find_link(table, file->path, hash);
+    if (*link != file) {
+        errno = ENOENT;
+    } else if (__atomic_load_n(&(file->nlookup), __ATOMIC_ACQUIRE) != 0) {
+        deleted = 1; // looked up again after its owner decided to free it
     } else {
-        deleted = icl_hash_delete(open_files_table, (char *) path, NULL, NULL);
+        *link = (*link)->next;
+        __atomic_sub_fetch(&(table->count), 1, __ATOMIC_RELAXED);
+        deleted = 0;
     }
+    PTH(err, pthread_rwlock_unlock(stripe), return -1)
 
-    PTH(err, pthread_mutex_unlock(&open_files_mtx), return -1)
     return deleted;
 }
 
-struct netpipe *netpipefs_get_or_create_open_file(const char *path, int *just_created) {
+/* Get the file or create it. If lookup is 1 then the kernel reference is taken while the stripe is held */
+static struct netpipe *get_or_create(struct netpipefs_socket *skt, const char *path, int *just_created, int lookup) {
     int err;
-    struct netpipe *file;
+    unsigned long hash;
+    size_t count = 0;
+    struct netpipe **link, *file;
+    pthread_rwlock_t *stripe;
+    struct open_files_table *table = skt->files;
     *just_created = 0;
 
-    PTH(err, pthread_mutex_lock(&open_files_mtx), return NULL)
-    if (open_files_table == NULL) {
+    if (table == NULL) {
         errno = EPERM;
-        pthread_mutex_unlock(&open_files_mtx);
         return NULL;
     }
 
-    file = icl_hash_find(open_files_table, (char*) path);
-    EQNULL(file, file = netpipe_alloc(path); *just_created = 1)
+    hash = hash_path(path);
+    stripe = stripe_of(table, hash);
 
-    if (file != NULL && *just_created) {
-        if (icl_hash_insert(open_files_table, (void*) file->path, file) == NULL) {
-            netpipe_free(file, NULL); // there are no poll handle
-            file = NULL;
-        }
+    // fast path: the file already exists
+    PTH(err, pthread_rwlock_rdlock(stripe), return NULL)
+    file = *find_link(table, path, hash);
+    if (file != NULL && lookup) __atomic_add_fetch(&(file->nlookup), 1, __ATOMIC_ACQ_REL);
+    PTH(err, pthread_rwlock_unlock(stripe), return NULL)
+    if (file != NULL) return file;
+
+    PTH(err, pthread_rwlock_wrlock(stripe), return NULL)
+
+    link = find_link(table, path, hash);
+    file = *link;
+    if (file == NULL && (file = netpipe_alloc(path, skt)) != NULL) {
+        file->hash = hash;
+        *link = file;
+        count = __atomic_add_fetch(&(table->count), 1, __ATOMIC_RELAXED);
+        *just_created = 1;
     }
+    if (file != NULL && lookup) __atomic_add_fetch(&(file->nlookup), 1, __ATOMIC_ACQ_REL);
+
+    PTH(err, pthread_rwlock_unlock(stripe), return NULL)
 
-    PTH(err, pthread_mutex_unlock(&open_files_mtx), return NULL)
+    // the table is grown after the stripe is released. If it fails the chains are just longer
+    if (*just_created && count > __atomic_load_n(&(table->nbuckets), __ATOMIC_RELAXED) * MAX_LOAD)
+        table_grow(table);
 
     return file;
-}
\ No newline at end of file
+}
+
+struct netpipe *netpipefs_get_or_create_open_file(struct netpipefs_socket *skt, const char *path, int *just_created) {
+    return get_or_create(skt, path, just_created, 0);
+}
+
+struct netpipe *netpipefs_lookup_open_file(struct netpipefs_socket *skt, const char *path) {
+    int just_created;
+    return get_or_create(skt, path, &just_created, 1);
+}
@@ -1,7 +1,9 @@
 #include "../include/options.h"
+#include <fuse.h>
 #include "../include/netpipefs_socket.h"
 #include "../include/utils.h"
 #include "../include/netpipe.h"
+#include "../include/fanout.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,7 +29,28 @@ static const struct fuse_opt netpipefs_opts[] = {
         NETPIPEFS_OPT("--hostport=%i",      hostport, 0),
         NETPIPEFS_OPT("--writeahead=%i",    writeahead, 0),
         NETPIPEFS_OPT("--readahead=%i",     readahead, 0),
+        NETPIPEFS_OPT("--spooldir=%s",      spooldir, 0),
+        NETPIPEFS_OPT("--spoolmax=%i",      spoolmax, 0),
         NETPIPEFS_OPT("-delayconnect",      delayconnect, 1),
+        NETPIPEFS_OPT("--busypoll=%i",      busypoll, 0),
+        NETPIPEFS_OPT("--readmin=%i",       readmin, 0),
+        NETPIPEFS_OPT("--readtime=%i",      readtime, 0),
+        NETPIPEFS_OPT("--earlydata=%i",     earlydata, 0),
+        NETPIPEFS_OPT("--earlymax=%i",      earlymax, 0),
+        NETPIPEFS_OPT("-asyncclose",        asyncclose, 1),
+        NETPIPEFS_OPT("--linger=%i",        linger, 0),
+        NETPIPEFS_OPT("--workers=%i",       workers, 0),
+        NETPIPEFS_OPT("--maxio=%i",         maxio, 0),
+        NETPIPEFS_OPT("-clonefd",           clonefd, 1),
+        NETPIPEFS_OPT("--zerocopy=%i",      zerocopy, 0),
+        NETPIPEFS_OPT("-zerocopyrecv",      zerocopyrecv, 1),
+        NETPIPEFS_OPT("--shmsize=%i",       shmsize, 0),
+        NETPIPEFS_OPT("--peers=%s",         peers, 0),
+        NETPIPEFS_OPT("--fanout=%s",        fanout, 0),
+        NETPIPEFS_OPT("--fanoutlag=%i",     fanoutlag, 0),
+        NETPIPEFS_OPT("-fanoutdrop",        fanoutdrop, 1),
+        NETPIPEFS_OPT("--relay=%s",         relay, 0),
+        NETPIPEFS_OPT("--pipes=%s",         pipes, 0),
 
         FUSE_OPT_END
 };
@@ -44,6 +67,27 @@ int netpipefs_opt_parse(const char *progname, struct fuse_args *args) {
     netpipefs_options.delayconnect = 0;
     netpipefs_options.readahead = DEFAULT_READAHEAD;
     netpipefs_options.writeahead = DEFAULT_WRITEAHEAD;
+    netpipefs_options.spooldir = NULL;
+    netpipefs_options.spoolmax = DEFAULT_SPOOLMAX;
+    netpipefs_options.busypoll = DEFAULT_BUSYPOLL;
+    netpipefs_options.readmin = DEFAULT_READMIN;
+    netpipefs_options.readtime = DEFAULT_READTIME;
+    netpipefs_options.earlydata = DEFAULT_EARLYDATA;
+    netpipefs_options.earlymax = DEFAULT_EARLYMAX;
+    netpipefs_options.asyncclose = 0;
+    netpipefs_options.linger = DEFAULT_LINGER;
+    netpipefs_options.workers = DEFAULT_WORKERS;
+    netpipefs_options.maxio = DEFAULT_MAXIO;
+    netpipefs_options.clonefd = 0;
+    netpipefs_options.zerocopy = DEFAULT_ZEROCOPY;
+    netpipefs_options.zerocopyrecv = 0;
+    netpipefs_options.shmsize = DEFAULT_SHMSIZE;
+    netpipefs_options.peers = NULL;
+    netpipefs_options.fanout = NULL;
+    netpipefs_options.fanoutlag = DEFAULT_FANOUTLAG;
+    netpipefs_options.fanoutdrop = 0;
+    netpipefs_options.relay = NULL;
+    netpipefs_options.pipes = NULL;
     //netpipefs_options.intr = 1;
 
     /* Parse options */
@@ -58,7 +102,8 @@ int netpipefs_opt_parse(const char *progname, struct fuse_args *args) {
 
     /* Validate host ip address */
     int array[4];
-    if (netpipefs_options.hostip == NULL) { // host ip is missing
+    if (netpipefs_options.peers != NULL) { // each peer has its own host, checked when the file is read
+    } else if (netpipefs_options.hostip == NULL) { // host ip is missing
         fprintf(stderr, "missing host ip address\nsee '%s -h' for usage\n", progname);
         return 1;
     } else if (strcmp(netpipefs_options.hostip, "localhost") == 0) { // localhost is valid. Will use afunix sockets
@@ -80,6 +125,77 @@ int netpipefs_opt_parse(const char *progname, struct fuse_args *args) {
         return 1;
     }
 
+    /* Check busy polling time */
+    if (netpipefs_options.busypoll < 0) {
+        fprintf(stderr, "invalid busy poll time\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check read minimum and read timeout */
+    if (netpipefs_options.readmin <= 0) {
+        fprintf(stderr, "invalid read minimum\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+    if (netpipefs_options.readtime < 0) {
+        fprintf(stderr, "invalid read timeout\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check linger time */
+    if (netpipefs_options.linger < 0) {
+        fprintf(stderr, "invalid linger time\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check number of workers */
+    if (netpipefs_options.workers <= 0) {
+        fprintf(stderr, "invalid number of workers\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check max request size */
+    if (netpipefs_options.maxio < 4096) {
+        fprintf(stderr, "invalid max request size\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check zerocopy threshold */
+    if (netpipefs_options.zerocopy < 0) {
+        fprintf(stderr, "invalid zerocopy threshold\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check shared memory ring capacity */
+    if (netpipefs_options.shmsize < 0) {
+        fprintf(stderr, "invalid shared memory size\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check fan-out directory. It is into the root, next to the directories of the peers */
+    if (netpipefs_options.fanout != NULL && (netpipefs_options.peers == NULL || netpipefs_options.fanout[0] == '\0'
+        || strchr(netpipefs_options.fanout, '/') != NULL || strcmp(netpipefs_options.fanout, ".") == 0
+        || strcmp(netpipefs_options.fanout, "..") == 0)) {
+        fprintf(stderr, "invalid fan-out directory, it requires --peers\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Check fan-out lag */
+    if (netpipefs_options.fanoutlag <= 0) {
+        fprintf(stderr, "invalid fan-out lag\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* The peers of each pair are checked when the file is read */
+    if (netpipefs_options.relay != NULL && netpipefs_options.peers == NULL) {
+        fprintf(stderr, "relay requires --peers\nsee '%s -h' for usage\n", progname);
+        return 1;
+    }
+
+    /* Large requests. Inserted before the user's mount options so that they can override them */
+    char maxio_opt[64];
+    snprintf(maxio_opt, sizeof(maxio_opt), "-omax_read=%d,max_write=%d", netpipefs_options.maxio, netpipefs_options.maxio);
+    MINUS1ERR(fuse_opt_insert_arg(args, 1, maxio_opt), return -1)
+
     /*if (netpipefs_options.pipecapacity < 0) {
         fprintf(stderr, "invalid pipe capacity\nsee '%s -h' for usage\n", progname);
         return 1;
@@ -104,6 +220,26 @@ void netpipefs_opt_free(struct fuse_args *args) {
         free((void*) netpipefs_options.hostip);
         netpipefs_options.hostip = NULL;
     }
+    if (netpipefs_options.peers) {
+        free((void*) netpipefs_options.peers);
+        netpipefs_options.peers = NULL;
+    }
+    if (netpipefs_options.fanout) {
+        free((void*) netpipefs_options.fanout);
+        netpipefs_options.fanout = NULL;
+    }
+    if (netpipefs_options.relay) {
+        free((void*) netpipefs_options.relay);
+        netpipefs_options.relay = NULL;
+    }
+    if (netpipefs_options.pipes) {
+        free((void*) netpipefs_options.pipes);
+        netpipefs_options.pipes = NULL;
+    }
+    if (netpipefs_options.spooldir) {
+        free((void*) netpipefs_options.spooldir);
+        netpipefs_options.spooldir = NULL;
+    }
     if (netpipefs_options.mountpoint) {
         free((void*) netpipefs_options.mountpoint);
         netpipefs_options.mountpoint = NULL;
@@ -125,7 +261,30 @@ void netpipefs_usage(const char *progname) {
            "    -delayconnect           connect to host after the filesystem is mounted\n"
            "    --readahead=<d>         how many bytes can be received and put into the buffer to anticipate read requests (default: %d)\n"
            "    --writeahead=<d>        how many bytes can be bufferized on write requests if the remote host can't receive data (default: %d)\n"
-           "\n", DEFAULT_PORT, DEFAULT_PORT, DEFAULT_TIMEOUT, DEFAULT_READAHEAD, DEFAULT_WRITEAHEAD);
+           "    --spooldir=<s>          when the writeahead is full the data written is spilled into a file of this directory. Disabled by default\n"
+           "    --spoolmax=<d>          bytes which can be spilled for each netpipe (default: %d)\n"
+           "    --busypoll=<d>          microseconds spent busy polling for data before blocking. 0 disables it (default: %d)\n"
+           "    --readmin=<d>           bytes a blocking read waits for before it returns (default: %d)\n"
+           "    --readtime=<d>          milliseconds a read waits for readmin bytes after the first one. 0 waits forever (default: %d)\n"
+           "    --earlydata=<d>         bytes a remote writer can send before the netpipe is open for reading. 0 disables it (default: %d)\n"
+           "    --earlymax=<d>          bytes which can be sent early to all the netpipes of a remote host (default: %d)\n"
+           "    -asyncclose             the last writer's close returns at once, the data is sent in background\n"
+           "    --linger=<d>            milliseconds the last writer's close waits for the data to be read. 0 waits forever (default: %d)\n"
+           "    --workers=<d>           number of threads which process requests. Ignored with -s (default: %d)\n"
+           "    --maxio=<d>             max size of a single read or write request (default: %d)\n"
+           "    -clonefd                each worker receives requests from its own clone of /dev/fuse\n"
+           "    --zerocopy=<d>          payloads of at least this size are sent with MSG_ZEROCOPY. 0 disables it (default: %d)\n"
+           "    -zerocopyrecv           map large payloads with TCP_ZEROCOPY_RECEIVE instead of copying them\n"
+           "    --shmsize=<d>           with localhost messages go through a shared memory ring of this size per direction. 0 disables it (default: %d)\n"
+           "    --peers=<s>             file with a remote host per line: <name> <hostip> <hostport> <port>. The netpipes of each one are into <mountpoint>/<name>\n"
+           "    --fanout=<s>            with --peers, what is written into the netpipes of <mountpoint>/<s> is sent to every peer\n"
+           "    --fanoutlag=<d>         bytes a peer can lag behind the fastest one before it is disconnected (default: %d)\n"
+           "    -fanoutdrop             a lagging peer skips the data instead of being disconnected\n"
+           "    --relay=<s>             with --peers, pairs <src>:<dst> separated by commas. The netpipes written by src are forwarded to dst\n"
+           "    --pipes=<s>             file with a netpipe provisioned at mount time per line: <name> <r|w> <window>\n"
+           "\n", DEFAULT_PORT, DEFAULT_PORT, DEFAULT_TIMEOUT, DEFAULT_READAHEAD, DEFAULT_WRITEAHEAD, DEFAULT_SPOOLMAX, DEFAULT_BUSYPOLL, DEFAULT_READMIN,
+           DEFAULT_READTIME, DEFAULT_EARLYDATA, DEFAULT_EARLYMAX, DEFAULT_LINGER, DEFAULT_WORKERS,
+           DEFAULT_MAXIO, DEFAULT_ZEROCOPY, DEFAULT_SHMSIZE, DEFAULT_FANOUTLAG);
     fuse_usage();
 }
 
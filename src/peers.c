@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include "../include/peers.h"
+#include "../include/openfiles.h"
+#include "../include/netpipe.h"
+#include "../include/utils.h"
+
+struct netpipefs_peer *netpipefs_peers = NULL;
+int netpipefs_npeers = 0;
+
+/* Check the host and the name of the peer. It returns 0 if they are valid */
+static int peer_check(struct netpipefs_peer *peer) {
+    int array[4], i;
+
+    if (strcmp(peer->hostip, "localhost") != 0 && ipv4_address_to_array(peer->hostip, array) == -1) return -1;
+    if (peer->options.hostport < 0 || peer->options.port < 0) return -1;
+    if (peer->name[0] == '\0' || strcmp(peer->name, ".") == 0 || strcmp(peer->name, "..") == 0) return -1;
+
+    // names and local ports must be unique
+    for (i = 0; &netpipefs_peers[i] != peer; i++) {
+        if (strcmp(netpipefs_peers[i].name, peer->name) == 0 || netpipefs_peers[i].options.port == peer->options.port)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Read the peers from the given file */
+static int peers_load(const char *path, const struct netpipefs_options *options) {
+    FILE *fp;
+    char *line = NULL, *p, name[PEER_NAME_MAX], hostip[PEER_HOST_MAX];
+    size_t len = 0;
+    int hostport, port, lineno = 0, capacity = 0, err = 0;
+    struct netpipefs_peer *peers, *peer;
+
+    EQNULL(fp = fopen(path, "r"), return -1)
+
+    while (getline(&line, &len, fp) != -1) {
+        lineno++;
+        for (p = line; *p == ' ' || *p == '\t'; p++);
+        if (*p == '\n' || *p == '\0' || *p == '#') continue;
+
+        if (netpipefs_npeers == capacity) {
+            capacity = capacity == 0 ? 8 : capacity * 2;
+            peers = (struct netpipefs_peer *) realloc(netpipefs_peers, sizeof(struct netpipefs_peer) * capacity);
+            EQNULL(peers, err = errno; break)
+            netpipefs_peers = peers;
+        }
+
+        peer = &netpipefs_peers[netpipefs_npeers];
+        memset(peer, 0, sizeof(struct netpipefs_peer));
+        if (sscanf(p, "%63s %63s %d %d", name, hostip, &hostport, &port) != 4 || strchr(name, '/') != NULL) {
+            fprintf(stderr, "%s:%d: expected <name> <hostip> <hostport> <port>\n", path, lineno);
+            err = EINVAL;
+            break;
+        }
+        strcpy(peer->name, name);
+        strcpy(peer->hostip, hostip);
+        peer->options = *options;
+        peer->options.hostport = hostport;
+        peer->options.port = port;
+        if (peer_check(peer) != 0) {
+            fprintf(stderr, "%s:%d: invalid or duplicated peer\n", path, lineno);
+            err = EINVAL;
+            break;
+        }
+        netpipefs_npeers++;
+    }
+    if (err == 0 && ferror(fp)) err = EIO;
+    if (err == 0 && netpipefs_npeers == 0) {
+        fprintf(stderr, "%s: no peers\n", path);
+        err = EINVAL;
+    }
+
+    free(line);
+    fclose(fp);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Set the destination of the relayed peers. Each pair is "<source>:<destination>" and the pairs are separated by commas */
+static int peers_relay(const char *spec) {
+    char *pairs, *pair, *dst, *saveptr = NULL;
+    struct netpipefs_peer *from, *to;
+    int err = 0;
+
+    EQNULL(pairs = strdup(spec), return -1)
+    for (pair = strtok_r(pairs, ",", &saveptr); pair != NULL; pair = strtok_r(NULL, ",", &saveptr)) {
+        if ((dst = strchr(pair, ':')) == NULL) {
+            err = EINVAL;
+            break;
+        }
+        *dst++ = '\0';
+        from = netpipefs_peer_by_name(pair);
+        to = netpipefs_peer_by_name(dst);
+        // a peer is forwarded to only one other peer
+        if (from == NULL || to == NULL || from == to || from->skt.relay_to != NULL) {
+            err = EINVAL;
+            break;
+        }
+        from->skt.relay_to = &(to->skt);
+    }
+    if (err != 0) fprintf(stderr, "%s: invalid relay pair\n", pair);
+    free(pairs);
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int netpipefs_peers_init(const struct netpipefs_options *options) {
+    int i, err;
+
+    if (options->peers != NULL) {
+        if (peers_load(options->peers, options) == -1 || (options->relay != NULL && peers_relay(options->relay) == -1)) {
+            err = errno;
+            free(netpipefs_peers);
+            netpipefs_peers = NULL;
+            netpipefs_npeers = 0;
+            errno = err;
+            return -1;
+        }
+    } else {
+        EQNULL(netpipefs_peers = (struct netpipefs_peer *) calloc(1, sizeof(struct netpipefs_peer)), return -1)
+        netpipefs_npeers = 1;
+        netpipefs_peers[0].options = *options;
+        snprintf(netpipefs_peers[0].hostip, PEER_HOST_MAX, "%s", options->hostip);
+    }
+
+    for (i = 0; i < netpipefs_npeers; i++) {
+        netpipefs_peers[i].options.hostip = netpipefs_peers[i].hostip;
+        PTH(err, pthread_mutex_init(&(netpipefs_peers[i].skt.wr_mtx), NULL), netpipefs_npeers = i; netpipefs_peers_free(); return -1)
+    }
+
+    return 0;
+}
+
+/* Add the netpipe declared by the given line of the pipes file to its peer. It returns 0 on success, 1 if the
+ * line is not valid, -1 on error and sets errno */
+static int pipe_add(const char *p) {
+    char spec[PEER_NAME_MAX + PIPE_NAME_MAX], mode[8], *name = spec;
+    long window;
+    int i;
+    struct netpipefs_peer *peer = &netpipefs_peers[0];
+    struct netpipefs_pipe *pipes;
+
+    if (sscanf(p, "%319s %7s %ld", spec, mode, &window) != 3) return 1;
+    if ((strcmp(mode, "r") != 0 && strcmp(mode, "w") != 0) || window <= 0) return 1;
+
+    // with many peers the name starts with the directory of its peer
+    if (peer->name[0] != '\0') {
+        if ((name = strchr(spec, '/')) == NULL) return 1;
+        *name++ = '\0';
+        if ((peer = netpipefs_peer_by_name(spec)) == NULL) return 1;
+    }
+    if (name[0] == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+        || strlen(name) >= PIPE_NAME_MAX) return 1;
+    // the relayed netpipes are open on behalf of the relay
+    if (peer->skt.relay_to != NULL) return 1;
+    for (i = 0; i < peer->npipes; i++) {
+        if (strcmp(peer->pipes[i].path + 1, name) == 0) return 1;
+    }
+
+    pipes = (struct netpipefs_pipe *) realloc(peer->pipes, sizeof(struct netpipefs_pipe) * (peer->npipes + 1));
+    EQNULL(pipes, return -1)
+    peer->pipes = pipes;
+    pipes[peer->npipes].path[0] = '/';
+    strcpy(pipes[peer->npipes].path + 1, name);
+    pipes[peer->npipes].mode = mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+    pipes[peer->npipes].window = (size_t) window;
+    peer->npipes++;
+
+    return 0;
+}
+
+int netpipefs_peers_load_pipes(const char *path) {
+    FILE *fp;
+    char *line = NULL, *p;
+    size_t len = 0;
+    int lineno = 0, err = 0, ret;
+
+    EQNULL(fp = fopen(path, "r"), return -1)
+
+    while (getline(&line, &len, fp) != -1) {
+        lineno++;
+        for (p = line; *p == ' ' || *p == '\t'; p++);
+        if (*p == '\n' || *p == '\0' || *p == '#') continue;
+
+        if ((ret = pipe_add(p)) == -1) {
+            err = errno;
+            break;
+        }
+        if (ret == 1) {
+            fprintf(stderr, "%s:%d: expected %s<name> <r|w> <window>, not duplicated\n", path, lineno,
+                    netpipefs_peers[0].name[0] != '\0' ? "<peer>/" : "");
+            err = EINVAL;
+            break;
+        }
+    }
+    if (err == 0 && ferror(fp)) err = EIO;
+
+    free(line);
+    fclose(fp);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int netpipefs_peers_provision(void) {
+    int i, j;
+    struct netpipefs_peer *peer;
+    struct netpipefs_pipe *pipe;
+    struct netpipe *file;
+
+    for (i = 0; i < netpipefs_npeers; i++) {
+        peer = &netpipefs_peers[i];
+        for (j = 0; j < peer->npipes; j++) {
+            pipe = &(peer->pipes[j]);
+            // the lookup reference is never forgotten, so the netpipe is not freed when it is closed
+            EQNULL(file = netpipefs_lookup_open_file(&(peer->skt), pipe->path), return -1)
+            MINUS1(netpipe_provision(file, pipe->mode, pipe->window), return -1)
+        }
+    }
+
+    return 0;
+}
+
+void netpipefs_peers_free(void) {
+    int i;
+    for (i = 0; i < netpipefs_npeers; i++) {
+        pthread_mutex_destroy(&(netpipefs_peers[i].skt.wr_mtx));
+        free(netpipefs_peers[i].pipes);
+    }
+    free(netpipefs_peers);
+    netpipefs_peers = NULL;
+    netpipefs_npeers = 0;
+}
+
+/* Establish the connection with the given peer. It returns the error */
+static void *peer_connect(void *arg) {
+    struct netpipefs_peer *peer = (struct netpipefs_peer *) arg;
+    long err = 0;
+
+    if (establish_socket_connection(&(peer->skt), &(peer->options)) == -1) {
+        err = errno;
+        if (peer->name[0] != '\0') fprintf(stderr, "peer %s: %s\n", peer->name, strerror(errno));
+    }
+
+    return (void *) err;
+}
+
+int netpipefs_peers_connect(void) {
+    int i, n, err = 0;
+    void *res;
+    pthread_t *tids;
+    long *errs;
+
+    if (netpipefs_npeers == 1) {
+        err = (int) (long) peer_connect(&netpipefs_peers[0]);
+        if (err != 0) errno = err;
+        return err == 0 ? 0 : -1;
+    }
+
+    EQNULL(tids = (pthread_t *) malloc(sizeof(pthread_t) * netpipefs_npeers), return -1)
+    EQNULL(errs = (long *) malloc(sizeof(long) * netpipefs_npeers), free(tids); return -1)
+    for (n = 0; n < netpipefs_npeers; n++) {
+        PTH(err, pthread_create(&tids[n], NULL, &peer_connect, &netpipefs_peers[n]), break)
+    }
+    for (i = 0; i < n; i++) {
+        errs[i] = pthread_join(tids[i], &res) == 0 ? (long) res : EINVAL;
+        if (errs[i] != 0) err = (int) errs[i];
+    }
+
+    // don't keep the connections with only some of the peers
+    if (err != 0) {
+        for (i = 0; i < n; i++)
+            if (errs[i] == 0) end_socket_connection(&(netpipefs_peers[i].skt));
+    }
+    free(errs);
+    free(tids);
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+struct netpipefs_peer *netpipefs_peer_by_name(const char *name) {
+    int i;
+    for (i = 0; i < netpipefs_npeers; i++) {
+        if (strcmp(netpipefs_peers[i].name, name) == 0) return &netpipefs_peers[i];
+    }
+
+    return NULL;
+}
+
+int netpipefs_peers_shutdown(void (*poll_notify)(void *)) {
+    int i, ret = 0;
+    for (i = 0; i < netpipefs_npeers; i++)
+        MINUS1(netpipefs_shutdown(&(netpipefs_peers[i].skt), poll_notify), ret = -1)
+
+    return ret;
+}
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../include/pollhandle.h"
+#include "../include/options.h"
+#include "../include/utils.h"
+#include <fuse_lowlevel.h>
+
+#define POLLPIPE_TAG ((uintptr_t) 1) // set on the pipe poll handles. FUSE ones are aligned pointers
+
+/** The pipe poll handle of the given opaque poll handle, NULL if it is a FUSE poll handle */
+static struct netpipefs_pollpipe *pollpipe_of(void *ph) {
+    if (((uintptr_t) ph & POLLPIPE_TAG) == 0) return NULL;
+    return (struct netpipefs_pollpipe *) ((uintptr_t) ph & ~POLLPIPE_TAG);
+}
+
+void netpipefs_poll_destroy(void *ph) {
+    if (pollpipe_of(ph) == NULL) fuse_pollhandle_destroy((struct fuse_pollhandle *) ph);
+}
+
+void netpipefs_poll_notify(void *ph) {
+    struct netpipefs_pollpipe *pp = pollpipe_of(ph);
+    char c = 1;
+
+    if (pp != NULL) {
+        // the pipe may be full: there is a notification to be read already
+        if (write(pp->fd[1], &c, sizeof(char)) == -1 && errno != EAGAIN)
+            DEBUG("failed to notify poll pipe: %s\n", strerror(errno));
+        return;
+    }
+
+    fuse_lowlevel_notify_poll((struct fuse_pollhandle *) ph);
+    netpipefs_poll_destroy(ph);
+}
+
+int netpipefs_pollpipe_init(struct netpipefs_pollpipe *pp) {
+    MINUS1(pipe(pp->fd), return -1)
+    if (fcntl(pp->fd[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(pp->fd[1], F_SETFL, O_NONBLOCK) == -1) {
+        netpipefs_pollpipe_destroy(pp);
+        return -1;
+    }
+
+    return 0;
+}
+
+void *netpipefs_pollpipe_handle(struct netpipefs_pollpipe *pp) {
+    return (void *) ((uintptr_t) pp | POLLPIPE_TAG);
+}
+
+void netpipefs_pollpipe_clear(struct netpipefs_pollpipe *pp) {
+    char discard[64];
+    while (read(pp->fd[0], discard, sizeof(discard)) > 0);
+}
+
+void netpipefs_pollpipe_destroy(struct netpipefs_pollpipe *pp) {
+    int err = errno;
+    close(pp->fd[0]);
+    close(pp->fd[1]);
+    errno = err;
+}
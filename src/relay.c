@@ -0,0 +1,317 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "../include/relay.h"
+#include "../include/netpipe.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/openfiles.h"
+#include "../include/scfiles.h"
+#include "../include/cbuf.h"
+#include "../include/utils.h"
+
+#define RELAY_COPY_SIZE 65536 // chunk size used when data cannot be spliced
+#define RELAY_ACK_SIZE 65536  // forwarded bytes which are acknowledged together to the source
+
+/** How many bytes can be sent to the remote host of the file */
+#define credit(file) ((file)->remotemax - (file)->remotesize)
+
+struct relay {
+    pthread_mutex_t mtx;    // taken before the locks of the netpipes
+    unsigned long nref;     // references. The relay holds one until it ends
+    struct netpipe *in;     // netpipe read from the source
+    struct netpipe *out;    // netpipe written to the destination. Set with the lock of in held
+    size_t requested;       // credit given to the source for data which did not arrive yet. Protected by the lock of in
+    size_t unacked;         // bytes forwarded and not acknowledged to the source yet. Protected by the lock of in
+    int failed;             // the destination cannot be written anymore. Protected by the lock of in
+    int out_readers;        // the destination had at least one reader
+    int ended;
+    int pipefd[2];          // used to splice the data between the sockets, -1 if not available
+    size_t pipesize;
+    void (*poll_notify)(void *);
+};
+
+/* Create the pipe used to splice the data. Without it the data is copied */
+static void relay_pipe_open(struct relay *relay) {
+    int size;
+
+    if (pipe(relay->pipefd) == -1) {
+        relay->pipefd[0] = relay->pipefd[1] = -1;
+        return;
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(relay->pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    size = fcntl(relay->pipefd[1], F_GETPIPE_SZ);
+#else
+    size = -1;
+#endif
+    relay->pipesize = size > 0 ? (size_t) size : RELAY_COPY_SIZE;
+}
+
+static void relay_pipe_close(struct relay *relay) {
+    if (relay->pipefd[0] != -1) close(relay->pipefd[0]);
+    if (relay->pipefd[1] != -1) close(relay->pipefd[1]);
+    relay->pipefd[0] = relay->pipefd[1] = -1;
+}
+
+static struct relay *relay_alloc(void (*poll_notify)(void *)) {
+    int err;
+    struct relay *relay = (struct relay *) calloc(1, sizeof(struct relay));
+    EQNULL(relay, return NULL)
+
+    PTH(err, pthread_mutex_init(&(relay->mtx), NULL), free(relay); return NULL)
+    relay->nref = 1;
+    relay->poll_notify = poll_notify;
+    relay_pipe_open(relay);
+
+    return relay;
+}
+
+void netpipefs_relay_ref(struct relay *relay) {
+    __atomic_add_fetch(&(relay->nref), 1, __ATOMIC_ACQ_REL);
+}
+
+static void relay_put(struct relay *relay) {
+    if (__atomic_sub_fetch(&(relay->nref), 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    relay_pipe_close(relay);
+    pthread_mutex_destroy(&(relay->mtx));
+    free(relay);
+}
+
+static void relay_close_done(void *arg, ssize_t bytes, int error) {
+    if (bytes == -1) DEBUG("relay close failed: %s\n", strerror(error));
+}
+
+/**
+ * Move size bytes from the socket of the source to the destination. The data is spliced through the pipe, or
+ * copied if the source uses shared memory. If the destination cannot be written the data is discarded.
+ * The lock of the destination must be held.
+ *
+ * @return how much data was read from the source, 0 if its connection was lost, -1 on error
+ */
+static ssize_t relay_forward(struct relay *relay, struct netpipefs_socket *src, struct netpipe *out, size_t size) {
+    char buf[RELAY_COPY_SIZE];
+    size_t done = 0, len;
+    ssize_t bytes;
+    int sent;
+
+    while (done < size) {
+        if (relay->pipefd[0] != -1 && src->shm_rx == NULL) {
+            len = size - done < relay->pipesize ? size - done : relay->pipesize;
+            bytes = splicen(src->fd, relay->pipefd[1], len);
+            if (bytes <= 0) return bytes;
+            sent = relay->failed ? -1 : send_splice_message(out->skt, out->path, relay->pipefd[0], bytes);
+            if (sent <= 0) { // what is left into the pipe is lost
+                relay_pipe_close(relay);
+                relay_pipe_open(relay);
+            }
+        } else {
+            len = size - done < RELAY_COPY_SIZE ? size - done : RELAY_COPY_SIZE;
+            bytes = read_socket(src, buf, len);
+            if (bytes <= 0) return bytes;
+            sent = relay->failed ? -1 : send_write_message(out->skt, out->path, buf, bytes);
+        }
+
+        if (sent > 0) out->remotesize += bytes;
+        else relay->failed = 1;
+        done += bytes;
+    }
+
+    return done;
+}
+
+/**
+ * Tell the source that the forwarded bytes were read. Like a reader does when its read is completed, they are
+ * acknowledged together, unless the source has no credit left to send more. The lock of in must be held.
+ *
+ * @return 1 on success, 0 if connection was lost, -1 on error
+ */
+static int relay_ack(struct relay *relay) {
+    int bytes;
+
+    if (relay->unacked == 0 || (relay->requested > 0 && relay->unacked < RELAY_ACK_SIZE)) return 1;
+
+    bytes = send_read_message(relay->in->skt, relay->in->path, relay->unacked);
+    if (bytes > 0) relay->unacked = 0;
+
+    return bytes;
+}
+
+ssize_t netpipefs_relay_recv(struct relay *relay, size_t size) {
+    struct netpipe *in = relay->in, *out = relay->out;
+    size_t forward = 0, space;
+    ssize_t bytes = 0;
+
+    if (out != NULL) {
+        NOTZERO(netpipe_lock(out), return -1)
+        if (!out->force_exit && !relay->failed) forward = size < credit(out) ? size : credit(out);
+        if (forward > 0) bytes = relay_forward(relay, in->skt, out, forward);
+        NOTZERO(netpipe_unlock(out), return -1)
+        if (bytes <= 0 && forward > 0) return bytes;
+        DEBUG("relay[%s] %ld bytes\n", in->path, forward);
+    }
+
+    // the source sent ahead: keep what fits into the buffer
+    if (size > forward) {
+        space = cbuf_capacity(in->buffer) - cbuf_size(in->buffer);
+        if (space > size - forward) space = size - forward;
+        if (space > 0 && (bytes = read_socket_cbuf(in->skt, in->buffer, space)) <= 0) return bytes;
+        if (size - forward > space && (bytes = skip_socket(in->skt, size - forward - space)) <= 0) return bytes;
+    }
+    relay->requested -= size < relay->requested ? size : relay->requested;
+
+    if (forward > 0 && !relay->failed) {
+        relay->unacked += forward;
+        if ((bytes = relay_ack(relay)) <= 0) return bytes;
+    }
+
+    return size;
+}
+
+int netpipefs_relay_urgent(struct relay *relay, const char *buf, size_t size) {
+    if (relay->out == NULL || relay->failed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return netpipe_send_urgent(relay->out, buf, size);
+}
+
+/**
+ * Forward the buffered data and give the credit of the destination to the source. The caller must hold
+ * the locks of the relay and of both the netpipes.
+ *
+ * @return 1 if the relay should end, 0 otherwise
+ */
+static int relay_update_locked(struct relay *relay) {
+    struct netpipe *in = relay->in, *out = relay->out;
+    size_t len, drained = 0;
+    char *data;
+
+    if (out->readers > 0) relay->out_readers = 1;
+    if (in->force_exit || out->force_exit || relay->failed) return 1;
+    // nobody reads anymore: the writers of the source get a broken pipe
+    if (relay->out_readers && out->readers == 0) return 1;
+
+    while (!cbuf_empty(in->buffer) && credit(out) > 0) {
+        len = cbuf_peek(in->buffer, 0, &data);
+        if (len > credit(out)) len = credit(out);
+        if (send_write_message(out->skt, out->path, data, len) <= 0) return 1;
+        cbuf_drop(in->buffer, len);
+        out->remotesize += len;
+        drained += len;
+    }
+    if (drained > 0) DEBUG("relay buffered[%s] %ld bytes\n", in->path, drained);
+    relay->unacked += drained;
+    if (relay_ack(relay) <= 0) return 1;
+
+    // every writer closed and everything was forwarded
+    if (in->writers == 0 && cbuf_empty(in->buffer)) return 1;
+
+    if (cbuf_empty(in->buffer) && credit(out) > relay->requested) {
+        if (send_read_request_message(in->skt, in->path, credit(out) - relay->requested) <= 0) return 1;
+        relay->requested = credit(out);
+    }
+
+    return 0;
+}
+
+/* Close both the netpipes of the relay which has ended */
+static void relay_close(struct relay *relay) {
+    MINUS1(netpipe_close_async(relay->in, O_RDONLY, &netpipefs_remove_open_file, relay->poll_notify, &relay_close_done, NULL),
+           DEBUG("relay close failed: %s\n", strerror(errno)))
+    if (relay->out == NULL) return;
+
+    MINUS1(netpipe_close_async(relay->out, O_WRONLY, &netpipefs_remove_open_file, relay->poll_notify, &relay_close_done, NULL),
+           DEBUG("relay close failed: %s\n", strerror(errno)))
+    MINUS1(netpipe_forget(relay->out, 1, &netpipefs_remove_open_file), DEBUG("relay forget failed: %s\n", strerror(errno)))
+}
+
+static void relay_update(struct relay *relay) {
+    int err, end = 0;
+
+    PTH(err, pthread_mutex_lock(&(relay->mtx)), perror("relay lock"); return)
+    if (relay->ended || relay->out == NULL) {
+        PTH(err, pthread_mutex_unlock(&(relay->mtx)), perror("relay unlock"))
+        return;
+    }
+
+    NOTZERO(netpipe_lock(relay->in), perror("relay lock"); goto unlock)
+    NOTZERO(netpipe_lock(relay->out), perror("relay lock"); netpipe_unlock(relay->in); goto unlock)
+
+    end = relay_update_locked(relay);
+    if (end) {
+        DEBUG("relay[%s] ended\n", relay->in->path);
+        relay->ended = 1;
+        relay->in->relay = NULL;
+        relay->out->relay = NULL;
+    }
+
+    NOTZERO(netpipe_unlock(relay->out), perror("relay unlock"))
+    NOTZERO(netpipe_unlock(relay->in), perror("relay unlock"))
+
+unlock:
+    PTH(err, pthread_mutex_unlock(&(relay->mtx)), perror("relay unlock"))
+    if (end) {
+        relay_close(relay);
+        relay_put(relay);
+    }
+}
+
+void netpipefs_relay_notify(struct relay *relay) {
+    relay_update(relay);
+    relay_put(relay);
+}
+
+int netpipefs_relay_start(struct netpipe *file, struct netpipefs_socket *dst, void (*poll_notify)(void *)) {
+    int err;
+    struct netpipe *out;
+    struct relay *relay;
+
+    EQNULL(relay = relay_alloc(poll_notify), return -1)
+    relay->in = file;
+
+    PTH(err, pthread_mutex_lock(&(relay->mtx)), relay_put(relay); return -1)
+    if (netpipe_relay_attach(file, O_RDONLY, relay) == -1) {
+        err = errno;
+        pthread_mutex_unlock(&(relay->mtx));
+        relay_put(relay);
+        if (err == EBUSY) return 0; // it is read locally
+        errno = err;
+        return -1;
+    }
+
+    // the messages are forwarded as they are, so the readers of the destination split them
+    out = netpipefs_lookup_open_file(dst, file->path);
+    if (out != NULL && netpipe_relay_attach(out, file->messages ? O_WRONLY | NETPIPE_MESSAGES : O_WRONLY, relay) == -1) {
+        err = errno;
+        MINUS1(netpipe_forget(out, 1, &netpipefs_remove_open_file), DEBUG("relay forget failed: %s\n", strerror(errno)))
+        errno = err;
+        out = NULL;
+    }
+    if (out == NULL) {
+        err = errno;
+        MINUS1(netpipe_relay_detach(file), perror("relay detach"))
+        relay->ended = 1;
+        pthread_mutex_unlock(&(relay->mtx));
+        relay_close(relay);
+        relay_put(relay);
+        errno = err;
+        return -1;
+    }
+
+    NOTZERO(netpipe_lock(file), perror("relay lock"))
+    relay->out = out;
+    NOTZERO(netpipe_unlock(file), perror("relay unlock"))
+    DEBUG("relay[%s] started\n", file->path);
+
+    PTH(err, pthread_mutex_unlock(&(relay->mtx)), perror("relay unlock"))
+    relay_update(relay);
+
+    return 0;
+}
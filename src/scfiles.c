@@ -1,5 +1,10 @@
+#define _GNU_SOURCE // splice()
 #include "../include/scfiles.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define COPY_SIZE 65536 // chunk size used when data cannot be spliced
 
 ssize_t readn(int fd, void *ptr, size_t n) {
     size_t   nleft;
@@ -31,4 +36,40 @@ ssize_t writen(int fd, void *ptr, size_t n) {
         ptr = (char*) ptr + nwritten;
     }
     return(n - nleft); /* return >= 0 */
-}
\ No newline at end of file
+}
+/* Fallback of splicen() */
+static ssize_t copyn(int fd_in, int fd_out, size_t n) {
+    char buf[COPY_SIZE];
+    size_t nleft = n, len;
+    ssize_t nread = 0, nwritten;
+
+    while (nleft > 0) {
+        len = nleft < COPY_SIZE ? nleft : COPY_SIZE;
+        if ((nread = readn(fd_in, buf, len)) <= 0) break;
+        if ((nwritten = writen(fd_out, buf, nread)) != nread) break;
+        nleft -= nread;
+    }
+    if (nleft == n && n > 0) return nread == 0 ? 0 : -1;
+    return(n - nleft);
+}
+
+ssize_t splicen(int fd_in, int fd_out, size_t n) {
+#ifdef __linux__
+    size_t   nleft;
+    ssize_t  nmoved;
+
+    nleft = n;
+    while (nleft > 0) {
+        if((nmoved = splice(fd_in, NULL, fd_out, NULL, nleft, SPLICE_F_MOVE)) < 0) {
+            if (errno == EINTR) continue;
+            if (nleft == n && (errno == EINVAL || errno == ENOSYS)) return copyn(fd_in, fd_out, n); /* not supported */
+            if (nleft == n) return -1; /* error, return -1 */
+            else break; /* error, return amount moved so far */
+        } else if (nmoved == 0) break; /* EOF */
+        nleft -= nmoved;
+    }
+    return(n - nleft); /* return >= 0 */
+#else
+    return copyn(fd_in, fd_out, n);
+#endif
+}
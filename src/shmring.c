@@ -0,0 +1,336 @@
+#define _GNU_SOURCE // memfd_create()
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "../include/shmring.h"
+
+#define CACHELINE 64
+#define SHMRING_HDR 4096    // the data starts after the header, at the next page
+
+enum { MEMFD, DATA_DOORBELL, SPACE_DOORBELL };
+
+/** Header at the beginning of the shared memory. Positions only grow, the offset is the position modulo size */
+struct shmring_hdr {
+    size_t size;
+    size_t head;    // written by the producer
+    char pad1[CACHELINE - 2 * sizeof(size_t)];
+    size_t tail;    // written by the consumer
+    char pad2[CACHELINE - sizeof(size_t)];
+    int rd_waiting; // the consumer sleeps until the data doorbell rings
+    int wr_waiting; // the producer sleeps until the space doorbell rings
+};
+
+struct shmring_s {
+    struct shmring_hdr *hdr;
+    char *data;
+    size_t size;
+    size_t cursor;  // consumer: position of the next byte to read. Space between tail and cursor is held
+    int fds[SHMRING_FDS];
+};
+
+/** Map the memory and fill the ring structure. Returns 0 on success, -1 on error */
+static int shmring_map(shmring_t *ring, size_t len) {
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fds[MEMFD], 0);
+    if (map == MAP_FAILED) return -1;
+
+    ring->hdr = (struct shmring_hdr *) map;
+    ring->data = (char *) map + SHMRING_HDR;
+    return 0;
+}
+
+static void close_fds(int fds[SHMRING_FDS]) {
+    int i;
+    for (i = 0; i < SHMRING_FDS; i++)
+        if (fds[i] != -1) close(fds[i]);
+}
+
+shmring_t *shmring_create(size_t size) {
+#ifdef __linux__
+    int i, err;
+    shmring_t *ring;
+
+    if (size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ring = (shmring_t *) malloc(sizeof(shmring_t));
+    if (ring == NULL) return NULL;
+    for (i = 0; i < SHMRING_FDS; i++) ring->fds[i] = -1;
+
+    ring->fds[MEMFD] = memfd_create("netpipefs", MFD_CLOEXEC);
+    if (ring->fds[MEMFD] == -1) goto error;
+    if (ftruncate(ring->fds[MEMFD], SHMRING_HDR + size) == -1) goto error;
+    ring->fds[DATA_DOORBELL] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->fds[DATA_DOORBELL] == -1) goto error;
+    ring->fds[SPACE_DOORBELL] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->fds[SPACE_DOORBELL] == -1) goto error;
+    if (shmring_map(ring, SHMRING_HDR + size) == -1) goto error;
+
+    // the memfd is zero-filled
+    ring->hdr->size = size;
+    ring->size = size;
+    ring->cursor = 0;
+    return ring;
+
+error:
+    err = errno;
+    close_fds(ring->fds);
+    free(ring);
+    errno = err;
+    return NULL;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+shmring_t *shmring_attach(int fds[SHMRING_FDS]) {
+    int i, err;
+    struct stat st;
+    shmring_t *ring = (shmring_t *) malloc(sizeof(shmring_t));
+    if (ring == NULL) {
+        close_fds(fds);
+        return NULL;
+    }
+    for (i = 0; i < SHMRING_FDS; i++) ring->fds[i] = fds[i];
+
+    if (fstat(ring->fds[MEMFD], &st) == -1) goto error;
+    if (st.st_size <= SHMRING_HDR) {
+        errno = EINVAL;
+        goto error;
+    }
+    if (shmring_map(ring, st.st_size) == -1) goto error;
+
+    ring->size = ring->hdr->size;
+    if (ring->size != (size_t) st.st_size - SHMRING_HDR) {
+        munmap(ring->hdr, st.st_size);
+        errno = EINVAL;
+        goto error;
+    }
+    ring->cursor = __atomic_load_n(&(ring->hdr->tail), __ATOMIC_ACQUIRE);
+    return ring;
+
+error:
+    err = errno;
+    close_fds(ring->fds);
+    free(ring);
+    errno = err;
+    return NULL;
+}
+
+void shmring_free(shmring_t *ring) {
+    if (ring) {
+        munmap(ring->hdr, SHMRING_HDR + ring->size);
+        close_fds(ring->fds);
+        free(ring);
+    }
+}
+
+const int *shmring_fds(shmring_t *ring) {
+    return ring->fds;
+}
+
+int shmring_pollfd(shmring_t *ring) {
+    return ring->fds[DATA_DOORBELL];
+}
+
+size_t shmring_capacity(shmring_t *ring) {
+    return ring->size;
+}
+
+/** Wake up the other side. It is called only when it sleeps, so it is not called twice for the same wait */
+static void doorbell_ring(int doorbell) {
+    uint64_t one = 1;
+    while (write(doorbell, &one, sizeof(uint64_t)) == -1 && errno == EINTR);
+}
+
+/**
+ * Sleep until the doorbell rings or the other process is gone.
+ *
+ * @return 1 if the doorbell rang, 0 if the other process is gone, -1 on error
+ */
+static int doorbell_wait(int doorbell, int peerfd) {
+    uint64_t count;
+    struct pollfd fds[2];
+    nfds_t nfds = peerfd == -1 ? 1 : 2;
+
+    fds[0].fd = doorbell;
+    fds[0].events = POLLIN;
+    fds[1].fd = peerfd;
+    fds[1].events = POLLIN;
+    while (poll(fds, nfds, -1) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    if (fds[0].revents & POLLIN) {
+        // the doorbell is nonblocking: reset it
+        while (read(doorbell, &count, sizeof(uint64_t)) == -1 && errno == EINTR);
+        return 1;
+    }
+
+    // nothing else is sent over the connection, so it can be read only when it is closed
+    return 0;
+}
+
+/** Returns how much data can be written and sets data to the contiguous free space */
+static size_t ring_space(shmring_t *ring, char **data) {
+    size_t head = ring->hdr->head;  // only the producer writes it
+    size_t tail = __atomic_load_n(&(ring->hdr->tail), __ATOMIC_ACQUIRE);
+    size_t offset = head % ring->size, space = ring->size - (head - tail);
+
+    *data = ring->data + offset;
+    return space < ring->size - offset ? space : ring->size - offset;
+}
+
+void shmring_commit(shmring_t *ring, size_t n) {
+    __atomic_store_n(&(ring->hdr->head), ring->hdr->head + n, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(ring->hdr->rd_waiting), __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&(ring->hdr->rd_waiting), 0, __ATOMIC_ACQ_REL))
+        doorbell_ring(ring->fds[DATA_DOORBELL]);
+}
+
+ssize_t shmring_reserve(shmring_t *ring, char **data, int peerfd) {
+    size_t space;
+    int err;
+
+    while ((space = ring_space(ring, data)) == 0) {
+        __atomic_store_n(&(ring->hdr->wr_waiting), 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((space = ring_space(ring, data)) > 0) {
+            __atomic_store_n(&(ring->hdr->wr_waiting), 0, __ATOMIC_RELAXED);
+            break;
+        }
+        err = doorbell_wait(ring->fds[SPACE_DOORBELL], peerfd);
+        if (err <= 0) return err;
+    }
+
+    return space;
+}
+
+ssize_t shmring_writen(shmring_t *ring, const char *buf, size_t n, int peerfd) {
+    size_t done = 0;
+    ssize_t len;
+    char *data;
+
+    while (done < n) {
+        len = shmring_reserve(ring, &data, peerfd);
+        if (len == -1 && done == 0) return -1;
+        if (len <= 0) break;
+        if ((size_t) len > n - done) len = n - done;
+
+        memcpy(data, buf + done, len);
+        shmring_commit(ring, len);
+        done += len;
+    }
+
+    return done;
+}
+
+ssize_t shmring_readfd(shmring_t *ring, int fd, size_t n, int peerfd) {
+    size_t done = 0;
+    ssize_t len, bytes;
+    char *data;
+
+    while (done < n) {
+        len = shmring_reserve(ring, &data, peerfd);
+        if (len == -1 && done == 0) return -1;
+        if (len <= 0) break;
+        if ((size_t) len > n - done) len = n - done;
+
+        bytes = read(fd, data, len);
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes == -1 && done == 0) return -1;
+        if (bytes <= 0) break;
+        shmring_commit(ring, bytes);
+        done += bytes;
+    }
+
+    return done;
+}
+
+size_t shmring_peek(shmring_t *ring, char **data) {
+    size_t head = __atomic_load_n(&(ring->hdr->head), __ATOMIC_ACQUIRE);
+    size_t offset = ring->cursor % ring->size, available = head - ring->cursor;
+
+    *data = ring->data + offset;
+    return available < ring->size - offset ? available : ring->size - offset;
+}
+
+void shmring_consume(shmring_t *ring, size_t n) {
+    ring->cursor += n;
+}
+
+void shmring_release(shmring_t *ring) {
+    if (ring->hdr->tail == ring->cursor) return; // only the consumer writes it
+
+    __atomic_store_n(&(ring->hdr->tail), ring->cursor, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(ring->hdr->wr_waiting), __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&(ring->hdr->wr_waiting), 0, __ATOMIC_ACQ_REL))
+        doorbell_ring(ring->fds[SPACE_DOORBELL]);
+}
+
+int shmring_ready(shmring_t *ring) {
+    uint64_t count;
+    char *data;
+
+    shmring_release(ring);
+    if (shmring_peek(ring, &data) > 0) return 1;
+
+    // reset the doorbell before arming it, then check again because the producer doesn't ring it if not armed
+    while (read(ring->fds[DATA_DOORBELL], &count, sizeof(uint64_t)) == -1 && errno == EINTR);
+    __atomic_store_n(&(ring->hdr->rd_waiting), 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shmring_peek(ring, &data) > 0) {
+        __atomic_store_n(&(ring->hdr->rd_waiting), 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    return 0;
+}
+
+int shmring_wait(shmring_t *ring, int peerfd) {
+    int err;
+    char *data;
+
+    while (!shmring_ready(ring)) {
+        err = doorbell_wait(ring->fds[DATA_DOORBELL], peerfd);
+        if (err == -1) return -1;
+        // the other process may have written something before leaving
+        if (err == 0) return shmring_peek(ring, &data) > 0;
+    }
+
+    return 1;
+}
+
+ssize_t shmring_readn(shmring_t *ring, char *buf, size_t n, int peerfd) {
+    size_t done = 0, len;
+    char *data;
+    int err;
+
+    while (done < n) {
+        len = shmring_peek(ring, &data);
+        if (len == 0) {
+            err = shmring_wait(ring, peerfd);
+            if (err == -1 && done == 0) return -1;
+            if (err <= 0) break;
+            continue;
+        }
+        if (len > n - done) len = n - done;
+
+        memcpy(buf + done, data, len);
+        shmring_consume(ring, len);
+        done += len;
+    }
+    shmring_release(ring);
+
+    return done;
+}
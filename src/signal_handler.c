@@ -1,16 +1,19 @@
 #include "../include/signal_handler.h"
 #include "../include/utils.h"
 #include "../include/openfiles.h"
+#include "../include/pollhandle.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/peers.h"
 #include "../include/scfiles.h"
-#include <fuse/fuse_lowlevel.h>
+#include <fuse_lowlevel.h>
 #include <pthread.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 
-/* Fuse channel and fuse structure. Used to unmount the filesystem when a signal arrives */
+/* Fuse channel and session. Used to unmount the filesystem when a signal arrives */
 static struct fuse_chan *chan;
-static struct fuse *fuse;
+static struct fuse_session *session;
 
 /* Thread signal handler */
 static pthread_t sig_handler_tid;
@@ -25,12 +28,11 @@ static void *signal_handler_thread(void *arg) {
     PTHERR(err, sigwait(set, &sig), return NULL)
 
     /* Stop all the operations on file */
-    err = netpipefs_shutdown();
+    err = netpipefs_peers_shutdown(&netpipefs_poll_notify);
     if (err == -1) perror("signal handler failed to exit all");
 
     /* Exit from loop */
-    fuse_session_exit(fuse_get_session(fuse));
-    // calling fuse_exit(fuse) is equal but it will lead to errors
+    fuse_session_exit(session);
 
     /* Unmount the filesystem */
     if (netpipefs_options.mountpoint && chan)
@@ -47,7 +49,7 @@ static void *signal_handler_thread(void *arg) {
     return 0;
 }
 
-int netpipefs_set_signal_handlers(sigset_t *set, struct fuse_chan *ch, struct fuse *fu) {
+int netpipefs_set_signal_handlers(sigset_t *set, struct fuse_chan *ch, struct fuse_session *se) {
     int err;
     if (pipefd[0] != -1) { // sig handler is already running
         errno = EALREADY;
@@ -70,10 +72,10 @@ int netpipefs_set_signal_handlers(sigset_t *set, struct fuse_chan *ch, struct fu
     /* Do not handle SIGPIPE */
     MINUS1(sigdelset(set, SIGPIPE), return -1)
 
-    fuse = fu;
+    session = se;
     chan = ch;
     /* Run signal handler thread */
-    PTH(err, pthread_create(&sig_handler_tid, NULL, &signal_handler_thread, set), if (fuse) fuse = NULL; if (chan) chan = NULL; return -1)
+    PTH(err, pthread_create(&sig_handler_tid, NULL, &signal_handler_thread, set), session = NULL; chan = NULL; return -1)
 
     //PTH(err, pthread_detach(sig_handler_tid), return -1)
 
@@ -146,4 +146,86 @@ int sock_read_h(int fd_skt, void **ptr) {
     if (bytes <= 0) free(*ptr);
 
     return bytes;
-}
\ No newline at end of file
+}
+
+int sock_send_fds(int fd_skt, const int *fds, int n) {
+    char byte = 0;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    if (n <= 0 || n > SOCK_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* At least one byte of data must be sent with the file descriptors */
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    while (sendmsg(fd_skt, &msg, 0) == -1) {
+        if (errno != EINTR) return -1;
+    }
+
+    return 1;
+}
+
+int sock_recv_fds(int fd_skt, int *fds, int n) {
+    char byte;
+    ssize_t bytes;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    if (n <= 0 || n > SOCK_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    while ((bytes = recvmsg(fd_skt, &msg, 0)) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    if (bytes == 0) return 0;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n)) {
+        // close what was received, if anything
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < count; i++) close(((int *) CMSG_DATA(cmsg))[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+
+    return 1;
+}
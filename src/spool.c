@@ -0,0 +1,156 @@
+#define _GNU_SOURCE // O_TMPFILE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/spool.h"
+
+#define SPOOL_TEMPLATE "netpipefs.XXXXXX"
+
+/** Positions only grow, the offset is the position modulo capacity */
+struct spool_s {
+    char *data;
+    size_t capacity;
+    size_t head;    // position where the next byte is appended
+    size_t tail;    // position of the oldest byte
+    int fd;
+};
+
+/** Create an unnamed file into the directory. Returns its file descriptor, -1 on error */
+static int spool_open(const char *dir) {
+    int fd, err;
+    char *path;
+
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+#endif
+    // the filesystem doesn't support unnamed files: the file is unlinked as soon as it is created
+    path = (char *) malloc(strlen(dir) + sizeof(SPOOL_TEMPLATE) + 1);
+    if (path == NULL) return -1;
+    sprintf(path, "%s/%s", dir, SPOOL_TEMPLATE);
+    fd = mkstemp(path);
+    if (fd != -1) {
+        err = errno;
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        errno = err;
+    }
+    free(path);
+
+    return fd;
+}
+
+spool_t *spool_create(const char *dir, size_t capacity) {
+    int err;
+    void *map;
+    spool_t *spool;
+
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    spool = (spool_t *) malloc(sizeof(spool_t));
+    if (spool == NULL) return NULL;
+
+    spool->fd = spool_open(dir);
+    if (spool->fd == -1) goto error;
+    // the blocks are allocated now, so writing into the mapping cannot fail later because the disk is full
+    if ((err = posix_fallocate(spool->fd, 0, capacity)) != 0) {
+        errno = err;
+        goto error_fd;
+    }
+    map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+    if (map == MAP_FAILED) goto error_fd;
+
+    spool->data = (char *) map;
+    spool->capacity = capacity;
+    spool->head = 0;
+    spool->tail = 0;
+    return spool;
+
+error_fd:
+    err = errno;
+    close(spool->fd);
+    errno = err;
+error:
+    err = errno;
+    free(spool);
+    errno = err;
+    return NULL;
+}
+
+void spool_free(spool_t *spool) {
+    if (spool) {
+        munmap(spool->data, spool->capacity);
+        close(spool->fd);
+        free(spool);
+    }
+}
+
+size_t spool_capacity(spool_t *spool) {
+    return spool->capacity;
+}
+
+size_t spool_size(spool_t *spool) {
+    return spool->head - spool->tail;
+}
+
+/** Returns how much data can be appended and sets data to the contiguous free space */
+static size_t spool_space(spool_t *spool, char **data) {
+    size_t offset = spool->head % spool->capacity, space = spool->capacity - (spool->head - spool->tail);
+
+    *data = spool->data + offset;
+    return space < spool->capacity - offset ? space : spool->capacity - offset;
+}
+
+size_t spool_put(spool_t *spool, const char *data, size_t size) {
+    size_t put = 0, space;
+    char *dest;
+
+    while (put < size && (space = spool_space(spool, &dest)) > 0) {
+        if (space > size - put) space = size - put;
+        memcpy(dest, data + put, space);
+        spool->head += space;
+        put += space;
+    }
+
+    return put;
+}
+
+ssize_t spool_readn(int fd, spool_t *spool, size_t n) {
+    size_t put = 0, space;
+    ssize_t bytes;
+    char *dest;
+
+    while (put < n && (space = spool_space(spool, &dest)) > 0) {
+        if (space > n - put) space = n - put;
+        bytes = read(fd, dest, space);
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+            return put > 0 ? (ssize_t) put : -1;
+        }
+        if (bytes == 0) break;
+        spool->head += bytes;
+        put += bytes;
+    }
+
+    return put;
+}
+
+size_t spool_peek(spool_t *spool, char **data) {
+    size_t offset = spool->tail % spool->capacity, size = spool->head - spool->tail;
+
+    *data = spool->data + offset;
+    return size < spool->capacity - offset ? size : spool->capacity - offset;
+}
+
+void spool_drop(spool_t *spool, size_t n) {
+    spool->tail += n;
+    // start again from the beginning of the file, so the data is contiguous as long as possible
+    if (spool->tail == spool->head) spool->head = spool->tail = 0;
+}
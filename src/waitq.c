@@ -0,0 +1,157 @@
+#define _DEFAULT_SOURCE // syscall()
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <time.h>
+#include "../include/waitq.h"
+#include "../include/utils.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <pthread.h>
+#endif
+
+#define WAITQ_PENDING 0     // not completed and nobody is sleeping on it
+#define WAITQ_SLEEPING 1    // not completed and the waiter is sleeping (or is going to)
+#define WAITQ_DONE 2        // completed
+
+#define SPIN_MIN 1000L      // nanoseconds that a waiter always spins, so that the estimate can grow again
+#define SPIN_CHECK 64       // the clock is read once every SPIN_CHECK iterations
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while(0)
+#endif
+
+#ifdef __linux__
+static int futex_wait(uint32_t *uaddr, uint32_t val) {
+    return (int) syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static int futex_wake(uint32_t *uaddr, int nwake) {
+    return (int) syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, nwake, NULL, NULL, 0);
+}
+#else
+/* Without futexes every waiter sleeps on the same condition variable */
+static pthread_mutex_t waitq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitq_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+void waitq_node_init(waitq_node_t *node) {
+    node->state = WAITQ_PENDING;
+    node->next = NULL;
+    node->callback = NULL;
+}
+
+void waitq_node_init_callback(waitq_node_t *node, void (*callback)(waitq_node_t *node)) {
+    waitq_node_init(node);
+    node->callback = callback;
+}
+
+int waitq_done(waitq_node_t *node) {
+    return __atomic_load_n(&(node->state), __ATOMIC_ACQUIRE) == WAITQ_DONE;
+}
+
+#ifdef __linux__
+int waitq_wait(waitq_node_t *node) {
+    uint32_t expected = WAITQ_PENDING;
+
+    /* Announce that this thread is going to sleep. Fails only if the node is already done */
+    if (!__atomic_compare_exchange_n(&(node->state), &expected, WAITQ_SLEEPING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+
+    while (!waitq_done(node)) {
+        if (futex_wait(&(node->state), WAITQ_SLEEPING) == -1 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void wake_waiter(waitq_node_t *node) {
+    /* The waiter may see the node done and free it before futex_wake() is called. Waking an address
+     * which is no longer used is harmless: at most it causes a spurious wake up that is checked again. */
+    if (__atomic_exchange_n(&(node->state), WAITQ_DONE, __ATOMIC_ACQ_REL) == WAITQ_SLEEPING)
+        futex_wake(&(node->state), 1);
+}
+#else
+int waitq_wait(waitq_node_t *node) {
+    int err;
+    if ((err = pthread_mutex_lock(&waitq_mtx)) != 0) { errno = err; return -1; }
+    while (!waitq_done(node)) {
+        if ((err = pthread_cond_wait(&waitq_cond, &waitq_mtx)) != 0) {
+            pthread_mutex_unlock(&waitq_mtx);
+            errno = err;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&waitq_mtx);
+
+    return 0;
+}
+
+static void wake_waiter(waitq_node_t *node) {
+    pthread_mutex_lock(&waitq_mtx);
+    __atomic_store_n(&(node->state), WAITQ_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&waitq_cond);
+    pthread_mutex_unlock(&waitq_mtx);
+}
+#endif
+
+void waitq_wake(waitq_node_t *node) {
+    if (node->callback != NULL) node->callback(node);
+    else wake_waiter(node);
+}
+
+int waitq_wait_spin(waitq_node_t *node, waitq_spin_t *spin, long max_spin) {
+    struct timespec start, spent;
+    long estimate, limit, elapsed;
+    unsigned int iterations = 0;
+
+    if (max_spin <= 0) return waitq_wait(node);
+
+    estimate = __atomic_load_n(&(spin->estimate), __ATOMIC_RELAXED);
+    limit = 2 * estimate + SPIN_MIN;
+    if (limit > max_spin) limit = max_spin;
+
+    MINUS1(clock_gettime(CLOCK_MONOTONIC, &start), return waitq_wait(node))
+    while (!waitq_done(node)) {
+        cpu_relax();
+        if (++iterations % SPIN_CHECK == 0) {
+            spent = elapsed_time(&start);
+            if (spent.tv_sec * 1000000000L + spent.tv_nsec >= limit) {
+                /* Spinning was useless: spin less the next time and block */
+                __atomic_store_n(&(spin->estimate), estimate - estimate / 8, __ATOMIC_RELAXED);
+                return waitq_wait(node);
+            }
+        }
+    }
+
+    spent = elapsed_time(&start);
+    elapsed = spent.tv_sec * 1000000000L + spent.tv_nsec;
+    __atomic_store_n(&(spin->estimate), estimate + (elapsed - estimate) / 8, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void waitq_defer(waitq_wakelist_t *wl, waitq_node_t *node) {
+    node->next = NULL;
+    if (wl->tail != NULL) wl->tail->next = node;
+    else wl->head = node;
+    wl->tail = node;
+}
+
+void waitq_wake_all(waitq_wakelist_t *wl) {
+    waitq_node_t *node = wl->head, *next;
+
+    while (node != NULL) {
+        next = node->next; // read it before the node is completed
+        waitq_wake(node);
+        node = next;
+    }
+    wl->head = NULL;
+    wl->tail = NULL;
+}
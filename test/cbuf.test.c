@@ -6,6 +6,9 @@
 static void test_operations(void);
 static void test_zero_capacity(void);
 static void test_from_file_descriptor(void);
+static void test_peek_drop(void);
+static void test_grow(void);
+static void test_rfind(void);
 
 int main(int argc, char** argv) {
     size_t capacity = 8192;
@@ -46,6 +49,9 @@ int main(int argc, char** argv) {
     test_operations();
     test_zero_capacity();
     test_from_file_descriptor();
+    test_peek_drop();
+    test_grow();
+    test_rfind();
     testpassed("Circular buffer");
     return 0;
 }
@@ -159,4 +165,111 @@ static void test_from_file_descriptor(void) {
 
     /* Free buffer */
     cbuf_free(buffer);
-}
\ No newline at end of file
+}
+static void test_peek_drop(void) {
+    size_t capacity = 10;
+    char *data;
+
+    /* Alloc buffer */
+    cbuf_t *buffer = cbuf_alloc(capacity);
+    test(buffer != NULL)
+    test(cbuf_peek(buffer, 0, &data) == 0)
+
+    char dummydata[capacity];
+    for(size_t i=0; i<capacity; i++) dummydata[i] = (char)(97+i);
+
+    /* Move the tail near the end so that data wraps around */
+    test(cbuf_put(buffer, dummydata, 7) == 7)
+    cbuf_drop(buffer, 7);
+    test(cbuf_empty(buffer) == 1)
+    test(cbuf_put(buffer, dummydata, capacity) == capacity)
+    test(cbuf_full(buffer) == 1)
+
+    /* Peek the contiguous parts without consuming */
+    test(cbuf_peek(buffer, 0, &data) == 3)
+    test(data[0] == 'a' && data[2] == 'c')
+    test(cbuf_peek(buffer, 3, &data) == 7)
+    test(data[0] == 'd')
+    test(cbuf_peek(buffer, 5, &data) == 5)
+    test(data[0] == 'f')
+    test(cbuf_peek(buffer, capacity, &data) == 0)
+    test(cbuf_size(buffer) == capacity)
+
+    /* Drop across the end */
+    cbuf_drop(buffer, 4);
+    test(cbuf_full(buffer) == 0)
+    test(cbuf_size(buffer) == capacity - 4)
+    test(cbuf_peek(buffer, 0, &data) == 6)
+    test(data[0] == 'e')
+    cbuf_drop(buffer, 6);
+    test(cbuf_empty(buffer) == 1)
+
+    /* Free buffer */
+    cbuf_free(buffer);
+}
+
+static void test_grow(void) {
+    size_t capacity = 10;
+    char datagot[20];
+
+    /* Alloc buffer */
+    cbuf_t *buffer = cbuf_alloc(0);
+    test(buffer != NULL)
+    test(cbuf_grow(buffer, capacity) == 0)
+    test(cbuf_capacity(buffer) == capacity)
+
+    char dummydata[capacity];
+    for(size_t i=0; i<capacity; i++) dummydata[i] = (char)(97+i);
+
+    /* Full buffer whose data wraps around */
+    test(cbuf_put(buffer, dummydata, 6) == 6)
+    cbuf_drop(buffer, 6);
+    test(cbuf_put(buffer, dummydata, capacity) == capacity)
+
+    /* The data is kept in order */
+    test(cbuf_grow(buffer, 5) == 0)
+    test(cbuf_capacity(buffer) == capacity)
+    test(cbuf_grow(buffer, 2*capacity) == 0)
+    test(cbuf_capacity(buffer) == 2*capacity)
+    test(cbuf_size(buffer) == capacity)
+    test(cbuf_full(buffer) == 0)
+    test(cbuf_put(buffer, dummydata, capacity) == capacity)
+    test(cbuf_full(buffer) == 1)
+    test(cbuf_get(buffer, datagot, 2*capacity) == 2*capacity)
+    for(size_t i = 0; i<2*capacity; i++) {
+        test(datagot[i] == dummydata[i % capacity])
+    }
+
+    /* Free buffer */
+    cbuf_free(buffer);
+}
+
+static void test_rfind(void) {
+    size_t capacity = 100;
+    char dummydata[capacity];
+    for(size_t i=0; i<capacity; i++) dummydata[i] = (char)(97+i%26);
+
+    /* Alloc buffer */
+    cbuf_t *buffer = cbuf_alloc(capacity);
+    test(buffer != NULL)
+    test(cbuf_rfind(buffer, 0, capacity, 'a') == 0)
+
+    /* Data which wraps around, longer than a vector */
+    test(cbuf_put(buffer, dummydata, 60) == 60)
+    cbuf_drop(buffer, 60);
+    test(cbuf_put(buffer, dummydata, 90) == 90)
+    test(cbuf_rfind(buffer, 0, 90, 'a') == 79)
+    test(cbuf_rfind(buffer, 0, 78, 'a') == 53)
+    test(cbuf_rfind(buffer, 0, 90, 'l') == 90)
+    test(cbuf_rfind(buffer, 0, 90, '\n') == 0)
+    test(cbuf_rfind(buffer, 53, 78, 'a') == 0)
+    test(cbuf_rfind(buffer, 0, 1, 'a') == 1)
+    test(cbuf_find(buffer, 0, 90, 'a') == 1)
+    test(cbuf_find(buffer, 27, 90, 'a') == 53)
+    test(cbuf_find(buffer, 53, 78, 'a') == 0)
+    test(cbuf_find(buffer, 53, 79, 'a') == 79)
+    test(cbuf_find(buffer, 0, 90, '\n') == 0)
+
+    /* Free buffer */
+    cbuf_free(buffer);
+}
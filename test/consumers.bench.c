@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "netpipeutilities.h"
+#include "../include/netpipe.h"
+#include "../include/dispatcher.h"
+#include "../include/openfiles.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/utils.h"
+
+#define UNITS 10000     // messages or records sent by each run
+#define UNIT_SIZE 1024  // size of a message or a record
+#define READ_SIZE 65536 // size of the reads
+#define WORK_US 200     // microseconds a reader waits for each message or record, like for a database
+#define MAX_READERS 4
+
+static struct netpipefs_socket skts[2];
+static char path[32];
+static int records;
+static struct netpipe *reader_file;
+static size_t units_read[MAX_READERS];
+
+/* Wait some time for each unit, like a consumer which stores it somewhere else */
+static void work(size_t units) {
+    struct timespec wait;
+
+    wait.tv_sec = 0;
+    wait.tv_nsec = (long) (units * WORK_US * 1000);
+    while (wait.tv_nsec >= 1000000000L) {
+        wait.tv_sec++;
+        wait.tv_nsec -= 1000000000L;
+    }
+    test(nanosleep(&wait, NULL) == 0)
+}
+
+static void *writer_thread(void *arg) {
+    char unit[UNIT_SIZE];
+    int i;
+    struct netpipe *file = open_netpipe(&skts[0], path, records ? O_WRONLY : O_WRONLY | NETPIPE_MESSAGES);
+
+    memset(unit, 'u', UNIT_SIZE - 1);
+    unit[UNIT_SIZE - 1] = '\n';
+    for (i = 0; i < UNITS; i++)
+        test(netpipe_send(file, unit, UNIT_SIZE, 0) == UNIT_SIZE)
+    test(netpipe_close(file, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    static __thread char buf[READ_SIZE];
+    size_t *units = (size_t *) arg, n;
+    ssize_t bytes;
+
+    test(netpipe_open(reader_file, O_RDONLY, 0) == 0)
+    while ((bytes = netpipe_read(reader_file, buf, READ_SIZE, 0)) > 0) {
+        n = bytes / UNIT_SIZE;
+        *units += n;
+        work(n);
+    }
+    test(bytes == 0)
+    test(netpipe_close(reader_file, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    return NULL;
+}
+
+/* Measures how many messages or records per second are processed by some readers of the same netpipe */
+static void bench_consumers(int readers, int group) {
+    pthread_t writer, tids[MAX_READERS];
+    struct timespec start, elapsed;
+    size_t total = 0, least = UNITS;
+    double seconds;
+    int i;
+
+    // each run has its own netpipe, so the closes of the previous one don't matter
+    snprintf(path, sizeof(path), "/%s%d%s", records ? "records" : "messages", readers, group ? "group" : "");
+    reader_file = netpipefs_lookup_open_file(&skts[1], path);
+    test(reader_file != NULL)
+    if (records) test(netpipe_set_delimiter(reader_file, '\n') == 0)
+    test(netpipe_set_group(reader_file, group) == 0)
+
+    test(clock_gettime(CLOCK_MONOTONIC, &start) != -1)
+    test(pthread_create(&writer, NULL, &writer_thread, NULL) == 0)
+    for (i = 0; i < readers; i++) {
+        units_read[i] = 0;
+        test(pthread_create(&tids[i], NULL, &reader_thread, &units_read[i]) == 0)
+    }
+    for (i = 0; i < readers; i++) {
+        test(pthread_join(tids[i], NULL) == 0)
+        total += units_read[i];
+        if (units_read[i] < least) least = units_read[i];
+    }
+    elapsed = elapsed_time(&start);
+    test(pthread_join(writer, NULL) == 0)
+    test(total == UNITS)
+    test(netpipe_forget(reader_file, 1, &netpipefs_remove_open_file) == 0)
+
+    seconds = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+    printf("%-8s %d readers %-6s %10.0f units/s   least loaded reader %5.1f%%\n", records ? "records" : "messages",
+           readers, group ? "group" : "fifo", UNITS / seconds, 100.0 * least / UNITS);
+}
+
+/* Throughput of the readers of a netpipe which share its messages or its records */
+int main(int argc, char** argv) {
+    struct dispatcher *dispatchers[2];
+    struct netpipefs_socket *skt;
+    int sv[2], i, readers, group;
+    netpipefs_options.debug = 0;
+
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    for (i = 0; i < 2; i++) {
+        skt_init(&skts[i], sv[i], 0); // the default readahead and writeahead, which are zero
+        skt = &skts[i];
+        test((dispatchers[i] = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+    }
+
+    for (records = 0; records <= 1; records++)
+        for (readers = 1; readers <= MAX_READERS; readers *= 2)
+            for (group = 0; group <= 1; group++)
+                bench_consumers(readers, group);
+
+    for (i = 0; i < 2; i++)
+        test(netpipefs_dispatcher_stop(dispatchers[i]) == 0)
+
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include <unistd.h>
+#include <pthread.h>
+#include "netpipeutilities.h"
+#include "../include/fanout.h"
+#include "../include/dispatcher.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/openfiles.h"
+#include "../include/utils.h"
+
+#define AHEAD 4096              // readahead and writeahead of every host
+#define LAG (4 * AHEAD)         // bytes a subscriber can lag behind the fastest one
+#define DATA (32 * LAG)         // bytes written when a subscriber lags
+#define WRITES 500              // writes of each writer when there are many writers
+
+/* The first host writes the fan-out netpipes and it is connected to two subscribers, which read them */
+static struct netpipefs_socket wskts[2], subskts[2];
+static struct dispatcher *dispatchers[3];
+
+/* Open of a reader made by another thread */
+struct opener {
+    struct netpipefs_socket *skt;
+    const char *path;
+    struct netpipe *file;
+};
+
+/* Reader which reads into its buffer until the end of file */
+struct drain {
+    pthread_t tid;
+    struct netpipe *file;
+    char *buf;
+    size_t size;    // capacity of the buffer
+    size_t got;     // bytes read
+};
+
+/* Writer of a fan-out netpipe shared with other writers */
+struct writer {
+    pthread_t tid;
+    struct fanout *fanout;
+    unsigned int seed;
+    size_t wrote;
+};
+
+static void connect_hosts(void);
+static void disconnect_hosts(void);
+static void test_subscribers(void);
+static void test_close_waits(void);
+static void test_lagging(int drop);
+static void test_reactivate(void);
+static void test_writers(void);
+
+int main(int argc, char** argv) {
+    netpipefs_options.debug = 0;
+
+    connect_hosts();
+    test_subscribers();
+    test_close_waits();
+    test_lagging(1);
+    test_lagging(0);
+    test_reactivate();
+    test_writers();
+    disconnect_hosts();
+
+    testpassed("Fan-out netpipe");
+    return 0;
+}
+
+static void connect_hosts(void) {
+    struct netpipefs_socket *skts[2] = { &wskts[0], &wskts[1] }, *skt;
+    int i;
+
+    for (i = 0; i < 2; i++) connect_skts(&wskts[i], &subskts[i], AHEAD);
+    test((dispatchers[0] = netpipefs_dispatcher_run(skts, 2, NULL)) != NULL)
+    for (i = 0; i < 2; i++) {
+        skt = &subskts[i];
+        test((dispatchers[i + 1] = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+    }
+}
+
+static void disconnect_hosts(void) {
+    int i;
+
+    for (i = 0; i < 3; i++)
+        test(netpipefs_dispatcher_stop(dispatchers[i]) == 0)
+    for (i = 0; i < 2; i++) {
+        test(netpipefs_open_files_table_destroy(&wskts[i], NULL) == 0)
+        test(netpipefs_open_files_table_destroy(&subskts[i], NULL) == 0)
+        close(wskts[i].fd);
+        close(subskts[i].fd);
+    }
+}
+
+static void *open_reader(void *arg) {
+    struct opener *op = (struct opener *) arg;
+    op->file = open_netpipe(op->skt, op->path, O_RDONLY);
+
+    return NULL;
+}
+
+/* Open the fan-out netpipe with the given policy and a reader on each subscriber, then wait until the writer's
+ * host knows of the readers, so that nothing written is discarded */
+static struct fanout *fanout_begin(const char *path, size_t lag, int drop, struct netpipe **readers) {
+    struct netpipefs_socket *skts[2] = { &wskts[0], &wskts[1] };
+    struct opener ops[2];
+    pthread_t tids[2];
+    struct fanout *fanout;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        ops[i].skt = &subskts[i];
+        ops[i].path = path;
+        test(pthread_create(&tids[i], NULL, &open_reader, &ops[i]) == 0)
+    }
+    test((fanout = netpipefs_fanout_get(path, lag, drop, NULL)) != NULL)
+    test(netpipefs_fanout_open(fanout, skts, 2) == 0)
+    for (i = 0; i < 2; i++) {
+        test(pthread_join(tids[i], NULL) == 0)
+        readers[i] = ops[i].file;
+        wait_readers(netpipefs_get_open_file(&wskts[i], path), 1);
+    }
+
+    return fanout;
+}
+
+static void fanout_write(struct fanout *fanout, const char *buf, size_t size) {
+    struct result res;
+
+    test(sem_init(&(res.done), 0, 0) == 0)
+    test(netpipefs_fanout_write_async(fanout, buf, size, 0, &result_done, &res) == 0)
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == (ssize_t) size)
+    test(sem_destroy(&(res.done)) == 0)
+}
+
+static void fanout_close(struct fanout *fanout) {
+    struct result res;
+
+    test(sem_init(&(res.done), 0, 0) == 0)
+    test(netpipefs_fanout_close_async(fanout, &result_done, &res) == 0)
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == 0)
+    test(sem_destroy(&(res.done)) == 0)
+}
+
+/* The readers of the subscribers get the end of file and close */
+static void close_readers(struct netpipe **readers) {
+    char c;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        test(netpipe_read(readers[i], &c, 1, 0) == 0)
+        test(netpipe_close(readers[i], O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+    }
+}
+
+static void *drain_thread(void *arg) {
+    struct drain *drain = (struct drain *) arg;
+    ssize_t bytes;
+
+    while ((bytes = netpipe_read(drain->file, drain->buf + drain->got, drain->size - drain->got, 0)) > 0)
+        drain->got += bytes;
+    test(bytes == 0)
+
+    return NULL;
+}
+
+static void drain_start(struct drain *drain, struct netpipe *file, size_t size) {
+    drain->file = file;
+    drain->size = size;
+    drain->got = 0;
+    test((drain->buf = (char *) malloc(size)) != NULL)
+    test(pthread_create(&(drain->tid), NULL, &drain_thread, drain) == 0)
+}
+
+/* Wait for the end of file, then close the reader */
+static void drain_end(struct drain *drain) {
+    test(pthread_join(drain->tid, NULL) == 0)
+    test(netpipe_close(drain->file, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+}
+
+/* Every subscriber reads what is written */
+static void test_subscribers(void) {
+    char buf[64];
+    struct netpipe *readers[2];
+    struct fanout *fanout = fanout_begin("/fanout", LAG, 0, readers);
+    int i;
+
+    fanout_write(fanout, "hello", 5);
+    fanout_write(fanout, " world", 6);
+    for (i = 0; i < 2; i++) {
+        read_all(readers[i], buf, 11);
+        test(memcmp(buf, "hello world", 11) == 0)
+    }
+
+    fanout_close(fanout);
+    close_readers(readers);
+    netpipefs_fanout_put(fanout, 1);
+}
+
+/* The close of the last writer waits until the slow subscriber was sent the buffer */
+static void test_close_waits(void) {
+    char buf[3 * AHEAD];
+    struct netpipe *readers[2];
+    struct fanout *fanout = fanout_begin("/fanoutclose", LAG, 0, readers);
+    struct result res;
+    int i;
+
+    /* More than the credit of the slow subscriber, less than the lag */
+    memset(buf, 'c', sizeof(buf));
+    fanout_write(fanout, buf, sizeof(buf));
+    read_all(readers[0], buf, sizeof(buf));
+
+    test(sem_init(&(res.done), 0, 0) == 0)
+    test(netpipefs_fanout_close_async(fanout, &result_done, &res) == 0)
+    test(msleep(50) == 0)
+    test(sem_trywait(&(res.done)) == -1 && errno == EAGAIN)
+    errno = 0;
+
+    memset(buf, 0, sizeof(buf));
+    read_all(readers[1], buf, sizeof(buf));
+    for (i = 0; i < (int) sizeof(buf); i++) test(buf[i] == 'c')
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == 0)
+    test(sem_destroy(&(res.done)) == 0)
+
+    close_readers(readers);
+    netpipefs_fanout_put(fanout, 1);
+}
+
+/* The fast subscriber reads everything. The slow one lags: it skips the data it lost or it is disconnected */
+static void test_lagging(int drop) {
+    char *data;
+    struct netpipe *readers[2];
+    struct fanout *fanout = fanout_begin(drop ? "/fanoutdrop" : "/fanoutdisconnect", LAG, drop, readers);
+    struct drain fast, slow;
+    size_t i;
+
+    test((data = (char *) malloc(DATA)) != NULL)
+    for (i = 0; i < DATA; i++) data[i] = (char) (i % 251);
+
+    /* The slow subscriber doesn't read while the data is written */
+    drain_start(&fast, readers[0], DATA + 1);
+    for (i = 0; i < DATA; i += AHEAD) fanout_write(fanout, data + i, AHEAD);
+
+    /* With the drop policy the close waits for the slow subscriber, which was disconnected otherwise */
+    drain_start(&slow, readers[1], DATA + 1);
+    fanout_close(fanout);
+    drain_end(&fast);
+    drain_end(&slow);
+
+    test(fast.got == DATA)
+    test(memcmp(fast.buf, data, DATA) == 0)
+    test(slow.got > 0 && slow.got < DATA)
+    if (!drop) test(slow.got <= 2 * AHEAD + LAG)
+    test(memcmp(slow.buf, data, AHEAD) == 0)
+
+    free(fast.buf);
+    free(slow.buf);
+    free(data);
+    netpipefs_fanout_put(fanout, 1);
+}
+
+/* A subscriber without readers doesn't receive anything. When it has readers again it receives what is
+ * written from then on */
+static void test_reactivate(void) {
+    char buf[64];
+    const char *path = "/fanoutagain";
+    struct netpipe *readers[2];
+    struct fanout *fanout = fanout_begin(path, LAG, 0, readers);
+
+    fanout_write(fanout, "one", 3);
+    read_all(readers[0], buf, 3);
+    read_all(readers[1], buf, 3);
+    test(memcmp(buf, "one", 3) == 0)
+
+    test(netpipe_close(readers[1], O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+    wait_readers(netpipefs_get_open_file(&wskts[1], path), 0);
+    fanout_write(fanout, "two", 3);
+    read_all(readers[0], buf, 3);
+    test(memcmp(buf, "two", 3) == 0)
+
+    readers[1] = open_netpipe(&subskts[1], path, O_RDONLY);
+    wait_readers(netpipefs_get_open_file(&wskts[1], path), 1);
+    fanout_write(fanout, "three", 5);
+    read_all(readers[0], buf, 5);
+    test(memcmp(buf, "three", 5) == 0)
+    read_all(readers[1], buf, 5);
+    test(memcmp(buf, "three", 5) == 0)
+
+    fanout_close(fanout);
+    close_readers(readers);
+    netpipefs_fanout_put(fanout, 1);
+}
+
+static void *writer_thread(void *arg) {
+    struct writer *writer = (struct writer *) arg;
+    char buf[256];
+    size_t size;
+    int i;
+
+    for (i = 0; i < WRITES; i++) {
+        size = 1 + rand_r(&(writer->seed)) % sizeof(buf);
+        memset(buf, 'a' + i % 26, size);
+        fanout_write(writer->fanout, buf, size);
+        writer->wrote += size;
+    }
+    fanout_close(writer->fanout);
+
+    return NULL;
+}
+
+/* Many writers and readers at the same time. The writers take the lock of the fan-out netpipe and then the one of
+ * each netpipe, the dispatchers notify the fan-out netpipe after they released the lock of the netpipe, so they
+ * never deadlock. Nobody lags because the buffer can hold everything, so the subscribers read the same data */
+static void test_writers(void) {
+    struct netpipefs_socket *skts[2] = { &wskts[0], &wskts[1] };
+    struct netpipe *readers[2];
+    struct fanout *fanout = fanout_begin("/fanoutwriters", 2 * WRITES * 256, 0, readers);
+    struct writer writers[2];
+    struct drain drains[2];
+    int i;
+
+    for (i = 0; i < 2; i++) drain_start(&drains[i], readers[i], 2 * WRITES * 256 + 1);
+
+    // the first writer is open, so the second one doesn't open the netpipes again
+    test(netpipefs_fanout_open(fanout, skts, 2) == 0)
+    for (i = 0; i < 2; i++) {
+        writers[i].fanout = fanout;
+        writers[i].seed = i + 1;
+        writers[i].wrote = 0;
+        test(pthread_create(&(writers[i].tid), NULL, &writer_thread, &writers[i]) == 0)
+    }
+    for (i = 0; i < 2; i++)
+        test(pthread_join(writers[i].tid, NULL) == 0)
+    fanout_close(fanout);
+
+    for (i = 0; i < 2; i++) drain_end(&drains[i]);
+    test(drains[0].got == writers[0].wrote + writers[1].wrote)
+    test(drains[1].got == drains[0].got)
+    test(memcmp(drains[0].buf, drains[1].buf, drains[0].got) == 0)
+
+    for (i = 0; i < 2; i++) free(drains[i].buf);
+    netpipefs_fanout_put(fanout, 1);
+}
@@ -1,23 +1,85 @@
 #include <unistd.h>
-#include "testutilities.h"
+#include <poll.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include "netpipeutilities.h"
 #include "../include/netpipe.h"
 #include "../include/dispatcher.h"
 #include "../include/netpipefs_socket.h"
 #include "../include/openfiles.h"
+#include "../include/peers.h"
+#include "../include/utils.h"
+
+#define AHEAD 65536 // readahead and writeahead of both the hosts
+#define GROUP_READERS 3 // readers of a consumer group
+#define GROUP_UNITS 300 // messages or records shared by a consumer group
+#define SPOOLMAX (4 * AHEAD) // bytes of the spool of a writer
+#define PEERSFILE "/tmp/netpipe.test.peers"
+#define PIPESFILE "/tmp/netpipe.test.pipes"
 
 struct netpipefs_socket netpipefs_socket;
 
+/* Two hosts connected with a socket pair. The netpipes are written by the first one and read by the second one */
+static struct netpipefs_socket skts[2];
+static struct dispatcher *dispatchers[2];
+
+static struct netpipe *group_file;      // netpipe read by a consumer group
+static int group_seen[GROUP_UNITS];     // how many times each message or record was read
+
+/* Open of a netpipe made by another thread */
+struct opener {
+    struct netpipefs_socket *skt;
+    const char *path;
+    int mode;
+    struct netpipe *file;
+};
+
+static void connect_hosts(void);
+static void disconnect_hosts(void);
+static void open_pair(const char *path, int wrmode, int rdmode, struct netpipe **writer, struct netpipe **reader);
+static void close_pair(struct netpipe *writer, struct netpipe *reader);
 static void test_nonblock_operations(void);
+static void test_peers(void);
+static void test_messages(void);
+static void test_readmin(void);
+static void test_early_data(void);
+static void test_fsync(void);
+static void test_duplex(void);
+static void test_urgent(void);
+static void test_group(int records);
+static void test_spill(void);
+static void test_asyncclose(void);
+static void test_linger(int async);
+static void test_provision(void);
 
 int main(int argc, char** argv) {
+    struct dispatcher *dispatcher;
+    struct netpipefs_socket *skt = &netpipefs_socket;
     netpipefs_options.debug = 0;
-    test(netpipefs_open_files_table_init() == 0)
+    test(netpipefs_open_files_table_init(&netpipefs_socket) == 0)
 
     test_nonblock_operations();
-    test(netpipefs_dispatcher_run() == 0)
-    test(netpipefs_dispatcher_stop() == 0)
+    test((dispatcher = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+    test(netpipefs_dispatcher_stop(dispatcher) == 0)
 
-    test(netpipefs_open_files_table_destroy() == 0)
+    test(netpipefs_open_files_table_destroy(&netpipefs_socket, NULL) == 0)
+    test_peers();
+
+    connect_hosts();
+    test_messages();
+    test_readmin();
+    test_early_data();
+    test_fsync();
+    test_duplex();
+    test_urgent();
+    test_group(0);
+    test_group(1);
+    test_spill();
+    test_asyncclose();
+    test_linger(0);
+    test_linger(1);
+    test_provision();
+    disconnect_hosts();
 
     testpassed("Netpipe");
     return 0;
@@ -46,4 +108,554 @@ static void test_nonblock_operations(void) {
     /*test(netpipe_close(netpipe, O_WRONLY) == 0)
     netpipefs_options.pipecapacity = old_writeahead;
     netpipefs_socket.remotepipecapacity = old_readahead;*/
-}
\ No newline at end of file
+}
+static void connect_hosts(void) {
+    struct netpipefs_socket *skt;
+    int i;
+
+    connect_skts(&skts[0], &skts[1], AHEAD);
+    for (i = 0; i < 2; i++) {
+        skt = &skts[i];
+        test((dispatchers[i] = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+    }
+}
+
+static void disconnect_hosts(void) {
+    int i;
+
+    for (i = 0; i < 2; i++)
+        test(netpipefs_dispatcher_stop(dispatchers[i]) == 0)
+    for (i = 0; i < 2; i++) {
+        test(netpipefs_open_files_table_destroy(&skts[i], NULL) == 0)
+        close(skts[i].fd);
+    }
+}
+
+static void *open_thread(void *arg) {
+    struct opener *op = (struct opener *) arg;
+    op->file = open_netpipe(op->skt, op->path, op->mode);
+
+    return NULL;
+}
+
+/* Open the netpipe with the first mode on the first host and with the second mode on the second host */
+static void open_pair(const char *path, int wrmode, int rdmode, struct netpipe **writer, struct netpipe **reader) {
+    pthread_t tid;
+    struct opener op = { &skts[0], path, wrmode, NULL };
+
+    test(pthread_create(&tid, NULL, &open_thread, &op) == 0)
+    *reader = open_netpipe(&skts[1], path, rdmode);
+    test(pthread_join(tid, NULL) == 0)
+    *writer = op.file;
+}
+
+/* Close the writer, then the reader gets the end of file */
+static void close_pair(struct netpipe *writer, struct netpipe *reader) {
+    char c;
+
+    test(netpipe_close(writer, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+    test(netpipe_read(reader, &c, 1, 0) == 0)
+    test(netpipe_close(reader, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+}
+
+/* Each write is read whole by a single read and what doesn't fit into the buffer of the read is discarded */
+static void test_messages(void) {
+    char buf[64], *big;
+    struct netpipe *writer, *reader;
+    struct result res;
+
+    open_pair("/messages", O_WRONLY | NETPIPE_MESSAGES, O_RDONLY, &writer, &reader);
+    test(netpipe_send(writer, "first", 5, 0) == 5)
+    test(netpipe_send(writer, "second", 6, 0) == 6)
+    test(netpipe_send(writer, "third message", 13, 0) == 13)
+    test(netpipe_read(reader, buf, sizeof(buf), 0) == 5)
+    test(memcmp(buf, "first", 5) == 0)
+    test(netpipe_read(reader, buf, sizeof(buf), 0) == 6)
+    test(memcmp(buf, "second", 6) == 0)
+    test(netpipe_read(reader, buf, 5, 0) == 5)
+    test(memcmp(buf, "third", 5) == 0)
+    errno = 0;
+    test(netpipe_read(reader, buf, sizeof(buf), 1) == -1 && errno == EAGAIN)
+
+    /* A message is never split, so it cannot be bigger than the max size nor sent in part */
+    test((big = (char *) malloc(NETPIPE_MSG_MAX + 1)) != NULL)
+    memset(big, 'm', NETPIPE_MSG_MAX + 1);
+    errno = 0;
+    test(netpipe_send(writer, big, NETPIPE_MSG_MAX + 1, 0) == -1 && errno == EMSGSIZE)
+    test(netpipe_send(writer, big, NETPIPE_MSG_MAX, 1) == -1 && errno == EAGAIN)
+    errno = 0;
+
+    /* The biggest message is more than the readahead and the writeahead */
+    test(sem_init(&(res.done), 0, 0) == 0)
+    test(netpipe_send_async(writer, big, NETPIPE_MSG_MAX, 0, &result_done, &res) == 0)
+    memset(big, 0, NETPIPE_MSG_MAX);
+    test(netpipe_read(reader, big, NETPIPE_MSG_MAX + 1, 0) == NETPIPE_MSG_MAX)
+    test(big[0] == 'm' && big[NETPIPE_MSG_MAX - 1] == 'm' && big[NETPIPE_MSG_MAX] == 'm')
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == NETPIPE_MSG_MAX)
+    test(sem_destroy(&(res.done)) == 0)
+    free(big);
+
+    close_pair(writer, reader);
+}
+
+/* A read waits for the read minimum, or for the read timeout after the first byte */
+static void test_readmin(void) {
+    char buf[64];
+    struct netpipe *writer, *reader;
+    struct result res;
+
+    open_pair("/readmin", O_WRONLY, O_RDONLY, &writer, &reader);
+    test(sem_init(&(res.done), 0, 0) == 0)
+
+    test(netpipe_set_readmin(reader, 10, 0) == 0)
+    test(netpipe_read_async(reader, buf, sizeof(buf), 0, &result_done, &res) == 0)
+    test(netpipe_send(writer, "0123", 4, 0) == 4)
+    test(msleep(50) == 0)
+    test(sem_trywait(&(res.done)) == -1 && errno == EAGAIN)
+    errno = 0;
+    test(netpipe_send(writer, "456789", 6, 0) == 6)
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == 10)
+    test(memcmp(buf, "0123456789", 10) == 0)
+
+    /* The minimum is not reached: the read returns what it has when the timeout expires */
+    test(netpipe_set_readmin(reader, 20, 50) == 0)
+    test(netpipe_read_async(reader, buf, sizeof(buf), 0, &result_done, &res) == 0)
+    test(netpipe_send(writer, "abcd", 4, 0) == 4)
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == 4)
+    test(memcmp(buf, "abcd", 4) == 0)
+
+    test(sem_destroy(&(res.done)) == 0)
+    close_pair(writer, reader);
+}
+
+/* The writer doesn't wait for a reader if the reader's host grants early data, which the reader gets when it opens */
+static void test_early_data(void) {
+    char buf[64];
+    struct netpipe *writer, *reader;
+
+    skts[1].earlydata = 1024;
+    skts[1].earlymax = DEFAULT_EARLYMAX;
+    writer = open_netpipe(&skts[0], "/early", O_WRONLY);
+    test(netpipe_send(writer, "sent early", 10, 0) == 10)
+
+    reader = open_netpipe(&skts[1], "/early", O_RDONLY);
+    test(netpipe_read(reader, buf, sizeof(buf), 0) == 10)
+    test(memcmp(buf, "sent early", 10) == 0)
+    test(netpipe_send(writer, "sent later", 10, 0) == 10)
+    test(netpipe_read(reader, buf, sizeof(buf), 0) == 10)
+    test(memcmp(buf, "sent later", 10) == 0)
+
+    close_pair(writer, reader);
+    test(skts[1].early_used == 0)
+    skts[1].earlydata = 0;
+}
+
+/* fdatasync returns when the data was sent within the readahead, fsync when it was read */
+static void test_fsync(void) {
+    char buf[64];
+    struct netpipe *writer, *reader;
+    struct result res;
+
+    open_pair("/fsync", O_WRONLY, O_RDONLY, &writer, &reader);
+    test(sem_init(&(res.done), 0, 0) == 0)
+    test(netpipe_fsync(writer, 0) == 0)
+
+    test(netpipe_send(writer, "0123456789", 10, 0) == 10)
+    test(netpipe_fsync_async(writer, 0, &result_done, &res) == 0)
+    test(netpipe_fsync(writer, 1) == 0)
+    test(msleep(50) == 0)
+    test(sem_trywait(&(res.done)) == -1 && errno == EAGAIN)
+    errno = 0;
+
+    test(netpipe_read(reader, buf, sizeof(buf), 0) == 10)
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == 0)
+
+    test(sem_destroy(&(res.done)) == 0)
+    close_pair(writer, reader);
+}
+
+/* With O_RDWR on both the hosts each one reads what the other one writes, with a buffer for each direction */
+static void test_duplex(void) {
+    char buf[64];
+    struct netpipe *client, *server;
+
+    open_pair("/duplex", O_RDWR, O_RDWR, &client, &server);
+    test(netpipe_send(client, "request", 7, 0) == 7)
+    test(netpipe_send(server, "response", 8, 0) == 8)
+    test(netpipe_read(server, buf, sizeof(buf), 0) == 7)
+    test(memcmp(buf, "request", 7) == 0)
+    test(netpipe_read(client, buf, sizeof(buf), 0) == 8)
+    test(memcmp(buf, "response", 8) == 0)
+
+    /* It cannot be open in one direction meanwhile */
+    errno = 0;
+    test(netpipe_open(client, O_RDONLY, 1) == -1 && errno == EPERM)
+    errno = 0;
+
+    /* The end of file of each direction */
+    test(netpipe_close(client, O_RDWR, &netpipefs_remove_open_file, NULL) == 0)
+    test(netpipe_read(server, buf, sizeof(buf), 0) == 0)
+    test(netpipe_close(server, O_RDWR, &netpipefs_remove_open_file, NULL) == 0)
+}
+
+/* An urgent message overtakes the data waiting for credit and the reader is told with POLLPRI */
+static void test_urgent(void) {
+    char buf[NETPIPE_URGENT_MAX + 1], *data;
+    struct netpipe *writer, *reader;
+    struct result res;
+    unsigned int revents = 0;
+    int waited = 0;
+
+    open_pair("/urgent", O_WRONLY, O_RDONLY, &writer, &reader);
+    test(sem_init(&(res.done), 0, 0) == 0)
+    errno = 0;
+    test(netpipe_send_urgent(writer, buf, 0) == -1 && errno == EMSGSIZE)
+    test(netpipe_send_urgent(writer, buf, NETPIPE_URGENT_MAX + 1) == -1 && errno == EMSGSIZE)
+    test(netpipe_send_urgent(reader, "stop", 4) == -1 && errno == EBADF)
+    test(netpipe_read_urgent(reader, buf, sizeof(buf)) == -1 && errno == EAGAIN)
+    errno = 0;
+
+    /* More data than the readahead and the writeahead: some of it waits for credit */
+    test((data = (char *) malloc(4 * AHEAD)) != NULL)
+    memset(data, 'd', 4 * AHEAD);
+    test(netpipe_send_async(writer, data, 4 * AHEAD, 0, &result_done, &res) == 0)
+    test(netpipe_send_urgent(writer, "stop", 4) == 0)
+    test(netpipe_send_urgent(writer, "now", 3) == 0)
+
+    /* The reader doesn't read the data meanwhile */
+    while (!(revents & POLLPRI) && waited++ < 1000) {
+        test(msleep(1) == 0)
+        test(netpipe_poll(reader, NULL, &revents) == 0)
+    }
+    test(revents & POLLPRI)
+    test(netpipe_read_urgent(reader, buf, sizeof(buf)) == 4)
+    test(memcmp(buf, "stop", 4) == 0)
+    test(netpipe_read_urgent(reader, buf, 2) == 2)
+    test(memcmp(buf, "no", 2) == 0)
+    test(netpipe_read_urgent(reader, buf, sizeof(buf)) == -1 && errno == EAGAIN)
+    errno = 0;
+    revents = 0;
+    test(netpipe_poll(reader, NULL, &revents) == 0)
+    test(!(revents & POLLPRI))
+
+    /* The data is not affected */
+    memset(data, 0, 4 * AHEAD);
+    read_all(reader, data, 4 * AHEAD);
+    test(data[0] == 'd' && data[4 * AHEAD - 1] == 'd')
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == 4 * AHEAD)
+    free(data);
+
+    test(sem_destroy(&(res.done)) == 0)
+    close_pair(writer, reader);
+}
+
+/* Read the units of the consumer group one at a time */
+static void *group_reader(void *arg) {
+    char buf[64];
+    int records = *((int *) arg), unit;
+    ssize_t bytes;
+
+    test(netpipe_open(group_file, O_RDONLY, 0) == 0)
+    while ((bytes = netpipe_read(group_file, buf, sizeof(buf), 0)) > 0) {
+        test(bytes == (records ? 6 : 5))
+        buf[5] = '\0';
+        unit = atoi(buf);
+        test(unit >= 0 && unit < GROUP_UNITS)
+        __atomic_add_fetch(&group_seen[unit], 1, __ATOMIC_RELAXED);
+    }
+    test(bytes == 0)
+    test(netpipe_close(group_file, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    return NULL;
+}
+
+/* Each message or record is read by exactly one reader of a consumer group, and each read takes only one */
+static void test_group(int records) {
+    char unit[8];
+    struct netpipe *writer;
+    pthread_t tids[GROUP_READERS];
+    const char *path = records ? "/grouprecords" : "/groupmessages";
+    int i;
+
+    // without readahead the writer sends a unit for each pending read
+    memset(group_seen, 0, sizeof(group_seen));
+    skts[0].remote_readahead = skts[1].readahead = 0;
+    test((group_file = netpipefs_lookup_open_file(&skts[1], path)) != NULL)
+    if (records) test(netpipe_set_delimiter(group_file, '\n') == 0)
+    test(netpipe_set_group(group_file, 1) == 0)
+    for (i = 0; i < GROUP_READERS; i++)
+        test(pthread_create(&tids[i], NULL, &group_reader, &records) == 0)
+
+    writer = open_netpipe(&skts[0], path, records ? O_WRONLY : O_WRONLY | NETPIPE_MESSAGES);
+    for (i = 0; i < GROUP_UNITS; i++) {
+        snprintf(unit, sizeof(unit), "%05d\n", i);
+        test(netpipe_send(writer, unit, records ? 6 : 5, 0) == (records ? 6 : 5))
+    }
+    test(netpipe_close(writer, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    for (i = 0; i < GROUP_READERS; i++)
+        test(pthread_join(tids[i], NULL) == 0)
+    for (i = 0; i < GROUP_UNITS; i++)
+        test(group_seen[i] == 1)
+    test(netpipe_forget(group_file, 1, &netpipefs_remove_open_file) == 0)
+    skts[0].remote_readahead = skts[1].readahead = AHEAD;
+}
+
+/* What doesn't fit into the writeahead buffer is spilled to the spool, then the reader gets all of it in order */
+static void test_spill(void) {
+    char *data;
+    struct netpipe *writer, *reader;
+    size_t size = 8 * AHEAD, i;
+    ssize_t sent;
+    struct result res;
+    unsigned int revents = 0;
+
+    test(sem_init(&(res.done), 0, 0) == 0)
+    skts[0].spooldir = "/tmp";
+    skts[0].spoolmax = SPOOLMAX;
+    open_pair("/spill", O_WRONLY, O_RDONLY, &writer, &reader);
+    test((data = (char *) malloc(size)) != NULL)
+    for (i = 0; i < size; i++) data[i] = (char) (i % 251);
+
+    /* The reader doesn't read: the writer fills the credit, the buffer and the spool without waiting */
+    sent = netpipe_send(writer, data, size, 1);
+    test(sent > 2 * AHEAD && sent < (ssize_t) size)
+    test(writer->spool != NULL && spool_size(writer->spool) == SPOOLMAX)
+    test(netpipe_send(writer, data + sent, size - sent, 1) == 0)
+    test(netpipe_poll(writer, NULL, &revents) == 0)
+    test(!(revents & POLLOUT))
+
+    /* The rest waits until the spool is sent */
+    test(netpipe_send_async(writer, data + sent, size - sent, 0, &result_done, &res) == 0)
+    memset(data, 0, size);
+    read_all(reader, data, size);
+    for (i = 0; i < size; i++) test(data[i] == (char) (i % 251))
+    test(sem_wait(&(res.done)) == 0)
+    test(res.bytes == (ssize_t) size - sent)
+    test(netpipe_fsync(writer, 0) == 0)
+    test(spool_size(writer->spool) == 0)
+
+    free(data);
+    test(sem_destroy(&(res.done)) == 0)
+    close_pair(writer, reader);
+    skts[0].spooldir = NULL;
+}
+
+/* Wait until the closes of the first host which returned at once are drained or give up */
+static void wait_drained(void) {
+    int waited = 0;
+
+    while (__atomic_load_n(&(skts[0].draining), __ATOMIC_ACQUIRE) > 0 && waited++ < 1000)
+        test(msleep(1) == 0)
+    test(skts[0].draining == 0)
+}
+
+/* With asyncclose the close of the last writer returns at once and the buffer is drained in background */
+static void test_asyncclose(void) {
+    char *data;
+    struct netpipe *writer, *reader;
+    size_t size = 4 * AHEAD, i;
+    ssize_t sent;
+    char c;
+
+    skts[0].asyncclose = 1;
+    open_pair("/asyncclose", O_WRONLY, O_RDONLY, &writer, &reader);
+    test((data = (char *) malloc(size)) != NULL)
+    for (i = 0; i < size; i++) data[i] = (char) (i % 251);
+
+    /* The reader doesn't read: the writer fills the credit and the buffer */
+    sent = netpipe_send(writer, data, size, 1);
+    test(sent > AHEAD && sent < (ssize_t) size)
+    test(netpipe_close(writer, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+    test(__atomic_load_n(&(skts[0].draining), __ATOMIC_ACQUIRE) == 1)
+
+    /* The reader gets all of it, then the end of file */
+    memset(data, 0, size);
+    read_all(reader, data, sent);
+    for (i = 0; i < (size_t) sent; i++) test(data[i] == (char) (i % 251))
+    test(netpipe_read(reader, &c, 1, 0) == 0)
+    test(netpipe_close(reader, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+    wait_drained();
+
+    free(data);
+    skts[0].asyncclose = 0;
+}
+
+/* The close of the last writer waits at most the linger time for its data to be read, then what is left is
+ * discarded and the close fails with ETIMEDOUT. With asyncclose the drain gives up after the linger time */
+static void test_linger(int async) {
+    char *data;
+    struct netpipe *writer, *reader;
+    size_t size = 4 * AHEAD, got = 0;
+    ssize_t sent, bytes;
+
+    skts[0].asyncclose = async;
+    skts[0].linger = 50;
+    open_pair(async ? "/asynclinger" : "/linger", O_WRONLY, O_RDONLY, &writer, &reader);
+    test((data = (char *) malloc(size)) != NULL)
+    memset(data, 'l', size);
+
+    sent = netpipe_send(writer, data, size, 1);
+    test(sent > AHEAD && sent < (ssize_t) size)
+    if (async) {
+        test(netpipe_close(writer, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+        test(__atomic_load_n(&(skts[0].draining), __ATOMIC_ACQUIRE) == 1)
+    } else {
+        errno = 0;
+        test(netpipe_close(writer, O_WRONLY, &netpipefs_remove_open_file, NULL) == -1 && errno == ETIMEDOUT)
+        errno = 0;
+    }
+    wait_drained();
+
+    /* The reader gets only what was sent before the linger time expired, then the end of file */
+    while ((bytes = netpipe_read(reader, data, size, 0)) > 0) got += bytes;
+    test(bytes == 0)
+    test(got > 0 && got < (size_t) sent)
+    test(netpipe_close(reader, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    free(data);
+    skts[0].asyncclose = 0;
+    skts[0].linger = 0;
+}
+
+/* Write the given text into the file */
+static void write_file(const char *path, const char *text) {
+    FILE *fp;
+
+    test((fp = fopen(path, "w")) != NULL)
+    test(fputs(text, fp) >= 0)
+    test(fclose(fp) == 0)
+}
+
+/* The pipes file is not valid */
+static void test_invalid_pipes(const char *text) {
+    write_file(PIPESFILE, text);
+    errno = 0;
+    test(netpipefs_peers_load_pipes(PIPESFILE) == -1 && errno == EINVAL)
+    errno = 0;
+}
+
+/* The peers file and the pipes file declared at mount time, then the provisioned netpipes */
+static void test_peers(void) {
+    char hostip[] = "localhost", peersfile[] = PEERSFILE;
+    struct netpipefs_options options;
+    struct netpipefs_peer *peer;
+    struct netpipe *file;
+    int i;
+
+    /* Without a peers file there is one unnamed peer and a netpipe name cannot have a directory */
+    memset(&options, 0, sizeof(struct netpipefs_options));
+    options.hostip = hostip;
+    options.port = 7000;
+    options.hostport = 7001;
+    test(netpipefs_peers_init(&options) == 0)
+    test(netpipefs_npeers == 1 && netpipefs_peers[0].name[0] == '\0')
+    test(strcmp(netpipefs_peers[0].hostip, "localhost") == 0 && netpipefs_peers[0].options.port == 7000)
+    test_invalid_pipes("a/in r 4096\n");
+    netpipefs_peers_free();
+
+    /* Comments and empty lines are skipped. Names and local ports are unique */
+    write_file(PEERSFILE, "a 127.0.0.1 7001 7000\nb 7002\n");
+    options.peers = peersfile;
+    errno = 0;
+    test(netpipefs_peers_init(&options) == -1 && errno == EINVAL)
+    write_file(PEERSFILE, "a 127.0.0.1 7001 7000\nb localhost 7003 7000\n");
+    test(netpipefs_peers_init(&options) == -1 && errno == EINVAL)
+    write_file(PEERSFILE, "a 127.0.0.1 7001 7000\na localhost 7003 7002\n");
+    test(netpipefs_peers_init(&options) == -1 && errno == EINVAL)
+    write_file(PEERSFILE, "# no peers\n\n");
+    test(netpipefs_peers_init(&options) == -1 && errno == EINVAL)
+    errno = 0;
+    test(netpipefs_npeers == 0 && netpipefs_peers == NULL)
+
+    write_file(PEERSFILE, "# name host hostport port\na 127.0.0.1 7001 7000\n\n  b localhost 7003 7002\n");
+    test(netpipefs_peers_init(&options) == 0)
+    test(netpipefs_npeers == 2)
+    test((peer = netpipefs_peer_by_name("b")) == &netpipefs_peers[1])
+    test(strcmp(peer->hostip, "localhost") == 0 && peer->options.hostport == 7003 && peer->options.port == 7002)
+    test(netpipefs_peer_by_name("c") == NULL)
+
+    /* Each netpipe has its peer, a mode, a window and it is declared once */
+    test_invalid_pipes("in r 4096\n");
+    test_invalid_pipes("c/in r 4096\n");
+    test_invalid_pipes("a/in x 4096\n");
+    test_invalid_pipes("a/in r 0\n");
+    test_invalid_pipes("a/ r 4096\n");
+    test_invalid_pipes("a/.. r 4096\n");
+    test_invalid_pipes("a/in r 4096\na/in w 4096\n");
+    for (i = 0; i < netpipefs_npeers; i++) {
+        free(netpipefs_peers[i].pipes);
+        netpipefs_peers[i].pipes = NULL;
+        netpipefs_peers[i].npipes = 0;
+    }
+
+    write_file(PIPESFILE, "# peer/name mode window\na/in r 4096\n\na/out w 8192\nb/in w 1024\n");
+    test(netpipefs_peers_load_pipes(PIPESFILE) == 0)
+    test(netpipefs_peers[0].npipes == 2 && netpipefs_peers[1].npipes == 1)
+    test(strcmp(netpipefs_peers[0].pipes[0].path, "/in") == 0 && netpipefs_peers[0].pipes[0].mode == O_RDONLY)
+    test(netpipefs_peers[0].pipes[1].mode == O_WRONLY && netpipefs_peers[0].pipes[1].window == 8192)
+    test(netpipefs_peers[1].pipes[0].mode == O_WRONLY && netpipefs_peers[1].pipes[0].window == 1024)
+
+    /* The provisioned netpipes exist before they are open */
+    for (i = 0; i < netpipefs_npeers; i++)
+        test(netpipefs_open_files_table_init(&(netpipefs_peers[i].skt)) == 0)
+    test(netpipefs_peers_provision() == 0)
+    test((file = netpipefs_get_open_file(&(netpipefs_peers[0].skt), "/in")) != NULL)
+    test(file->provisioned == O_RDONLY && file->readahead == 4096)
+    test((file = netpipefs_get_open_file(&(netpipefs_peers[1].skt), "/in")) != NULL)
+    test(file->provisioned == O_WRONLY && file->remote_readahead == 1024)
+    test(netpipefs_get_open_file(&(netpipefs_peers[1].skt), "/out") == NULL)
+    for (i = 0; i < netpipefs_npeers; i++)
+        test(netpipefs_open_files_table_destroy(&(netpipefs_peers[i].skt), NULL) == 0)
+
+    netpipefs_peers_free();
+    unlink(PEERSFILE);
+    unlink(PIPESFILE);
+}
+
+/* A provisioned netpipe cannot be open with the other mode, its writer doesn't wait for a reader and it is the
+ * same netpipe after each open and close */
+static void test_provision(void) {
+    char buf[64];
+    struct netpipe *wrfile, *rdfile;
+    struct result res;
+    int i;
+
+    test(sem_init(&(res.done), 0, 0) == 0)
+    test((wrfile = netpipefs_lookup_open_file(&skts[0], "/provisioned")) != NULL)
+    test((rdfile = netpipefs_lookup_open_file(&skts[1], "/provisioned")) != NULL)
+    test(netpipe_provision(wrfile, O_WRONLY, AHEAD) == 0)
+    test(netpipe_provision(rdfile, O_RDONLY, AHEAD) == 0)
+    errno = 0;
+    test(netpipe_open(wrfile, O_RDONLY, 1) == -1 && errno == EACCES)
+    errno = 0;
+    test(netpipe_open(rdfile, O_WRONLY, 1) == -1 && errno == EACCES)
+    errno = 0;
+
+    for (i = 0; i < 3; i++) {
+        /* The writer opens and writes before the reader opens, then its close waits for the reader */
+        test(netpipe_open(wrfile, O_WRONLY, 0) == 0)
+        test(netpipe_send(wrfile, "provisioned", 11, 0) == 11)
+        test(netpipe_close_async(wrfile, O_WRONLY, &netpipefs_remove_open_file, NULL, &result_done, &res) == 0)
+        test(netpipe_open(rdfile, O_RDONLY, 0) == 0)
+        read_all(rdfile, buf, 11);
+        test(memcmp(buf, "provisioned", 11) == 0)
+        test(sem_wait(&(res.done)) == 0)
+        test(res.bytes == 0)
+        test(netpipe_read(rdfile, buf, sizeof(buf), 0) == 0)
+        test(netpipe_close(rdfile, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+        test(netpipefs_get_open_file(&skts[0], "/provisioned") == wrfile)
+        test(netpipefs_get_open_file(&skts[1], "/provisioned") == rdfile)
+
+        // the next writer waits for the reader's close, otherwise it sends to a reader which is leaving
+        wait_readers(wrfile, 0);
+    }
+
+    test(sem_destroy(&(res.done)) == 0)
+}
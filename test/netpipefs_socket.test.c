@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/tcp.h>     // TCP_ZEROCOPY_RECEIVE
+#endif
+#include "netpipeutilities.h"
+#include "../include/netpipefs_socket.h"
+
+#define PAYLOAD (4 * ALIGNED_WRITE_MIN + 100) // page-aligned when the remote host maps it, its end is not
+#define MAPPED_IOV 16
+#define PATH "/mapped"
+
+/* The writer sends the payloads page-aligned because the reader maps them from the TCP connection */
+static struct netpipefs_socket wr, rd;
+static size_t pagesize;
+static size_t rd_bytes; // bytes read by the reader since the connection was established
+static char payload[PAYLOAD];
+
+/* Messages sent by the writer: a small one shifts the stream by the given bytes before each large one */
+static const size_t shifts[] = { 1, 13, 4096 - 7, 0, 100 };
+#define NSHIFTS (sizeof(shifts) / sizeof(shifts[0]))
+
+static int connect_tcp(void);
+static void test_aligned(void);
+static void test_unaligned(void);
+
+int main(int argc, char** argv) {
+    size_t i;
+
+#ifndef TCP_ZEROCOPY_RECEIVE
+    testpassed("Mapped receive (not supported)");
+    return 0;
+#endif
+    netpipefs_options.debug = 0;
+    pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    for (i = 0; i < PAYLOAD; i++) payload[i] = (char) (i % 251);
+
+    if (!connect_tcp()) {
+        testpassed("Mapped receive (not supported)");
+        return 0;
+    }
+    test_aligned();
+    test_unaligned();
+
+    munmap(rd.zc_map, rd.zc_map_len);
+    test(netpipefs_open_files_table_destroy(&wr, NULL) == 0)
+    test(netpipefs_open_files_table_destroy(&rd, NULL) == 0)
+    close(wr.fd);
+    close(rd.fd);
+
+    testpassed("Mapped receive");
+    return 0;
+}
+
+/* Connect the writer and the reader with TCP over the loopback. Returns 0 if the payloads cannot be mapped */
+static int connect_tcp(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int lfd, wfd, rfd;
+    void *map;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test((lfd = socket(AF_INET, SOCK_STREAM, 0)) != -1)
+    test(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+    test(listen(lfd, 1) == 0)
+    test(getsockname(lfd, (struct sockaddr *) &addr, &len) == 0)
+    test((wfd = socket(AF_INET, SOCK_STREAM, 0)) != -1)
+    test(connect(wfd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+    test((rfd = accept(lfd, NULL, NULL)) != -1)
+    close(lfd);
+
+    skt_init(&wr, wfd, 0);
+    skt_init(&rd, rfd, 0);
+
+    map = mmap(NULL, (PAYLOAD + pagesize - 1) / pagesize * pagesize, PROT_READ, MAP_SHARED, rfd, 0);
+    if (map == MAP_FAILED) {
+        close(wfd);
+        close(rfd);
+        errno = 0;
+        return 0;
+    }
+    rd.zc_map = (char *) map;
+    rd.zc_map_len = (PAYLOAD + pagesize - 1) / pagesize * pagesize;
+    wr.remote_align = pagesize;
+
+    return 1;
+}
+
+static void *writer_thread(void *arg) {
+    size_t i;
+
+    for (i = 0; i < NSHIFTS; i++) {
+        if (shifts[i] > 0) test(send_write_message(&wr, PATH, payload, shifts[i]) > 0)
+        test(send_write_message(&wr, PATH, payload, PAYLOAD) > 0)
+    }
+
+    return NULL;
+}
+
+static void *send_thread(void *arg) {
+    size_t size = *(size_t *) arg;
+
+    test(send_write_message(&wr, PATH, payload, size) > 0)
+    return NULL;
+}
+
+static void read_counted(void *buf, size_t size) {
+    test(read_socket(&rd, buf, size) == (ssize_t) size)
+    rd_bytes += size;
+}
+
+/* Read the header of a WRITE message and the size of its data */
+static size_t read_write_header(enum netpipefs_header expected) {
+    enum netpipefs_header header;
+    char *path = NULL;
+    size_t size;
+
+    test(read_socket_header(&rd, &header, &path) > 0)
+    test(header == expected)
+    test(strcmp(path, PATH) == 0)
+    rd_bytes += sizeof(enum netpipefs_header) + sizeof(size_t) + strlen(path) + 1;
+    free(path);
+    read_counted(&size, sizeof(size_t));
+
+    return size;
+}
+
+/* Receive the payload, which is mapped or copied, and check it. Over the loopback the kernel usually cannot map the
+ * pages and it tells how many bytes must be copied instead */
+static void recv_payload(size_t size, int aligned) {
+    static char buf[PAYLOAD];
+    struct iovec iov[MAPPED_IOV];
+    int i, iovcnt = MAPPED_IOV;
+    size_t done = 0;
+    char *base;
+
+    memset(buf, 0, sizeof(buf));
+    test(recv_mapped(&rd, buf, size, iov, &iovcnt) == (ssize_t) size)
+    test(iovcnt > 0 && iovcnt <= MAPPED_IOV)
+    for (i = 0; i < iovcnt; i++) {
+        base = (char *) iov[i].iov_base;
+        test(memcmp(base, payload + done, iov[i].iov_len) == 0)
+        if (base >= rd.zc_map && base < rd.zc_map + rd.zc_map_len) {
+            // only whole pages of a page-aligned payload are mapped
+            test(aligned && iov[i].iov_len % pagesize == 0 && (uintptr_t) base % pagesize == 0)
+        } else {
+            // what cannot be mapped is copied at the same offset
+            test(base == buf + done)
+        }
+        done += iov[i].iov_len;
+    }
+    test(done == size)
+    rd_bytes += size;
+}
+
+/* The padding computed from the bytes written so far makes every large payload start at a page-aligned offset of
+ * the stream, whatever was written before it. Small payloads are not padded */
+static void test_aligned(void) {
+    char buf[4096];
+    pthread_t tid;
+    size_t i, size, pad;
+
+    test(pthread_create(&tid, NULL, &writer_thread, NULL) == 0)
+    for (i = 0; i < NSHIFTS; i++) {
+        if (shifts[i] > 0) {
+            test(read_write_header(WRITE) == shifts[i])
+            read_counted(buf, shifts[i]);
+        }
+
+        test((size = read_write_header(WRITE_ALIGNED)) == PAYLOAD)
+        read_counted(&pad, sizeof(size_t));
+        test(pad < pagesize)
+        test((rd_bytes + pad) % pagesize == 0)
+        test(skip_socket(&rd, pad) == (ssize_t) pad)
+        rd_bytes += pad;
+        recv_payload(size, 1);
+    }
+    test(pthread_join(tid, NULL) == 0)
+    test(wr.wr_bytes == rd_bytes)
+}
+
+/* A payload which is not page-aligned cannot be mapped: the reader copies the bytes the kernel skips */
+static void test_unaligned(void) {
+    char buf[13];
+    size_t size = PAYLOAD;
+    pthread_t tid;
+
+    wr.remote_align = 0;
+    test(send_write_message(&wr, PATH, payload, sizeof(buf)) > 0)
+    read_counted(buf, read_write_header(WRITE));
+
+    test(pthread_create(&tid, NULL, &send_thread, &size) == 0)
+    test(read_write_header(WRITE) == PAYLOAD)
+    test(rd_bytes % pagesize != 0)
+    recv_payload(PAYLOAD, 0);
+    test(pthread_join(tid, NULL) == 0)
+    test(wr.wr_bytes == rd_bytes)
+}
@@ -0,0 +1,80 @@
+#ifndef NETPIPEUTILITIES_H
+#define NETPIPEUTILITIES_H
+
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include "testutilities.h"
+#include "../include/netpipe.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/openfiles.h"
+#include "../include/utils.h"
+
+/* Result of an asynchronous operation */
+struct result {
+    sem_t done;
+    ssize_t bytes;
+    int error;
+};
+
+/* Initialize the socket of a host connected with the given file descriptor. Both the hosts have the given
+ * readahead and writeahead */
+static inline void skt_init(struct netpipefs_socket *skt, int fd, size_t ahead) {
+    memset(skt, 0, sizeof(struct netpipefs_socket));
+    skt->fd = fd;
+    skt->readahead = skt->writeahead = skt->remote_readahead = ahead;
+    skt->timerfd = -1;
+    test(pthread_mutex_init(&(skt->wr_mtx), NULL) == 0)
+    test(netpipefs_open_files_table_init(skt) == 0)
+}
+
+/* Connect two hosts with a socket pair */
+static inline void connect_skts(struct netpipefs_socket *a, struct netpipefs_socket *b, size_t ahead) {
+    int sv[2];
+
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    skt_init(a, sv[0], ahead);
+    skt_init(b, sv[1], ahead);
+}
+
+/* Open the netpipe with the given path. It is removed from the table when it is closed */
+static inline struct netpipe *open_netpipe(struct netpipefs_socket *skt, const char *path, int mode) {
+    struct netpipe *file = netpipefs_lookup_open_file(skt, path);
+    test(file != NULL)
+    test(netpipe_open(file, mode, 0) == 0)
+    test(netpipe_forget(file, 1, &netpipefs_remove_open_file) == 0)
+
+    return file;
+}
+
+/* Done function of an asynchronous operation which posts the result */
+static inline void result_done(void *arg, ssize_t bytes, int error) {
+    struct result *res = (struct result *) arg;
+    res->bytes = bytes;
+    res->error = error;
+    test(sem_post(&(res->done)) == 0)
+}
+
+/* Read exactly size bytes */
+static inline void read_all(struct netpipe *file, char *buf, size_t size) {
+    ssize_t bytes;
+
+    while (size > 0) {
+        bytes = netpipe_read(file, buf, size, 0);
+        test(bytes > 0)
+        buf += bytes;
+        size -= bytes;
+    }
+}
+
+/* Wait until the netpipe has the given number of readers, that is until the host knows of the remote ones */
+static inline void wait_readers(struct netpipe *file, int readers) {
+    int waited = 0;
+
+    while (__atomic_load_n(&(file->readers), __ATOMIC_ACQUIRE) != readers && waited++ < 1000)
+        test(msleep(1) == 0)
+    test(file->readers == readers)
+}
+
+#endif //NETPIPEUTILITIES_H
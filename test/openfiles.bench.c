@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "testutilities.h"
+#include "../include/openfiles.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/utils.h"
+
+#define PATH_LEN 32
+#define LOOKUPS 2000000 // lookups done by each thread
+
+struct netpipefs_socket netpipefs_socket;
+
+struct bench_arg {
+    long nfiles;
+    unsigned int seed;
+};
+
+static void *lookup_thread(void *arg) {
+    struct bench_arg *barg = (struct bench_arg *) arg;
+    char path[PATH_LEN];
+    long i;
+
+    for (i = 0; i < LOOKUPS; i++) {
+        snprintf(path, PATH_LEN, "/pipe%ld", (long) (rand_r(&(barg->seed)) % barg->nfiles));
+        if (netpipefs_get_open_file(&netpipefs_socket, path) == NULL) {
+            fprintf(stderr, "%s %s not found\n", FAIL, path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+/* Measures how many lookups per second are done by nthreads threads on a table with nfiles files */
+static void bench_lookups(long nfiles, int nthreads) {
+    pthread_t tid[nthreads];
+    struct bench_arg args[nthreads];
+    struct timespec start, elapsed;
+    char path[PATH_LEN];
+    int i, just_created;
+    long f;
+    double seconds;
+
+    test(netpipefs_open_files_table_init(&netpipefs_socket) == 0)
+    for (f = 0; f < nfiles; f++) {
+        snprintf(path, PATH_LEN, "/pipe%ld", f);
+        test(netpipefs_get_or_create_open_file(&netpipefs_socket, path, &just_created) != NULL)
+    }
+
+    test(clock_gettime(CLOCK_MONOTONIC, &start) != -1)
+    for (i = 0; i < nthreads; i++) {
+        args[i].nfiles = nfiles;
+        args[i].seed = i + 1;
+        test(pthread_create(&tid[i], NULL, &lookup_thread, &args[i]) == 0)
+    }
+    for (i = 0; i < nthreads; i++)
+        test(pthread_join(tid[i], NULL) == 0)
+    elapsed = elapsed_time(&start);
+
+    seconds = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+    printf("%8ld files %3d threads %12.0f lookups/s\n", nfiles, nthreads, (double) LOOKUPS * nthreads / seconds);
+
+    test(netpipefs_open_files_table_destroy(&netpipefs_socket, NULL) == 0)
+}
+
+/* Lookups per second on the open files table with 1k, 100k and 1M open files */
+int main(int argc, char** argv) {
+    long sizes[] = { 1000, 100000, 1000000 };
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+    netpipefs_options.debug = 0;
+    if (nthreads < 1) nthreads = 1;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_lookups(sizes[i], 1);
+        if (nthreads > 1) bench_lookups(sizes[i], nthreads);
+    }
+
+    return 0;
+}
@@ -9,12 +9,16 @@ struct netpipefs_socket netpipefs_socket;
 
 static void test_uninitialized_table(void);
 static void test_openfiles_table(void);
+static void test_many_files(void);
+static void test_lookup_references(void);
 
 int main(int argc, char** argv) {
     netpipefs_options.debug = 0; // disable debug printings
 
     test_uninitialized_table();
     test_openfiles_table();
+    test_many_files();
+    test_lookup_references();
 
     testpassed("Open files hash table");
     return 0;
@@ -24,19 +28,23 @@ int main(int argc, char** argv) {
 static void test_uninitialized_table(void) {
     const char *path = "./filename.txt";
 
+    struct netpipe *file;
+
     /* Get open file */
-    test(netpipefs_get_open_file(path) == NULL)
+    test(netpipefs_get_open_file(&netpipefs_socket, path) == NULL)
     test(errno == EPERM)
     errno = 0;
 
     /* Remove open file */
-    test(netpipefs_remove_open_file(path) == -1)
+    test((file = netpipe_alloc(path, &netpipefs_socket)) != NULL)
+    test(netpipefs_remove_open_file(file) == -1)
     test(errno == EPERM)
     errno = 0;
+    netpipe_free(file, NULL);
 
     /* Get or create if missing */
     int just_created = 0;
-    test(netpipefs_get_or_create_open_file(path, &just_created) == NULL)
+    test(netpipefs_get_or_create_open_file(&netpipefs_socket, path, &just_created) == NULL)
     test(errno == EPERM)
     errno = 0;
 }
@@ -52,25 +60,92 @@ static void test_openfiles_table(void) {
     netpipefs_socket.fd = pipefd[1];
 
     /* Init open files table */
-    test(netpipefs_open_files_table_init() == 0)
+    test(netpipefs_open_files_table_init(&netpipefs_socket) == 0)
 
     /* Get or create if missing */
     int just_created = 0;
-    test((file = netpipefs_get_or_create_open_file(path, &just_created)) != NULL)
+    test((file = netpipefs_get_or_create_open_file(&netpipefs_socket, path, &just_created)) != NULL)
     test(just_created == 1)
 
     /* Get open file */
-    test(netpipefs_get_open_file(path) == file)
+    test(netpipefs_get_open_file(&netpipefs_socket, path) == file)
 
     /* Remove open file */
-    test(netpipefs_remove_open_file(path) == 0)
+    test(netpipefs_remove_open_file(file) == 0)
 
     /* Remove not open file */
-    test(netpipefs_remove_open_file("badpath") == -1)
+    test(netpipefs_remove_open_file(file) == -1)
+    test(errno == ENOENT)
+    netpipe_free(file, NULL);
 
     /* Destroy open files table */
-    test(netpipefs_open_files_table_destroy() == 0)
+    test(netpipefs_open_files_table_destroy(&netpipefs_socket, NULL) == 0)
 
     close(pipefd[0]);
     close(pipefd[1]);
 }
+
+/* Insert enough files to grow the table many times. All of them should be found after each resize */
+static void test_many_files(void) {
+    const int nfiles = 10000;
+    char path[32];
+    struct netpipe **files = (struct netpipe **) malloc(sizeof(struct netpipe *) * nfiles);
+    int i, just_created;
+    test(files != NULL)
+
+    test(netpipefs_open_files_table_init(&netpipefs_socket) == 0)
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, 32, "/pipe%d", i);
+        test((files[i] = netpipefs_get_or_create_open_file(&netpipefs_socket, path, &just_created)) != NULL)
+        test(just_created == 1)
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, 32, "/pipe%d", i);
+        test(netpipefs_get_open_file(&netpipefs_socket, path) == files[i])
+        test(netpipefs_get_or_create_open_file(&netpipefs_socket, path, &just_created) == files[i])
+        test(just_created == 0)
+    }
+
+    /* Remove half of them */
+    for (i = 0; i < nfiles; i += 2) {
+        snprintf(path, 32, "/pipe%d", i);
+        test(netpipefs_remove_open_file(files[i]) == 0)
+        test(netpipefs_get_open_file(&netpipefs_socket, path) == NULL)
+        netpipe_free(files[i], NULL);
+    }
+
+    for (i = 1; i < nfiles; i += 2) {
+        snprintf(path, 32, "/pipe%d", i);
+        test(netpipefs_get_open_file(&netpipefs_socket, path) == files[i])
+    }
+
+    /* The remaining files are freed with the table */
+    test(netpipefs_open_files_table_destroy(&netpipefs_socket, NULL) == 0)
+    free(files);
+}
+
+/* A file referenced by the kernel cannot be removed. It is freed when the last reference is forgotten */
+static void test_lookup_references(void) {
+    const char *path = "/lookedup";
+    struct netpipe *file;
+
+    test(netpipefs_open_files_table_init(&netpipefs_socket) == 0)
+
+    test((file = netpipefs_lookup_open_file(&netpipefs_socket, path)) != NULL)
+    test(netpipefs_lookup_open_file(&netpipefs_socket, path) == file)
+    test(file->nlookup == 2)
+
+    /* Still referenced */
+    test(netpipefs_remove_open_file(file) == 1)
+    test(netpipefs_get_open_file(&netpipefs_socket, path) == file)
+    test(netpipe_forget(file, 1, &netpipefs_remove_open_file) == 0)
+    test(netpipefs_get_open_file(&netpipefs_socket, path) == file)
+
+    /* Last reference: the file is removed and freed */
+    test(netpipe_forget(file, 1, &netpipefs_remove_open_file) == 0)
+    test(netpipefs_get_open_file(&netpipefs_socket, path) == NULL)
+
+    test(netpipefs_open_files_table_destroy(&netpipefs_socket, NULL) == 0)
+}
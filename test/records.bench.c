@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "netpipeutilities.h"
+#include "../include/netpipe.h"
+#include "../include/dispatcher.h"
+#include "../include/openfiles.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/utils.h"
+
+#define BLOCK_SIZE 1048576  // records sent by each write
+#define BLOCKS 256          // blocks sent by each run
+#define READ_SIZE 65536     // size of the reads
+#define AHEAD 65536         // readahead and writeahead of both the hosts
+
+static struct netpipefs_socket skts[2];
+static char block[BLOCK_SIZE];
+static size_t block_len, block_records;
+
+/* Fill the block with newline-delimited JSON records of different lengths */
+static void make_block(void) {
+    char value[256];
+    int len;
+
+    memset(value, 'x', sizeof(value));
+    while (1) {
+        value[(block_records * 37) % 200 + 8] = '\0';
+        len = snprintf(block + block_len, BLOCK_SIZE - block_len, "{\"id\":%lu,\"value\":\"%s\"}\n",
+                       (unsigned long) block_records, value);
+        value[(block_records * 37) % 200 + 8] = 'x';
+        if (len < 0 || (size_t) len >= BLOCK_SIZE - block_len) break;
+        block_len += len;
+        block_records++;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct netpipe *file = open_netpipe(&skts[0], (const char *) arg, O_WRONLY);
+    int i;
+
+    for (i = 0; i < BLOCKS; i++)
+        test(netpipe_send(file, block, block_len, 0) == (ssize_t) block_len)
+    test(netpipe_close(file, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    return NULL;
+}
+
+/* Count the records of the data. With partial, the last record may be incomplete and it is moved to the beginning */
+static size_t split(char *buf, size_t *len, int partial) {
+    char *p = buf, *end = buf + *len, *nl;
+    size_t records = 0;
+
+    while (p < end && (nl = (char *) memchr(p, '\n', end - p)) != NULL) {
+        records++;
+        p = nl + 1;
+    }
+    test(partial || p == end)
+    *len = end - p;
+    if (*len > 0) memmove(buf, p, *len);
+
+    return records;
+}
+
+/* Measures how many records per second are read, split by the netpipe or by the reader */
+static void bench_records(const char *path, int delimiter) {
+    static char buf[2 * READ_SIZE];
+    struct netpipe *file;
+    struct timespec start, elapsed;
+    pthread_t tid;
+    size_t records = 0, len = 0;
+    ssize_t bytes;
+    double seconds;
+
+    test(clock_gettime(CLOCK_MONOTONIC, &start) != -1)
+    test(pthread_create(&tid, NULL, &writer_thread, (void *) path) == 0)
+    file = open_netpipe(&skts[1], path, O_RDONLY);
+    if (delimiter) test(netpipe_set_delimiter(file, '\n') == 0)
+
+    while ((bytes = netpipe_read(file, buf + len, READ_SIZE, 0)) > 0) {
+        len += bytes;
+        records += split(buf, &len, !delimiter);
+    }
+    test(bytes == 0)
+    elapsed = elapsed_time(&start);
+
+    test(len == 0)
+    test(records == block_records * BLOCKS)
+    test(netpipe_close(file, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+    test(pthread_join(tid, NULL) == 0)
+
+    seconds = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+    printf("%-18s %12.0f records/s %8.1f MB/s\n", delimiter ? "netpipe delimiter" : "client split",
+           records / seconds, block_len * BLOCKS / seconds / 1e6);
+}
+
+/* Records per second read from a netpipe of newline-delimited records */
+int main(int argc, char** argv) {
+    struct dispatcher *dispatchers[2];
+    struct netpipefs_socket *skt;
+    int sv[2], i;
+    netpipefs_options.debug = 0;
+
+    make_block();
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    for (i = 0; i < 2; i++) {
+        skt_init(&skts[i], sv[i], AHEAD);
+        skt = &skts[i];
+        test((dispatchers[i] = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+    }
+
+    bench_records("/split", 0);
+    bench_records("/records", 1);
+
+    for (i = 0; i < 2; i++)
+        test(netpipefs_dispatcher_stop(dispatchers[i]) == 0)
+
+    return 0;
+}
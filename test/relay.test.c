@@ -0,0 +1,242 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "netpipeutilities.h"
+#include "../include/relay.h"
+#include "../include/dispatcher.h"
+#include "../include/netpipefs_socket.h"
+#include "../include/openfiles.h"
+#include "../include/utils.h"
+
+#define AHEAD 16384             // readahead and writeahead of every host
+#define DATA (256 * AHEAD)      // bytes forwarded from the source to the destination
+#define CHUNK 10000             // size of the writes of the source
+
+/* The source writes the netpipes and the hub forwards them to the destination, which reads them */
+static struct netpipefs_socket src, hub[2], dst;
+static struct dispatcher *dispatchers[3];
+static char data[DATA];
+
+/* Writer of the source opened by another thread */
+struct writer {
+    pthread_t tid;
+    const char *path;
+    struct netpipe *file;
+    size_t size;    // bytes written and closed by the thread, 0 if it only opens
+};
+
+static void connect_hosts(void);
+static void disconnect_hosts(void);
+static void test_forward(int copy);
+static void test_credit(void);
+static void test_readers_leave(void);
+
+int main(int argc, char** argv) {
+    size_t i;
+
+    netpipefs_options.debug = 0;
+    for (i = 0; i < DATA; i++) data[i] = (char) (i % 251);
+
+    connect_hosts();
+    test_forward(0);
+    test_forward(1);
+    test_credit();
+    test_readers_leave();
+    disconnect_hosts();
+
+    testpassed("Relay");
+    return 0;
+}
+
+static void connect_hosts(void) {
+    struct netpipefs_socket *skts[2] = { &hub[0], &hub[1] }, *skt;
+
+    connect_skts(&src, &hub[0], AHEAD);
+    connect_skts(&hub[1], &dst, AHEAD);
+    hub[0].relay_to = &hub[1];
+
+    test((dispatchers[0] = netpipefs_dispatcher_run(skts, 2, NULL)) != NULL)
+    skt = &src;
+    test((dispatchers[1] = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+    skt = &dst;
+    test((dispatchers[2] = netpipefs_dispatcher_run(&skt, 1, NULL)) != NULL)
+}
+
+static void disconnect_hosts(void) {
+    struct netpipefs_socket *skts[4] = { &src, &hub[0], &hub[1], &dst };
+    int i;
+
+    for (i = 0; i < 3; i++)
+        test(netpipefs_dispatcher_stop(dispatchers[i]) == 0)
+    for (i = 0; i < 4; i++) {
+        test(netpipefs_open_files_table_destroy(skts[i], NULL) == 0)
+        close(skts[i]->fd);
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct writer *writer = (struct writer *) arg;
+    size_t done, len;
+
+    writer->file = open_netpipe(&src, writer->path, O_WRONLY);
+    if (writer->size == 0) return NULL;
+
+    for (done = 0; done < writer->size; done += len) {
+        len = writer->size - done < CHUNK ? writer->size - done : CHUNK;
+        test(netpipe_send(writer->file, data + done, len, 0) == (ssize_t) len)
+    }
+    test(netpipe_close(writer->file, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    return NULL;
+}
+
+/* Open the netpipe on the source and on the destination. The hub starts the relay when the source opens it, so
+ * both the opens are completed only if the relay works */
+static struct netpipe *open_relayed(struct writer *writer, const char *path, size_t size) {
+    struct netpipe *reader;
+
+    writer->path = path;
+    writer->size = size;
+    test(pthread_create(&(writer->tid), NULL, &writer_thread, writer) == 0)
+    reader = open_netpipe(&dst, path, O_RDONLY);
+    if (size == 0) test(pthread_join(writer->tid, NULL) == 0)
+
+    return reader;
+}
+
+/* The netpipe of the hub is not relayed anymore and nobody uses it */
+static int relay_ended(struct netpipefs_socket *skt, const char *path) {
+    struct netpipe *file = netpipefs_get_open_file(skt, path);
+    int ended;
+
+    if (file == NULL) return 1;
+    test(netpipe_lock(file) == 0)
+    ended = file->relay == NULL && file->readers == 0 && file->writers == 0;
+    test(netpipe_unlock(file) == 0)
+
+    return ended;
+}
+
+/* When a relay ends it closes its netpipes on both the connections of the hub */
+static void wait_relay_end(const char *path) {
+    int waited = 0;
+
+    while ((!relay_ended(&hub[0], path) || !relay_ended(&hub[1], path)) && waited++ < 1000)
+        test(msleep(1) == 0)
+    test(relay_ended(&hub[0], path))
+    test(relay_ended(&hub[1], path))
+}
+
+/* Bytes sent by the writer of the source and not acknowledged, once it cannot send anymore */
+static size_t sent_when_stuck(struct netpipe *file) {
+    size_t sent, last = 0;
+    int idle = 0;
+
+    while (idle < 5) {
+        test(msleep(20) == 0)
+        test(netpipe_lock(file) == 0)
+        sent = file->remotesize;
+        test(netpipe_unlock(file) == 0)
+        if (sent == last) idle++;
+        else idle = 0;
+        last = sent;
+    }
+
+    return sent;
+}
+
+/* Write as much as the netpipe accepts without blocking */
+static size_t send_until_full(struct netpipe *file, size_t offset) {
+    size_t done = offset;
+    ssize_t bytes;
+
+    while (done < DATA && (bytes = netpipe_send(file, data + done, CHUNK, 1)) > 0) done += bytes;
+    test(done < DATA && (bytes == 0 || errno == EAGAIN))
+    errno = 0;
+
+    return done - offset;
+}
+
+/* The data arrives intact and the end of file is forwarded when the writers close. Without a pipe for splice(),
+ * because no file descriptor is left, the relay copies the data */
+static void test_forward(int copy) {
+    const char *path = copy ? "/relaycopy" : "/relay";
+    static char buf[DATA];
+    struct rlimit lim, nofile;
+    struct writer writer;
+    struct netpipe *reader;
+    int fd;
+
+    if (copy) {
+        test(getrlimit(RLIMIT_NOFILE, &nofile) == 0)
+        test((fd = dup(0)) != -1)
+        close(fd);
+        lim = nofile;
+        lim.rlim_cur = fd;
+        test(setrlimit(RLIMIT_NOFILE, &lim) == 0)
+        test(dup(0) == -1 && errno == EMFILE)
+        errno = 0;
+    }
+
+    reader = open_relayed(&writer, path, DATA);
+    if (copy) test(setrlimit(RLIMIT_NOFILE, &nofile) == 0)
+    read_all(reader, buf, DATA);
+    test(memcmp(buf, data, DATA) == 0)
+    test(netpipe_read(reader, buf, 1, 0) == 0)
+    test(pthread_join(writer.tid, NULL) == 0)
+
+    test(netpipe_close(reader, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+    wait_relay_end(path);
+}
+
+/* The source is given only the credit of the destination. What the destination reads is granted to the source
+ * again, through the hub */
+static void test_credit(void) {
+    const char *path = "/relaycredit";
+    static char buf[DATA];
+    struct writer writer;
+    struct netpipe *reader = open_relayed(&writer, path, 0);
+    size_t accepted, sent, total = 0;
+    int round;
+
+    for (round = 0; round < 4; round++) {
+        accepted = send_until_full(writer.file, total);
+        sent = sent_when_stuck(writer.file);
+        // only the readahead of the hub is not acknowledged, the rest was forwarded with the credit of the destination
+        test(sent <= AHEAD)
+        // the buffer of the source, the readahead of the hub and the credit of the destination
+        test(accepted > 0 && accepted <= 3 * AHEAD)
+
+        read_all(reader, buf + total, accepted);
+        total += accepted;
+    }
+    test(memcmp(buf, data, total) == 0)
+
+    test(netpipe_close(writer.file, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+    test(netpipe_read(reader, buf, 1, 0) == 0)
+    test(netpipe_close(reader, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+    wait_relay_end(path);
+}
+
+/* When the readers of the destination leave the writers of the source get a broken pipe */
+static void test_readers_leave(void) {
+    const char *path = "/relayleave";
+    char buf[CHUNK];
+    struct writer writer;
+    struct netpipe *reader = open_relayed(&writer, path, 0);
+    ssize_t bytes;
+    int i;
+
+    test(netpipe_send(writer.file, data, CHUNK, 0) == CHUNK)
+    read_all(reader, buf, CHUNK);
+    test(memcmp(buf, data, CHUNK) == 0)
+    test(netpipe_close(reader, O_RDONLY, &netpipefs_remove_open_file, NULL) == 0)
+
+    for (i = 0; i < DATA / CHUNK && (bytes = netpipe_send(writer.file, data, CHUNK, 0)) > 0; i++)
+        continue;
+    test(bytes == -1 && errno == EPIPE)
+    errno = 0;
+
+    test(netpipe_close(writer.file, O_WRONLY, &netpipefs_remove_open_file, NULL) == 0)
+    wait_relay_end(path);
+}
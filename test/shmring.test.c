@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "testutilities.h"
+#include "../include/shmring.h"
+
+#define RING_SIZE 4096
+#define TOTAL (4*1024*1024)
+
+static void test_create_attach(void);
+static void test_producer_consumer(void);
+static void test_peek_hold(void);
+static void test_read_fd(void);
+static void test_peer_gone(void);
+
+int main(int argc, char** argv) {
+    shmring_t *ring = shmring_create(RING_SIZE);
+    if (ring == NULL && errno == ENOSYS) {
+        testpassed("Shared memory ring (not supported)");
+        return 0;
+    }
+    shmring_free(ring);
+    errno = 0;
+
+    test_create_attach();
+    test_producer_consumer();
+    test_peek_hold();
+    test_read_fd();
+    test_peer_gone();
+
+    testpassed("Shared memory ring");
+    return 0;
+}
+
+/** Attach the ring a second time, like another process does with the file descriptors it received */
+static shmring_t *attach_copy(shmring_t *ring) {
+    int i, fds[SHMRING_FDS];
+    const int *orig = shmring_fds(ring);
+
+    for (i = 0; i < SHMRING_FDS; i++) fds[i] = dup(orig[i]);
+    return shmring_attach(fds);
+}
+
+/* Data written into a mapping is read from the other one */
+static void test_create_attach(void) {
+    char buf[8];
+    char *data;
+    shmring_t *producer = shmring_create(RING_SIZE);
+    test(producer != NULL)
+    shmring_t *consumer = attach_copy(producer);
+    test(consumer != NULL)
+    test(shmring_capacity(consumer) == RING_SIZE)
+
+    test(shmring_ready(consumer) == 0)
+    test(shmring_writen(producer, "abcdefgh", 8, -1) == 8)
+    test(shmring_ready(consumer) == 1)
+    test(shmring_peek(consumer, &data) == 8)
+    test(shmring_readn(consumer, buf, 8, -1) == 8)
+    test(memcmp(buf, "abcdefgh", 8) == 0)
+    test(shmring_peek(consumer, &data) == 0)
+
+    shmring_free(consumer);
+    shmring_free(producer);
+}
+
+static void *producer_fun(void *arg) {
+    shmring_t *ring = (shmring_t *) arg;
+    char buf[1000];
+    size_t sent = 0, n;
+    unsigned char c = 0;
+
+    while (sent < TOTAL) {
+        n = TOTAL - sent < sizeof(buf) ? TOTAL - sent : sizeof(buf);
+        for (size_t i = 0; i < n; i++) buf[i] = (char) (c + i);
+        if (shmring_writen(ring, buf, n, -1) != (ssize_t) n) return (void *) 1;
+        c = (unsigned char) (c + n);
+        sent += n;
+    }
+    return NULL;
+}
+
+/* Many more bytes than the capacity move from a thread to another, so both of them have to sleep */
+static void test_producer_consumer(void) {
+    pthread_t tid;
+    void *ret;
+    char buf[777];
+    size_t got = 0, n;
+    unsigned char c = 0;
+    shmring_t *producer = shmring_create(RING_SIZE);
+    test(producer != NULL)
+    shmring_t *consumer = attach_copy(producer);
+    test(consumer != NULL)
+
+    test(pthread_create(&tid, NULL, &producer_fun, producer) == 0)
+    while (got < TOTAL) {
+        n = TOTAL - got < sizeof(buf) ? TOTAL - got : sizeof(buf);
+        test(shmring_readn(consumer, buf, n, -1) == (ssize_t) n)
+        for (size_t i = 0; i < n; i++) test((unsigned char) buf[i] == (unsigned char) (c + i))
+        c = (unsigned char) (c + n);
+        got += n;
+    }
+    test(pthread_join(tid, &ret) == 0)
+    test(ret == NULL)
+
+    shmring_free(consumer);
+    shmring_free(producer);
+}
+
+/* Consumed data is held until it is released, so the producer cannot overwrite it */
+static void test_peek_hold(void) {
+    char buf[RING_SIZE];
+    char *data;
+    shmring_t *producer = shmring_create(RING_SIZE);
+    test(producer != NULL)
+    shmring_t *consumer = attach_copy(producer);
+    test(consumer != NULL)
+
+    memset(buf, 'a', RING_SIZE);
+    test(shmring_writen(producer, buf, RING_SIZE, -1) == RING_SIZE)
+    test(shmring_peek(consumer, &data) == RING_SIZE)
+    shmring_consume(consumer, RING_SIZE);
+    test(shmring_peek(consumer, &data) == 0)
+    test(shmring_ready(consumer) == 0) // releases the space
+
+    /* The data wraps around: it is peeked in two parts */
+    test(shmring_writen(producer, buf, 100, -1) == 100)
+    test(shmring_readn(consumer, buf, 100, -1) == 100)
+    test(shmring_writen(producer, buf, RING_SIZE, -1) == RING_SIZE)
+    test(shmring_peek(consumer, &data) == RING_SIZE - 100)
+    shmring_consume(consumer, RING_SIZE - 100);
+    test(shmring_peek(consumer, &data) == 100)
+    test(data[0] == 'a')
+    shmring_consume(consumer, 100);
+
+    shmring_free(consumer);
+    shmring_free(producer);
+}
+
+/* Data is moved from a pipe into the ring */
+static void test_read_fd(void) {
+    int pipefd[2];
+    char buf[16];
+    shmring_t *producer = shmring_create(RING_SIZE);
+    test(producer != NULL)
+    shmring_t *consumer = attach_copy(producer);
+    test(consumer != NULL)
+
+    test(pipe(pipefd) == 0)
+    test(write(pipefd[1], "0123456789", 10) == 10)
+    test(shmring_readfd(producer, pipefd[0], 10, -1) == 10)
+    test(shmring_readn(consumer, buf, 10, -1) == 10)
+    test(memcmp(buf, "0123456789", 10) == 0)
+
+    /* End of file */
+    close(pipefd[1]);
+    test(shmring_readfd(producer, pipefd[0], 10, -1) == 0)
+    close(pipefd[0]);
+
+    shmring_free(consumer);
+    shmring_free(producer);
+}
+
+/* When the other process is gone the data left can still be read, then the reads return 0 */
+static void test_peer_gone(void) {
+    int sv[2];
+    char buf[16];
+    shmring_t *producer = shmring_create(RING_SIZE);
+    test(producer != NULL)
+    shmring_t *consumer = attach_copy(producer);
+    test(consumer != NULL)
+
+    test(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    test(shmring_writen(producer, "left", 4, sv[0]) == 4)
+    close(sv[0]);
+
+    test(shmring_readn(consumer, buf, 16, sv[1]) == 4)
+    test(memcmp(buf, "left", 4) == 0)
+    test(shmring_readn(consumer, buf, 16, sv[1]) == 0)
+    close(sv[1]);
+
+    shmring_free(consumer);
+    shmring_free(producer);
+}
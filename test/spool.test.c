@@ -0,0 +1,98 @@
+#include <unistd.h>
+#include "testutilities.h"
+#include "../include/spool.h"
+
+#define SPOOL_DIR "/tmp"
+#define SPOOL_SIZE 4096
+
+static void test_put_peek_drop(void);
+static void test_wrap_around(void);
+static void test_read_fd(void);
+
+int main(int argc, char** argv) {
+    test(spool_create(SPOOL_DIR, 0) == NULL)
+    test(spool_create("/nonexistent", SPOOL_SIZE) == NULL)
+    errno = 0;
+
+    test_put_peek_drop();
+    test_wrap_around();
+    test_read_fd();
+
+    testpassed("Spool");
+    return 0;
+}
+
+/* Data is taken in the same order it was put, and only until the spool is full */
+static void test_put_peek_drop(void) {
+    char buf[SPOOL_SIZE + 1];
+    char *data;
+    spool_t *spool = spool_create(SPOOL_DIR, SPOOL_SIZE);
+    test(spool != NULL)
+    test(spool_capacity(spool) == SPOOL_SIZE)
+    test(spool_size(spool) == 0)
+    test(spool_peek(spool, &data) == 0)
+
+    test(spool_put(spool, "abcdefgh", 8) == 8)
+    test(spool_size(spool) == 8)
+    test(spool_peek(spool, &data) == 8)
+    test(memcmp(data, "abcdefgh", 8) == 0)
+    spool_drop(spool, 3);
+    test(spool_peek(spool, &data) == 5)
+    test(memcmp(data, "defgh", 5) == 0)
+    spool_drop(spool, 5);
+    test(spool_size(spool) == 0)
+
+    memset(buf, 'a', SPOOL_SIZE + 1);
+    test(spool_put(spool, buf, SPOOL_SIZE + 1) == SPOOL_SIZE)
+    test(spool_put(spool, buf, 1) == 0)
+    test(spool_size(spool) == SPOOL_SIZE)
+
+    spool_free(spool);
+}
+
+/* The data wraps around: it is peeked in two parts */
+static void test_wrap_around(void) {
+    char buf[SPOOL_SIZE];
+    char *data;
+    spool_t *spool = spool_create(SPOOL_DIR, SPOOL_SIZE);
+    test(spool != NULL)
+
+    memset(buf, 'a', SPOOL_SIZE);
+    test(spool_put(spool, buf, 100) == 100)
+    test(spool_put(spool, buf, 100) == 100)
+    spool_drop(spool, 100);
+    memset(buf, 'b', SPOOL_SIZE);
+    test(spool_put(spool, buf, SPOOL_SIZE - 100) == SPOOL_SIZE - 100)
+    test(spool_size(spool) == SPOOL_SIZE)
+
+    test(spool_peek(spool, &data) == SPOOL_SIZE - 100)
+    test(data[0] == 'a' && data[99] == 'a' && data[100] == 'b')
+    spool_drop(spool, SPOOL_SIZE - 100);
+    test(spool_peek(spool, &data) == 100)
+    test(data[0] == 'b' && data[99] == 'b')
+    spool_drop(spool, 100);
+    test(spool_size(spool) == 0)
+
+    spool_free(spool);
+}
+
+/* Data is moved from a pipe into the spool */
+static void test_read_fd(void) {
+    int pipefd[2];
+    char *data;
+    spool_t *spool = spool_create(SPOOL_DIR, SPOOL_SIZE);
+    test(spool != NULL)
+
+    test(pipe(pipefd) == 0)
+    test(write(pipefd[1], "0123456789", 10) == 10)
+    test(spool_readn(pipefd[0], spool, 10) == 10)
+    test(spool_peek(spool, &data) == 10)
+    test(memcmp(data, "0123456789", 10) == 0)
+
+    /* End of file */
+    close(pipefd[1]);
+    test(spool_readn(pipefd[0], spool, 10) == 0)
+    close(pipefd[0]);
+
+    spool_free(spool);
+}
@@ -0,0 +1,88 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "testutilities.h"
+#include "../include/waitq.h"
+#include "../include/utils.h"
+
+static void test_wake_before_wait(void);
+static void test_wake_from_thread(void);
+static void test_wakelist(void);
+static void test_wait_spin(void);
+
+int main(int argc, char** argv) {
+
+    test_wake_before_wait();
+    test_wake_from_thread();
+    test_wakelist();
+    test_wait_spin();
+
+    testpassed("Wait queue");
+    return 0;
+}
+
+/* Waiting on a completed node returns immediately */
+static void test_wake_before_wait(void) {
+    waitq_node_t node;
+    waitq_node_init(&node);
+    test(waitq_done(&node) == 0)
+
+    waitq_wake(&node);
+    test(waitq_done(&node) == 1)
+    test(waitq_wait(&node) == 0)
+}
+
+static void *waker(void *arg) {
+    msleep(50);
+    waitq_wake((waitq_node_t *) arg);
+    return NULL;
+}
+
+/* The waiter sleeps until another thread completes the node */
+static void test_wake_from_thread(void) {
+    pthread_t tid;
+    waitq_node_t node;
+    waitq_node_init(&node);
+
+    test(pthread_create(&tid, NULL, &waker, &node) == 0)
+    test(waitq_wait(&node) == 0)
+    test(waitq_done(&node) == 1)
+    test(pthread_join(tid, NULL) == 0)
+}
+
+/* Deferred nodes are completed only when the wake list is processed */
+static void test_wakelist(void) {
+    waitq_node_t nodes[4];
+    waitq_wakelist_t wakelist = WAITQ_WAKELIST_INIT;
+
+    for (int i = 0; i < 4; i++) {
+        waitq_node_init(&nodes[i]);
+        waitq_defer(&wakelist, &nodes[i]);
+    }
+    for (int i = 0; i < 4; i++) test(waitq_done(&nodes[i]) == 0)
+
+    waitq_wake_all(&wakelist);
+    for (int i = 0; i < 4; i++) test(waitq_done(&nodes[i]) == 1)
+    test(wakelist.head == NULL)
+    test(wakelist.tail == NULL)
+}
+
+/* A spinning waiter completed before the spin ends and one that has to block */
+static void test_wait_spin(void) {
+    pthread_t tid;
+    waitq_node_t node;
+    waitq_spin_t spin = WAITQ_SPIN_INIT;
+
+    /* Already completed: it doesn't spin */
+    waitq_node_init(&node);
+    waitq_wake(&node);
+    test(waitq_wait_spin(&node, &spin, 100000L) == 0)
+
+    /* Completed after the maximum spin time: it blocks */
+    spin.estimate = 100000L;
+    waitq_node_init(&node);
+    test(pthread_create(&tid, NULL, &waker, &node) == 0)
+    test(waitq_wait_spin(&node, &spin, 100000L) == 0)
+    test(waitq_done(&node) == 1)
+    test(pthread_join(tid, NULL) == 0)
+    test(spin.estimate < 100000L) // it should spin less the next time
+}